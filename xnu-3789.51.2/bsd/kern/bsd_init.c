@@ -332,6 +332,8 @@ extern void sysv_msg_lock_init(void);
 #endif
 
 extern void ulock_initialize(void);
+extern void ioring_init(void);
+extern void splice_init(void);
 
 #if CONFIG_MACF
 #if defined (__i386__) || defined (__x86_64__)
@@ -636,6 +638,7 @@ bsd_init(void)
 
 	TAILQ_INIT(&kernproc->p_aio_activeq);
 	TAILQ_INIT(&kernproc->p_aio_doneq);
+	klist_init(&kernproc->p_aio_klist);
 	kernproc->p_aio_total_count = 0;
 	kernproc->p_aio_active_count = 0;
 
@@ -761,6 +764,14 @@ bsd_init(void)
 	bsd_init_kprintf("calling pipeinit\n");
 	pipeinit();
 
+	/* Initialize I/O rings */
+	bsd_init_kprintf("calling ioring_init\n");
+	ioring_init();
+
+	/* Initialize splice() page loaning */
+	bsd_init_kprintf("calling splice_init\n");
+	splice_init();
+
 	/* Initialize SysV shm subsystem locks; the subsystem proper is
 	 * initialized through a sysctl.
 	 */
@@ -67,6 +67,10 @@ UNUSED_SYMBOL(decmpfs_validate_compressed_file)
 #include <sys/ubc.h>
 #include <sys/decmpfs.h>
 #include <sys/uio_internal.h>
+#include <sys/sysctl.h>
+#include <kern/thread.h>
+#include <machine/machine_routines.h>
+#include <libkern/OSAtomic.h>
 #include <libkern/OSByteOrder.h>
 
 #pragma mark --- debugging ---
@@ -203,6 +207,47 @@ static lck_mtx_t *decompress_channel_mtx;
 
 vfs_context_t decmpfs_ctx;
 
+/*
+ large pageins and reads are split into pieces that start on the compressor's
+ chunk boundaries and decompressed by a pool of worker threads alongside the
+ requesting thread; requests smaller than decmpfs_parallel_min are fetched
+ inline, and setting it to 0 fetches everything inline
+ */
+#define DECMPFS_MAX_PIECES  32
+#define DECMPFS_MAX_THREADS 8
+
+typedef struct decmpfs_fetch_job {
+    TAILQ_ENTRY(decmpfs_fetch_job) link;
+    vnode_t vp;
+    decmpfs_cnode *cp;
+    decmpfs_header *hdr;
+    char *buf;                  /* where offset lands */
+    off_t offset;
+    user_ssize_t size;
+    user_ssize_t piece;         /* bytes per piece; the first and last may be shorter */
+    int npieces;
+    int next;                   /* next piece to hand out */
+    int pending;                /* pieces handed out or waiting that haven't finished */
+    int err;
+    uint64_t did_read[DECMPFS_MAX_PIECES];
+} decmpfs_fetch_job;
+
+static TAILQ_HEAD(, decmpfs_fetch_job) decmpfs_fetch_jobs = TAILQ_HEAD_INITIALIZER(decmpfs_fetch_jobs);
+static lck_mtx_t *decmpfs_fetch_mtx;
+static uint32_t decmpfs_fetch_threads;
+
+static uint32_t decmpfs_parallel_min = 256 * 1024;
+static uint32_t decmpfs_parallel_chunk = 64 * 1024; /* chunk size of the resource fork compressors */
+static SInt64 decmpfs_parallel_fetches;             /* fetches split across the pool */
+static SInt64 decmpfs_parallel_pieces;              /* pieces those fetches were split into */
+
+SYSCTL_NODE(_vfs, OID_AUTO, decmpfs, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "transparent decompression");
+SYSCTL_UINT(_vfs_decmpfs, OID_AUTO, parallel_min, CTLFLAG_RW | CTLFLAG_LOCKED, &decmpfs_parallel_min, 0, "");
+SYSCTL_UINT(_vfs_decmpfs, OID_AUTO, parallel_chunk, CTLFLAG_RW | CTLFLAG_LOCKED, &decmpfs_parallel_chunk, 0, "");
+SYSCTL_UINT(_vfs_decmpfs, OID_AUTO, threads, CTLFLAG_RD | CTLFLAG_LOCKED, &decmpfs_fetch_threads, 0, "");
+SYSCTL_QUAD(_vfs_decmpfs, OID_AUTO, parallel_fetches, CTLFLAG_RD | CTLFLAG_LOCKED, &decmpfs_parallel_fetches, "");
+SYSCTL_QUAD(_vfs_decmpfs, OID_AUTO, parallel_pieces, CTLFLAG_RD | CTLFLAG_LOCKED, &decmpfs_parallel_pieces, "");
+
 #pragma mark --- decmp_get_func ---
 
 #define offsetof_func(func) ((uintptr_t)(&(((decmpfs_registration*)NULL)->func)))
@@ -1083,6 +1128,180 @@ out:
     return err;
 }
 
+#pragma mark --- parallel fetch ---
+
+static void
+decmpfs_piece_range(decmpfs_fetch_job *job, int i, off_t *start, off_t *end)
+{
+    /* pieces after the first start on a multiple of job->piece */
+    off_t base = job->offset - (job->offset % job->piece);
+    
+    *start = (i == 0) ? job->offset : base + (off_t)i * job->piece;
+    *end = MIN(base + (off_t)(i + 1) * job->piece, job->offset + job->size);
+}
+
+static int
+decmpfs_claim_piece(decmpfs_fetch_job *job)
+{
+    /* called with decmpfs_fetch_mtx held; returns the next piece to fetch, or -1 */
+    int i;
+    
+    if (job->next >= job->npieces)
+        return -1;
+    if (job->err != 0) {
+        /* a piece failed, so don't bother with the rest */
+        job->pending -= job->npieces - job->next;
+        job->next = job->npieces;
+        TAILQ_REMOVE(&decmpfs_fetch_jobs, job, link);
+        if (job->pending == 0)
+            wakeup((caddr_t)job);
+        return -1;
+    }
+    i = job->next++;
+    if (job->next == job->npieces)
+        TAILQ_REMOVE(&decmpfs_fetch_jobs, job, link);
+    return i;
+}
+
+static void
+decmpfs_fetch_piece(decmpfs_fetch_job *job, int i)
+{
+    /*
+     called with decmpfs_fetch_mtx held, drops it around the fetch and returns with it held;
+     job may be gone as soon as the last piece is accounted for, so it isn't touched after that
+     */
+    off_t start, end;
+    decmpfs_vector vec;
+    uint64_t did_read = 0;
+    int err;
+    
+    lck_mtx_unlock(decmpfs_fetch_mtx);
+    
+    decmpfs_piece_range(job, i, &start, &end);
+    vec.buf = job->buf + (start - job->offset);
+    vec.size = end - start;
+    err = decmpfs_fetch_uncompressed_data(job->vp, job->cp, job->hdr, start, end - start, 1, &vec, &did_read);
+    
+    lck_mtx_lock(decmpfs_fetch_mtx);
+    job->did_read[i] = did_read;
+    if (err != 0 && job->err == 0)
+        job->err = err;
+    if (--job->pending == 0)
+        wakeup((caddr_t)job);
+}
+
+static void
+decmpfs_fetch_worker(__unused void *param, __unused wait_result_t wr)
+{
+    decmpfs_fetch_job *job;
+    int i;
+    
+    lck_mtx_lock(decmpfs_fetch_mtx);
+    for (;;) {
+        job = TAILQ_FIRST(&decmpfs_fetch_jobs);
+        if (job == NULL) {
+            msleep((caddr_t)&decmpfs_fetch_jobs, decmpfs_fetch_mtx, PRIBIO, "decmpfs_fetch_worker", NULL);
+            continue;
+        }
+        if ((i = decmpfs_claim_piece(job)) >= 0)
+            decmpfs_fetch_piece(job, i);
+    }
+}
+
+static int
+decmpfs_chunk_starts_at(vnode_t vp, decmpfs_header *hdr, off_t boundary)
+{
+    /* ask the compressor whether a fetch at boundary has to start any earlier */
+    off_t pos = boundary;
+    user_ssize_t size = 1;
+    
+    lck_rw_lock_shared(decompressorsLock);
+    decmpfs_adjust_fetch_region_func adjust_fetch = decmp_get_func(vp, hdr->compression_type, adjust_fetch);
+    if (adjust_fetch) {
+        adjust_fetch(vp, decmpfs_ctx, hdr, &pos, &size);
+    }
+    lck_rw_unlock_shared(decompressorsLock);
+    
+    return pos == boundary;
+}
+
+static int
+decmpfs_fetch_uncompressed_data_parallel(vnode_t vp, decmpfs_cnode *cp, decmpfs_header *hdr, off_t offset, user_ssize_t size, decmpfs_vector *vec, uint64_t *bytes_read)
+{
+    /* like decmpfs_fetch_uncompressed_data into a single vector, but splits large fetches across the worker pool */
+    
+    decmpfs_fetch_job job;
+    user_ssize_t piece = decmpfs_parallel_chunk;
+    off_t base, start, end;
+    int npieces, wakeups, i;
+    
+    if (decmpfs_parallel_min == 0 || size < decmpfs_parallel_min ||
+        decmpfs_fetch_threads == 0 || piece < PAGE_SIZE || (piece & PAGE_MASK) != 0 ||
+        offset < 0 || (uint64_t)offset >= hdr->uncompressed_size) {
+        goto fetch_inline;
+    }
+    if ((uint64_t)(offset + size) > hdr->uncompressed_size) {
+        /* adjust size so we don't hand out pieces past the end of the file */
+        size = hdr->uncompressed_size - offset;
+    }
+    
+    for (;;) {
+        base = offset - (offset % piece);
+        npieces = (int)((offset + size - base + piece - 1) / piece);
+        if (npieces <= DECMPFS_MAX_PIECES)
+            break;
+        piece *= 2;
+    }
+    if (npieces < 2 || !decmpfs_chunk_starts_at(vp, hdr, base + piece)) {
+        /* nothing to split, or the compressor's chunks don't line up with our pieces */
+        goto fetch_inline;
+    }
+    
+    bzero(&job, sizeof(job));
+    job.vp = vp;
+    job.cp = cp;
+    job.hdr = hdr;
+    job.buf = vec->buf;
+    job.offset = offset;
+    job.size = size;
+    job.piece = piece;
+    job.npieces = npieces;
+    job.pending = npieces;
+    
+    lck_mtx_lock(decmpfs_fetch_mtx);
+    TAILQ_INSERT_TAIL(&decmpfs_fetch_jobs, &job, link);
+    wakeups = MIN(npieces - 1, (int)decmpfs_fetch_threads);
+    for (i = 0; i < wakeups; i++) {
+        wakeup_one((caddr_t)&decmpfs_fetch_jobs);
+    }
+    /* take pieces ourselves until they're all handed out, then wait for the workers */
+    while ((i = decmpfs_claim_piece(&job)) >= 0) {
+        decmpfs_fetch_piece(&job, i);
+    }
+    while (job.pending > 0) {
+        msleep((caddr_t)&job, decmpfs_fetch_mtx, PRIBIO, "decmpfs_fetch", NULL);
+    }
+    lck_mtx_unlock(decmpfs_fetch_mtx);
+    
+    OSIncrementAtomic64(&decmpfs_parallel_fetches);
+    OSAddAtomic64(npieces, &decmpfs_parallel_pieces);
+    
+    /* only report the bytes read up to the first piece that came up short */
+    *bytes_read = 0;
+    if (job.err == 0) {
+        for (i = 0; i < npieces; i++) {
+            decmpfs_piece_range(&job, i, &start, &end);
+            *bytes_read += job.did_read[i];
+            if (job.did_read[i] < (uint64_t)(end - start))
+                break;
+        }
+    }
+    return job.err;
+    
+fetch_inline:
+    return decmpfs_fetch_uncompressed_data(vp, cp, hdr, offset, size, 1, vec, bytes_read);
+}
+
 static kern_return_t
 commit_upl(upl_t upl, upl_offset_t pl_offset, size_t uplSize, int flags, int abort)
 {
@@ -1193,7 +1412,7 @@ decompress:
 		err = 0;
 		did_read = 0;
 	} else {
-        err = decmpfs_fetch_uncompressed_data(vp, cp, hdr, uplPos, uplSize, 1, &vec, &did_read);
+        err = decmpfs_fetch_uncompressed_data_parallel(vp, cp, hdr, uplPos, uplSize, &vec, &did_read);
 	}
     if (err) {
         DebugLogWithPath("decmpfs_fetch_uncompressed_data err %d\n", err);
@@ -1419,7 +1638,7 @@ decmpfs_read_compressed(struct vnop_read_args *ap, int *is_compressed, decmpfs_c
         decmpfs_vector vec;
     decompress:
         vec = (decmpfs_vector){ .buf = data, .size = curUplSize };
-        err = decmpfs_fetch_uncompressed_data(vp, cp, hdr, curUplPos, curUplSize, 1, &vec, &did_read);
+        err = decmpfs_fetch_uncompressed_data_parallel(vp, cp, hdr, curUplPos, curUplSize, &vec, &did_read);
         if (err) {
             ErrorLogWithPath("decmpfs_fetch_uncompressed_data err %d\n", err);
             
@@ -1866,9 +2085,22 @@ void decmpfs_init()
     lck_grp_attr_free(attr);
     decompressorsLock = lck_rw_alloc_init(decmpfs_lockgrp, NULL);
     decompress_channel_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
+    decmpfs_fetch_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
     
     register_decmpfs_decompressor(CMP_Type1, &Type1Reg);
     
+    /* the requesting thread fetches too, so leave it a cpu */
+    uint32_t nthreads = MIN(ml_get_max_cpus() - 1, DECMPFS_MAX_THREADS);
+    for (uint32_t i = 0; i < nthreads; i++) {
+        thread_t thread;
+        if (kernel_thread_start(decmpfs_fetch_worker, NULL, &thread) != KERN_SUCCESS) {
+            ErrorLog("failed to start decmpfs fetch worker\n");
+            break;
+        }
+        thread_deallocate(thread);
+        decmpfs_fetch_threads++;
+    }
+    
     done = 1;
 }
 #endif /* FS_COMPRESSION */
@@ -49,6 +49,7 @@
 #include <sys/kernel.h>
 #include <sys/vnode_internal.h>
 #include <sys/malloc.h>
+#include <sys/mcache.h>
 #include <sys/mount_internal.h>
 #include <sys/param.h>
 #include <sys/proc_internal.h>
@@ -57,15 +58,21 @@
 #include <sys/user.h>
 
 #include <sys/aio_kern.h>
+#include <sys/event.h>
 #include <sys/sysproto.h>
 
 #include <machine/limits.h>
+#include <machine/machine_routines.h>
 
 #include <mach/mach_types.h>
+#include <mach/thread_act.h>
 #include <kern/kern_types.h>
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
 #include <kern/waitq.h>
 #include <kern/zalloc.h>
 #include <kern/task.h>
+#include <kern/thread_call.h>
 #include <kern/sched_prim.h>
 
 #include <vm/vm_map.h>
@@ -125,18 +132,38 @@ typedef struct aio_workq   {
 	int				aioq_count;
 	lck_mtx_t			aioq_mtx;
 	struct waitq			aioq_waitq;
-} *aio_workq_t;
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE))) *aio_workq_t;
+
+/*
+ * There is a work queue per CPU, up to AIO_MAX_WORK_QUEUES.  A request is
+ * queued on the queue of the CPU that submitted it.  Each worker thread has
+ * a home queue that it services first, and steals from the other queues
+ * before it goes to sleep.  Every queue has at least one of the
+ * aio_worker_threads workers homed on it, so work queued while all the
+ * workers are busy is never stranded.
+ *
+ * On top of those, up to aio_max_dynamic_threads extra workers are started
+ * when requests back up with no worker idle, and exit again after
+ * AIO_DYNAMIC_IDLE_SECS without work.
+ */
+#define AIO_MAX_WORK_QUEUES	16
+#define AIO_DYNAMIC_IDLE_SECS	5
+
+/* worker thread parameter: home queue index, and whether it may exit */
+#define AIO_WORKER_HOME_MASK	0x00ff
+#define AIO_WORKER_DYNAMIC	0x0100
 
-#define AIO_NUM_WORK_QUEUES 1
 struct aio_anchor_cb
 {
 	volatile int32_t	aio_inflight_count; 	/* entries that have been taken from a workq */
 	volatile int32_t	aio_done_count; 	/* entries on all done queues (proc.aio_doneq) */
 	volatile int32_t	aio_total_count;	/* total extant entries */
+	volatile int32_t	aio_idle_workers;	/* workers asleep on a workq */
+	volatile int32_t	aio_dynamic_workers;	/* extra workers started for queue depth */
+	volatile int32_t	aio_next_home;		/* home queue of the next permanent worker */
 	
-	/* Hash table of queues here */
 	int 			aio_num_workqs;
-	struct aio_workq 	aio_async_workqs[AIO_NUM_WORK_QUEUES];
+	struct aio_workq 	aio_async_workqs[AIO_MAX_WORK_QUEUES];
 };
 typedef struct aio_anchor_cb aio_anchor_cb;
 
@@ -199,8 +226,13 @@ static void		aio_workq_lock_spin(aio_workq_t wq);
 static void		aio_workq_unlock(aio_workq_t wq);
 static lck_mtx_t*	aio_workq_mutex(aio_workq_t wq);
 
-static void		aio_work_thread( void );
-static aio_workq_entry *aio_get_some_work( void );
+static void		aio_work_thread(void *param, wait_result_t wresult);
+static aio_workq_entry *aio_get_some_work(int param);
+static aio_workq_t	aio_workq_find_work(int home);
+static int		aio_workq_wakeup(int qindex, int count);
+static void		aio_workq_maybe_grow(void);
+static void		aio_grow_workers(thread_call_param_t p0, thread_call_param_t p1);
+static void		aio_start_worker(int param);
 
 static int		aio_get_all_queues_count( void );
 static int		aio_queue_async_request(proc_t procp, user_addr_t aiocbp, int kindOfIO );
@@ -226,6 +258,9 @@ static aio_workq_entry *aio_create_queue_entry(proc_t procp,
 static user_addr_t *aio_copy_in_list(proc_t procp, user_addr_t aiocblist, int nent);
 static void		free_lio_context(aio_lio_context* context);
 static void 		aio_enqueue_work( proc_t procp, aio_workq_entry *entryp, int proc_locked);
+static void		aio_proc_add_active_locked(proc_t procp, aio_workq_entry *entryp);
+static void		aio_workq_add_list(aio_workq_entry **entryp_listp, int nent);
+static void		aio_kevent_post(proc_t procp);
 
 #define ASSERT_AIO_PROC_LOCK_OWNED(p)	lck_mtx_assert(aio_proc_mutex((p)), LCK_MTX_ASSERT_OWNED)
 #define ASSERT_AIO_WORKQ_LOCK_OWNED(q)	lck_mtx_assert(aio_workq_mutex((q)), LCK_MTX_ASSERT_OWNED)
@@ -266,6 +301,44 @@ static lck_grp_attr_t	*aio_lock_grp_attr;
 static struct zone  	*aio_workq_zonep;
 static lck_mtx_t	aio_entry_mtx;
 static lck_mtx_t	aio_proc_mtx;
+static thread_call_t	aio_grow_call;
+
+static int		aio_max_dynamic_threads = 64;
+static uint64_t		aio_steals;		/* requests taken from another CPU's queue */
+static uint64_t		aio_lio_batches;	/* lio_listio() lists queued in one pass */
+
+SYSCTL_INT(_kern, OID_AUTO, aio_max_dynamic_threads, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &aio_max_dynamic_threads, 0, "Max AIO workers started on demand");
+SYSCTL_INT(_kern, OID_AUTO, aio_dynamic_threads, CTLFLAG_RD | CTLFLAG_LOCKED,
+    __DEVOLATILE(int *, &aio_anchor.aio_dynamic_workers), 0, "AIO workers started on demand");
+SYSCTL_INT(_kern, OID_AUTO, aio_workqs, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &aio_anchor.aio_num_workqs, 0, "AIO work queues");
+SYSCTL_QUAD(_kern, OID_AUTO, aio_steals, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &aio_steals, "AIO requests taken from another queue");
+SYSCTL_QUAD(_kern, OID_AUTO, aio_lio_batches, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &aio_lio_batches, "lio_listio lists queued in one pass");
+
+/*
+ * EVFILT_AIO: fires when AIO requests of the process that registered it
+ * have completed, with data set to the number of completions since the
+ * last delivery.  Each knote counts the completions it has seen in its
+ * own kn_data, under the proc klist lock, so two kqueues watching the same
+ * process both see every completion.  A knote that is already active is
+ * not activated again, so a burst of completions costs a single wakeup.
+ */
+static int	filt_aioattach(struct knote *kn);
+static void	filt_aiodetach(struct knote *kn);
+static int	filt_aio(struct knote *kn, long hint);
+static int	filt_aiotouch(struct knote *kn, struct kevent_internal_s *kev);
+static int	filt_aioprocess(struct knote *kn, struct filt_process_s *data, struct kevent_internal_s *kev);
+
+struct filterops aio_filtops = {
+	.f_attach = filt_aioattach,
+	.f_detach = filt_aiodetach,
+	.f_event = filt_aio,
+	.f_touch = filt_aiotouch,
+	.f_process = filt_aioprocess,
+};
 
 static void
 aio_entry_lock(__unused aio_workq_entry *entryp)
@@ -285,11 +358,10 @@ aio_entry_unlock(__unused aio_workq_entry *entryp)
 	lck_mtx_unlock(&aio_entry_mtx);
 }
 
-/* Hash */
 static aio_workq_t
-aio_entry_workq(__unused aio_workq_entry *entryp) 
+aio_entry_workq(aio_workq_entry *entryp) 
 {
-	return &aio_anchor.aio_async_workqs[0];
+	return &aio_anchor.aio_async_workqs[entryp->aio_workq_index];
 }
 
 static lck_mtx_t*
@@ -1378,7 +1450,6 @@ aio_enqueue_work( proc_t procp, aio_workq_entry *entryp, int proc_locked)
 #if 0
 	aio_workq_entry	*my_entryp;	/* used for insertion sort */
 #endif /* 0 */
-	aio_workq_t queue = aio_entry_workq(entryp);
 
 	if (proc_locked == 0) {
 		aio_proc_lock(procp);
@@ -1387,16 +1458,10 @@ aio_enqueue_work( proc_t procp, aio_workq_entry *entryp, int proc_locked)
 	ASSERT_AIO_PROC_LOCK_OWNED(procp);
 
 	/* Onto proc queue */
-	TAILQ_INSERT_TAIL(&procp->p_aio_activeq, entryp,  aio_proc_link);
-	procp->p_aio_active_count++;
-	procp->p_aio_total_count++;
+	aio_proc_add_active_locked(procp, entryp);
 
 	/* And work queue */
-	aio_workq_lock_spin(queue);
-	aio_workq_add_entry_locked(queue, entryp);
-	waitq_wakeup64_one(&queue->aioq_waitq, CAST_EVENT64_T(queue),
-			   THREAD_AWAKENED, WAITQ_ALL_PRIORITIES);
-	aio_workq_unlock(queue);
+	aio_workq_add_list(&entryp, 1);
 	
 	if (proc_locked == 0) {
 		aio_proc_unlock(procp);
@@ -1444,6 +1509,148 @@ aio_enqueue_work( proc_t procp, aio_workq_entry *entryp, int proc_locked)
 }
 
 
+/*
+ * Called with proc locked.
+ */
+static void
+aio_proc_add_active_locked(proc_t procp, aio_workq_entry *entryp)
+{
+	ASSERT_AIO_PROC_LOCK_OWNED(procp);
+
+	TAILQ_INSERT_TAIL(&procp->p_aio_activeq, entryp,  aio_proc_link);
+	procp->p_aio_active_count++;
+	procp->p_aio_total_count++;
+}
+
+/*
+ * aio_workq_add_list
+ *
+ * Put a list of entries, already on their proc's active queue, on the work
+ * queue of the current CPU with a single acquisition of its lock, and wake
+ * a worker for each of them.  Workers homed on other CPUs' queues are woken
+ * when there are not enough idle here; they steal the work.  If there are
+ * not enough idle workers at all, more may be started.
+ *
+ * Called with proc locked.
+ */
+static void
+aio_workq_add_list(aio_workq_entry **entryp_listp, int nent)
+{
+	aio_workq_t	queue;
+	int		qindex;
+	int		i;
+
+	qindex = cpu_number() % aio_anchor.aio_num_workqs;
+	queue = &aio_anchor.aio_async_workqs[qindex];
+
+	aio_workq_lock_spin(queue);
+	for (i = 0; i < nent; i++) {
+		entryp_listp[i]->aio_workq_index = qindex;
+		aio_workq_add_entry_locked(queue, entryp_listp[i]);
+	}
+	aio_workq_unlock(queue);
+
+	if (aio_workq_wakeup(qindex, nent) < nent) {
+		aio_workq_maybe_grow();
+	}
+}
+
+/*
+ * aio_workq_wakeup
+ *
+ * Wake up to count idle workers, those sleeping on queue qindex first.
+ * Returns the number woken.
+ */
+static int
+aio_workq_wakeup(int qindex, int count)
+{
+	aio_workq_t	queue;
+	int		woken = 0;
+	int		i;
+
+	for (i = 0; i < aio_anchor.aio_num_workqs && woken < count; i++) {
+		if (aio_anchor.aio_idle_workers <= 0) {
+			break;
+		}
+		queue = &aio_anchor.aio_async_workqs[(qindex + i) % aio_anchor.aio_num_workqs];
+		while (woken < count &&
+		       waitq_wakeup64_one(&queue->aioq_waitq, CAST_EVENT64_T(queue),
+					  THREAD_AWAKENED, WAITQ_ALL_PRIORITIES) == KERN_SUCCESS) {
+			OSDecrementAtomic(&aio_anchor.aio_idle_workers);
+			woken++;
+		}
+	}
+
+	return (woken);
+}
+
+/*
+ * aio_workq_maybe_grow
+ *
+ * Work was queued that no idle worker could be woken for.  If requests
+ * are backing up on the queues, have more workers started.
+ */
+static void
+aio_workq_maybe_grow(void)
+{
+	int	queued = 0;
+	int	i;
+
+	if (aio_anchor.aio_dynamic_workers >= aio_max_dynamic_threads) {
+		return;
+	}
+
+	for (i = 0; i < aio_anchor.aio_num_workqs; i++) {
+		queued += aio_anchor.aio_async_workqs[i].aioq_count;
+	}
+
+	if (queued > aio_anchor.aio_num_workqs) {
+		thread_call_enter(aio_grow_call);
+	}
+}
+
+/*
+ * aio_grow_workers
+ *
+ * Thread call that starts a dynamic worker for each request queued beyond
+ * one per queue that no idle worker is available for, homed on the deepest
+ * queue.  Dynamic workers exit once they have been idle for
+ * AIO_DYNAMIC_IDLE_SECS.
+ */
+static void
+aio_grow_workers(__unused thread_call_param_t p0, __unused thread_call_param_t p1)
+{
+	int	deepest = 0;
+	int	queued = 0;
+	int	want;
+	int	i;
+
+	for (i = 0; i < aio_anchor.aio_num_workqs; i++) {
+		int count = aio_anchor.aio_async_workqs[i].aioq_count;
+
+		queued += count;
+		if (count > aio_anchor.aio_async_workqs[deepest].aioq_count) {
+			deepest = i;
+		}
+	}
+
+	want = queued - aio_anchor.aio_num_workqs - aio_anchor.aio_idle_workers;
+	while (want > 0) {
+		int32_t	workers = aio_anchor.aio_dynamic_workers;
+
+		if (workers >= aio_max_dynamic_threads) {
+			break;
+		}
+		if (!OSCompareAndSwap((UInt32)workers, (UInt32)(workers + 1),
+				      (volatile UInt32 *)&aio_anchor.aio_dynamic_workers)) {
+			continue;
+		}
+		aio_start_worker(deepest | AIO_WORKER_DYNAMIC);
+		want--;
+	}
+}
+
+
 /*
  * lio_listio - initiate a list of IO requests.  We process the list of
  * aiocbs either synchronously (mode == LIO_WAIT) or asynchronously
@@ -1460,6 +1667,7 @@ lio_listio(proc_t p, struct lio_listio_args *uap, int *retval )
 	int				call_result;
 	int				result;
 	int				old_count;
+	int				nqueued;
 	aio_workq_entry			**entryp_listp;
 	user_addr_t			*aiocbpp;
 	struct user_sigevent		aiosigev;
@@ -1571,34 +1779,57 @@ lio_listio(proc_t p, struct lio_listio_args *uap, int *retval )
 			/* flag that this thread blocks pending completion */
 			entryp->flags |= AIO_LIO_NOTIFY;
 		}
+	}
+
+	/*
+	 * Queue the whole list in one pass: the proc lock and the work queue
+	 * lock are taken once for the list, not once per request.  Requests
+	 * over our limits are moved to the tail of the list and freed once
+	 * the proc lock is dropped.
+	 */
+	nqueued = 0;
+	aio_proc_lock(p);
+	for ( i = 0; i < uap->nent; i++ ) {
+		aio_workq_entry		 		*entryp;
+
+		entryp = entryp_listp[i];
+		if ( entryp == NULL )
+			continue;
 
 		/* check our aio limits to throttle bad or rude user land behavior */
 		old_count = aio_increment_total_count();
-
-		aio_proc_lock_spin(p);
 		if ( old_count >= aio_max_requests ||
 			 aio_get_process_count( entryp->procp ) >= aio_max_requests_per_process ||
 			 is_already_queued( entryp->procp, entryp->uaiocbp ) == TRUE ) {
 			
 			lio_context->io_issued--;
-			aio_proc_unlock(p);
-	
 			aio_decrement_total_count();
 
 			if ( call_result == -1 )
 				call_result = EAGAIN;
-			aio_free_request(entryp);
-			entryp_listp[i] = NULL;
 			continue;
 		}
-		
-		lck_mtx_convert_spin(aio_proc_mutex(p));
-		aio_enqueue_work(p, entryp, 1);
-		aio_proc_unlock(p);
-		
+
+		aio_proc_add_active_locked(p, entryp);
+		entryp_listp[i] = entryp_listp[nqueued];
+		entryp_listp[nqueued++] = entryp;
+
 		KERNEL_DEBUG( (BSDDBG_CODE(DBG_BSD_AIO, AIO_work_queued)) | DBG_FUNC_NONE,
 				  (int)p, (int)entryp->uaiocbp, 0, 0, 0 );
 	}
+	if ( nqueued > 0 ) {
+		aio_workq_add_list(entryp_listp, nqueued);
+		if ( nqueued > 1 )
+			OSIncrementAtomic64((volatile SInt64 *)&aio_lio_batches);
+	}
+	aio_proc_unlock(p);
+
+	for ( i = nqueued; i < uap->nent; i++ ) {
+		if ( entryp_listp[i] != NULL ) {
+			aio_free_request(entryp_listp[i]);
+			entryp_listp[i] = NULL;
+		}
+	}
 
 	switch(uap->mode) {
 	case LIO_WAIT:
@@ -1651,12 +1882,13 @@ ExitRoutine:
 
 /*
  * aio worker thread.  this is where all the real work gets done.
- * we get a wake up call on sleep channel &aio_anchor.aio_async_workq 
- * after new work is queued up.
+ * we get a wake up call on the waitq of our home work queue after new
+ * work is queued up.  param is the home queue index, plus
+ * AIO_WORKER_DYNAMIC for a worker that exits when it has been idle.
  */
 __attribute__((noreturn))
 static void
-aio_work_thread(void)
+aio_work_thread(void *param, wait_result_t wresult)
 {
 	aio_workq_entry		 	*entryp;
 	int 			error;
@@ -1664,13 +1896,21 @@ aio_work_thread(void)
 	vm_map_t 		oldmap = VM_MAP_NULL;
 	task_t			oldaiotask = TASK_NULL;
 	struct uthread	*uthreadp = NULL;
+
+	if (wresult == THREAD_TIMED_OUT) {
+		/* Only dynamic workers sleep with a deadline */
+		OSDecrementAtomic(&aio_anchor.aio_idle_workers);
+		OSDecrementAtomic(&aio_anchor.aio_dynamic_workers);
+		thread_terminate(current_thread());
+		/* NOTREACHED */
+	}
 	
 	for( ;; ) {
 		/* 
 		 * returns with the entry ref'ed.
 		 * sleeps until work is available. 
 		 */
-		entryp = aio_get_some_work();         
+		entryp = aio_get_some_work((int)(uintptr_t)param);
 
 		KERNEL_DEBUG( (BSDDBG_CODE(DBG_BSD_AIO, AIO_worker_thread)) | DBG_FUNC_START,
 				(int)entryp->procp, (int)entryp->uaiocbp, entryp->flags, 0, 0 );
@@ -1749,46 +1989,75 @@ aio_work_thread(void)
 } /* aio_work_thread */
 
 
+/*
+ * aio_workq_find_work - find a work queue with work on it, trying the home
+ * queue first and then stealing from the others, and return it locked.
+ * Returns NULL, with no queue locked, if all the queues looked empty.
+ */
+static aio_workq_t
+aio_workq_find_work(int home)
+{
+	aio_workq_t	queue;
+	int		n = aio_anchor.aio_num_workqs;
+	int		i;
+
+	for (i = 0; i < n; i++) {
+		queue = &aio_anchor.aio_async_workqs[(home + i) % n];
+		if (queue->aioq_count == 0) {
+			continue;
+		}
+		aio_workq_lock_spin(queue);
+		if (queue->aioq_count != 0) {
+			if (i != 0) {
+				OSIncrementAtomic64((volatile SInt64 *)&aio_steals);
+			}
+			return (queue);
+		}
+		aio_workq_unlock(queue);
+	}
+
+	return (NULL);
+}
+
 /*
  * aio_get_some_work - get the next async IO request that is ready to be executed.
  * aio_fsync complicates matters a bit since we cannot do the fsync until all async
  * IO requests at the time the aio_fsync call came in have completed.
- * NOTE - AIO_LOCK must be held by caller
+ * If there is no work on any queue, sleeps on the home queue and restarts
+ * aio_work_thread when woken.
  */
 static aio_workq_entry *
-aio_get_some_work( void )
+aio_get_some_work(int param)
 {
 	aio_workq_entry		 		*entryp = NULL;
 	aio_workq_t 				queue = NULL;
-
-	/* Just one queue for the moment.  In the future there will be many. */
-	queue = &aio_anchor.aio_async_workqs[0];	
-	aio_workq_lock_spin(queue);
-	if (queue->aioq_count == 0) {
-		goto nowork;
-	}
+	int					home = param & AIO_WORKER_HOME_MASK;
+	uint64_t				deadline = 0;
 
 	/* 
-	 * Hold the queue lock.
-	 *
-	 * pop some work off the work queue and add to our active queue
-	 * Always start with the queue lock held. 
+	 * pop some work off a work queue and add to our active queue
 	 */
 	for(;;) {
+		queue = aio_workq_find_work(home);
+		if (queue == NULL) {
+			/* 
+			 * Recheck our home queue under its lock, so that an enqueue
+			 * racing with us either is seen here or sees us waiting.
+			 */
+			queue = &aio_anchor.aio_async_workqs[home];
+			aio_workq_lock_spin(queue);
+			if (queue->aioq_count == 0) {
+				goto nowork;
+			}
+			aio_workq_unlock(queue);
+			continue;
+		}
+
 		/* 
 		 * Pull of of work queue.  Once it's off, it can't be cancelled,
 		 * so we can take our ref once we drop the queue lock.
 		 */
 		entryp = TAILQ_FIRST(&queue->aioq_entries);
-
-		/* 
-		 * If there's no work or only fsyncs that need delay, go to sleep 
-		 * and then start anew from aio_work_thread 
-		 */
-		if (entryp == NULL) {
-			goto nowork;
-		}
-
 		aio_workq_remove_entry_locked(queue, entryp);
 		
 		aio_workq_unlock(queue);
@@ -1812,6 +2081,7 @@ aio_get_some_work( void )
 
 				aio_workq_lock_spin(queue);
 				aio_workq_add_entry_locked(queue, entryp);
+				aio_workq_unlock(queue);
 				continue;
 			} 
 			aio_proc_unlock(entryp->procp);
@@ -1827,9 +2097,13 @@ aio_get_some_work( void )
 
 nowork:
 	/* We will wake up when someone enqueues something */
-	waitq_assert_wait64(&queue->aioq_waitq, CAST_EVENT64_T(queue), THREAD_UNINT, 0);
+	if ((param & AIO_WORKER_DYNAMIC) != 0) {
+		clock_interval_to_deadline(AIO_DYNAMIC_IDLE_SECS, NSEC_PER_SEC, &deadline);
+	}
+	OSIncrementAtomic(&aio_anchor.aio_idle_workers);
+	waitq_assert_wait64(&queue->aioq_waitq, CAST_EVENT64_T(queue), THREAD_UNINT, deadline);
 	aio_workq_unlock(queue);
-	thread_block( (thread_continue_t)aio_work_thread );
+	thread_block_parameter((thread_continue_t)aio_work_thread, (void *)(uintptr_t)param);
 
 	// notreached
 	return NULL;
@@ -2342,6 +2616,11 @@ do_aio_completion( aio_workq_entry *entryp )
 	KERNEL_DEBUG( (BSDDBG_CODE(DBG_BSD_AIO, AIO_completion_suspend_wake)) | DBG_FUNC_NONE,
 				  (int)entryp->procp, (int)entryp->uaiocbp, 0, 0, 0 );
 
+	/* Count the completion for EVFILT_AIO, unless the process is exiting */
+	if ( (entryp->flags & AIO_DISABLE) == 0 ) {
+		aio_kevent_post(entryp->procp);
+	}
+
 	/*   
 	 * free the LIO context if the last lio completed and no thread is
 	 * waiting
@@ -2353,6 +2632,113 @@ do_aio_completion( aio_workq_entry *entryp )
 } /* do_aio_completion */
 
 
+/*
+ * aio_kevent_post - count a completed request in each EVFILT_AIO knote of
+ * its process.
+ */
+static void
+aio_kevent_post(proc_t procp)
+{
+	if (SLIST_EMPTY(&procp->p_aio_klist)) {
+		return;
+	}
+
+	proc_klist_lock();
+	KNOTE(&procp->p_aio_klist, 1);
+	proc_klist_unlock();
+}
+
+static int
+filt_aioattach(struct knote *kn)
+{
+	proc_t p = current_proc();  /* can attach only to oneself */
+
+	proc_klist_lock();
+
+	kn->kn_ptr.p_proc = p;
+	kn->kn_data = 0;
+
+	KNOTE_ATTACH(&p->p_aio_klist, kn);
+
+	proc_klist_unlock();
+
+	/* only completions after the attach are reported */
+	return 0;
+}
+
+/*
+ * remove the knote from the process list, if it hasn't already
+ * been removed by exit processing.  
+ */
+static void
+filt_aiodetach(struct knote *kn)
+{
+	proc_t p;
+
+	proc_klist_lock();
+	p = kn->kn_ptr.p_proc;
+	if (p != PROC_NULL) {
+		kn->kn_ptr.p_proc = PROC_NULL;
+		KNOTE_DETACH(&p->p_aio_klist, kn);
+	}
+	proc_klist_unlock();
+}
+
+static int
+filt_aio(struct knote *kn, long hint)
+{
+	/* ALWAYS CALLED WITH proc_klist_lock */
+	if (kn->kn_ptr.p_proc == PROC_NULL)
+		return 0;
+
+	kn->kn_data += hint;
+	return (kn->kn_data != 0);
+}
+
+static int
+filt_aiotouch(struct knote *kn, struct kevent_internal_s *kev)
+{
+	proc_t p;
+	int res;
+
+	proc_klist_lock();
+
+	if ((kn->kn_status & KN_UDATA_SPECIFIC) == 0)
+		kn->kn_udata = kev->udata;
+
+	p = kn->kn_ptr.p_proc;
+	res = (p != PROC_NULL && kn->kn_data != 0);
+
+	proc_klist_unlock();
+
+	return res;
+}
+
+static int
+filt_aioprocess(struct knote *kn, __unused struct filt_process_s *data,
+    struct kevent_internal_s *kev)
+{
+	proc_klist_lock();
+
+	if (kn->kn_ptr.p_proc == PROC_NULL || kn->kn_data == 0) {
+		proc_klist_unlock();
+		return 0;
+	}
+
+	/*
+	 * Snapshot the event data.
+	 * All AIO events are EV_CLEAR; data is the number of requests
+	 * that completed since the last delivery.
+	 */
+	*kev = kn->kn_kevent;
+	kev->flags |= EV_CLEAR;
+	kn->kn_data = 0;
+
+	proc_klist_unlock();
+	return 1;
+}
+
+
 /*
  * do_aio_read
  */
@@ -2585,12 +2971,25 @@ aio_init( void )
 	aio_anchor.aio_inflight_count = 0;
 	aio_anchor.aio_done_count = 0;
 	aio_anchor.aio_total_count = 0;
-	aio_anchor.aio_num_workqs = AIO_NUM_WORK_QUEUES;
-
-	for (i = 0; i < AIO_NUM_WORK_QUEUES; i++) {
+	aio_anchor.aio_idle_workers = 0;
+	aio_anchor.aio_dynamic_workers = 0;
+	aio_anchor.aio_next_home = 0;
+
+	/* A queue per CPU, but never more queues than permanent workers */
+	aio_anchor.aio_num_workqs = ml_get_max_cpus();
+	if (aio_anchor.aio_num_workqs > aio_worker_threads)
+		aio_anchor.aio_num_workqs = aio_worker_threads;
+	if (aio_anchor.aio_num_workqs > AIO_MAX_WORK_QUEUES)
+		aio_anchor.aio_num_workqs = AIO_MAX_WORK_QUEUES;
+	if (aio_anchor.aio_num_workqs < 1)
+		aio_anchor.aio_num_workqs = 1;
+
+	for (i = 0; i < aio_anchor.aio_num_workqs; i++) {
 		aio_workq_init(&aio_anchor.aio_async_workqs[i]);
 	}
 
+	aio_grow_call = thread_call_allocate(aio_grow_workers, NULL);
+
 
 	i = sizeof( aio_workq_entry );
 	aio_workq_zonep = zinit( i, i * aio_max_requests, i * aio_max_requests, "aiowq" );
@@ -2601,7 +3000,8 @@ aio_init( void )
 
 
 /*
- * aio worker threads created here.
+ * aio worker threads created here.  Permanent workers are spread round
+ * robin over the work queues, so each queue has at least one.
  */
 __private_extern__ void
 _aio_create_worker_threads( int num )
@@ -2610,19 +3010,33 @@ _aio_create_worker_threads( int num )
 	
 	/* create some worker threads to handle the async IO requests */
 	for ( i = 0; i < num; i++ ) {
-		thread_t		myThread;
-		
-		if ( KERN_SUCCESS != kernel_thread_start((thread_continue_t)aio_work_thread, NULL, &myThread) ) {
-			printf( "%s - failed to create a work thread \n", __FUNCTION__ ); 
-		}
-		else
-			thread_deallocate(myThread);
+		int home;
+
+		home = OSIncrementAtomic(&aio_anchor.aio_next_home) % aio_anchor.aio_num_workqs;
+		aio_start_worker(home);
 	}
 	
 	return;
 	
 } /* _aio_create_worker_threads */
 
+static void
+aio_start_worker(int param)
+{
+	thread_t		myThread;
+
+	if ( KERN_SUCCESS != kernel_thread_start((thread_continue_t)aio_work_thread,
+	    (void *)(uintptr_t)param, &myThread) ) {
+		printf( "%s - failed to create a work thread \n", __FUNCTION__ ); 
+		if ((param & AIO_WORKER_DYNAMIC) != 0) {
+			OSDecrementAtomic(&aio_anchor.aio_dynamic_workers);
+		}
+	}
+	else
+		thread_deallocate(myThread);
+
+} /* aio_start_worker */
+
 /*
  * Return the current activation utask
  */
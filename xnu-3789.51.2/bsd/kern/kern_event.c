@@ -297,9 +297,7 @@ static zone_t kqworkq_zone;
 
 #define	KN_HASH(val, mask)	(((val) ^ (val >> 8)) & (mask))
 
-#if 0
 extern struct filterops aio_filtops;
-#endif
 
 /* Mach portset filter */
 extern struct filterops machport_filtops;
@@ -336,6 +334,7 @@ extern struct filterops skywalk_channel_rfiltops;
 extern struct filterops skywalk_channel_wfiltops;
 extern struct filterops fsevent_filtops;
 extern struct filterops vnode_filtops;
+extern struct filterops ioring_filtops;
 
 /*
  *
@@ -357,7 +356,7 @@ static struct filterops *sysfilt_ops[EVFILTID_MAX] = {
 	/* Public Filters */
 	[~EVFILT_READ] 					= &file_filtops,
 	[~EVFILT_WRITE] 				= &file_filtops,
-	[~EVFILT_AIO] 					= &bad_filtops,
+	[~EVFILT_AIO] 					= &aio_filtops,
 	[~EVFILT_VNODE] 				= &file_filtops,
 	[~EVFILT_PROC] 					= &proc_filtops,
 	[~EVFILT_SIGNAL] 				= &sig_filtops,
@@ -388,7 +387,8 @@ static struct filterops *sysfilt_ops[EVFILTID_MAX] = {
 	[EVFILTID_BPFREAD] 				= &bpfread_filtops,
 	[EVFILTID_NECP_FD] 				= &necp_fd_rfiltops,
 	[EVFILTID_FSEVENT] 				= &fsevent_filtops,
-	[EVFILTID_VN] 					= &vnode_filtops
+	[EVFILTID_VN] 					= &vnode_filtops,
+	[EVFILTID_IORING] 				= &ioring_filtops
 };
 
 /* waitq prepost callback */
@@ -1333,6 +1333,7 @@ retry:
 	TAILQ_INIT(&child_proc->p_uthlist);
 	TAILQ_INIT(&child_proc->p_aio_activeq);
 	TAILQ_INIT(&child_proc->p_aio_doneq);
+	klist_init(&child_proc->p_aio_klist);
 
 	/* Inherit the parent flags for code sign */
 	child_proc->p_csflags = (parent_proc->p_csflags & ~CS_KILLED);
@@ -2930,6 +2930,10 @@ proc_knote_drain(struct proc *p)
 		kn->kn_ptr.p_proc = PROC_NULL;
 		KNOTE_DETACH(&p->p_klist, kn);
 	}
+	while ((kn = SLIST_FIRST(&p->p_aio_klist))) {
+		kn->kn_ptr.p_proc = PROC_NULL;
+		KNOTE_DETACH(&p->p_aio_klist, kn);
+	}
 	proc_klist_unlock();
 }
 
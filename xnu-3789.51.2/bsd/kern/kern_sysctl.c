@@ -2083,10 +2083,12 @@ SYSCTL_NODE(_kern_timer, OID_AUTO, longterm, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "lo
 enum {
 	THRESHOLD, QCOUNT,
 	ENQUEUES, DEQUEUES, ESCALATES, SCANS, PREEMPTS,
-	LATENCY, LATENCY_MIN, LATENCY_MAX
+	LATENCY, LATENCY_MIN, LATENCY_MAX,
+	INSERT_HINT_HITS, INSERT_HINT_MISSES, INSERT_APPENDS, INSERT_TEST
 };
 extern uint64_t	timer_sysctl_get(int);
 extern int      timer_sysctl_set(int, uint64_t);
+extern void	timer_sysctl_latency_histogram(uint64_t *, unsigned int);
 
 STATIC int
 sysctl_timer
@@ -2138,6 +2140,46 @@ SYSCTL_PROC(_kern_timer_longterm, OID_AUTO, latency_max,
 		(void *) LATENCY_MAX, 0, sysctl_timer, "Q", "");
 #endif /* DEBUG */
 
+#if DEVELOPMENT || DEBUG
+SYSCTL_PROC(_kern_timer, OID_AUTO, insert_hint_hits,
+		CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+		(void *) INSERT_HINT_HITS, 0, sysctl_timer, "Q", "");
+SYSCTL_PROC(_kern_timer, OID_AUTO, insert_hint_misses,
+		CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+		(void *) INSERT_HINT_MISSES, 0, sysctl_timer, "Q", "");
+SYSCTL_PROC(_kern_timer, OID_AUTO, insert_appends,
+		CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_LOCKED,
+		(void *) INSERT_APPENDS, 0, sysctl_timer, "Q", "");
+SYSCTL_PROC(_kern_timer, OID_AUTO, insert_test,
+		CTLTYPE_QUAD | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED,
+		(void *) INSERT_TEST, 0, sysctl_timer, "Q", "");
+#endif /* DEVELOPMENT || DEBUG */
+
+STATIC int
+sysctl_timer_latency_histogram
+(__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	uint64_t	bins[TIMER_CALL_LATENCY_BINS];
+
+	timer_sysctl_latency_histogram(bins, TIMER_CALL_LATENCY_BINS);
+	return sysctl_io_opaque(req, bins, sizeof(bins), NULL);
+}
+
+SYSCTL_PROC(_kern_timer, OID_AUTO, latency_histogram,
+		CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+		0, 0, sysctl_timer_latency_histogram, "Q",
+		"Timer callout latency past soft deadline, log2 microsecond bins");
+
+extern int ledger_defer_enable;
+extern uint32_t ledger_defer_max_updates;
+
+SYSCTL_INT(_kern, OID_AUTO, ledger_defer,
+		CTLFLAG_RW | CTLFLAG_LOCKED,
+		&ledger_defer_enable, 0, "Batch per-thread updates to unlimited task ledger entries");
+SYSCTL_UINT(_kern, OID_AUTO, ledger_defer_max_updates,
+		CTLFLAG_RW | CTLFLAG_LOCKED,
+		&ledger_defer_max_updates, 0, "Updates a thread batches per ledger entry before applying them");
+
 STATIC int
 sysctl_usrstack
 (__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
@@ -2762,6 +2804,15 @@ extern uint32_t phantom_cache_thrashing_threshold_ssd;
 SYSCTL_INT(_vm, OID_AUTO, phantom_cache_eval_period_in_msecs, CTLFLAG_RW | CTLFLAG_LOCKED, &phantom_cache_eval_period_in_msecs, 0, "");
 SYSCTL_INT(_vm, OID_AUTO, phantom_cache_thrashing_threshold, CTLFLAG_RW | CTLFLAG_LOCKED, &phantom_cache_thrashing_threshold, 0, "");
 SYSCTL_INT(_vm, OID_AUTO, phantom_cache_thrashing_threshold_ssd, CTLFLAG_RW | CTLFLAG_LOCKED, &phantom_cache_thrashing_threshold_ssd, 0, "");
+
+extern int phantom_cache_adapt_inactive;
+extern uint32_t phantom_cache_inactive_boost;
+extern uint32_t phantom_cache_inactive_boost_max;
+
+SYSCTL_INT(_vm, OID_AUTO, phantom_cache_adapt_inactive, CTLFLAG_RW | CTLFLAG_LOCKED, &phantom_cache_adapt_inactive, 0, "");
+SYSCTL_INT(_vm, OID_AUTO, phantom_cache_inactive_boost, CTLFLAG_RD | CTLFLAG_LOCKED, &phantom_cache_inactive_boost, 0, "");
+SYSCTL_INT(_vm, OID_AUTO, phantom_cache_inactive_boost_max, CTLFLAG_RW | CTLFLAG_LOCKED, &phantom_cache_inactive_boost_max, 0, "");
+SYSCTL_OPAQUE(_vm, OID_AUTO, phantom_cache_refault_histogram, CTLFLAG_RD | CTLFLAG_LOCKED, vm_phantom_refault_histogram, sizeof(vm_phantom_refault_histogram), "Q", "");
 #endif
 
 #if CONFIG_BACKGROUND_QUEUE
@@ -2874,6 +2925,54 @@ SYSCTL_INT(_kern, OID_AUTO, ipc_portbt,
 		CTLFLAG_RW | CTLFLAG_KERN | CTLFLAG_LOCKED,
 		&ipc_portbt, 0, "");
 
+/*
+ * Out-of-line message memory: copy-vs-remap threshold
+ */
+extern vm_size_t msg_ool_size_small;
+extern vm_size_t msg_ool_copy_threshold;
+extern int ipc_kmsg_ool_adaptive;
+extern uint64_t ipc_kmsg_ool_kbuf_cost;
+extern uint64_t ipc_kmsg_ool_remap_cost;
+extern uint64_t ipc_kmsg_ool_batched_copyouts;
+
+STATIC int
+sysctl_ipc_ool_copy_threshold SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	int error, changed;
+	uint64_t new_value, old_value = msg_ool_copy_threshold;
+
+	error = sysctl_io_number(req, old_value, sizeof(old_value), &new_value, &changed);
+	if (error || !changed)
+		return (error);
+
+	/* kernel buffer copies can't be larger than msg_ool_size_small */
+	if (new_value > msg_ool_size_small)
+		return (EINVAL);
+
+	/* an explicit setting turns off the adaptive estimator */
+	ipc_kmsg_ool_adaptive = 0;
+	msg_ool_copy_threshold = (vm_size_t)new_value;
+	return (0);
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, ipc_ool_copy_threshold,
+		CTLTYPE_QUAD | CTLFLAG_RW | CTLFLAG_LOCKED,
+		0, 0, sysctl_ipc_ool_copy_threshold, "Q",
+		"OOL regions below this size are copied rather than remapped");
+SYSCTL_INT(_kern, OID_AUTO, ipc_ool_adaptive,
+		CTLFLAG_RW | CTLFLAG_LOCKED,
+		&ipc_kmsg_ool_adaptive, 0, "Adapt the OOL copy threshold to measured cost");
+SYSCTL_QUAD(_kern, OID_AUTO, ipc_ool_kbuf_cost,
+		CTLFLAG_RD | CTLFLAG_LOCKED,
+		&ipc_kmsg_ool_kbuf_cost, "");
+SYSCTL_QUAD(_kern, OID_AUTO, ipc_ool_remap_cost,
+		CTLFLAG_RD | CTLFLAG_LOCKED,
+		&ipc_kmsg_ool_remap_cost, "");
+SYSCTL_QUAD(_kern, OID_AUTO, ipc_ool_batched_copyouts,
+		CTLFLAG_RD | CTLFLAG_LOCKED,
+		&ipc_kmsg_ool_batched_copyouts, "");
+
 /*
  * Scheduler sysctls
  */
@@ -3670,3 +3670,25 @@ SYSCTL_PROC(_kern, OID_AUTO, wqset_clear_preposts, CTLTYPE_QUAD | CTLFLAG_RW | C
 
 #endif /* CONFIG_WAITQ_DEBUG */
 #endif /* defined(DEVELOPMENT) || defined(DEBUG) */
+
+#if CONFIG_WAITQ_STATS
+static int sysctl_waitq_table_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg2)
+	struct wq_table_stats stats;
+
+	if (req->newptr)
+		return EPERM;
+
+	if (arg1 == NULL)
+		waitq_link_stats(&stats);
+	else
+		waitq_prepost_stats(&stats);
+
+	return SYSCTL_OUT(req, &stats, sizeof(stats));
+}
+SYSCTL_PROC(_kern, OID_AUTO, waitq_link_stats, CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+	    NULL, 0, sysctl_waitq_table_stats, "S,wq_table_stats", "waitq link table statistics");
+SYSCTL_PROC(_kern, OID_AUTO, waitq_prepost_stats, CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+	    (void *)1, 0, sysctl_waitq_table_stats, "S,wq_table_stats", "waitq prepost table statistics");
+#endif /* CONFIG_WAITQ_STATS */
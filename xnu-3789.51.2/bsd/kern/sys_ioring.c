@@ -0,0 +1,899 @@
+/*
+ * Copyright (c) 2016 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/event.h>
+#include <sys/file_internal.h>
+#include <sys/filedesc.h>
+#include <sys/kauth.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/mount_internal.h>
+#include <sys/proc_internal.h>
+#include <sys/resourcevar.h>
+#include <sys/select.h>
+#include <sys/signalvar.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <sys/protosw.h>
+#include <sys/sysctl.h>
+#include <sys/sysproto.h>
+#include <sys/uio_internal.h>
+#include <sys/user.h>
+#include <sys/vnode_internal.h>
+#include <sys/ioring.h>
+
+#include <mach/mach_types.h>
+#include <kern/kern_types.h>
+#include <kern/locks.h>
+#include <kern/task.h>
+#include <kern/thread.h>
+
+#include <vm/vm_map.h>
+
+#include <libkern/OSAtomic.h>
+
+#if CONFIG_MACF
+#include <security/mac_framework.h>
+#endif
+
+/*
+ * I/O rings.
+ *
+ * Each ring descriptor owns one kernel worker thread; kern.ioring_max caps
+ * how many rings, and so workers, exist at once.  ioring_enter() publishes
+ * how many SQEs the worker may consume and wakes it; the worker assumes
+ * the owner's address space the way the AIO workers do, runs the SQEs
+ * through the ordinary fileops and copies the CQEs out, and then signals
+ * completion once per batch through wakeup(), select() and EVFILT_READ.
+ *
+ * The ring does not hold on to the owner's proc: the descriptor can be
+ * passed to another process and outlive its owner.  The worker looks the
+ * owner up by pid and unique id, holding a proc reference for each batch,
+ * and stops running SQEs for good once the owner has exited or exec'd.
+ *
+ * SQEs run in a vfs_context made of the thread that last called
+ * ioring_enter() and that thread's credential, as do_aio_write() uses the
+ * submitting thread, so file systems charge RLIMIT_FSIZE and SIGXFSZ to
+ * the owner rather than to the kernel.  ioring_rw() also checks the
+ * owner's RLIMIT_FSIZE itself for positioned writes.
+ *
+ * ir_lock protects the ring counters and flags.  ir_sq_head and ir_cq_tail
+ * are only written by the worker.
+ */
+
+struct ioring {
+	decl_lck_mtx_data(,	ir_lock);
+	uint32_t		ir_flags;
+	pid_t			ir_pid;		/* owner */
+	uint64_t		ir_uniqueid;	/* owner's proc_uniqueid() */
+	vm_map_t		ir_map;		/* owner's map, referenced */
+	user_addr_t		ir_sq_ring;
+	user_addr_t		ir_cq_ring;
+	uint32_t		ir_sq_entries;
+	uint32_t		ir_cq_entries;
+	uint32_t		ir_sq_head;	/* next SQE the worker consumes */
+	uint32_t		ir_sq_submitted;	/* SQEs handed over by ioring_enter() */
+	uint32_t		ir_cq_tail;	/* next CQE the worker fills */
+	uint32_t		ir_cq_posted;	/* CQEs posted since last enter or kevent */
+	thread_t		ir_thread;	/* last submitter, referenced */
+	kauth_cred_t		ir_cred;	/* its credential, referenced */
+	struct selinfo		ir_si;
+};
+
+#define IORING_CLOSING		0x01	/* descriptor is being closed */
+#define IORING_EXITED		0x02	/* worker has exited */
+#define IORING_CQ_FULL		0x04	/* worker parked on a full CQ */
+#define IORING_ORPHANED		0x08	/* owner has exited or exec'd */
+
+#define IORING_SQE_ADDR(ir, i)	((ir)->ir_sq_ring + sizeof(struct ioring_ring_hdr) + \
+				    (user_addr_t)((i) & ((ir)->ir_sq_entries - 1)) * sizeof(struct ioring_sqe))
+#define IORING_CQE_ADDR(ir, i)	((ir)->ir_cq_ring + sizeof(struct ioring_ring_hdr) + \
+				    (user_addr_t)((i) & ((ir)->ir_cq_entries - 1)) * sizeof(struct ioring_cqe))
+#define IORING_HEAD_ADDR(ring)	((ring) + offsetof(struct ioring_ring_hdr, head))
+#define IORING_TAIL_ADDR(ring)	((ring) + offsetof(struct ioring_ring_hdr, tail))
+
+static lck_grp_t	*ioring_lck_grp;
+static lck_attr_t	*ioring_lck_attr;
+
+static uint64_t		ioring_sqes;		/* SQEs run by ring workers */
+static uint64_t		ioring_batches;		/* worker wakeups that ran SQEs */
+static int		ioring_count;		/* rings, and so worker threads */
+static int		ioring_max = 64;
+
+SYSCTL_INT(_kern, OID_AUTO, ioring_max, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &ioring_max, 0, "Maximum number of I/O rings");
+SYSCTL_INT(_kern, OID_AUTO, ioring_count, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &ioring_count, 0, "I/O rings in use");
+SYSCTL_QUAD(_kern, OID_AUTO, ioring_sqes, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &ioring_sqes, "I/O ring submissions completed");
+SYSCTL_QUAD(_kern, OID_AUTO, ioring_batches, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &ioring_batches, "I/O ring worker batches");
+
+static int ioringop_read(struct fileproc *, struct uio *, int, vfs_context_t);
+static int ioringop_write(struct fileproc *, struct uio *, int, vfs_context_t);
+static int ioringop_ioctl(struct fileproc *, unsigned long, caddr_t, vfs_context_t);
+static int ioringop_select(struct fileproc *, int, void *, vfs_context_t);
+static int ioringop_close(struct fileglob *, vfs_context_t);
+static int ioringop_kqfilter(struct fileproc *, struct knote *, vfs_context_t);
+
+static const struct fileops ioring_ops = {
+	.fo_type = DTYPE_IORING,
+	.fo_read = ioringop_read,
+	.fo_write = ioringop_write,
+	.fo_ioctl = ioringop_ioctl,
+	.fo_select = ioringop_select,
+	.fo_close = ioringop_close,
+	.fo_kqfilter = ioringop_kqfilter,
+	.fo_drain = NULL,
+};
+
+static void	ioring_worker(void *param, wait_result_t wr);
+
+void
+ioring_init(void)
+{
+	lck_grp_attr_t *grp_attr;
+
+	grp_attr = lck_grp_attr_alloc_init();
+	ioring_lck_grp = lck_grp_alloc_init("ioring", grp_attr);
+	lck_grp_attr_free(grp_attr);
+	ioring_lck_attr = lck_attr_alloc_init();
+}
+
+static void
+ioring_free(struct ioring *ir)
+{
+	if (ir->ir_thread != THREAD_NULL)
+		thread_deallocate(ir->ir_thread);
+	if (IS_VALID_CRED(ir->ir_cred))
+		kauth_cred_unref(&ir->ir_cred);
+	vm_map_deallocate(ir->ir_map);
+	lck_mtx_destroy(&ir->ir_lock, ioring_lck_grp);
+	FREE(ir, M_TEMP);
+	OSDecrementAtomic(&ioring_count);
+}
+
+/*
+ * Look up a ring descriptor; returns with an I/O reference on the fileproc.
+ */
+static int
+ioring_find(proc_t p, int fd, struct fileproc **fpp, struct ioring **irp)
+{
+	struct fileproc *fp;
+	int error;
+
+	proc_fdlock_spin(p);
+	if ((error = fp_lookup(p, fd, &fp, 1)) != 0) {
+		proc_fdunlock(p);
+		return (error);
+	}
+	if (FILEGLOB_DTYPE(fp->f_fglob) != DTYPE_IORING) {
+		fp_drop(p, fd, fp, 1);
+		proc_fdunlock(p);
+		return (EBADF);
+	}
+	proc_fdunlock(p);
+
+	*fpp = fp;
+	*irp = (struct ioring *)fp->f_fglob->fg_data;
+	return (0);
+}
+
+/*
+ * Post a batch of completions.  A non-zero hint distinguishes the
+ * notification from kqueue's own calls to f_event.
+ */
+static void
+ioring_notify_locked(struct ioring *ir, uint32_t posted)
+{
+	ir->ir_cq_posted += posted;
+	wakeup(&ir->ir_cq_tail);
+	selwakeup(&ir->ir_si);
+	KNOTE(&ir->ir_si.si_note, 1);
+}
+
+/*
+ * Socket operations go to the protocol directly, with MSG_* flags, the way
+ * soo_read() and soo_write() do; MSG_DONTWAIT keeps the worker from
+ * blocking on a socket that is not ready.
+ */
+static int
+ioring_sock_rw(proc_t p, struct fileproc *fp, uio_t auio, int is_read,
+    int flags, vfs_context_t ctx)
+{
+	struct socket *so;
+	int error;
+
+	if ((so = (struct socket *)fp->f_fglob->fg_data) == NULL)
+		return (EBADF);
+
+	flags |= MSG_DONTWAIT;
+	if (is_read) {
+#if CONFIG_MACF_SOCKET
+		if ((error = mac_socket_check_receive(vfs_context_ucred(ctx), so)) != 0)
+			return (error);
+#endif /* CONFIG_MACF_SOCKET */
+		return ((*so->so_proto->pr_usrreqs->pru_soreceive)(so, NULL,
+		    auio, NULL, NULL, &flags));
+	}
+
+#if CONFIG_MACF_SOCKET
+	if ((error = mac_socket_check_send(vfs_context_ucred(ctx), so, NULL)) != 0)
+		return (error);
+#endif /* CONFIG_MACF_SOCKET */
+	error = (*so->so_proto->pr_usrreqs->pru_sosend)(so, NULL, auio,
+	    NULL, NULL, flags);
+	if (error == EPIPE && !(so->so_flags & SOF_NOSIGPIPE))
+		psignal(p, SIGPIPE);
+	return (error);
+}
+
+static int64_t
+ioring_rw(proc_t p, struct ioring_sqe *sqe, vfs_context_t ctx)
+{
+	int spacetype = IS_64BIT_PROCESS(p) ? UIO_USERSPACE64 : UIO_USERSPACE32;
+	int is_read, is_sock, flags = 0;
+	struct fileproc *fp;
+	user_ssize_t count = 0;
+	uio_t auio = NULL;
+	int error;
+
+	is_read = (sqe->opcode == IORING_OP_READ || sqe->opcode == IORING_OP_READV ||
+	    sqe->opcode == IORING_OP_RECVMSG);
+	is_sock = (sqe->opcode == IORING_OP_SENDMSG || sqe->opcode == IORING_OP_RECVMSG);
+
+	if ((error = fp_lookup(p, sqe->fd, &fp, 0)) != 0)
+		return (-error);
+
+	if ((fp->f_fglob->fg_flag & (is_read ? FREAD : FWRITE)) == 0) {
+		error = EBADF;
+		goto out;
+	}
+	if (is_sock) {
+		if (FILEGLOB_DTYPE(fp->f_fglob) != DTYPE_SOCKET) {
+			error = ENOTSOCK;
+			goto out;
+		}
+		if (sqe->off != IORING_OFF_CURRENT) {
+			error = ESPIPE;
+			goto out;
+		}
+	} else {
+		if (FILEGLOB_DTYPE(fp->f_fglob) != DTYPE_VNODE ||
+		    !vnode_isreg((vnode_t)fp->f_fglob->fg_data) || sqe->op_flags != 0) {
+			error = EINVAL;
+			goto out;
+		}
+		if (sqe->off != IORING_OFF_CURRENT) {
+			if (sqe->off < 0) {
+				error = EINVAL;
+				goto out;
+			}
+			flags = FOF_OFFSET;
+		}
+	}
+
+	if (sqe->opcode == IORING_OP_READ || sqe->opcode == IORING_OP_WRITE) {
+		if (sqe->len > INT_MAX) {
+			error = EINVAL;
+			goto out;
+		}
+		auio = uio_create(1, (flags & FOF_OFFSET) ? sqe->off : 0, spacetype,
+		    is_read ? UIO_READ : UIO_WRITE);
+		if (auio == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+		uio_addiov(auio, (user_addr_t)sqe->addr, sqe->len);
+	} else {
+		struct user_iovec *iovp;
+
+		if (sqe->len == 0 || sqe->len > UIO_MAXIOV) {
+			error = EINVAL;
+			goto out;
+		}
+		auio = uio_create(sqe->len, (flags & FOF_OFFSET) ? sqe->off : 0,
+		    spacetype, is_read ? UIO_READ : UIO_WRITE);
+		if (auio == NULL || (iovp = uio_iovsaddr(auio)) == NULL) {
+			error = ENOMEM;
+			goto free;
+		}
+		error = copyin_user_iovec_array((user_addr_t)sqe->addr, spacetype,
+		    sqe->len, iovp);
+		if (error == 0)
+			error = uio_calculateresid(auio);
+		if (error)
+			goto free;
+	}
+
+	count = uio_resid(auio);
+
+	/* the owner's file size limit, which not every file system checks */
+	if (!is_read && !is_sock && (flags & FOF_OFFSET) &&
+	    (uint64_t)sqe->off + (uint64_t)count >
+	    (uint64_t)p->p_rlimit[RLIMIT_FSIZE].rlim_cur) {
+		psignal(p, SIGXFSZ);
+		error = EFBIG;
+		goto free;
+	}
+
+	if (is_sock)
+		error = ioring_sock_rw(p, fp, auio, is_read, (int)sqe->op_flags, ctx);
+	else if (is_read)
+		error = fo_read(fp, auio, flags, ctx);
+	else
+		error = fo_write(fp, auio, flags, ctx);
+	if (error && uio_resid(auio) != count &&
+	    (error == ERESTART || error == EINTR || error == EWOULDBLOCK))
+		error = 0;
+	count -= uio_resid(auio);
+
+free:
+	if (auio != NULL)
+		uio_free(auio);
+out:
+	if (error == 0 && !is_read && !is_sock)
+		fp_drop_written(p, sqe->fd, fp);
+	else
+		fp_drop(p, sqe->fd, fp, 0);
+	return (error ? -(int64_t)error : (int64_t)count);
+}
+
+static int64_t
+ioring_fsync(proc_t p, struct ioring_sqe *sqe, vfs_context_t ctx)
+{
+	struct fileproc *fp;
+	vnode_t vp;
+	int error;
+
+	if (sqe->op_flags & ~IORING_FSYNC_DATASYNC)
+		return (-EINVAL);
+
+	if ((error = fp_getfvp(p, sqe->fd, &fp, &vp)) != 0)
+		return (-error);
+	if ((error = vnode_getwithref(vp)) == 0) {
+		error = VNOP_FSYNC(vp, (sqe->op_flags & IORING_FSYNC_DATASYNC) ?
+		    MNT_DWAIT : MNT_WAIT, ctx);
+		(void)vnode_put(vp);
+	}
+	fp_drop(p, sqe->fd, fp, 0);
+
+	return (error ? -(int64_t)error : 0);
+}
+
+static int64_t
+ioring_do_sqe(proc_t p, struct ioring_sqe *sqe, vfs_context_t ctx)
+{
+	switch (sqe->opcode) {
+	case IORING_OP_NOP:
+		return (0);
+	case IORING_OP_READ:
+	case IORING_OP_WRITE:
+	case IORING_OP_READV:
+	case IORING_OP_WRITEV:
+	case IORING_OP_SENDMSG:
+	case IORING_OP_RECVMSG:
+		return (ioring_rw(p, sqe, ctx));
+	case IORING_OP_FSYNC:
+		return (ioring_fsync(p, sqe, ctx));
+	default:
+		return (-EINVAL);
+	}
+}
+
+/*
+ * Run SQEs from *sq_headp up to limit, posting a CQE for each, until the
+ * SQ is drained or the CQ fills.  Called with a reference on the owner p
+ * and its map switched in; ctx is the submitter's context.
+ * Returns the number of CQEs posted; *cq_fullp is set if the worker has
+ * to wait for the process to reap completions.
+ */
+static uint32_t
+ioring_run(struct ioring *ir, proc_t p, vfs_context_t ctx, uint32_t *sq_headp,
+    uint32_t limit, uint32_t *cq_tailp, boolean_t *cq_fullp)
+{
+	uint32_t sq_head = *sq_headp, cq_tail = *cq_tailp, cq_head;
+	struct ioring_sqe sqe;
+	struct ioring_cqe cqe;
+	uint32_t posted = 0;
+
+	*cq_fullp = FALSE;
+	if (copyin(IORING_HEAD_ADDR(ir->ir_cq_ring), &cq_head, sizeof(cq_head)) != 0) {
+		*cq_fullp = TRUE;
+		return (0);
+	}
+
+	while (sq_head != limit) {
+		if (cq_tail - cq_head >= ir->ir_cq_entries) {
+			*cq_fullp = TRUE;
+			break;
+		}
+
+		if (copyin(IORING_SQE_ADDR(ir, sq_head), &sqe, sizeof(sqe)) != 0) {
+			cqe.user_data = 0;
+			cqe.res = -EFAULT;
+		} else {
+			cqe.user_data = sqe.user_data;
+			cqe.res = ioring_do_sqe(p, &sqe, ctx);
+		}
+		if (copyout(&cqe, IORING_CQE_ADDR(ir, cq_tail), sizeof(cqe)) != 0) {
+			*cq_fullp = TRUE;
+			break;
+		}
+		sq_head++;
+		cq_tail++;
+		posted++;
+	}
+
+	if (posted != 0) {
+		/* CQEs must be visible before the tail that covers them */
+		OSMemoryBarrier();
+		(void)copyout(&sq_head, IORING_HEAD_ADDR(ir->ir_sq_ring), sizeof(sq_head));
+		(void)copyout(&cq_tail, IORING_TAIL_ADDR(ir->ir_cq_ring), sizeof(cq_tail));
+		OSAddAtomic64(posted, (volatile SInt64 *)&ioring_sqes);
+		OSIncrementAtomic64((volatile SInt64 *)&ioring_batches);
+	}
+
+	*sq_headp = sq_head;
+	*cq_tailp = cq_tail;
+	return (posted);
+}
+
+static void
+ioring_worker(void *param, __unused wait_result_t wr)
+{
+	struct ioring *ir = (struct ioring *)param;
+	struct uthread *uthreadp = (struct uthread *)get_bsdthread_info(current_thread());
+	uint32_t sq_head, limit, cq_tail, posted;
+	struct vfs_context context;
+	boolean_t cq_full;
+	task_t oldaiotask;
+	vm_map_t oldmap;
+	proc_t p;
+
+	lck_mtx_lock(&ir->ir_lock);
+	for (;;) {
+		while ((ir->ir_flags & IORING_CLOSING) == 0 &&
+		    (ir->ir_sq_head == ir->ir_sq_submitted ||
+		    (ir->ir_flags & (IORING_CQ_FULL | IORING_ORPHANED)) != 0)) {
+			msleep(&ir->ir_sq_submitted, &ir->ir_lock, PRIBIO, "ioring_worker", NULL);
+		}
+		if (ir->ir_flags & IORING_CLOSING)
+			break;
+
+		sq_head = ir->ir_sq_head;
+		limit = ir->ir_sq_submitted;
+		cq_tail = ir->ir_cq_tail;
+		context.vc_thread = ir->ir_thread;
+		context.vc_ucred = ir->ir_cred;
+		thread_reference(context.vc_thread);
+		kauth_cred_ref(context.vc_ucred);
+		lck_mtx_unlock(&ir->ir_lock);
+
+		/*
+		 * Hold the owner for the batch.  A different map means the
+		 * owner has exec'd; the ring belonged to the old image.
+		 */
+		p = proc_find(ir->ir_pid);
+		if (p != PROC_NULL && (proc_uniqueid(p) != ir->ir_uniqueid ||
+		    get_task_map(p->task) != ir->ir_map)) {
+			proc_rele(p);
+			p = PROC_NULL;
+		}
+		if (p == PROC_NULL) {
+			thread_deallocate(context.vc_thread);
+			kauth_cred_unref(&context.vc_ucred);
+			lck_mtx_lock(&ir->ir_lock);
+			ir->ir_flags |= IORING_ORPHANED;
+			continue;
+		}
+
+		/*
+		 * Assume the owner's address space identity for the batch,
+		 * as aio_work_thread() does for each request.
+		 */
+		oldaiotask = uthreadp->uu_aio_task;
+		uthreadp->uu_aio_task = p->task;
+		oldmap = vm_map_switch(ir->ir_map);
+
+		posted = ioring_run(ir, p, &context, &sq_head, limit, &cq_tail, &cq_full);
+
+		(void) vm_map_switch(oldmap);
+		uthreadp->uu_aio_task = oldaiotask;
+		proc_rele(p);
+		thread_deallocate(context.vc_thread);
+		kauth_cred_unref(&context.vc_ucred);
+
+		lck_mtx_lock(&ir->ir_lock);
+		ir->ir_sq_head = sq_head;
+		ir->ir_cq_tail = cq_tail;
+		if (cq_full)
+			ir->ir_flags |= IORING_CQ_FULL;
+		if (posted != 0)
+			ioring_notify_locked(ir, posted);
+	}
+
+	/* ioringop_close() frees the ring once it sees IORING_EXITED */
+	ir->ir_flags |= IORING_EXITED;
+	wakeup(&ir->ir_flags);
+	lck_mtx_unlock(&ir->ir_lock);
+
+	thread_terminate(current_thread());
+	/* NOT REACHED */
+}
+
+static int
+ioringop_read(struct fileproc *fp, struct uio *uio, int flags, vfs_context_t ctx)
+{
+#pragma unused(fp, uio, flags, ctx)
+	return (ENXIO);
+}
+
+static int
+ioringop_write(struct fileproc *fp, struct uio *uio, int flags, vfs_context_t ctx)
+{
+#pragma unused(fp, uio, flags, ctx)
+	return (ENXIO);
+}
+
+static int
+ioringop_ioctl(struct fileproc *fp, unsigned long com, caddr_t data, vfs_context_t ctx)
+{
+#pragma unused(fp, com, data, ctx)
+	return (ENOTTY);
+}
+
+static int
+ioringop_select(struct fileproc *fp, int which, void *wql, vfs_context_t ctx)
+{
+	struct ioring *ir = (struct ioring *)fp->f_fglob->fg_data;
+	int ready = 0;
+
+	if (which != FREAD)
+		return (0);
+
+	lck_mtx_lock(&ir->ir_lock);
+	if (ir->ir_cq_posted != 0)
+		ready = 1;
+	else
+		selrecord(vfs_context_proc(ctx), &ir->ir_si, wql);
+	lck_mtx_unlock(&ir->ir_lock);
+
+	return (ready);
+}
+
+static int
+ioringop_close(struct fileglob *fg, vfs_context_t ctx)
+{
+#pragma unused(ctx)
+	struct ioring *ir = (struct ioring *)fg->fg_data;
+
+	fg->fg_data = NULL;
+	if (ir == NULL)
+		return (0);
+
+	lck_mtx_lock(&ir->ir_lock);
+	ir->ir_flags |= IORING_CLOSING;
+	wakeup(&ir->ir_sq_submitted);
+	while ((ir->ir_flags & IORING_EXITED) == 0)
+		msleep(&ir->ir_flags, &ir->ir_lock, PRIBIO, "ioring_close", NULL);
+	lck_mtx_unlock(&ir->ir_lock);
+
+	selthreadclear(&ir->ir_si);
+	ioring_free(ir);
+
+	return (0);
+}
+
+static void
+filt_ioringdetach(struct knote *kn)
+{
+	struct ioring *ir = (struct ioring *)kn->kn_hook;
+
+	lck_mtx_lock(&ir->ir_lock);
+	KNOTE_DETACH(&ir->ir_si.si_note, kn);
+	lck_mtx_unlock(&ir->ir_lock);
+}
+
+/* called with ir_lock held, from ioring_notify_locked() */
+static int
+filt_ioringevent(struct knote *kn, long hint)
+{
+#pragma unused(hint)
+	struct ioring *ir = (struct ioring *)kn->kn_hook;
+
+	return (ir->ir_cq_posted != 0);
+}
+
+static int
+filt_ioringtouch(struct knote *kn, struct kevent_internal_s *kev)
+{
+	struct ioring *ir = (struct ioring *)kn->kn_hook;
+	int res;
+
+	lck_mtx_lock(&ir->ir_lock);
+	if ((kn->kn_status & KN_UDATA_SPECIFIC) == 0)
+		kn->kn_udata = kev->udata;
+	res = (ir->ir_cq_posted != 0);
+	lck_mtx_unlock(&ir->ir_lock);
+
+	return (res);
+}
+
+/*
+ * Deliver the number of CQEs posted since the last delivery; the count
+ * restarts at zero, so the event behaves as if EV_CLEAR were set.
+ */
+static int
+filt_ioringprocess(struct knote *kn, struct filt_process_s *data, struct kevent_internal_s *kev)
+{
+#pragma unused(data)
+	struct ioring *ir = (struct ioring *)kn->kn_hook;
+	int res = 0;
+
+	lck_mtx_lock(&ir->ir_lock);
+	if (ir->ir_cq_posted != 0) {
+		*kev = kn->kn_kevent;
+		kev->data = ir->ir_cq_posted;
+		ir->ir_cq_posted = 0;
+		res = 1;
+	}
+	lck_mtx_unlock(&ir->ir_lock);
+
+	return (res);
+}
+
+struct filterops ioring_filtops = {
+	.f_isfd = 1,
+	.f_detach = filt_ioringdetach,
+	.f_event = filt_ioringevent,
+	.f_touch = filt_ioringtouch,
+	.f_process = filt_ioringprocess,
+};
+
+static int
+ioringop_kqfilter(struct fileproc *fp, struct knote *kn, vfs_context_t ctx)
+{
+#pragma unused(ctx)
+	struct ioring *ir = (struct ioring *)fp->f_fglob->fg_data;
+	int res;
+
+	if (kn->kn_filter != EVFILT_READ || ir == NULL) {
+		kn->kn_flags = EV_ERROR;
+		kn->kn_data = EINVAL;
+		return (0);
+	}
+
+	lck_mtx_lock(&ir->ir_lock);
+	kn->kn_filtid = EVFILTID_IORING;
+	kn->kn_hook = ir;
+	KNOTE_ATTACH(&ir->ir_si.si_note, kn);
+	res = (ir->ir_cq_posted != 0);
+	lck_mtx_unlock(&ir->ir_lock);
+
+	return (res);
+}
+
+static int
+ioring_valid_entries(uint32_t n)
+{
+	return (n != 0 && n <= IORING_MAX_ENTRIES && (n & (n - 1)) == 0);
+}
+
+/*
+ * ioring_setup: create a ring descriptor for the SQ and CQ rings
+ * described by *params.
+ *
+ * Returns:	0			Success
+ *		EINVAL			Bad ring sizes, addresses or flags
+ *		EAGAIN			kern.ioring_max rings already exist
+ *		ENOMEM
+ *	copyin:EFAULT
+ *	falloc:???
+ */
+int
+ioring_setup(proc_t p, struct ioring_setup_args *uap, int *retval)
+{
+	struct ioring_params params;
+	struct ioring_ring_hdr hdr;
+	struct ioring *ir = NULL;
+	struct fileproc *fp = NULL;
+	thread_t worker;
+	int fd = -1;
+	int error;
+
+	if ((error = copyin(uap->params, &params, sizeof(params))) != 0)
+		return (error);
+
+	if (params.cq_entries == 0)
+		params.cq_entries = 2 * params.sq_entries;
+	if (params.flags != 0 || !ioring_valid_entries(params.sq_entries) ||
+	    !ioring_valid_entries(params.cq_entries) ||
+	    params.cq_entries < params.sq_entries ||
+	    params.sq_ring == 0 || (params.sq_ring & (sizeof(uint64_t) - 1)) != 0 ||
+	    params.cq_ring == 0 || (params.cq_ring & (sizeof(uint64_t) - 1)) != 0)
+		return (EINVAL);
+
+	/* both rings start out empty; this also catches bad addresses early */
+	bzero(&hdr, sizeof(hdr));
+	if ((error = copyout(&hdr, (user_addr_t)params.sq_ring, sizeof(hdr))) != 0 ||
+	    (error = copyout(&hdr, (user_addr_t)params.cq_ring, sizeof(hdr))) != 0)
+		return (error);
+
+	/* every ring has a worker thread; don't let them pile up */
+	if (OSIncrementAtomic(&ioring_count) >= ioring_max) {
+		OSDecrementAtomic(&ioring_count);
+		return (EAGAIN);
+	}
+
+	MALLOC(ir, struct ioring *, sizeof(*ir), M_TEMP, M_WAITOK | M_ZERO);
+	if (ir == NULL) {
+		OSDecrementAtomic(&ioring_count);
+		return (ENOMEM);
+	}
+
+	lck_mtx_init(&ir->ir_lock, ioring_lck_grp, ioring_lck_attr);
+	klist_init(&ir->ir_si.si_note);
+	ir->ir_pid = proc_pid(p);
+	ir->ir_uniqueid = proc_uniqueid(p);
+	ir->ir_map = get_task_map(p->task);
+	vm_map_reference(ir->ir_map);
+	ir->ir_sq_ring = (user_addr_t)params.sq_ring;
+	ir->ir_cq_ring = (user_addr_t)params.cq_ring;
+	ir->ir_sq_entries = params.sq_entries;
+	ir->ir_cq_entries = params.cq_entries;
+	ir->ir_thread = current_thread();
+	thread_reference(ir->ir_thread);
+	ir->ir_cred = kauth_cred_get_with_ref();
+
+	if ((error = falloc(p, &fp, &fd, vfs_context_current())) != 0) {
+		ioring_free(ir);
+		return (error);
+	}
+
+	if (kernel_thread_start(ioring_worker, ir, &worker) != KERN_SUCCESS) {
+		fp_free(p, fd, fp);
+		ioring_free(ir);
+		return (ENOMEM);
+	}
+	thread_deallocate(worker);
+
+	fp->f_fglob->fg_flag = FREAD;
+	fp->f_fglob->fg_ops = &ioring_ops;
+	fp->f_fglob->fg_data = ir;
+
+	proc_fdlock(p);
+	*fdflags(p, fd) |= (UF_EXCLOSE | UF_FORKCLOSE);
+	procfdtbl_releasefd(p, fd, NULL);
+	fp_drop(p, fd, fp, 1);
+	proc_fdunlock(p);
+
+	*retval = fd;
+	return (0);
+}
+
+/*
+ * ioring_enter: hand up to to_submit new SQEs to the ring's worker and,
+ * with IORING_ENTER_GETEVENTS, wait until at least min_complete CQEs are
+ * waiting to be reaped.  Returns the number of SQEs handed over.
+ *
+ * Returns:	0			Success
+ *		EBADF			fd is not a ring descriptor
+ *		EPERM			Caller does not own the ring
+ *		EINVAL			Bad flags, count or SQ tail
+ *		EINTR
+ *	copyin:EFAULT
+ */
+int
+ioring_enter(proc_t p, struct ioring_enter_args *uap, int *retval)
+{
+	struct fileproc *fp;
+	struct ioring *ir;
+	uint32_t sq_tail = 0, cq_head, avail, n = 0;
+	thread_t old_thread = THREAD_NULL;
+	kauth_cred_t cred, old_cred;
+	int error;
+
+	if ((error = ioring_find(p, uap->fd, &fp, &ir)) != 0)
+		return (error);
+	cred = kauth_cred_get_with_ref();
+
+	if (ir->ir_pid != proc_pid(p) || ir->ir_uniqueid != proc_uniqueid(p) ||
+	    ir->ir_map != get_task_map(p->task)) {
+		error = EPERM;
+		goto out;
+	}
+	if ((uap->flags & ~IORING_ENTER_GETEVENTS) != 0 ||
+	    uap->min_complete > ir->ir_cq_entries) {
+		error = EINVAL;
+		goto out;
+	}
+
+	if (uap->to_submit != 0 &&
+	    (error = copyin(IORING_TAIL_ADDR(ir->ir_sq_ring), &sq_tail, sizeof(sq_tail))) != 0)
+		goto out;
+
+	lck_mtx_lock(&ir->ir_lock);
+	if (uap->to_submit != 0) {
+		avail = sq_tail - ir->ir_sq_submitted;
+		if (avail > ir->ir_sq_entries - (ir->ir_sq_submitted - ir->ir_sq_head)) {
+			lck_mtx_unlock(&ir->ir_lock);
+			error = EINVAL;
+			goto out;
+		}
+		n = MIN(uap->to_submit, avail);
+		ir->ir_sq_submitted += n;
+	}
+	if (n != 0 && (ir->ir_thread != current_thread() || ir->ir_cred != cred)) {
+		old_thread = ir->ir_thread;
+		old_cred = ir->ir_cred;
+		ir->ir_thread = current_thread();
+		thread_reference(ir->ir_thread);
+		ir->ir_cred = cred;
+		cred = old_cred;
+	}
+	/* the caller is about to look at the CQ; restart the kevent count */
+	ir->ir_cq_posted = 0;
+	if (n != 0 || (ir->ir_flags & IORING_CQ_FULL)) {
+		ir->ir_flags &= ~IORING_CQ_FULL;
+		wakeup(&ir->ir_sq_submitted);
+	}
+
+	if ((uap->flags & IORING_ENTER_GETEVENTS) && uap->min_complete != 0) {
+		for (;;) {
+			uint32_t cq_tail = ir->ir_cq_tail;
+
+			lck_mtx_unlock(&ir->ir_lock);
+			error = copyin(IORING_HEAD_ADDR(ir->ir_cq_ring), &cq_head, sizeof(cq_head));
+			lck_mtx_lock(&ir->ir_lock);
+			if (error != 0 || ir->ir_cq_tail - cq_head >= uap->min_complete)
+				break;
+			if (ir->ir_cq_tail != cq_tail)
+				continue;
+			error = msleep(&ir->ir_cq_tail, &ir->ir_lock, PSOCK | PCATCH,
+			    "ioring_enter", NULL);
+			if (error != 0)
+				break;
+		}
+	}
+	lck_mtx_unlock(&ir->ir_lock);
+
+	/* SQEs already handed over are not taken back */
+	if (n != 0)
+		error = 0;
+	*retval = (int)n;
+out:
+	if (old_thread != THREAD_NULL)
+		thread_deallocate(old_thread);
+	if (IS_VALID_CRED(cred))
+		kauth_cred_unref(&cred);
+	fp_drop(p, uap->fd, fp, 0);
+	return (error);
+}
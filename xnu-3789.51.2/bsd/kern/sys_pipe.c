@@ -137,6 +137,7 @@
 #include <sys/pipe.h>
 #include <sys/sysproto.h>
 #include <sys/proc_info.h>
+#include <sys/sysctl.h>
 
 #include <security/audit/audit.h>
 
@@ -145,6 +146,9 @@
 #include <kern/zalloc.h>
 #include <kern/kalloc.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#include <mach/memory_object_types.h>
+#include <sys/ubc.h>
 #include <libkern/OSAtomic.h>
 
 #define f_flag f_fglob->fg_flag
@@ -230,6 +234,24 @@ SYSCTL_INT(_kern_ipc, OID_AUTO, pipekvawired, CTLFLAG_RD|CTLFLAG_LOCKED,
 	   &amountpipekvawired, 0, "Pipe wired KVA usage");
 #endif
 
+/*
+ * Blocking writes of at least pipe_direct_min bytes from user space skip
+ * the pipe buffer when they don't fit in its free space: the writer's
+ * pages are wired and the reader copies straight out of them.  A write that fits in the buffer always goes
+ * through it, so it never waits for a reader.  0 disables direct writes.
+ */
+static int pipe_direct_min = BIG_PIPE_SIZE;
+static SInt64 pipe_direct_writes = 0;
+static SInt64 pipe_direct_bytes = 0;
+
+SYSCTL_DECL(_kern_ipc);
+SYSCTL_INT(_kern_ipc, OID_AUTO, pipe_direct_min, CTLFLAG_RW|CTLFLAG_LOCKED,
+	   &pipe_direct_min, 0, "Smallest pipe write handed to the reader directly");
+SYSCTL_QUAD(_kern_ipc, OID_AUTO, pipe_direct_writes, CTLFLAG_RD|CTLFLAG_LOCKED,
+	   &pipe_direct_writes, "Pipe writes handed to the reader directly");
+SYSCTL_QUAD(_kern_ipc, OID_AUTO, pipe_direct_bytes, CTLFLAG_RD|CTLFLAG_LOCKED,
+	   &pipe_direct_bytes, "Bytes read straight from a writer's pages");
+
 static void pipeclose(struct pipe *cpipe);
 static void pipe_free_kmem(struct pipe *cpipe);
 static int pipe_create(struct pipe **cpipep);
@@ -239,6 +261,8 @@ static int expand_pipespace(struct pipe *p, int target_size);
 static void pipeselwakeup(struct pipe *cpipe, struct pipe *spipe);
 static __inline int pipeio_lock(struct pipe *cpipe, int catch);
 static __inline void pipeio_unlock(struct pipe *cpipe);
+static int pipe_direct_write(struct pipe *wpipe, struct uio *uio);
+static int pipe_direct_copy(struct pipe *rpipe, u_int size, struct uio *uio);
 
 extern int postpipeevent(struct pipe *, int);
 extern void evpipefree(struct pipe *cpipe);
@@ -251,6 +275,11 @@ static zone_t pipe_zone;
 
 #define MAX_PIPESIZE(pipe)  		( MAX(PIPE_SIZE, (pipe)->pipe_buffer.size) )
 
+/* bytes a reader can consume: the buffer plus any pending direct write */
+#define PIPE_READABLE(pipe)		( (pipe)->pipe_buffer.cnt + \
+	(((pipe)->pipe_state & PIPE_DIRECTW) ? \
+	 (int)((pipe)->pipe_map.cnt - (pipe)->pipe_map.pos) : 0) )
+
 #define	PIPE_GARBAGE_AGE_LIMIT		5000	/* In milliseconds */
 #define PIPE_GARBAGE_QUEUE_LIMIT	32000
 
@@ -525,13 +554,13 @@ pipe_stat(struct pipe *cpipe, void *ub, int isstat64)
 	        if (cpipe->pipe_peer) {
 		        /* the peer still exists, use it's info */
 		        pipe_size  = MAX_PIPESIZE(cpipe->pipe_peer);
-			pipe_count = cpipe->pipe_peer->pipe_buffer.cnt;
+			pipe_count = PIPE_READABLE(cpipe->pipe_peer);
 		} else {
 			pipe_count = 0;
 		}
 	} else {
 	        pipe_size  = MAX_PIPESIZE(cpipe);
-		pipe_count = cpipe->pipe_buffer.cnt;
+		pipe_count = PIPE_READABLE(cpipe);
 	}
 	/*
 	 * since peer's buffer is setup ouside of lock
@@ -787,6 +816,39 @@ pipe_read(struct fileproc *fp, struct uio *uio, __unused int flags,
 				rpipe->pipe_buffer.out = 0;
 			}
 			nread += size;
+		} else if (rpipe->pipe_state & PIPE_DIRECTW) {
+			/*
+			 * direct write: copy straight out of the writer's
+			 * pages.  The writer can't take its pages back
+			 * while we hold the io lock.
+			 */
+			user_ssize_t resid = uio_resid(uio);
+
+			size = (u_int)(rpipe->pipe_map.cnt - rpipe->pipe_map.pos);
+			if (size > (u_int) resid)
+				size = (u_int) resid;
+
+			PIPE_UNLOCK(rpipe); /* we still hold io lock.*/
+			error = pipe_direct_copy(rpipe, size, uio);
+			PIPE_LOCK(rpipe);
+
+			size = (u_int)(resid - uio_resid(uio));
+			rpipe->pipe_map.pos += size;
+			nread += size;
+			OSAddAtomic64(size, &pipe_direct_bytes);
+
+			if (rpipe->pipe_map.pos == rpipe->pipe_map.cnt) {
+				/*
+				 * all of it consumed, let the writer go
+				 */
+				rpipe->pipe_state &= ~PIPE_DIRECTW;
+				if (rpipe->pipe_state & PIPE_WANTW) {
+					rpipe->pipe_state &= ~PIPE_WANTW;
+					wakeup(rpipe);
+				}
+			}
+			if (error)
+				break;
 		} else {
 			/*
 			 * detect EOF condition
@@ -883,6 +945,7 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 	// LP64todo - fix this!
 	orig_resid = uio_resid(uio);
 	int space;
+	int direct = !(fp->f_flag & FNONBLOCK);
 
 	rpipe = (struct pipe *)fp->f_data;
 
@@ -955,6 +1018,30 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 
 	while (uio_resid(uio)) {
 
+		/*
+		 * Large blocking writes from user space hand their pages
+		 * to the reader instead of going through the buffer, but
+		 * only when the rest of the write doesn't fit in the free
+		 * buffer space, so the writer would have to wait for a
+		 * reader anyway.  A write that fits is copied, even with a
+		 * reader waiting.  If the pages can't be wired, fall back
+		 * to the buffer for the rest of this write.
+		 */
+		if (direct && pipe_direct_min > 0 &&
+		    UIO_SEG_IS_USER_SPACE(uio->uio_segflg) &&
+		    uio_curriovlen(uio) >= (user_size_t)pipe_direct_min &&
+		    uio_resid(uio) > (user_ssize_t)(wpipe->pipe_buffer.size - wpipe->pipe_buffer.cnt)) {
+			error = pipe_direct_write(wpipe, uio);
+			if (error == ENOTSUP) {
+				direct = 0;
+				error = 0;
+			} else if (error) {
+				break;
+			} else {
+				continue;
+			}
+		}
+
 	retrywrite:
 		space = wpipe->pipe_buffer.size - wpipe->pipe_buffer.cnt;
 
@@ -962,6 +1049,10 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 		if ((space < uio_resid(uio)) && (orig_resid <= PIPE_BUF))
 			space = 0;
 
+		/* Buffered data can't overtake a pending direct write. */
+		if (wpipe->pipe_state & PIPE_DIRECTW)
+			space = 0;
+
 		if (space > 0) {
 
 			if ((error = pipeio_lock(wpipe,1)) == 0) {
@@ -978,7 +1069,8 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 				 * value for space might be bad... the mutex
 				 * is dropped while we're blocked
 				 */
-				if (space > (int)(wpipe->pipe_buffer.size - 
+				if ((wpipe->pipe_state & PIPE_DIRECTW) ||
+				    space > (int)(wpipe->pipe_buffer.size -
 				    wpipe->pipe_buffer.cnt)) {
 					pipeio_unlock(wpipe);
 					goto retrywrite;
@@ -1125,6 +1217,208 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 	return (error);
 }
 
+/*
+ * Hand the current iovec of a large write to the reader: wire the writer's
+ * pages in a UPL, publish them in pipe_map and sleep until the reader has
+ * copied them out.  Called and returns with the pipe mutex held.
+ *
+ * Returns ENOTSUP without transferring anything if the pages can't be
+ * wired; the caller then goes through the pipe buffer instead.
+ */
+static int
+pipe_direct_write(struct pipe *wpipe, struct uio *uio)
+{
+	upl_t			upl = NULL;
+	upl_page_info_t		*pl = NULL;
+	upl_size_t		upl_size;
+	upl_control_flags_t	upl_flags;
+	mach_msg_type_number_t	pages_in_pl;
+	kern_return_t		kret;
+	user_addr_t		iov_base;
+	vm_size_t		offset, cnt, pos;
+	int			i;
+	int			error;
+
+retry:
+	/*
+	 * Wait for the buffer to drain and for any other direct write
+	 * to finish, so the data stays in order.
+	 */
+	while ((wpipe->pipe_state & PIPE_DIRECTW) || wpipe->pipe_buffer.cnt > 0) {
+		if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF))
+			return (EPIPE);
+		if (wpipe->pipe_state & PIPE_WANTR) {
+			wpipe->pipe_state &= ~PIPE_WANTR;
+			wakeup(wpipe);
+		}
+		pipeselwakeup(wpipe, wpipe);
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH, "pipdww", 0);
+		if (error)
+			return (error);
+	}
+	if ((error = pipeio_lock(wpipe, 1)) != 0)
+		return (error);
+	if ((wpipe->pipe_state & PIPE_DIRECTW) || wpipe->pipe_buffer.cnt > 0) {
+		pipeio_unlock(wpipe);
+		goto retry;
+	}
+	if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) {
+		pipeio_unlock(wpipe);
+		return (EPIPE);
+	}
+
+	iov_base = uio_curriovbase(uio);
+	offset = (vm_size_t)(iov_base & PAGE_MASK);
+	cnt = (vm_size_t)MIN(uio_curriovlen(uio), PIPE_DIRECTMAX);
+
+	upl_size = (upl_size_t)round_page(offset + cnt);
+	upl_flags = UPL_COPYOUT_FROM | UPL_NO_SYNC | UPL_SET_INTERNAL | UPL_SET_LITE |
+	    UPL_SET_IO_WIRE | UPL_MEMORY_TAG_MAKE(VM_KERN_MEMORY_BSD);
+
+	PIPE_UNLOCK(wpipe);	/* we still hold io lock */
+	kret = vm_map_get_upl(current_map(),
+	    (vm_map_offset_t)(iov_base & ~((user_addr_t)PAGE_MASK)),
+	    &upl_size, &upl, NULL, &pages_in_pl, &upl_flags, 0);
+
+	if (kret == KERN_SUCCESS) {
+		pl = UPL_GET_INTERNAL_PAGE_LIST(upl);
+		pages_in_pl = upl_size / PAGE_SIZE;
+
+		for (i = 0; i < (int)pages_in_pl; i++) {
+			if (!upl_valid_page(pl, i))
+				break;
+		}
+		/*
+		 * hand over as much as came back wired; a hole in the
+		 * first page means we can't use this buffer at all
+		 */
+		if ((vm_size_t)i * PAGE_SIZE > offset) {
+			cnt = MIN(cnt, (vm_size_t)i * PAGE_SIZE - offset);
+		} else {
+			ubc_upl_abort(upl, 0);
+			kret = KERN_FAILURE;
+		}
+	}
+	PIPE_LOCK(wpipe);
+
+	if (kret != KERN_SUCCESS) {
+		pipeio_unlock(wpipe);
+		return (ENOTSUP);
+	}
+	wpipe->pipe_map.upl = upl;
+	wpipe->pipe_map.pl = pl;
+	wpipe->pipe_map.offset = offset;
+	wpipe->pipe_map.cnt = cnt;
+	wpipe->pipe_map.pos = 0;
+	wpipe->pipe_state |= PIPE_DIRECTW;
+	pipeio_unlock(wpipe);
+
+	OSIncrementAtomic64(&pipe_direct_writes);
+
+	/*
+	 * The reader clears PIPE_DIRECTW once it has consumed all of it.
+	 * By the time we run again another writer may already have
+	 * published its own pages, so check that the mapping is ours.
+	 */
+	while ((wpipe->pipe_state & PIPE_DIRECTW) && wpipe->pipe_map.upl == upl) {
+		if (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) {
+			error = EPIPE;
+			break;
+		}
+		if (wpipe->pipe_state & PIPE_WANTR) {
+			wpipe->pipe_state &= ~PIPE_WANTR;
+			wakeup(wpipe);
+		}
+		pipeselwakeup(wpipe, wpipe);
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH, "pipdwt", 0);
+		if (error)
+			break;
+	}
+
+	/*
+	 * Take the pages back, waiting out a reader still copying from
+	 * them.  Whatever it didn't get to is left for the next write.
+	 */
+	(void) pipeio_lock(wpipe, 0);
+	if ((wpipe->pipe_state & PIPE_DIRECTW) && wpipe->pipe_map.upl == upl) {
+		pos = wpipe->pipe_map.pos;
+		wpipe->pipe_state &= ~PIPE_DIRECTW;
+		bzero(&wpipe->pipe_map, sizeof(wpipe->pipe_map));
+	} else {
+		pos = cnt;
+	}
+	pipeio_unlock(wpipe);
+
+	PIPE_UNLOCK(wpipe);
+	ubc_upl_abort(upl, 0);
+	PIPE_LOCK(wpipe);
+
+	uio_update(uio, (user_size_t)pos);
+
+	return (error);
+}
+
+/*
+ * Copy size bytes of the pending direct write to the reader, straight
+ * from the physical pages the writer has wired.  Called with the io lock
+ * held and the pipe mutex dropped.
+ */
+static int
+pipe_direct_copy(struct pipe *rpipe, u_int size, struct uio *uio)
+{
+	upl_page_info_t	*pl = rpipe->pipe_map.pl;
+	vm_size_t	off;
+	int		pg_index;
+	int		pg_offset;
+	int		csize;
+	int		segflg;
+	int		error = 0;
+
+	off = rpipe->pipe_map.offset + rpipe->pipe_map.pos;
+	pg_index  = (int)(off / PAGE_SIZE);
+	pg_offset = (int)(off & PAGE_MASK);
+
+	segflg = uio->uio_segflg;
+
+	switch(segflg) {
+
+	  case UIO_USERSPACE32:
+	  case UIO_USERISPACE32:
+		uio->uio_segflg = UIO_PHYS_USERSPACE32;
+		break;
+
+	  case UIO_USERSPACE:
+	  case UIO_USERISPACE:
+		uio->uio_segflg = UIO_PHYS_USERSPACE;
+		break;
+
+	  case UIO_USERSPACE64:
+	  case UIO_USERISPACE64:
+		uio->uio_segflg = UIO_PHYS_USERSPACE64;
+		break;
+
+	  case UIO_SYSSPACE:
+		uio->uio_segflg = UIO_PHYS_SYSSPACE;
+		break;
+
+	}
+	while (size && error == 0) {
+		csize = min(PAGE_SIZE - pg_offset, size);
+
+		error = uiomove64(((addr64_t)upl_phys_page(pl, pg_index) << PAGE_SHIFT) + pg_offset,
+		    csize, uio);
+
+		pg_index += 1;
+		pg_offset = 0;
+		size     -= csize;
+	}
+	uio->uio_segflg = segflg;
+
+	return (error);
+}
+
 /*
  * we implement a very minimal set of ioctls for compatibility with sockets.
  */
@@ -1165,7 +1459,7 @@ pipe_ioctl(struct fileproc *fp, u_long cmd, caddr_t data,
 		return (0);
 
 	case FIONREAD:
-		*(int *)data = mpipe->pipe_buffer.cnt;
+		*(int *)data = PIPE_READABLE(mpipe);
 		PIPE_UNLOCK(mpipe);
 		return (0);
 
@@ -1380,7 +1674,7 @@ filt_piperead_common(struct knote *kn, struct pipe *rpipe)
 	 */
 
 	wpipe = rpipe->pipe_peer;
-	kn->kn_data = rpipe->pipe_buffer.cnt;
+	kn->kn_data = PIPE_READABLE(rpipe);
 	if ((rpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) ||
 	    (wpipe == NULL) || (wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF))) {
 		kn->kn_flags |= EV_EOF;
@@ -1467,7 +1761,10 @@ filt_pipewrite_common(struct knote *kn, struct pipe *rpipe)
 		kn->kn_flags |= EV_EOF; 
 		return (1);
 	}
-	kn->kn_data = MAX_PIPESIZE(wpipe) - wpipe->pipe_buffer.cnt;
+	if (wpipe->pipe_state & PIPE_DIRECTW)
+		kn->kn_data = 0;	/* buffered writes wait for the direct one */
+	else
+		kn->kn_data = MAX_PIPESIZE(wpipe) - wpipe->pipe_buffer.cnt;
 
 	int64_t lowwat = PIPE_BUF;
 	if (kn->kn_sfflags & NOTE_LOWAT) {
@@ -1648,13 +1945,13 @@ fill_pipeinfo(struct pipe * cpipe, struct pipe_info * pinfo)
 			 * the peer still exists, use it's info
 			 */
 		        pipe_size  = MAX_PIPESIZE(cpipe->pipe_peer);
-			pipe_count = cpipe->pipe_peer->pipe_buffer.cnt;
+			pipe_count = PIPE_READABLE(cpipe->pipe_peer);
 		} else {
 			pipe_count = 0;
 		}
 	} else {
 	        pipe_size  = MAX_PIPESIZE(cpipe);
-		pipe_count = cpipe->pipe_buffer.cnt;
+		pipe_count = PIPE_READABLE(cpipe);
 	}
 	/*
 	 * since peer's buffer is setup ouside of lock
@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2016 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/file_internal.h>
+#include <sys/filedesc.h>
+#include <sys/kernel.h>
+#include <sys/kpi_mbuf.h>
+#include <sys/kpi_socket.h>
+#include <sys/mbuf.h>
+#include <sys/proc_internal.h>
+#include <sys/protosw.h>
+#include <sys/signalvar.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <sys/sysctl.h>
+#include <sys/sysproto.h>
+#include <sys/ubc_internal.h>
+#include <sys/uio_internal.h>
+#include <sys/vnode_internal.h>
+#include <sys/splice.h>
+
+#include <mach/mach_types.h>
+#include <mach/memory_object_types.h>
+#include <kern/kalloc.h>
+#include <kern/locks.h>
+#include <kern/thread_call.h>
+
+#include <libkern/OSAtomic.h>
+
+#include <security/audit/audit.h>
+
+#if CONFIG_MACF
+#include <security/mac_framework.h>
+#endif
+
+/*
+ * splice(2): move data between files, pipes and sockets inside the kernel.
+ *
+ * A pass pulls a chunk from the source as an mbuf chain and pushes the
+ * chain to the destination:
+ *
+ *   regular file:	the file pages are wired in an I/O UPL, mapped into
+ *			the kernel and loaned out as read-only external mbufs,
+ *			one per page.  The pages are unwired once the last
+ *			mbuf is freed, which for a socket destination is when
+ *			the data has been acknowledged.
+ *   stream socket:	the received mbufs are handed over as they are.
+ *   anything else:	fo_read() into mbuf clusters.
+ *
+ * A socket destination takes the chain as is, so file to socket and
+ * socket to socket transfers never copy the data.  Any other destination
+ * is written with fo_write() from the chain, which is the one copy a
+ * write into a page cache or pipe buffer needs anyway.
+ *
+ * Like read(2), a pass from a socket or pipe returns what arrived rather
+ * than waiting for len bytes; a pass from a regular file continues until
+ * len bytes have moved or end of file.  Data already taken from a socket
+ * or pipe is dropped if the destination then fails, as it would be by a
+ * process that read it and then failed to write it.
+ */
+
+#define SPLICE_CHUNK_MAX	(256 * 1024)	/* most moved in one pass */
+
+#define SPLICE_FILE	1	/* regular file */
+#define SPLICE_SOCKET	2	/* connected stream socket */
+#define SPLICE_COPY	3	/* pipe or other file, through fo_read/fo_write */
+
+struct splice_end {
+	struct fileproc		*se_fp;
+	int			se_kind;
+	int			se_fof;		/* FOF_OFFSET if se_off is used */
+	off_t			se_off;		/* file offset, SPLICE_FILE */
+	struct vfs_context	se_ctx;		/* with the file's credential */
+};
+
+/*
+ * File pages on loan to an mbuf chain.
+ */
+struct splice_loan {
+	upl_t			sl_upl;		/* wired file pages */
+	vm_offset_t		sl_kaddr;	/* kernel mapping of sl_upl */
+	vnode_t			sl_vp;		/* usecount held while on loan */
+	SInt32			sl_refcnt;	/* mbufs still pointing into it */
+	struct splice_loan	*sl_next;	/* on splice_loan_done */
+};
+
+static lck_grp_t		*splice_lck_grp;
+static lck_spin_t		*splice_loan_lock;
+static struct splice_loan	*splice_loan_done;	/* waiting to be unwired */
+static thread_call_t		splice_loan_call;
+
+static SInt64	splice_bytes = 0;		/* bytes moved by splice() */
+static SInt64	splice_loaned_pages = 0;	/* file pages loaned to mbufs */
+
+SYSCTL_QUAD(_kern, OID_AUTO, splice_bytes, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &splice_bytes, "Bytes moved by splice()");
+SYSCTL_QUAD(_kern, OID_AUTO, splice_loaned_pages, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &splice_loaned_pages, "File pages loaned to mbufs by splice()");
+
+static void	splice_loan_reclaim(thread_call_param_t, thread_call_param_t);
+
+void
+splice_init(void)
+{
+	lck_grp_attr_t *grp_attr;
+
+	grp_attr = lck_grp_attr_alloc_init();
+	splice_lck_grp = lck_grp_alloc_init("splice", grp_attr);
+	lck_grp_attr_free(grp_attr);
+	splice_loan_lock = lck_spin_alloc_init(splice_lck_grp, LCK_ATTR_NULL);
+	splice_loan_call = thread_call_allocate(splice_loan_reclaim, NULL);
+}
+
+/*
+ * Unmapping and unwiring can block, and the last mbuf of a loan is often
+ * freed by the network stack with locks held, so returned loans are
+ * reclaimed from a thread call.
+ */
+static void
+splice_loan_reclaim(__unused thread_call_param_t p0, __unused thread_call_param_t p1)
+{
+	struct splice_loan *sl, *list;
+
+	lck_spin_lock(splice_loan_lock);
+	list = splice_loan_done;
+	splice_loan_done = NULL;
+	lck_spin_unlock(splice_loan_lock);
+
+	while ((sl = list) != NULL) {
+		list = sl->sl_next;
+
+		(void) ubc_upl_unmap(sl->sl_upl);
+		(void) ubc_upl_abort(sl->sl_upl, 0);
+		vnode_rele(sl->sl_vp);
+		kfree(sl, sizeof(*sl));
+	}
+}
+
+/*
+ * m_ext free routine for loaned pages; also drops the reference held
+ * while the chain is being built.
+ */
+static void
+splice_loan_free(__unused caddr_t buf, __unused u_int size, caddr_t arg)
+{
+	struct splice_loan *sl = (struct splice_loan *)(void *)arg;
+
+	if (OSDecrementAtomic(&sl->sl_refcnt) != 1)
+		return;
+
+	lck_spin_lock(splice_loan_lock);
+	sl->sl_next = splice_loan_done;
+	splice_loan_done = sl;
+	lck_spin_unlock(splice_loan_lock);
+
+	thread_call_enter(splice_loan_call);
+}
+
+/*
+ * Wire len bytes of vp at off and wrap each page in a read-only external
+ * mbuf.  Called with an iocount on vp.
+ */
+static int
+splice_loan_file(vnode_t vp, off_t off, size_t len, struct mbuf **mp)
+{
+	struct splice_loan *sl;
+	struct mbuf *top = NULL, **mtail = &top, *m;
+	off_t f_offset = trunc_page_64(off);
+	int upl_size = (int)round_page_64(off - f_offset + len);
+	vm_offset_t kaddr;
+	size_t resid, mlen;
+	int error = 0;
+
+	*mp = NULL;
+
+	sl = kalloc(sizeof(*sl));
+	if (sl == NULL)
+		return (ENOMEM);
+
+	if (ubc_create_iopl(vp, f_offset, upl_size, &sl->sl_upl, NULL) != KERN_SUCCESS) {
+		kfree(sl, sizeof(*sl));
+		return (EIO);
+	}
+	if (ubc_upl_map(sl->sl_upl, &sl->sl_kaddr) != KERN_SUCCESS) {
+		(void) ubc_upl_abort(sl->sl_upl, 0);
+		kfree(sl, sizeof(*sl));
+		return (ENOMEM);
+	}
+	sl->sl_vp = vp;
+	vnode_ref(vp);
+
+	/* one reference for us while the chain is built */
+	sl->sl_refcnt = 1;
+
+	kaddr = sl->sl_kaddr + (vm_offset_t)(off - f_offset);
+	for (resid = len; resid > 0; resid -= mlen, kaddr += mlen) {
+		mlen = MIN(resid, PAGE_SIZE - (kaddr & PAGE_MASK));
+
+		m = (top == NULL) ? NULL : m_get(M_WAIT, MT_DATA);
+		OSIncrementAtomic(&sl->sl_refcnt);
+		m = m_clattach(m, MT_DATA, (caddr_t)trunc_page(kaddr),
+		    splice_loan_free, PAGE_SIZE, (caddr_t)sl, M_WAIT, 0);
+		if (m == NULL) {
+			OSDecrementAtomic(&sl->sl_refcnt);
+			error = ENOBUFS;
+			break;
+		}
+		m_ext_set_readonly(m);
+		m->m_data = (caddr_t)kaddr;
+		m->m_len = (int32_t)mlen;
+
+		*mtail = m;
+		mtail = &m->m_next;
+	}
+	if (error == 0) {
+		top->m_pkthdr.len = (int)len;
+		OSAddAtomic64(atop(upl_size), &splice_loaned_pages);
+		*mp = top;
+	} else if (top != NULL) {
+		m_freem(top);
+	}
+	splice_loan_free(NULL, 0, (caddr_t)sl);
+
+	return (error);
+}
+
+/*
+ * Trim a freshly filled chain of clusters to len bytes.
+ */
+static void
+splice_trim(struct mbuf *top, size_t len)
+{
+	struct mbuf *m;
+	size_t resid = len;
+
+	for (m = top; m != NULL; m = m->m_next) {
+		m->m_len = (int32_t)MIN(mbuf_maxlen(m), resid);
+		resid -= m->m_len;
+		if (resid == 0 && m->m_next != NULL) {
+			m_freem(m->m_next);
+			m->m_next = NULL;
+		}
+	}
+	top->m_pkthdr.len = (int)len;
+}
+
+static int
+splice_pull_copy(struct splice_end *se, size_t len, struct mbuf **mp, size_t *lenp)
+{
+	struct mbuf *top = NULL, *m;
+	unsigned int nbufs = 0;
+	size_t resid, mlen;
+	uio_t auio;
+	int error;
+
+	*mp = NULL;
+	*lenp = 0;
+
+	if ((error = mbuf_allocpacket(MBUF_WAITOK, len, NULL, &top)) != 0)
+		return (error);
+	for (m = top; m != NULL; m = m->m_next)
+		nbufs++;
+
+	auio = uio_create(nbufs, se->se_off, UIO_SYSSPACE, UIO_READ);
+	if (auio == NULL) {
+		m_freem(top);
+		return (ENOMEM);
+	}
+	for (m = top, resid = len; m != NULL && resid > 0; m = m->m_next, resid -= mlen) {
+		mlen = MIN(mbuf_maxlen(m), resid);
+		uio_addiov(auio, CAST_USER_ADDR_T(mtod(m, caddr_t)), mlen);
+	}
+
+	error = fo_read(se->se_fp, auio, se->se_fof, &se->se_ctx);
+	resid = len - uio_resid(auio);
+	uio_free(auio);
+
+	if (error != 0 && resid != 0 &&
+	    (error == ERESTART || error == EINTR || error == EWOULDBLOCK))
+		error = 0;
+	if (error != 0 || resid == 0) {
+		m_freem(top);
+		return (error);
+	}
+	splice_trim(top, resid);
+	*mp = top;
+	*lenp = resid;
+
+	return (0);
+}
+
+static int
+splice_pull_file(struct splice_end *se, size_t len, struct mbuf **mp, size_t *lenp)
+{
+	vnode_t vp = (vnode_t)se->se_fp->f_fglob->fg_data;
+	off_t file_size;
+	int error;
+
+	*mp = NULL;
+	*lenp = 0;
+
+	if ((error = vnode_getwithref(vp)) != 0)
+		return (error);
+#if CONFIG_MACF
+	error = mac_vnode_check_read(&se->se_ctx, se->se_fp->f_fglob->fg_cred, vp);
+	if (error)
+		goto out;
+#endif
+	if ((error = vnode_size(vp, &file_size, &se->se_ctx)) != 0)
+		goto out;
+	if (se->se_off >= file_size)
+		goto out;
+	len = (size_t)MIN((off_t)len, file_size - se->se_off);
+
+	/*
+	 * Files without a pager, or whose pages can't be wired, are read
+	 * into clusters instead; that also reports any I/O error.
+	 */
+	if (splice_loan_file(vp, se->se_off, len, mp) == 0)
+		*lenp = len;
+	else
+		error = splice_pull_copy(se, len, mp, lenp);
+out:
+	vnode_put(vp);
+
+	return (error);
+}
+
+static int
+splice_pull_socket(struct splice_end *se, size_t len, int flags, struct mbuf **mp,
+    size_t *lenp)
+{
+	struct socket *so = (struct socket *)se->se_fp->f_fglob->fg_data;
+	int error;
+
+	*mp = NULL;
+	*lenp = len;
+
+	error = sock_receivembuf(so, NULL, mp,
+	    (flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0, lenp);
+	if (error != 0 || *lenp == 0) {
+		if (*mp != NULL)
+			m_freem(*mp);
+		*mp = NULL;
+		*lenp = 0;
+	}
+	return (error);
+}
+
+static int
+splice_push_socket(struct splice_end *se, struct mbuf *top, size_t len, int flags,
+    size_t *putp)
+{
+	struct socket *so = (struct socket *)se->se_fp->f_fglob->fg_data;
+	struct mbuf *m;
+
+	*putp = 0;
+
+	/* received mbufs don't necessarily start with a packet header */
+	if ((top->m_flags & M_PKTHDR) == 0) {
+		if ((m = m_gethdr(M_WAIT, MT_DATA)) == NULL) {
+			m_freem(top);
+			return (ENOBUFS);
+		}
+		m->m_len = 0;
+		m->m_next = top;
+		top = m;
+	}
+	top->m_pkthdr.len = (int)len;
+
+	return (sock_sendmbuf(so, NULL, top,
+	    (flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0, putp));
+}
+
+static int
+splice_push_copy(struct splice_end *se, struct mbuf *top, size_t len, size_t *putp)
+{
+	struct mbuf *m;
+	unsigned int nbufs = 0;
+	uio_t auio;
+	int error;
+
+	*putp = 0;
+
+	for (m = top; m != NULL; m = m->m_next) {
+		if (m->m_len > 0)
+			nbufs++;
+	}
+	auio = uio_create(nbufs, se->se_off, UIO_SYSSPACE, UIO_WRITE);
+	if (auio == NULL) {
+		m_freem(top);
+		return (ENOMEM);
+	}
+	for (m = top; m != NULL; m = m->m_next) {
+		if (m->m_len > 0)
+			uio_addiov(auio, CAST_USER_ADDR_T(mtod(m, caddr_t)), m->m_len);
+	}
+
+	error = fo_write(se->se_fp, auio, se->se_fof, &se->se_ctx);
+	*putp = len - uio_resid(auio);
+	uio_free(auio);
+	m_freem(top);
+
+	if (error != 0 && *putp != 0 &&
+	    (error == ERESTART || error == EINTR || error == EWOULDBLOCK))
+		error = 0;
+	/* The socket layer handles SIGPIPE */
+	if (error == EPIPE && (se->se_fp->f_fglob->fg_lflags & FG_NOSIGPIPE) == 0)
+		psignal(vfs_context_proc(&se->se_ctx), SIGPIPE);
+
+	return (error);
+}
+
+/*
+ * Set up one end of a splice; fetches the offset for regular files.
+ */
+static int
+splice_end_init(proc_t p, int fd, user_addr_t offp, int fflag, struct splice_end *se)
+{
+	struct fileproc *fp;
+	struct socket *so;
+	vnode_t vp;
+	int error;
+
+	if ((error = fp_lookup(p, fd, &fp, 0)) != 0)
+		return (error);
+	se->se_fp = fp;
+	se->se_fof = 0;
+	se->se_off = 0;
+	se->se_ctx = *vfs_context_current();
+	se->se_ctx.vc_ucred = fp->f_fglob->fg_cred;
+
+	if ((fp->f_flag & fflag) == 0)
+		return (EBADF);
+
+	switch (FILEGLOB_DTYPE(fp->f_fglob)) {
+	case DTYPE_VNODE:
+		vp = (vnode_t)fp->f_fglob->fg_data;
+		se->se_kind = vnode_isreg(vp) ? SPLICE_FILE : SPLICE_COPY;
+		break;
+
+	case DTYPE_SOCKET:
+		so = (struct socket *)fp->f_fglob->fg_data;
+		if (so->so_type != SOCK_STREAM)
+			return (EINVAL);
+		if ((so->so_state & SS_ISCONNECTED) == 0)
+			return (ENOTCONN);
+#if CONFIG_MACF_SOCKET_SUBSET
+		if (fflag == FREAD)
+			error = mac_socket_check_receive(se->se_ctx.vc_ucred, so);
+		else
+			error = mac_socket_check_send(se->se_ctx.vc_ucred, so, NULL);
+		if (error)
+			return (error);
+#endif
+		se->se_kind = SPLICE_SOCKET;
+		break;
+
+	case DTYPE_PIPE:
+		se->se_kind = SPLICE_COPY;
+		break;
+
+	default:
+		return (EINVAL);
+	}
+
+	if (offp != USER_ADDR_NULL) {
+		if (se->se_kind != SPLICE_FILE)
+			return (ESPIPE);
+		if ((error = copyin(offp, &se->se_off, sizeof(se->se_off))) != 0)
+			return (error);
+		if (se->se_off < 0)
+			return (EINVAL);
+		se->se_fof = FOF_OFFSET;
+	} else if (se->se_kind == SPLICE_FILE && fflag == FREAD) {
+		/* reads from the file offset; updated when we're done */
+		se->se_off = fp->f_fglob->fg_offset;
+		se->se_fof = FOF_OFFSET;
+	}
+	return (0);
+}
+
+/*
+ * splice(2).
+ * ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+ *	size_t len, int flags)
+ *
+ * Move up to len bytes from fd_in to fd_out without copying them through
+ * user space.  A NULL offset uses and updates the file offset.  Returns
+ * the number of bytes moved, 0 at end of file.
+ */
+int
+splice(proc_t p, struct splice_args *uap, user_ssize_t *retval)
+{
+	struct splice_end in, out;
+	struct socket *so;
+	struct mbuf *top;
+	user_size_t moved = 0;
+	size_t want, got, put;
+	long space;
+	int error;
+
+	*retval = 0;
+	bzero(&in, sizeof(in));
+	bzero(&out, sizeof(out));
+
+	if ((uap->flags & ~SPLICE_F_NONBLOCK) != 0 || uap->len > INT_MAX)
+		return (EINVAL);
+
+	AUDIT_ARG(fd, uap->fd_in);
+	AUDIT_ARG(value32, uap->fd_out);
+
+	if ((error = splice_end_init(p, uap->fd_in, uap->off_in, FREAD, &in)) != 0 ||
+	    (error = splice_end_init(p, uap->fd_out, uap->off_out, FWRITE, &out)) != 0)
+		goto out;
+	if (in.se_fp->f_fglob == out.se_fp->f_fglob) {
+		error = EINVAL;
+		goto out;
+	}
+
+	while (moved < uap->len) {
+		want = (size_t)MIN(uap->len - moved, SPLICE_CHUNK_MAX);
+
+		/*
+		 * Don't take more from the source than a socket destination
+		 * can queue; data taken can't be put back.
+		 */
+		if (out.se_kind == SPLICE_SOCKET) {
+			so = (struct socket *)out.se_fp->f_fglob->fg_data;
+			socket_lock(so, 1);
+			space = sbspace(&so->so_snd);
+			socket_unlock(so, 1);
+
+			if (space <= 0 && ((uap->flags & SPLICE_F_NONBLOCK) ||
+			    (so->so_state & SS_NBIO))) {
+				error = EAGAIN;
+				break;
+			}
+			if (space > 0 && (size_t)space < want)
+				want = (space > PAGE_SIZE) ? trunc_page(space) : (size_t)space;
+		}
+
+		switch (in.se_kind) {
+		case SPLICE_FILE:
+			error = splice_pull_file(&in, want, &top, &got);
+			break;
+		case SPLICE_SOCKET:
+			error = splice_pull_socket(&in, want, uap->flags, &top, &got);
+			break;
+		default:
+			error = splice_pull_copy(&in, want, &top, &got);
+			break;
+		}
+		if (error != 0 || got == 0)
+			break;
+
+		if (out.se_kind == SPLICE_SOCKET)
+			error = splice_push_socket(&out, top, got, uap->flags, &put);
+		else
+			error = splice_push_copy(&out, top, got, &put);
+
+		moved += put;
+		in.se_off += put;
+		out.se_off += put;
+		OSAddAtomic64(put, &splice_bytes);
+
+		if (error != 0 || put < got)
+			break;
+		/* like read(2), hand back what a socket or pipe had */
+		if (in.se_kind != SPLICE_FILE)
+			break;
+	}
+	if (moved != 0 && (error == ERESTART || error == EINTR ||
+	    error == EWOULDBLOCK || error == EAGAIN))
+		error = 0;
+
+	if (in.se_kind == SPLICE_FILE) {
+		if (uap->off_in != USER_ADDR_NULL) {
+			if (error == 0)
+				error = copyout(&in.se_off, uap->off_in, sizeof(in.se_off));
+		} else {
+			in.se_fp->f_fglob->fg_offset = in.se_off;
+		}
+	}
+	if (out.se_kind == SPLICE_FILE && uap->off_out != USER_ADDR_NULL && error == 0)
+		error = copyout(&out.se_off, uap->off_out, sizeof(out.se_off));
+
+	*retval = (user_ssize_t)moved;
+out:
+	if (out.se_fp != NULL)
+		fp_drop(p, uap->fd_out, out.se_fp, 0);
+	if (in.se_fp != NULL)
+		fp_drop(p, uap->fd_in, in.se_fp, 0);
+
+	return (error);
+}
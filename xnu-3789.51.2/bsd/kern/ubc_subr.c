@@ -2356,6 +2356,68 @@ ubc_create_upl(
 		*plp = UPL_GET_INTERNAL_PAGE_LIST(*uplp);
 	return kr;
 }
+
+
+/*
+ * ubc_create_iopl
+ *
+ * Wire the pages backing a range of a file for I/O, paging in any that
+ * are not resident, and return them in a upl.  Unlike ubc_create_upl(),
+ * the pages are wired rather than left busy, so the file can still be
+ * read, written and paged while the upl is outstanding.
+ *
+ * Parameters:	vp			The vnode
+ *		f_offset		The page aligned file offset
+ *		bufsize			The page aligned size of the range
+ *		uplp			Pointer to the upl to fill in
+ *		plp			If non-NULL, set to the internal page list
+ *
+ * Returns:	KERN_SUCCESS		The pages are wired in *uplp
+ *		KERN_INVALID_ARGUMENT	The bufsize is not page aligned or is
+ *					too large, or there is no memory
+ *					object control for the vnode
+ *	memory_object_iopl_request:KERN_*
+ *					A pagein or wiring failure
+ *
+ * Note:	If successful, the returned *uplp MUST subsequently be freed
+ *		via a call to ubc_upl_abort(), which unwires the pages.
+ */
+kern_return_t
+ubc_create_iopl(
+	struct vnode	*vp,
+	off_t		f_offset,
+	int		bufsize,
+	upl_t		*uplp,
+	upl_page_info_t	**plp)
+{
+	memory_object_control_t		control;
+	upl_control_flags_t		uplflags;
+	upl_size_t			size = bufsize;
+	kern_return_t			kr;
+
+	if (plp != NULL)
+		*plp = NULL;
+	*uplp = NULL;
+
+	if (bufsize & PAGE_MASK)
+		return KERN_INVALID_ARGUMENT;
+
+	if (bufsize > MAX_UPL_SIZE_BYTES)
+		return KERN_INVALID_ARGUMENT;
+
+	control = ubc_getobject(vp, UBC_FLAGS_NONE);
+	if (control == MEMORY_OBJECT_CONTROL_NULL)
+		return KERN_INVALID_ARGUMENT;
+
+	uplflags = UPL_COPYOUT_FROM | UPL_SET_INTERNAL | UPL_SET_LITE |
+		   UPL_SET_IO_WIRE | UPL_MEMORY_TAG_MAKE(VM_KERN_MEMORY_FILE);
+
+	kr = memory_object_iopl_request((ipc_port_t)control, f_offset, &size,
+					uplp, NULL, NULL, &uplflags);
+	if (kr == KERN_SUCCESS && plp != NULL)
+		*plp = UPL_GET_INTERNAL_PAGE_LIST(*uplp);
+	return kr;
+}
 		
 					  		      
 /*
@@ -3810,6 +3810,20 @@ m_mclhasreference(struct mbuf *m)
 	return ((MEXT_FLAGS(m) & EXTF_READONLY) ? 1 : 0);
 }
 
+/*
+ * Mark the external buffer of an mbuf as never writable through the mbuf,
+ * e.g. for pages loaned from a file; m_mclhasreference() then treats it
+ * as shared.
+ */
+__private_extern__ void
+m_ext_set_readonly(struct mbuf *m)
+{
+	VERIFY(m->m_flags & M_EXT);
+	ASSERT(m_get_rfa(m) != NULL);
+
+	(void) OSBitOrAtomic16(EXTF_READONLY, &MEXT_FLAGS(m));
+}
+
 __private_extern__ caddr_t
 m_bigalloc(int wait)
 {
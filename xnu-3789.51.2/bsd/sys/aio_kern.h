@@ -55,6 +55,9 @@ struct aio_workq_entry
 	vm_map_t	aio_map;	/* user land map we have a reference to */
 	thread_t	thread;		/* thread that queued this request */
 
+	/* Set before it is first queued, never changed */
+	int		aio_workq_index; /* work queue the entry is queued on */
+
 	/* Entry lock */
 	int		aio_refcount;
 	user_ssize_t	returnval;	/* return value from read / write request */	
@@ -221,8 +221,9 @@ struct kevent_qos_s {
 #define EVFILTID_NECP_FD        (EVFILT_SYSCOUNT + 10)
 #define EVFILTID_FSEVENT        (EVFILT_SYSCOUNT + 13)
 #define EVFILTID_VN             (EVFILT_SYSCOUNT + 14)
+#define EVFILTID_IORING         (EVFILT_SYSCOUNT + 15)
 
-#define EVFILTID_MAX 			(EVFILT_SYSCOUNT + 15)
+#define EVFILTID_MAX 			(EVFILT_SYSCOUNT + 16)
 
 #endif /* XNU_KERNEL_PRIVATE */
 
@@ -147,6 +147,7 @@ typedef enum {
 	DTYPE_FSEVENTS,		/* fsevents */
 	DTYPE_ATALK,		/* (obsolete) */
 	DTYPE_NETPOLICY,	/* networking policy */
+	DTYPE_IORING,		/* I/O submission/completion rings */
 } file_type_t;
 
 /* defines for fg_lflags */
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _SYS_IORING_H
+#define _SYS_IORING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * I/O rings let a process queue a batch of file and socket I/O and reap
+ * the results without a system call per operation.
+ *
+ * The process allocates two rings in its own memory and hands them to
+ * ioring_setup(), which returns a descriptor for the ring pair.  Each ring
+ * is a struct ioring_ring_hdr followed by a power of two number of
+ * entries:
+ *
+ *   submission queue (SQ):  the process fills sqes[tail & (n - 1)] and
+ *                           advances tail; the kernel advances head as it
+ *                           consumes entries.
+ *   completion queue (CQ):  the kernel fills cqes[tail & (n - 1)] and
+ *                           advances tail; the process advances head as it
+ *                           reaps entries.
+ *
+ * ioring_enter() hands up to to_submit new SQEs to the ring's kernel
+ * worker and, with IORING_ENTER_GETEVENTS, waits until at least
+ * min_complete CQEs are available.  The ring descriptor is also readable
+ * through select() and EVFILT_READ once the worker has posted CQEs, with
+ * the kevent data holding the number posted since the last delivery.
+ *
+ * The worker stops consuming SQEs while the CQ is full; the next
+ * ioring_enter() restarts it.  The descriptor is not inherited across
+ * fork() or exec().
+ *
+ * READ, WRITE, READV, WRITEV and FSYNC operate on regular files.  SENDMSG
+ * and RECVMSG operate on sockets and never block the worker: they complete
+ * with -EWOULDBLOCK when the socket is not ready, so callers wait for
+ * readiness with kqueue before queueing them.
+ */
+
+#define IORING_MAX_ENTRIES	4096
+
+struct ioring_ring_hdr {
+	uint32_t	head;
+	uint32_t	__pad0[15];
+	uint32_t	tail;
+	uint32_t	__pad1[15];
+};
+
+#define IORING_OP_NOP		0
+#define IORING_OP_READ		1	/* read len bytes into addr */
+#define IORING_OP_WRITE		2	/* write len bytes from addr */
+#define IORING_OP_READV		3	/* addr is an iovec array of len entries */
+#define IORING_OP_WRITEV	4
+#define IORING_OP_FSYNC		5
+#define IORING_OP_SENDMSG	6	/* addr is an iovec array, op_flags MSG_* */
+#define IORING_OP_RECVMSG	7
+
+#define IORING_OFF_CURRENT	((int64_t)-1)	/* use and update the file offset */
+
+#define IORING_FSYNC_DATASYNC	0x00000001	/* op_flags for IORING_OP_FSYNC */
+
+struct ioring_sqe {
+	uint8_t		opcode;
+	uint8_t		__reserved0;
+	uint16_t	__reserved1;
+	int32_t		fd;
+	int64_t		off;
+	uint64_t	addr;
+	uint32_t	len;
+	uint32_t	op_flags;
+	uint64_t	user_data;
+};
+
+struct ioring_cqe {
+	uint64_t	user_data;
+	int64_t		res;		/* bytes transferred, or -errno */
+};
+
+#define IORING_SQ_RING_SIZE(n)	(sizeof(struct ioring_ring_hdr) + (n) * sizeof(struct ioring_sqe))
+#define IORING_CQ_RING_SIZE(n)	(sizeof(struct ioring_ring_hdr) + (n) * sizeof(struct ioring_cqe))
+
+struct ioring_params {
+	uint32_t	sq_entries;
+	uint32_t	cq_entries;	/* 0 means twice sq_entries */
+	uint64_t	sq_ring;	/* address of the SQ ring */
+	uint64_t	cq_ring;	/* address of the CQ ring */
+	uint32_t	flags;		/* must be 0 */
+	uint32_t	__reserved;
+};
+
+#define IORING_ENTER_GETEVENTS	0x00000001
+
+#ifndef KERNEL
+
+int	__ioring_setup(struct ioring_params *params);
+int	__ioring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+
+#endif /* KERNEL */
+
+__END_DECLS
+
+#endif /* _SYS_IORING_H */
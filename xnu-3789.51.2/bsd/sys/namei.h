@@ -142,6 +142,7 @@ struct nameidata {
 #define NAMEI_COMPOUNDRMDIR	0x080	
 #define NAMEI_COMPOUNDRENAME	0x100	
 #define NAMEI_COMPOUND_OP_MASK (NAMEI_COMPOUNDOPEN | NAMEI_COMPOUNDREMOVE | NAMEI_COMPOUNDMKDIR | NAMEI_COMPOUNDRMDIR | NAMEI_COMPOUNDRENAME)
+#define NAMEI_PATHCACHE		0x200	/* enter the walk in the whole path cache if it can be */
 
 #ifdef KERNEL
 /*
@@ -267,6 +268,7 @@ void	lookup_compound_vnop_post_hook(int error, vnode_t dvp, vnode_t vp, struct n
 void    cache_purgevfs(mount_t mp);
 int		cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 			  vfs_context_t context, int *dp_authorized, vnode_t last_dp);
+int		cache_lookup_fullpath(struct nameidata *ndp, vnode_t dp, vfs_context_t context);
 
 void		vnode_cache_authorized_action(vnode_t vp, vfs_context_t context, kauth_action_t action);
 void		vnode_uncache_authorized_action(vnode_t vp, kauth_action_t action);
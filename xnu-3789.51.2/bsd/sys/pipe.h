@@ -89,7 +89,12 @@
 #define PIPE_MINDIRECT	8192
 #endif
 
-#define PIPENPAGES	(BIG_PIPE_SIZE / PAGE_SIZE + 1)
+/*
+ * Largest piece of a direct write handed to the reader at once.
+ */
+#ifndef PIPE_DIRECTMAX
+#define PIPE_DIRECTMAX	(1024 * 1024)
+#endif
 
 /*
  * Pipe buffer information.
@@ -105,19 +110,6 @@ struct pipebuf {
 };
 
 
-#ifdef PIPE_DIRECT
-/*
- * Information to support direct transfers between processes for pipes.
- */
-struct pipemapping {
-	vm_offset_t	kva;		/* kernel virtual address */
-	vm_size_t	cnt;		/* number of chars in buffer */
-	vm_size_t	pos;		/* current position of transfer */
-	int		npages;		/* number of pages */
-	vm_page_t	ms[PIPENPAGES];	/* pages in source process */
-};
-#endif
-
 /*
  * Bits in pipe_state.
  */
@@ -140,6 +132,21 @@ struct pipemapping {
 #ifdef	KERNEL
 
 struct label;
+struct upl;
+struct upl_page_info;
+
+/*
+ * Information to support direct transfers between processes for pipes.
+ * Valid while PIPE_DIRECTW is set: the writer's buffer is wired in a UPL
+ * and the reader copies straight out of its pages.
+ */
+struct pipemapping {
+	struct upl	*upl;		/* writer's wired pages */
+	struct upl_page_info *pl;	/* page list of upl */
+	vm_size_t	offset;		/* offset of the data in the first page */
+	vm_size_t	cnt;		/* number of chars in buffer */
+	vm_size_t	pos;		/* current position of transfer */
+};
 
 /*
  * Per-pipe data structure.
@@ -147,9 +154,7 @@ struct label;
  */
 struct pipe {
 	struct	pipebuf pipe_buffer;	/* data storage */
-#ifdef PIPE_DIRECT
 	struct	pipemapping pipe_map;	/* pipe mapping for direct I/O */
-#endif
 	struct	selinfo pipe_sel;	/* for compat with select */
 	pid_t	pipe_pgid;		/* information for async I/O */
 	struct	pipe *pipe_peer;	/* link with other direction */
@@ -679,6 +679,7 @@ struct appletalk_fdinfo {
 #define PROX_FDTYPE_PIPE	6
 #define PROX_FDTYPE_FSEVENTS	7
 #define PROX_FDTYPE_NETPOLICY	9
+#define PROX_FDTYPE_IORING	10
 
 struct proc_fdinfo {
 	int32_t			proc_fd;
@@ -346,6 +346,7 @@ struct	proc {
 	int		p_aio_active_count;		/* all unfinished AIO requests for this proc */
 	TAILQ_HEAD( , aio_workq_entry ) p_aio_activeq; 	/* active async IO requests */
 	TAILQ_HEAD( , aio_workq_entry ) p_aio_doneq;	/* completed async IO requests */
+	struct klist	p_aio_klist;			/* EVFILT_AIO knotes (proc_klist_lock) */
 
 	struct klist p_klist;  /* knote list (PL ?)*/
 
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2016 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _SYS_SPLICE_H
+#define _SYS_SPLICE_H
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * splice() moves up to len bytes from fd_in to fd_out inside the kernel,
+ * without copying them through user space.  Either end may be a regular
+ * file, a pipe or a connected stream socket.
+ *
+ * Pages of a regular file source are loaned to the destination rather
+ * than copied, and mbufs received from a socket source are passed on
+ * as they are, so file to socket and socket to socket transfers don't
+ * copy the data at all.
+ *
+ * off_in and off_out are only allowed for regular files; they give the
+ * offset to use and are updated, leaving the file offset alone.  A NULL
+ * offset uses and updates the file offset.
+ *
+ * splice() returns the number of bytes moved, or 0 at end of file.  Like
+ * read(), it returns what a socket or pipe source has rather than waiting
+ * for len bytes.
+ */
+
+#define SPLICE_F_NONBLOCK	0x00000001	/* don't block on sockets */
+
+#ifndef KERNEL
+
+ssize_t	__splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, int flags);
+
+#endif /* KERNEL */
+
+__END_DECLS
+
+#endif /* _SYS_SPLICE_H */
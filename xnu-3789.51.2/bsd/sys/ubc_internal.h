@@ -81,6 +81,25 @@ struct cl_readahead {
 	daddr64_t	cl_lastr;			/* last block read by client */
 	daddr64_t	cl_maxra;			/* last block prefetched by the read ahead */
 	int		cl_ralen;			/* length of last prefetch */
+	int		cl_ramax;			/* adaptive cap on cl_ralen, 0 if none */
+	daddr64_t	cl_lastb;			/* first block of the last read */
+	daddr64_t	cl_stride;			/* distance between the last two reads */
+	daddr64_t	cl_strra;			/* last strided read prefetched */
+	uint32_t	cl_rdlat;			/* average demand read latency, usecs */
+	uint32_t	cl_lastuse;			/* stream LRU stamp */
+};
+
+/*
+ * independent read ahead streams tracked per vnode, so that several
+ * readers working through different parts of the same file each get
+ * their own sequential or strided read ahead
+ */
+#define CL_RA_STREAMS	4
+
+struct cl_readahead_set {
+	lck_mtx_t	cl_lockset;			/* protects stream selection */
+	uint32_t	cl_clock;			/* source of cl_lastuse stamps */
+	struct cl_readahead cl_streams[CL_RA_STREAMS];
 };
 
 struct cl_writebehind {
@@ -133,7 +152,7 @@ struct ubc_info {
 	uint32_t		ui_flags;	/* flags */
 	uint32_t		cs_add_gen;	/* generation count when csblob was validated */
 
-        struct	cl_readahead   *cl_rahead;	/* cluster read ahead context */
+        struct	cl_readahead_set *cl_rahead;	/* cluster read ahead streams */
         struct	cl_writebehind *cl_wbehind;	/* cluster write behind context */
 
 	struct timespec		cs_mtime;	/* modify time of file when
@@ -181,6 +200,7 @@ __private_extern__ uint32_t cluster_throttle_io_limit(vnode_t, uint32_t *);
 #define UBC_FOR_PAGEOUT         0x0002
 
 memory_object_control_t ubc_getobject(vnode_t, int);
+kern_return_t	ubc_create_iopl(vnode_t, off_t, int, upl_t *, upl_page_info_t **);
 boolean_t	ubc_strict_uncached_IO(vnode_t);
 
 int	ubc_info_init(vnode_t);
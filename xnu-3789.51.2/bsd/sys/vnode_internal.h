@@ -154,14 +154,15 @@ struct vnode {
 	struct	buflists v_dirtyblkhd;		/* dirty blocklist head */
 	struct klist v_knotes;			/* knotes attached to this vnode */
         /*
-	 * the following 4 fields are protected
+	 * the following 5 fields are protected
 	 * by the name_cache_lock held in 
 	 * excluive mode
 	 */
         kauth_cred_t	v_cred;			/* last authorized credential */
         kauth_action_t	v_authorized_actions;	/* current authorized actions for v_cred */
         int		v_cred_timestamp;	/* determine if entry is stale for MNTK_AUTH_OPAQUE */
-        int		v_nc_generation;	/* changes when nodes are removed from the name cache */
+        int		v_nc_generation;	/* changes when nodes are removed from the name cache or rights uncached */
+        uint32_t	v_nc_seq;		/* odd while v_parent or the cached rights change */
         /*
 	 * back to the vnode lock for protection
 	 */
@@ -483,6 +484,8 @@ int	resize_namecache(uint32_t newsize);
 void	name_cache_lock_shared(void);
 void	name_cache_lock(void);
 void	name_cache_unlock(void);
+void	vnode_nc_seq_write_begin(vnode_t vp);
+void	vnode_nc_seq_write_end(vnode_t vp);
 void	cache_enter_with_gen(vnode_t dvp, vnode_t vp, struct componentname *cnp, int gen);
 const char *cache_enter_create(vnode_t dvp, vnode_t vp, struct componentname *cnp);
 
@@ -82,6 +82,13 @@
 #include <sys/kauth.h>
 #include <sys/user.h>
 #include <sys/paths.h>
+#include <sys/sysctl.h>
+
+#include <kern/cpu_data.h>
+#include <kern/cpu_number.h>
+#include <libkern/OSAtomic.h>
+#include <machine/atomic.h>
+#include <machine/machine_routines.h>
 
 #if CONFIG_MACF
 #include <security/mac_framework.h>
@@ -102,6 +109,19 @@
  * Upon reaching the last segment of a path, if the reference
  * is for DELETE, or NOCACHE is set (rewrite), and the
  * name is located in the cache, it will be dropped.
+ *
+ * All changes are made with the name cache lock held exclusive.
+ * cache_lookup_path() resolves components without it: a sequence
+ * counter per hash chain of the boot time table is odd while an entry
+ * for that chain is being entered or deleted, and each vnode's v_nc_seq
+ * covers the fields of that vnode (v_parent, v_cred,
+ * v_authorized_actions) the walk relies on.  A component is only taken
+ * from the lockless walk if both counters were unchanged across it;
+ * otherwise that component is resolved again under the shared lock.
+ * Entries and vnodes are never freed, only reused, and the names of
+ * deleted entries and retired hash tables are only freed once no
+ * lockless reader can still see them (see nc_limbo_removename() and
+ * nc_reader_synchronize()).
  */
 
 /*
@@ -111,6 +131,18 @@
 LIST_HEAD(nchashhead, namecache) *nchashtbl;	/* Hash Table */
 u_long	nchashmask;
 u_long	nchash;				/* size of hash table - 1 */
+volatile uint32_t *nchashseq;		/* chain sequence counters */
+u_long	nchashseqmask;			/* nchashmask at boot, never changes */
+
+/*
+ * While resize_namecache() moves entries into a new table, the old
+ * table's chains below nc_resize_cursor have already been moved.
+ */
+struct nchashhead *nchashtbl_old;
+u_long	nchashmask_old;
+u_long	nc_resize_cursor;
+int	nc_resize_busy;
+
 long	numcache;			/* number of cache entries allocated */
 int 	desiredNodes;
 int 	desiredNegNodes;
@@ -175,8 +207,234 @@ static void init_crc32(void);
 static unsigned int crc32tab[256];
 
 
-#define NCHHASH(dvp, hash_val) \
-	(&nchashtbl[(dvp->v_id ^ (hash_val)) & nchashmask])
+/*
+ * Number of chain entries a lockless lookup will look at before giving
+ * up and taking the lock.
+ */
+#define	NC_LOCKLESS_MAX_CHAIN	32
+
+/* Old chains moved per hold of the name cache lock during a resize */
+#define	NC_RESIZE_BATCH		64
+
+/* Names of deleted entries held back from vfs_removename(), per batch */
+#define	NC_LIMBO_MAX		128
+
+/*
+ * A batch of names held back from vfs_removename().  Once full it is
+ * retired with a new epoch, and its names are only released when every
+ * reader that started before that epoch has finished.
+ */
+struct nc_limbo {
+	TAILQ_ENTRY(nc_limbo)	ncl_link;
+	uint32_t		ncl_epoch;
+	int			ncl_count;
+	const char		*ncl_names[NC_LIMBO_MAX];
+};
+
+static struct nc_limbo *nc_limbo_cur;
+static TAILQ_HEAD(, nc_limbo) nc_limbo_retired;
+
+/*
+ * Lockless readers publish the epoch they started in, per CPU, and run
+ * with preemption disabled.  nc_reader_quiesced() tells whether every
+ * reader that started before a given epoch has finished.
+ */
+struct nc_reader {
+	volatile uint32_t	ncr_epoch;	/* 0 when not reading */
+	uint32_t		ncr_pad[15];
+};
+
+static struct nc_reader *nc_readers;
+static unsigned int nc_nreaders;
+static volatile uint32_t nc_epoch = 1;
+
+static inline void
+nc_seq_write_begin(volatile uint32_t *seqp)
+{
+	*seqp = *seqp + 1;
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+nc_seq_write_end(volatile uint32_t *seqp)
+{
+	atomic_thread_fence(memory_order_release);
+	*seqp = *seqp + 1;
+}
+
+static inline uint32_t
+nc_seq_read_begin(volatile uint32_t *seqp)
+{
+	uint32_t seq = *seqp;
+
+	atomic_thread_fence(memory_order_acquire);
+	return (seq);
+}
+
+static inline boolean_t
+nc_seq_read_valid(volatile uint32_t *seqp, uint32_t seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return (((seq & 1) == 0) && (*seqp == seq));
+}
+
+static inline void
+nc_reader_enter(void)
+{
+	disable_preemption();
+	nc_readers[cpu_number()].ncr_epoch = nc_epoch;
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void
+nc_reader_exit(void)
+{
+	atomic_thread_fence(memory_order_release);
+	nc_readers[cpu_number()].ncr_epoch = 0;
+	enable_preemption();
+}
+
+/*
+ * Start a new epoch.  Readers that start from now on can't see anything
+ * that was unlinked before the call.
+ */
+static uint32_t
+nc_epoch_advance(void)
+{
+	uint32_t epoch;
+
+	epoch = OSAddAtomic(2, &nc_epoch) + 2;
+	atomic_thread_fence(memory_order_seq_cst);
+	return (epoch);
+}
+
+static boolean_t
+nc_reader_quiesced(uint32_t epoch)
+{
+	uint32_t e;
+	unsigned int i;
+
+	for (i = 0; i < nc_nreaders; i++) {
+		e = nc_readers[i].ncr_epoch;
+		if (e != 0 && (int32_t)(e - epoch) < 0)
+			return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Wait for every reader that started before the call.  Must not be
+ * called with the name cache lock held.
+ */
+static void
+nc_reader_synchronize(void)
+{
+	uint32_t epoch;
+
+	epoch = nc_epoch_advance();
+	while (!nc_reader_quiesced(epoch))
+		delay(1);
+}
+
+/*
+ * Release the names of the retired batches no reader can still see,
+ * oldest first.  Returns one emptied batch for reuse, or NULL.
+ */
+static struct nc_limbo *
+nc_limbo_reap(void)
+{
+	struct nc_limbo *ncl, *spare = NULL;
+	int i;
+
+	while ((ncl = TAILQ_FIRST(&nc_limbo_retired)) != NULL &&
+	    nc_reader_quiesced(ncl->ncl_epoch)) {
+		TAILQ_REMOVE(&nc_limbo_retired, ncl, ncl_link);
+		for (i = 0; i < ncl->ncl_count; i++)
+			vfs_removename(ncl->ncl_names[i]);
+		if (spare == NULL)
+			spare = ncl;
+		else
+			FREE(ncl, M_CACHE);
+	}
+	return (spare);
+}
+
+/*
+ * Stand-in for vfs_removename() on the name of an entry that has been
+ * taken off its hash chain.  Called with the name cache lock held
+ * exclusive, so it never waits for readers: a full batch is retired
+ * and released later, once nc_limbo_reap() finds it quiesced.
+ */
+static void
+nc_limbo_removename(const char *name)
+{
+	struct nc_limbo *ncl = nc_limbo_cur;
+
+	if (ncl->ncl_count == NC_LIMBO_MAX) {
+		ncl->ncl_epoch = nc_epoch_advance();
+		TAILQ_INSERT_TAIL(&nc_limbo_retired, ncl, ncl_link);
+
+		if ((ncl = nc_limbo_reap()) == NULL)
+			MALLOC(ncl, struct nc_limbo *, sizeof(*ncl), M_CACHE, M_WAITOK);
+		ncl->ncl_count = 0;
+		nc_limbo_cur = ncl;
+	}
+	ncl->ncl_names[ncl->ncl_count++] = name;
+}
+
+/*
+ * Mark the name cache state of vp (v_parent, v_cred,
+ * v_authorized_actions) as changing, for the lockless walk in
+ * cache_lookup_path().  Called with the name cache lock held exclusive.
+ */
+void
+vnode_nc_seq_write_begin(vnode_t vp)
+{
+	nc_seq_write_begin(&vp->v_nc_seq);
+}
+
+void
+vnode_nc_seq_write_end(vnode_t vp)
+{
+	nc_seq_write_end(&vp->v_nc_seq);
+}
+
+/*
+ * The sequence counter for names hashing to hashval in dvp.  The
+ * counters are sized to the boot time table and the table only grows,
+ * so a counter covers one or more whole chains of the current table.
+ */
+static inline volatile uint32_t *
+nc_hash_seq(vnode_t dvp, unsigned int hashval)
+{
+	return (&nchashseq[(dvp->v_id ^ hashval) & nchashseqmask]);
+}
+
+/*
+ * Return the hash chain for a name in dvp.  Safe to call without the
+ * lock from a lockless reader, which may be handed a chain the name is
+ * no longer on if the table is being resized; that only costs a miss.
+ */
+static struct nchashhead *
+nc_hash_bucket(vnode_t dvp, unsigned int hashval)
+{
+	struct nchashhead *heads;
+	u_long idx, mask;
+
+	if ((heads = nchashtbl_old) != NULL) {
+		atomic_thread_fence(memory_order_acquire);
+		idx = (dvp->v_id ^ hashval) & nchashmask_old;
+		if (idx >= nc_resize_cursor)
+			return (&heads[idx]);
+	}
+	/*
+	 * A new mask is published after the table it goes with.
+	 */
+	mask = nchashmask;
+	atomic_thread_fence(memory_order_acquire);
+	idx = (dvp->v_id ^ hashval) & mask;
+	return (&nchashtbl[idx]);
+}
 
 /*
  * This function tries to check if a directory vp is a subdirectory of dvp
@@ -898,11 +1156,24 @@ vnode_update_identity(vnode_t vp, vnode_t dvp, const char *name, int name_len, u
 	if ( (flags & (VNODE_UPDATE_PURGE | VNODE_UPDATE_PARENT | VNODE_UPDATE_CACHE | VNODE_UPDATE_NAME)) ) {
 
 		NAME_CACHE_LOCK();
+		vnode_nc_seq_write_begin(vp);
+
+		/*
+		 * paths through vp's old name or parent in the path cache
+		 * are stale, whether or not a name cache entry for vp is
+		 * still around for cache_delete() to find
+		 */
+		if ( (flags & (VNODE_UPDATE_PARENT | VNODE_UPDATE_CACHE | VNODE_UPDATE_NAME)) ) {
+			if (vp->v_parent)
+				vp->v_parent->v_nc_generation++;
+			vp->v_nc_generation++;
+		}
 
 		if ( (flags & VNODE_UPDATE_PURGE) ) {
 
 			if (vp->v_parent)
 				vp->v_parent->v_nc_generation++;
+			vp->v_nc_generation++;
 
 			while ( (ncp = LIST_FIRST(&vp->v_nclinks)) )
 				cache_delete(ncp, 1);
@@ -936,6 +1207,7 @@ vnode_update_identity(vnode_t vp, vnode_t dvp, const char *name, int name_len, u
 			while ( (ncp = LIST_FIRST(&vp->v_nclinks)) )
 				cache_delete(ncp, 1);
 		}
+		vnode_nc_seq_write_end(vp);
 		NAME_CACHE_UNLOCK();
 	
 		if (vname != NULL)
@@ -1018,8 +1290,10 @@ vnode_update_identity(vnode_t vp, vnode_t dvp, const char *name, int name_len, u
 			        vnode_lock_convert(vp);
 
 			        NAME_CACHE_LOCK();
+				vnode_nc_seq_write_begin(vp);
 				old_parentvp = vp->v_parent;
 				vp->v_parent = NULLVP;
+				vnode_nc_seq_write_end(vp);
 				NAME_CACHE_UNLOCK();
 			} else {
 			        /*
@@ -1101,8 +1375,11 @@ void vnode_uncache_authorized_action(vnode_t vp, kauth_action_t action)
         kauth_cred_t tcred = NOCRED;
 
 	NAME_CACHE_LOCK();
+	vnode_nc_seq_write_begin(vp);
 
 	vp->v_authorized_actions &= ~action;
+	/* paths through vp in the path cache were authorized with these */
+	vp->v_nc_generation++;
 
 	if (action == KAUTH_INVALIDATE_CACHED_RIGHTS &&
 	    IS_VALID_CRED(vp->v_cred)) {
@@ -1112,6 +1389,7 @@ void vnode_uncache_authorized_action(vnode_t vp, kauth_action_t action)
 	        tcred = vp->v_cred;
 		vp->v_cred = NOCRED;
 	}
+	vnode_nc_seq_write_end(vp);
 	NAME_CACHE_UNLOCK();
 
 	if (tcred != NOCRED)
@@ -1201,6 +1479,7 @@ void vnode_cache_authorized_action(vnode_t vp, vfs_context_t ctx, kauth_action_t
 		microuptime(&tv);
 	}
 	NAME_CACHE_LOCK();
+	vnode_nc_seq_write_begin(vp);
 
 	if (vp->v_cred != ucred) {
 	        kauth_cred_ref(ucred);
@@ -1224,6 +1503,7 @@ void vnode_cache_authorized_action(vnode_t vp, vfs_context_t ctx, kauth_action_t
 	}
 	vp->v_authorized_actions |= action;
 
+	vnode_nc_seq_write_end(vp);
 	NAME_CACHE_UNLOCK();
 
 	if (IS_VALID_CRED(tcred))
@@ -1248,6 +1528,691 @@ boolean_t vnode_cache_is_stale(vnode_t vp)
 
 
 
+/*
+ * Whole path cache
+ *
+ * Remembers the vnode a path resolved to through the name cache alone,
+ * keyed by the directory the walk started in (the root directory for
+ * an absolute path, the current directory otherwise), the credential
+ * that did the walk and the path itself.  A hit skips the component
+ * by component walk in cache_lookup_path().
+ *
+ * Nothing is purged from here directly.  Each entry remembers the
+ * v_id and v_nc_generation of every directory the walk searched, and
+ * v_nc_generation moves whenever a name is removed from that directory
+ * or its cached rights are dropped, so an entry is only used while a
+ * walk would still find the same vnodes and authorize the same way.
+ * New mounts are caught by mount_generation and unmounts by
+ * nc_path_generation, which cache_purgevfs() bumps.
+ *
+ * Only plain LOOKUPs of a non symlink that needs nothing from lookup()
+ * beyond the vnode are entered, and never paths with a ".." or those
+ * that search a directory on a file system with a TTL'd rights cache.
+ */
+#define	NC_PATH_MAXDEPTH	16
+#define	NC_PATH_NAMELEN		256
+#define	NC_PATH_HASHSIZE	512
+
+struct nc_path_dir {
+	vnode_t		npd_vp;
+	uint32_t	npd_vid;
+	int		npd_gen;
+};
+
+struct nc_path_entry {
+	LIST_ENTRY(nc_path_entry) npe_hash;
+	TAILQ_ENTRY(nc_path_entry) npe_lru;
+	vnode_t		npe_startdir;
+	uint32_t	npe_startvid;
+	kauth_cred_t	npe_cred;		/* holds a reference */
+	u_long		npe_flags;		/* cn_flags that change the walk */
+	uint32_t	npe_mount_gen;
+	uint32_t	npe_gen;
+	unsigned int	npe_hashval;
+	int		npe_pathlen;
+	vnode_t		npe_vp;
+	uint32_t	npe_vid;
+	int		npe_referenced;
+	int		npe_ndirs;
+	struct nc_path_dir npe_dirs[NC_PATH_MAXDEPTH];
+	char		npe_path[NC_PATH_NAMELEN];
+};
+
+/*
+ * What cache_lookup_path() saw on its way, for cache_enter_fullpath().
+ * npr_ndirs is -1 once the walk can't be entered.
+ */
+struct nc_path_record {
+	int		npr_ndirs;
+	const char	*npr_path;
+	int		npr_pathlen;
+	vnode_t		npr_startdir;
+	uint32_t	npr_startvid;
+	uint32_t	npr_mount_gen;
+	uint32_t	npr_gen;
+	struct nc_path_dir npr_dirs[NC_PATH_MAXDEPTH];
+};
+
+#define	NC_PATH_FLAGS		(NOCROSSMOUNT)
+
+unsigned int hash_string(const char *cp, int len);
+
+static LIST_HEAD(nc_path_head, nc_path_entry) nc_path_hashtbl[NC_PATH_HASHSIZE];
+static TAILQ_HEAD(, nc_path_entry) nc_path_lru = TAILQ_HEAD_INITIALIZER(nc_path_lru);
+static int nc_path_count;
+static volatile uint32_t nc_path_generation;
+
+int	nc_path_enable = 0;
+int	nc_path_max = 1024;
+uint64_t nc_path_hits;
+uint64_t nc_path_misses;
+uint64_t nc_path_stale;
+uint64_t nc_path_enters;
+
+static int
+sysctl_nc_path_enable(__unused struct sysctl_oid *oidp, __unused void *arg1,
+    __unused int arg2, struct sysctl_req *req)
+{
+	int error, value = nc_path_enable;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error || !req->newptr)
+		return (error);
+
+	NAME_CACHE_LOCK();
+	nc_path_enable = value ? 1 : 0;
+	nc_path_generation++;
+	NAME_CACHE_UNLOCK();
+
+	return (0);
+}
+
+static int
+sysctl_nc_path_hitrate(__unused struct sysctl_oid *oidp, __unused void *arg1,
+    __unused int arg2, struct sysctl_req *req)
+{
+	uint64_t hits = nc_path_hits;
+	uint64_t lookups = hits + nc_path_misses + nc_path_stale;
+	int rate = lookups ? (int)((hits * 100) / lookups) : 0;
+
+	return (sysctl_handle_int(oidp, &rate, 0, req));
+}
+
+SYSCTL_NODE(_vfs, OID_AUTO, pathcache, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "whole path lookup cache");
+SYSCTL_PROC(_vfs_pathcache, OID_AUTO, enable, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+    0, 0, sysctl_nc_path_enable, "I", "");
+SYSCTL_INT(_vfs_pathcache, OID_AUTO, max, CTLFLAG_RW | CTLFLAG_LOCKED, &nc_path_max, 0, "");
+SYSCTL_INT(_vfs_pathcache, OID_AUTO, count, CTLFLAG_RD | CTLFLAG_LOCKED, &nc_path_count, 0, "");
+SYSCTL_QUAD(_vfs_pathcache, OID_AUTO, hits, CTLFLAG_RD | CTLFLAG_LOCKED, &nc_path_hits, "");
+SYSCTL_QUAD(_vfs_pathcache, OID_AUTO, misses, CTLFLAG_RD | CTLFLAG_LOCKED, &nc_path_misses, "");
+SYSCTL_QUAD(_vfs_pathcache, OID_AUTO, stale, CTLFLAG_RD | CTLFLAG_LOCKED, &nc_path_stale, "");
+SYSCTL_QUAD(_vfs_pathcache, OID_AUTO, enters, CTLFLAG_RD | CTLFLAG_LOCKED, &nc_path_enters, "");
+SYSCTL_PROC(_vfs_pathcache, OID_AUTO, hitrate, CTLTYPE_INT | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, sysctl_nc_path_hitrate, "I", "percentage of lookups satisfied from the cache");
+
+/*
+ * Can a lookup with these flags be answered from the path cache?
+ */
+static boolean_t
+nc_path_eligible(struct componentname *cnp)
+{
+	if (!nc_path_enable || nc_disabled)
+		return (FALSE);
+	if (cnp->cn_nameiop != LOOKUP)
+		return (FALSE);
+	if (cnp->cn_flags & (LOCKPARENT | WANTPARENT | SAVESTART | CN_SKIPNAMECACHE))
+		return (FALSE);
+	return (TRUE);
+}
+
+static boolean_t
+nc_path_match(struct nc_path_entry *npe, vnode_t dp, kauth_cred_t ucred,
+    u_long flags, unsigned int hashval, const char *path, int pathlen)
+{
+	return (npe->npe_hashval == hashval &&
+	    npe->npe_startdir == dp &&
+	    npe->npe_cred == ucred &&
+	    npe->npe_flags == flags &&
+	    npe->npe_pathlen == pathlen &&
+	    memcmp(npe->npe_path, path, pathlen) == 0);
+}
+
+/*
+ * Called with the name cache lock held.
+ */
+static boolean_t
+nc_path_valid(struct nc_path_entry *npe)
+{
+	int i;
+
+	if (npe->npe_vp == NULLVP ||
+	    npe->npe_gen != nc_path_generation ||
+	    npe->npe_mount_gen != mount_generation ||
+	    npe->npe_startdir->v_id != npe->npe_startvid)
+		return (FALSE);
+
+	for (i = 0; i < npe->npe_ndirs; i++) {
+		struct nc_path_dir *npd = &npe->npe_dirs[i];
+
+		if (npd->npd_vp->v_id != npd->npd_vid ||
+		    npd->npd_vp->v_nc_generation != npd->npd_gen)
+			return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Look up the rest of the path in ndp, starting from dp, in the path
+ * cache.  Returns -1 with an iocount on ndp->ni_vp and cnp set up for
+ * the last component on a hit, 0 on a miss, or an error from the MAC
+ * checks the component walk would have made.  On a miss that could be
+ * entered, NAMEI_PATHCACHE asks cache_lookup_path() to enter it.
+ */
+int
+cache_lookup_fullpath(struct nameidata *ndp, vnode_t dp, vfs_context_t ctx)
+{
+	struct componentname *cnp = &ndp->ni_cnd;
+	struct nc_path_entry *npe;
+	kauth_cred_t	ucred = vfs_context_ucred(ctx);
+	u_long		flags = cnp->cn_flags & NC_PATH_FLAGS;
+	const char	*path = cnp->cn_nameptr;
+	const char	*cp, *last;
+	struct nc_path_dir dirs[NC_PATH_MAXDEPTH];
+	int		ndirs = 0;
+	int		i;
+	vnode_t		vp = NULLVP;
+	uint32_t	vid = 0;
+	unsigned int	hashval;
+	int		pathlen;
+
+	if (!nc_path_eligible(cnp))
+		return (0);
+
+	pathlen = ndp->ni_pathlen - 1;
+	if (pathlen <= 0 || pathlen >= NC_PATH_NAMELEN)
+		return (0);
+	hashval = hash_string(path, pathlen);
+
+	NAME_CACHE_LOCK_SHARED();
+
+	LIST_FOREACH(npe, &nc_path_hashtbl[hashval & (NC_PATH_HASHSIZE - 1)], npe_hash) {
+		if (nc_path_match(npe, dp, ucred, flags, hashval, path, pathlen))
+			break;
+	}
+	if (npe != NULL) {
+		if (nc_path_valid(npe)) {
+			vp = npe->npe_vp;
+			vid = npe->npe_vid;
+			ndirs = npe->npe_ndirs;
+			bcopy(npe->npe_dirs, dirs, ndirs * sizeof(dirs[0]));
+			npe->npe_referenced = 1;
+		} else {
+			OSAddAtomic64(1, &nc_path_stale);
+		}
+	}
+	NAME_CACHE_UNLOCK();
+
+	if (vp == NULLVP) {
+		if (npe == NULL)
+			OSAddAtomic64(1, &nc_path_misses);
+		ndp->ni_flag |= NAMEI_PATHCACHE;
+		return (0);
+	}
+
+	/*
+	 * Find the last component, making the MAC lookup check for each
+	 * directory searched on the way there as the walk would have.
+	 */
+	cp = path;
+	last = path;
+	for (i = 0; i < ndirs; i++) {
+		while (*cp == '/')
+			cp++;
+		last = cp;
+		while (*cp && *cp != '/')
+			cp++;
+#if CONFIG_MACF
+		if (!(cnp->cn_flags & DONOTAUTH)) {
+			struct componentname cn = *cnp;
+			int error;
+
+			cn.cn_nameptr = (char *)(uintptr_t)last;
+			cn.cn_namelen = (int)(cp - last);
+			cn.cn_hash = 0;
+			if (i == ndirs - 1)
+				cn.cn_flags |= ISLASTCN;
+			error = mac_vnode_check_lookup(ctx, dirs[i].npd_vp, &cn);
+			if (error)
+				return (error);
+		}
+#endif /* CONFIG_MACF */
+	}
+
+	if (vnode_getwithvid(vp, vid)) {
+		ndp->ni_flag |= NAMEI_PATHCACHE;
+		OSAddAtomic64(1, &nc_path_stale);
+		return (0);
+	}
+	OSAddAtomic64(1, &nc_path_hits);
+
+	cnp->cn_nameptr = (char *)(uintptr_t)last;
+	cnp->cn_namelen = (int)(cp - last);
+	cnp->cn_hash = hash_string(last, cnp->cn_namelen);
+	cnp->cn_flags &= ~(ISDOTDOT | ISSYMLINK);
+	cnp->cn_flags |= ISLASTCN;
+	if (!(cnp->cn_flags & NOCACHE))
+		cnp->cn_flags |= MAKEENTRY;
+	ndp->ni_next = (char *)(uintptr_t)cp;
+	ndp->ni_pathlen = 1;
+	ndp->ni_dvp = NULLVP;
+	ndp->ni_vp = vp;
+
+	return (-1);
+}
+
+/*
+ * Start recording a cache_lookup_path() walk if namei() asked for it.
+ */
+static void
+nc_path_record_start(struct nc_path_record *pr, struct nameidata *ndp,
+    struct componentname *cnp, vnode_t dp, int vid)
+{
+	pr->npr_ndirs = -1;
+
+	if (!(ndp->ni_flag & NAMEI_PATHCACHE))
+		return;
+	ndp->ni_flag &= ~NAMEI_PATHCACHE;
+
+	pr->npr_path = cnp->cn_nameptr;
+	pr->npr_pathlen = strnlen(cnp->cn_nameptr, NC_PATH_NAMELEN);
+	if (pr->npr_pathlen == 0 || pr->npr_pathlen >= NC_PATH_NAMELEN)
+		return;
+	pr->npr_startdir = dp;
+	pr->npr_startvid = vid;
+	pr->npr_gen = nc_path_generation;
+	pr->npr_mount_gen = mount_generation;
+	pr->npr_ndirs = 0;
+}
+
+/*
+ * Note that the walk is about to search dp.  The generation is taken
+ * before the search so that anything removed from dp afterwards makes
+ * the entry stale.
+ */
+static void
+nc_path_record_dir(struct nc_path_record *pr, vnode_t dp, int vid,
+    struct componentname *cnp)
+{
+	mount_t mp;
+
+	if (pr->npr_ndirs < 0)
+		return;
+	if (pr->npr_ndirs == NC_PATH_MAXDEPTH || (cnp->cn_flags & ISDOTDOT) ||
+	    (mp = dp->v_mount) == NULL ||
+	    (mp->mnt_kern_flag & (MNTK_AUTH_OPAQUE | MNTK_AUTH_CACHE_TTL))) {
+		pr->npr_ndirs = -1;
+		return;
+	}
+	pr->npr_dirs[pr->npr_ndirs].npd_vp = dp;
+	pr->npr_dirs[pr->npr_ndirs].npd_vid = vid;
+	pr->npr_dirs[pr->npr_ndirs].npd_gen = dp->v_nc_generation;
+	pr->npr_ndirs++;
+}
+
+/*
+ * Enter a walk that cache_lookup_path() resolved to vp (which it holds
+ * an iocount on) entirely from the name cache.
+ */
+static void
+cache_enter_fullpath(struct nc_path_record *pr, struct nameidata *ndp,
+    struct componentname *cnp, vnode_t vp, int vid, vfs_context_t ctx)
+{
+	struct nc_path_entry *npe, *new_npe = NULL;
+	struct nc_path_head *head;
+	kauth_cred_t	ucred = vfs_context_ucred(ctx);
+	kauth_cred_t	tcred = NOCRED;
+	u_long		flags = cnp->cn_flags & NC_PATH_FLAGS;
+	unsigned int	hashval;
+	int		i;
+
+	if (pr->npr_ndirs <= 0 || !nc_path_eligible(cnp))
+		return;
+	if (!(cnp->cn_flags & ISLASTCN) || (ndp->ni_flag & NAMEI_TRAILINGSLASH))
+		return;
+#if NAMEDRSRCFORK
+	if (cnp->cn_flags & CN_WANTSRSRCFORK)
+		return;
+#endif
+	/*
+	 * lookup() has more to do for these than hand back the vnode
+	 */
+	if (vp->v_type == VLNK || vp->v_mountedhere != NULL ||
+	    vp->v_mount == NULL || (vp->v_mount->mnt_flag & MNT_MULTILABEL))
+		return;
+#if CONFIG_TRIGGERS
+	if (vp->v_resolve)
+		return;
+#endif
+#if NAMEDSTREAMS
+	if (vnode_isshadow(vp))
+		return;
+#endif
+	hashval = hash_string(pr->npr_path, pr->npr_pathlen);
+	head = &nc_path_hashtbl[hashval & (NC_PATH_HASHSIZE - 1)];
+
+	if (nc_path_count < nc_path_max)
+		MALLOC(new_npe, struct nc_path_entry *, sizeof(*new_npe), M_CACHE, M_WAITOK);
+
+	NAME_CACHE_LOCK();
+
+	/*
+	 * the walk raced with something that will have made it stale
+	 */
+	if (pr->npr_gen != nc_path_generation || pr->npr_mount_gen != mount_generation)
+		goto out;
+	for (i = 0; i < pr->npr_ndirs; i++) {
+		if (pr->npr_dirs[i].npd_vp->v_nc_generation != pr->npr_dirs[i].npd_gen)
+			goto out;
+	}
+
+	LIST_FOREACH(npe, head, npe_hash) {
+		if (nc_path_match(npe, pr->npr_startdir, ucred, flags, hashval,
+		    pr->npr_path, pr->npr_pathlen))
+			break;
+	}
+	if (npe == NULL) {
+		if (new_npe != NULL && nc_path_count < nc_path_max) {
+			npe = new_npe;
+			new_npe = NULL;
+			nc_path_count++;
+		} else {
+			/*
+			 * reuse the oldest entry that hasn't been
+			 * hit since it was last looked at
+			 */
+			for (i = 0; i < nc_path_count; i++) {
+				npe = TAILQ_FIRST(&nc_path_lru);
+				if (npe == NULL || !npe->npe_referenced)
+					break;
+				npe->npe_referenced = 0;
+				TAILQ_REMOVE(&nc_path_lru, npe, npe_lru);
+				TAILQ_INSERT_TAIL(&nc_path_lru, npe, npe_lru);
+			}
+			if (npe == NULL)
+				goto out;
+			TAILQ_REMOVE(&nc_path_lru, npe, npe_lru);
+			LIST_REMOVE(npe, npe_hash);
+			tcred = npe->npe_cred;
+		}
+		npe->npe_startdir = pr->npr_startdir;
+		kauth_cred_ref(ucred);
+		npe->npe_cred = ucred;
+		npe->npe_flags = flags;
+		npe->npe_hashval = hashval;
+		npe->npe_pathlen = pr->npr_pathlen;
+		bcopy(pr->npr_path, npe->npe_path, pr->npr_pathlen);
+
+		LIST_INSERT_HEAD(head, npe, npe_hash);
+	} else {
+		TAILQ_REMOVE(&nc_path_lru, npe, npe_lru);
+	}
+	TAILQ_INSERT_TAIL(&nc_path_lru, npe, npe_lru);
+
+	npe->npe_startvid = pr->npr_startvid;
+	npe->npe_gen = pr->npr_gen;
+	npe->npe_mount_gen = pr->npr_mount_gen;
+	npe->npe_vp = vp;
+	npe->npe_vid = vid;
+	npe->npe_referenced = 0;
+	npe->npe_ndirs = pr->npr_ndirs;
+	bcopy(pr->npr_dirs, npe->npe_dirs, pr->npr_ndirs * sizeof(npe->npe_dirs[0]));
+	OSAddAtomic64(1, &nc_path_enters);
+out:
+	NAME_CACHE_UNLOCK();
+
+	if (new_npe != NULL)
+		FREE(new_npe, M_CACHE);
+	if (IS_VALID_CRED(tcred))
+		kauth_cred_unref(&tcred);
+}
+
+
+/*
+ * Outcome of cache_lookup_path_step()
+ */
+#define	NC_STEP_BREAK	0	/* leave the fast path with *vpp (may be NULL) */
+#define	NC_STEP_NEXT	1	/* *vpp is the next directory to search */
+#define	NC_STEP_RETRY	2	/* lockless attempt failed, redo it locked */
+
+/*
+ * Resolve one component of cache_lookup_path() against the name cache.
+ *
+ * With locked FALSE no lock is held; every vnode field looked at is
+ * validated against dp's v_nc_seq and v_id, and anything that
+ * cannot be validated that way (mount structures, the TTL'd rights
+ * cache, the chroot check) returns NC_STEP_RETRY.  With locked TRUE the
+ * caller holds the name cache lock shared.  dp may have been recycled
+ * since it was found, in which case the step leaves the fast path and
+ * the vnode_getwithvid() in cache_lookup_path() sends namei() round
+ * again, as it would for any recycled vnode.
+ */
+static int
+cache_lookup_path_step(struct nameidata *ndp, struct componentname *cnp,
+    vnode_t dp, int vid, vfs_context_t ctx, kauth_cred_t ucred,
+    boolean_t ttl_enabled, struct timeval *tv, boolean_t *dotdotchecked,
+    int *dp_authorized, vnode_t *vpp, int *vvidp, boolean_t locked)
+{
+	vnode_t		vp = NULLVP;
+	int		vvid = 0;
+	int		result = NC_STEP_BREAK;
+	uint32_t	seq = 0;
+	boolean_t	checked = *dotdotchecked;
+        mount_t		mp;
+
+	*dp_authorized = 0;
+
+	if (!locked) {
+		if (ttl_enabled)
+			return (NC_STEP_RETRY);
+		seq = nc_seq_read_begin(&dp->v_nc_seq);
+		if (seq & 1)
+			return (NC_STEP_RETRY);
+	}
+
+	if (ttl_enabled &&
+	    (dp->v_mount->mnt_authcache_ttl == 0 ||
+	    ((tv->tv_sec - dp->v_cred_timestamp) > dp->v_mount->mnt_authcache_ttl))) {
+	        goto out;
+	}
+
+	/*
+	 * NAME_CACHE_LOCK holds these fields stable
+	 *
+	 * We can't cache KAUTH_VNODE_SEARCHBYANYONE for root correctly
+	 * so we make an ugly check for root here. root is always
+	 * allowed and breaking out of here only to find out that is
+	 * authorized by virtue of being root is very very expensive.
+	 * However, the check for not root is valid only for filesystems
+	 * which use local authorization.
+	 *
+	 * XXX: Remove the check for root when we can reliably set
+	 * KAUTH_VNODE_SEARCHBYANYONE as root.
+	 */
+	if ((dp->v_cred != ucred || !(dp->v_authorized_actions & KAUTH_VNODE_SEARCH)) &&
+	    !(dp->v_authorized_actions & KAUTH_VNODE_SEARCHBYANYONE) &&
+	    (ttl_enabled || !vfs_context_issuser(ctx)))  {
+	        goto out;
+	}
+
+	/*
+	 * indicate that we're allowed to traverse this directory...
+	 * even if we fail the cache lookup or decide to bail for
+	 * some other reason, this information is valid and is used
+	 * to avoid doing a vnode_authorize before the call to VNOP_LOOKUP
+	 */
+	*dp_authorized = 1;
+
+	if ( (cnp->cn_flags & (ISLASTCN | ISDOTDOT)) ) {
+		if (cnp->cn_nameiop != LOOKUP)
+			goto out;
+		if (cnp->cn_flags & LOCKPARENT) 
+			goto out;
+		if (cnp->cn_flags & NOCACHE)
+			goto out;
+		if (cnp->cn_flags & ISDOTDOT) {
+			/*
+			 * Force directory hardlinks to go to
+			 * file system for ".." requests.
+			 */
+			if (dp && (dp->v_flag & VISHARDLINK)) {
+				goto out;
+			}
+			/*
+			 * Quit here only if we can't use
+			 * the parent directory pointer or
+			 * don't have one.  Otherwise, we'll
+			 * use it below.
+			 */
+			if ((dp->v_flag & VROOT)  ||
+			    dp == ndp->ni_rootdir ||
+			    dp->v_parent == NULLVP)
+				goto out;
+		}
+	}
+
+	if ((cnp->cn_flags & CN_SKIPNAMECACHE)) {
+		/*
+		 * Force lookup to go to the filesystem with
+		 * all cnp fields set up.
+		 */
+		goto out;
+	}
+
+	/*
+	 * "." and ".." aren't supposed to be cached, so check
+	 * for them before checking the cache.
+	 */
+	if (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.') {
+		vp = dp;
+		vvid = vid;
+	} else if ( (cnp->cn_flags & ISDOTDOT) ) {
+		/*
+		 * If this is a chrooted process, we need to check if
+		 * the process is trying to break out of its chrooted
+		 * jail. We do that by trying to determine if dp is
+		 * a subdirectory of ndp->ni_rootdir. If we aren't
+		 * able to determine that by the v_parent pointers, we
+		 * will leave the fast path.
+		 *
+		 * Since this function may see dotdot components
+		 * many times, we optimise this by doing this
+		 * check only once per cache_lookup_path call.
+		 * If dotdotchecked is set, it means we've done this
+		 * check once already and don't need to do it again.
+		 */
+		if (!checked && (ndp->ni_rootdir != rootvnode)) {
+			vnode_t tvp = dp;
+			boolean_t defer = FALSE;
+			boolean_t is_subdir = FALSE;
+
+			/* walks mount structures, which need the lock */
+			if (!locked)
+				return (NC_STEP_RETRY);
+
+			defer = cache_check_vnode_issubdir(tvp,
+			    ndp->ni_rootdir, &is_subdir, &tvp);
+
+			if (defer) {
+				/* defer to Filesystem */
+				goto out;
+			} else if (!is_subdir) {
+				/*
+				 * This process is trying to break  out
+				 * of its chrooted jail, so all its
+				 * dotdot accesses will be translated to
+				 * its root directory.
+				 */
+				vp = ndp->ni_rootdir;
+			} else {
+				/*
+				 * All good, let this dotdot access
+				 * proceed normally
+				 */
+				vp = dp->v_parent;
+			}
+			checked = TRUE;
+		} else {
+			vp = dp->v_parent;
+		}
+		if (vp == NULLVP)
+			return (NC_STEP_RETRY);
+		vvid = vp->v_id;
+	} else {
+		if (locked) {
+			if ( (vp = cache_lookup_locked(dp, cnp)) == NULLVP)
+				goto out;
+			vvid = vp->v_id;
+		} else if ( (vp = cache_lookup_lockless(dp, cnp, &vvid)) == NULLVP) {
+			return (NC_STEP_RETRY);
+		}
+
+		if ( (vp->v_flag & VISHARDLINK) ) {
+			/*
+			 * The file system wants a VNOP_LOOKUP on this vnode
+			 */
+			vp = NULL;
+			goto out;
+		}
+	}
+	if ( (cnp->cn_flags & ISLASTCN) )
+	        goto out;
+
+	if (vp->v_type != VDIR) {
+	        if (vp->v_type != VLNK)
+		        vp = NULL;
+	        goto out;
+	}
+
+	if ( (mp = vp->v_mountedhere) && ((cnp->cn_flags & NOCROSSMOUNT) == 0)) {
+		vnode_t tmp_vp;
+
+		/* the mount may be going away */
+		if (!locked)
+			return (NC_STEP_RETRY);
+
+		tmp_vp = mp->mnt_realrootvp;
+		if (tmp_vp == NULLVP || mp->mnt_generation != mount_generation ||
+			mp->mnt_realrootvp_vid != tmp_vp->v_id)
+			goto out;
+		vp = tmp_vp;
+		vvid = vp->v_id;
+	}
+
+#if CONFIG_TRIGGERS
+	/*
+	 * After traversing all mountpoints stacked here, if we have a
+	 * trigger in hand, resolve it.  Note that we don't need to 
+	 * leave the fast path if the mount has already happened.
+	 */
+	if (vp->v_resolve)
+		goto out;
+#endif /* CONFIG_TRIGGERS */
+
+	result = NC_STEP_NEXT;
+out:
+	if (!locked) {
+		if (dp->v_id != vid || !nc_seq_read_valid(&dp->v_nc_seq, seq))
+			return (NC_STEP_RETRY);
+	} else if (dp->v_id != vid) {
+		vp = NULLVP;
+		result = NC_STEP_BREAK;
+	}
+	*dotdotchecked = checked;
+	*vpp = vp;
+	*vvidp = vvid;
+	return (result);
+}
+
 /*
  * Returns:	0			Success
  *		ERECYCLE		vnode was recycled from underneath us.  Force lookup to be re-driven from namei.
@@ -1265,10 +2230,11 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 	kauth_cred_t	ucred;
 	boolean_t	ttl_enabled = FALSE;
 	struct timeval	tv;
-        mount_t		mp;
 	unsigned int	hash;
 	int		error = 0;
+	int		step;
 	boolean_t	dotdotchecked = FALSE;
+	struct nc_path_record pr;
 
 #if CONFIG_TRIGGERS
 	vnode_t 	trigger_vp;
@@ -1277,12 +2243,17 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 	ucred = vfs_context_ucred(ctx);
 	ndp->ni_flag &= ~(NAMEI_TRAILINGSLASH);
 
-	NAME_CACHE_LOCK_SHARED();
-
 	if ( dp->v_mount && (dp->v_mount->mnt_kern_flag & (MNTK_AUTH_OPAQUE | MNTK_AUTH_CACHE_TTL)) ) {
 		ttl_enabled = TRUE;
 		microuptime(&tv);
 	}
+	/* the caller holds a reference on the directory we start from */
+	vid = dp->v_id;
+
+	nc_path_record_start(&pr, ndp, cnp, dp, vid);
+	if (ttl_enabled || last_dp != NULLVP)
+		pr.npr_ndirs = -1;
+
 	for (;;) {
 		/*
 		 * Search a directory.
@@ -1346,10 +2317,15 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 		if ((ndp->ni_pathlen == sizeof(_PATH_RSRCFORKSPEC)) &&
 		    (cp[1] == '.' && cp[2] == '.') &&
 		    bcmp(cp, _PATH_RSRCFORKSPEC, sizeof(_PATH_RSRCFORKSPEC)) == 0) {
+			boolean_t skip;
+
 		    	/* Skip volfs file systems that don't support native streams. */
-			if ((dp->v_mount != NULL) &&
+			NAME_CACHE_LOCK_SHARED();
+			skip = ((dp->v_mount != NULL) &&
 			    (dp->v_mount->mnt_flag & MNT_DOVOLFS) &&
-			    (dp->v_mount->mnt_kern_flag & MNTK_NAMED_STREAMS) == 0) {
+			    (dp->v_mount->mnt_kern_flag & MNTK_NAMED_STREAMS) == 0);
+			NAME_CACHE_UNLOCK();
+			if (skip) {
 				goto skiprsrcfork;
 			}
 			cnp->cn_flags |= CN_WANTSRSRCFORK;
@@ -1368,177 +2344,36 @@ skiprsrcfork:
 		 * We must perform MAC check here.  On denial
 		 * dp_authorized will remain 0 and second check will
 		 * be perfomed in lookup().
+		 *
+		 * dp may be a directory found without the name cache
+		 * lock.  Vnodes and their labels are never freed, and if
+		 * dp is recycled meanwhile the step below fails and the
+		 * lookup is driven again from namei().
 		 */
 		if (!(cnp->cn_flags & DONOTAUTH)) {
 			error = mac_vnode_check_lookup(ctx, dp, cnp);
 			if (error) {
-				NAME_CACHE_UNLOCK();
 				goto errorout;
 			}
 		}
 #endif /* MAC */
-		if (ttl_enabled &&
-		    (dp->v_mount->mnt_authcache_ttl == 0 ||
-		    ((tv.tv_sec - dp->v_cred_timestamp) > dp->v_mount->mnt_authcache_ttl))) {
-		        break;
-		}
-
-		/*
-		 * NAME_CACHE_LOCK holds these fields stable
-		 *
-		 * We can't cache KAUTH_VNODE_SEARCHBYANYONE for root correctly
-		 * so we make an ugly check for root here. root is always
-		 * allowed and breaking out of here only to find out that is
-		 * authorized by virtue of being root is very very expensive.
-		 * However, the check for not root is valid only for filesystems
-		 * which use local authorization.
-		 *
-		 * XXX: Remove the check for root when we can reliably set
-		 * KAUTH_VNODE_SEARCHBYANYONE as root.
-		 */
-		if ((dp->v_cred != ucred || !(dp->v_authorized_actions & KAUTH_VNODE_SEARCH)) &&
-		    !(dp->v_authorized_actions & KAUTH_VNODE_SEARCHBYANYONE) &&
-		    (ttl_enabled || !vfs_context_issuser(ctx)))  {
-		        break;
-		}
-
-		/*
-		 * indicate that we're allowed to traverse this directory...
-		 * even if we fail the cache lookup or decide to bail for
-		 * some other reason, this information is valid and is used
-		 * to avoid doing a vnode_authorize before the call to VNOP_LOOKUP
-		 */
-		*dp_authorized = 1;
-
-		if ( (cnp->cn_flags & (ISLASTCN | ISDOTDOT)) ) {
-			if (cnp->cn_nameiop != LOOKUP)
-				break;
-			if (cnp->cn_flags & LOCKPARENT) 
-				break;
-			if (cnp->cn_flags & NOCACHE)
-				break;
-			if (cnp->cn_flags & ISDOTDOT) {
-				/*
-				 * Force directory hardlinks to go to
-				 * file system for ".." requests.
-				 */
-				if (dp && (dp->v_flag & VISHARDLINK)) {
-					break;
-				}
-				/*
-				 * Quit here only if we can't use
-				 * the parent directory pointer or
-				 * don't have one.  Otherwise, we'll
-				 * use it below.
-				 */
-				if ((dp->v_flag & VROOT)  ||
-				    dp == ndp->ni_rootdir ||
-				    dp->v_parent == NULLVP)
-					break;
-			}
-		}
-
-		if ((cnp->cn_flags & CN_SKIPNAMECACHE)) {
-			/*
-			 * Force lookup to go to the filesystem with
-			 * all cnp fields set up.
-			 */
-			break;
-		}
-
-		/*
-		 * "." and ".." aren't supposed to be cached, so check
-		 * for them before checking the cache.
-		 */
-		if (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.')
-			vp = dp;
-		else if ( (cnp->cn_flags & ISDOTDOT) ) {
-			/*
-			 * If this is a chrooted process, we need to check if
-			 * the process is trying to break out of its chrooted
-			 * jail. We do that by trying to determine if dp is
-			 * a subdirectory of ndp->ni_rootdir. If we aren't
-			 * able to determine that by the v_parent pointers, we
-			 * will leave the fast path.
-			 *
-			 * Since this function may see dotdot components
-			 * many times and it has the name cache lock held for
-			 * the entire duration, we optimise this by doing this
-			 * check only once per cache_lookup_path call.
-			 * If dotdotchecked is set, it means we've done this
-			 * check once already and don't need to do it again.
-			 */
-			if (!dotdotchecked && (ndp->ni_rootdir != rootvnode)) {
-				vnode_t tvp = dp;
-				boolean_t defer = FALSE;
-				boolean_t is_subdir = FALSE;
+		nc_path_record_dir(&pr, dp, vid, cnp);
 
-				defer = cache_check_vnode_issubdir(tvp,
-				    ndp->ni_rootdir, &is_subdir, &tvp);
-
-				if (defer) {
-					/* defer to Filesystem */
-					break;
-				} else if (!is_subdir) {
-					/*
-					 * This process is trying to break  out
-					 * of its chrooted jail, so all its
-					 * dotdot accesses will be translated to
-					 * its root directory.
-					 */
-					vp = ndp->ni_rootdir;
-				} else {
-					/*
-					 * All good, let this dotdot access
-					 * proceed normally
-					 */
-					vp = dp->v_parent;
-				}
-				dotdotchecked = TRUE;
-			} else {
-				vp = dp->v_parent;
-			}
-		} else {
-			if ( (vp = cache_lookup_locked(dp, cnp)) == NULLVP)
-				break;
-
-			if ( (vp->v_flag & VISHARDLINK) ) {
-				/*
-				 * The file system wants a VNOP_LOOKUP on this vnode
-				 */
-				vp = NULL;
-				break;
-			}
-		}
-		if ( (cnp->cn_flags & ISLASTCN) )
-		        break;
-
-		if (vp->v_type != VDIR) {
-		        if (vp->v_type != VLNK)
-			        vp = NULL;
-		        break;
-		}
-
-		if ( (mp = vp->v_mountedhere) && ((cnp->cn_flags & NOCROSSMOUNT) == 0)) {
-			vnode_t tmp_vp = mp->mnt_realrootvp;
-			if (tmp_vp == NULLVP || mp->mnt_generation != mount_generation ||
-				mp->mnt_realrootvp_vid != tmp_vp->v_id)
-				break;
-			vp = tmp_vp;
+		step = cache_lookup_path_step(ndp, cnp, dp, vid, ctx, ucred,
+		    ttl_enabled, &tv, &dotdotchecked, dp_authorized, &vp, &vvid,
+		    FALSE);
+		if (step == NC_STEP_RETRY) {
+			NAME_CACHE_LOCK_SHARED();
+			step = cache_lookup_path_step(ndp, cnp, dp, vid, ctx, ucred,
+			    ttl_enabled, &tv, &dotdotchecked, dp_authorized, &vp,
+			    &vvid, TRUE);
+			NAME_CACHE_UNLOCK();
 		}
-
-#if CONFIG_TRIGGERS
-		/*
-		 * After traversing all mountpoints stacked here, if we have a
-		 * trigger in hand, resolve it.  Note that we don't need to 
-		 * leave the fast path if the mount has already happened.
-		 */
-		if (vp->v_resolve)
+		if (step == NC_STEP_BREAK)
 			break;
-#endif /* CONFIG_TRIGGERS */
-
 
 		dp = vp;
+		vid = vvid;
 		vp = NULLVP;
 
 		cnp->cn_nameptr = ndp->ni_next + 1;
@@ -1548,11 +2383,6 @@ skiprsrcfork:
 			ndp->ni_pathlen--;
 		}
 	}
-	if (vp != NULLVP)
-	        vvid = vp->v_id;
-	vid = dp->v_id;
-	
-	NAME_CACHE_UNLOCK();
 
 	if ((vp != NULLVP) && (vp->v_type != VLNK) &&
 	    ((cnp->cn_flags & (ISLASTCN | LOCKPARENT | WANTPARENT | SAVESTART)) == ISLASTCN)) {
@@ -1631,7 +2461,8 @@ need_dp:
 			        dp = tdp;
 				goto need_dp;
 			}
-		}
+		} else
+			cache_enter_fullpath(&pr, ndp, cnp, vp, vvid, ctx);
 	}
 
 	ndp->ni_dvp = dp;
@@ -1682,7 +2513,7 @@ cache_lookup_locked(vnode_t dvp, struct componentname *cnp)
 		return NULL;
 	}
 
-	ncpp = NCHHASH(dvp, cnp->cn_hash);
+	ncpp = nc_hash_bucket(dvp, hashval);
 	LIST_FOREACH(ncp, ncpp, nc_hash) {
 	        if ((ncp->nc_dvp == dvp) && (ncp->nc_hashval == hashval)) {
 			if (memcmp(ncp->nc_name, cnp->cn_nameptr, namelen) == 0 && ncp->nc_name[namelen] == 0)
@@ -1702,6 +2533,68 @@ cache_lookup_locked(vnode_t dvp, struct componentname *cnp)
 }
 
 
+/*
+ * cache_lookup_locked() without the name cache lock.  Only finds
+ * positive entries; a miss, a negative entry or a chain that changed
+ * while it was being walked all return NULLVP and the caller takes the
+ * lock and looks again.  *vidp is the v_id vp had while its entry was
+ * still in the cache.
+ */
+static vnode_t
+cache_lookup_lockless(vnode_t dvp, struct componentname *cnp, int *vidp)
+{
+	struct namecache *ncp;
+	struct nchashhead *ncpp;
+	volatile uint32_t *seqp;
+	long namelen = cnp->cn_namelen;
+	unsigned int hashval = cnp->cn_hash;
+	const char *name;
+	vnode_t vp = NULLVP;
+	uint32_t seq;
+	int count = 0;
+	int vid = 0;
+
+	if (nc_disabled)
+		return (NULLVP);
+
+	nc_reader_enter();
+
+	seqp = nc_hash_seq(dvp, hashval);
+	seq = nc_seq_read_begin(seqp);
+	ncpp = nc_hash_bucket(dvp, hashval);
+	if (seq & 1)
+		goto out;
+
+	for (ncp = LIST_FIRST(ncpp); ncp != NULL; ncp = LIST_NEXT(ncp, nc_hash)) {
+		if (++count > NC_LOCKLESS_MAX_CHAIN)
+			break;
+	        if ((ncp->nc_dvp != dvp) || (ncp->nc_hashval != hashval))
+			continue;
+		/*
+		 * the name can't be freed under us (see
+		 * nc_limbo_removename), but it can change
+		 */
+		name = ncp->nc_name;
+		if (name != NULL &&
+		    memcmp(name, cnp->cn_nameptr, namelen) == 0 && name[namelen] == 0) {
+			if ((vp = ncp->nc_vp) != NULLVP)
+				vid = vp->v_id;
+			break;
+		}
+	}
+	if (vp != NULLVP && !nc_seq_read_valid(seqp, seq))
+		vp = NULLVP;
+out:
+	nc_reader_exit();
+
+	if (vp != NULLVP) {
+		NCHSTAT(ncs_goodhits);
+		*vidp = vid;
+	}
+	return (vp);
+}
+
+
 unsigned int hash_string(const char *cp, int len);
 //
 // Have to take a len argument because we may only need to
@@ -1769,7 +2662,7 @@ cache_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp)
 	NAME_CACHE_LOCK_SHARED();
 
 relook:
-	ncpp = NCHHASH(dvp, cnp->cn_hash);
+	ncpp = nc_hash_bucket(dvp, hashval);
 	LIST_FOREACH(ncp, ncpp, nc_hash) {
 	        if ((ncp->nc_dvp == dvp) && (ncp->nc_hashval == hashval)) {
 			if (memcmp(ncp->nc_name, cnp->cn_nameptr, namelen) == 0 && ncp->nc_name[namelen] == 0)
@@ -1919,6 +2812,9 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 {
         struct namecache *ncp, *negp;
 	struct nchashhead *ncpp;
+	volatile uint32_t *seqp;
+	const char *name;
+	unsigned int hashval;
 
 	if (nc_disabled) 
 		return;
@@ -1966,17 +2862,11 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 	}
 	NCHSTAT(ncs_enters);
 
-	/*
-	 * Fill in cache info, if vp is NULL this is a "negative" cache entry.
-	 */
-	ncp->nc_vp = vp;
-	ncp->nc_dvp = dvp;
-	ncp->nc_hashval = cnp->cn_hash;
-
+	hashval = cnp->cn_hash;
 	if (strname == NULL)
-		ncp->nc_name = add_name_internal(cnp->cn_nameptr, cnp->cn_namelen, cnp->cn_hash, FALSE, 0);
+		name = add_name_internal(cnp->cn_nameptr, cnp->cn_namelen, cnp->cn_hash, FALSE, 0);
 	else
-		ncp->nc_name = strname;
+		name = strname;
 
 	//
 	// If the bytes of the name associated with the vnode differ,
@@ -1988,21 +2878,41 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 	// 
 	const char *vn_name = vp ? vp->v_name : NULL;
 	unsigned int len = vn_name ? strlen(vn_name) : 0;
-	if (vn_name && ncp && ncp->nc_name && strncmp(ncp->nc_name, vn_name, len) != 0) {
+	if (vn_name && name && strncmp(name, vn_name, len) != 0) {
 		unsigned int hash = hash_string(vn_name, len);
 		
-		vfs_removename(ncp->nc_name);
-		ncp->nc_name = add_name_internal(vn_name, len, hash, FALSE, 0);
-		ncp->nc_hashval = hash;
+		vfs_removename(name);
+		name = add_name_internal(vn_name, len, hash, FALSE, 0);
+		hashval = hash;
 	}
 
+	/*
+	 * A reused entry may still be looked at by a lockless reader
+	 * that found it under its old name; the counter makes sure
+	 * such a reader can't take a mix of old and new fields.
+	 */
+	seqp = nc_hash_seq(dvp, hashval);
+	nc_seq_write_begin(seqp);
+
+	/*
+	 * Fill in cache info, if vp is NULL this is a "negative" cache entry.
+	 */
+	ncp->nc_vp = vp;
+	ncp->nc_dvp = dvp;
+	ncp->nc_hashval = hashval;
+	ncp->nc_name = name;
+
 	/*
 	 * make us the newest entry in the cache
 	 * i.e. we'll be the last to be stolen
 	 */
 	TAILQ_INSERT_TAIL(&nchead, ncp, nc_entry);
 
-	ncpp = NCHHASH(dvp, cnp->cn_hash);
+	/*
+	 * file by the hash of the name we actually store, so that the
+	 * entry can always be found again from nc_dvp and nc_hashval
+	 */
+	ncpp = nc_hash_bucket(dvp, hashval);
 #if DIAGNOSTIC
 	{
 		struct namecache *p;
@@ -2016,6 +2926,7 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 	 * make us available to be found via lookup
 	 */
 	LIST_INSERT_HEAD(ncpp, ncp, nc_hash);
+	nc_seq_write_end(seqp);
 
 	if (vp) {
 	       /*
@@ -2103,6 +3014,18 @@ nchinit(void)
 	nchashmask = nchash;
 	nchash++;
 
+	nchashseqmask = nchashmask;
+	MALLOC(nchashseq, volatile uint32_t *, nchash * sizeof(*nchashseq),
+	    M_CACHE, M_WAITOK | M_ZERO);
+
+	nc_nreaders = ml_get_max_cpus();
+	MALLOC(nc_readers, struct nc_reader *, nc_nreaders * sizeof(*nc_readers),
+	    M_CACHE, M_WAITOK | M_ZERO);
+
+	TAILQ_INIT(&nc_limbo_retired);
+	MALLOC(nc_limbo_cur, struct nc_limbo *, sizeof(*nc_limbo_cur),
+	    M_CACHE, M_WAITOK | M_ZERO);
+
 	init_string_table();
 	
 	/* Allocate name cache lock group attribute and group */
@@ -2151,6 +3074,12 @@ name_cache_unlock(void)
 }
 
 
+/*
+ * Grow the name cache hash table.  Entries are moved to the new table
+ * NC_RESIZE_BATCH chains at a time so that lookups are not held off for
+ * the whole table; until a chain has been moved it is still searched
+ * in the old table (see nc_hash_bucket()).
+ */
 int
 resize_namecache(u_int newsize)
 {
@@ -2158,9 +3087,9 @@ resize_namecache(u_int newsize)
     struct nchashhead	*old_table;
     struct nchashhead	*old_head, *head;
     struct namecache 	*entry, *next;
-    uint32_t		i, hashval;
+    uint32_t		hashval;
     int			dNodes, dNegNodes;
-    u_long		new_size, old_size;
+    u_long		i, new_mask, old_size, batch_end;
 
     dNegNodes = (newsize / 10);
     dNodes = newsize + dNegNodes;
@@ -2169,50 +3098,84 @@ resize_namecache(u_int newsize)
     if (dNodes <= desiredNodes) {
 	return 0;
     }
-    new_table = hashinit(2 * dNodes, M_CACHE, &nchashmask);
-    new_size  = nchashmask + 1;
+    new_table = hashinit(2 * dNodes, M_CACHE, &new_mask);
 
     if (new_table == NULL) {
 	return ENOMEM;
     }
 
     NAME_CACHE_LOCK();
+    if (nc_resize_busy || dNodes <= desiredNodes) {
+	int error = nc_resize_busy ? EBUSY : 0;
+
+	NAME_CACHE_UNLOCK();
+	FREE(new_table, M_CACHE);
+	return error;
+    }
+    nc_resize_busy = 1;
+
     // do the switch!
     old_table = nchashtbl;
-    nchashtbl = new_table;
     old_size  = nchash;
-    nchash    = new_size;
+    nchashmask_old = nchashmask;
+    nc_resize_cursor = 0;
+    nchashtbl_old = old_table;
+
+    nchashtbl = new_table;
+    atomic_thread_fence(memory_order_release);
+    nchashmask = new_mask;
+    nchash    = new_mask + 1;
+
+    desiredNodes = dNodes;
+    desiredNegNodes = dNegNodes;
 
     // walk the old table and insert all the entries into
     // the new table
     //
-    for(i=0; i < old_size; i++) {
-	old_head = &old_table[i];
-	for (entry=old_head->lh_first; entry != NULL; entry=next) {
-	    //
-	    // XXXdbg - Beware: this assumes that hash_string() does
-	    //                  the same thing as what happens in
-	    //                  lookup() over in vfs_lookup.c
-	    hashval = hash_string(entry->nc_name, 0);
-	    entry->nc_hashval = hashval;
-	    head = NCHHASH(entry->nc_dvp, hashval);
-	    
-	    next = entry->nc_hash.le_next;
-	    LIST_INSERT_HEAD(head, entry, nc_hash);
+    for (i = 0; i < old_size; i = batch_end) {
+	batch_end = MIN(i + NC_RESIZE_BATCH, old_size);
+
+	for (; i < batch_end; i++) {
+	    old_head = &old_table[i];
+	    for (entry=old_head->lh_first; entry != NULL; entry=next) {
+		//
+		// XXXdbg - Beware: this assumes that hash_string() does
+		//                  the same thing as what happens in
+		//                  lookup() over in vfs_lookup.c
+		hashval = hash_string(entry->nc_name, 0);
+		entry->nc_hashval = hashval;
+		head = &new_table[(entry->nc_dvp->v_id ^ hashval) & new_mask];
+
+		next = entry->nc_hash.le_next;
+		LIST_INSERT_HEAD(head, entry, nc_hash);
+	    }
+	    old_head->lh_first = NULL;
+	    nc_resize_cursor = i + 1;
 	}
+	NAME_CACHE_UNLOCK();
+	NAME_CACHE_LOCK();
     }
-    desiredNodes = dNodes;
-    desiredNegNodes = dNegNodes;
-    
+    nchashtbl_old = NULL;
     NAME_CACHE_UNLOCK();
+
+    /*
+     * lockless readers may still be walking the old chains
+     */
+    nc_reader_synchronize();
     FREE(old_table, M_CACHE);
 
+    NAME_CACHE_LOCK();
+    nc_resize_busy = 0;
+    NAME_CACHE_UNLOCK();
+
     return 0;
 }
 
 static void
 cache_delete(struct namecache *ncp, int age_entry)
 {
+	volatile uint32_t *seqp;
+
         NCHSTAT(ncs_deletes);
 
         if (ncp->nc_vp) {
@@ -2223,6 +3186,16 @@ cache_delete(struct namecache *ncp, int age_entry)
 	}
         TAILQ_REMOVE(&(ncp->nc_dvp->v_ncchildren), ncp, nc_child);
 
+	/*
+	 * paths through this name in the path cache are stale,
+	 * unless the entry is only being stolen for reuse
+	 */
+	if (ncp->nc_vp && age_entry)
+		ncp->nc_dvp->v_nc_generation++;
+
+	seqp = nc_hash_seq(ncp->nc_dvp, ncp->nc_hashval);
+	nc_seq_write_begin(seqp);
+
 	LIST_REMOVE(ncp, nc_hash);
 	/*
 	 * this field is used to indicate
@@ -2232,6 +3205,8 @@ cache_delete(struct namecache *ncp, int age_entry)
 	 */
 	ncp->nc_hash.le_prev = NULL;
 
+	nc_seq_write_end(seqp);
+
 	if (age_entry) {
 	        /*
 		 * make it the next one available
@@ -2240,7 +3215,7 @@ cache_delete(struct namecache *ncp, int age_entry)
 	        TAILQ_REMOVE(&nchead, ncp, nc_entry);
 	        TAILQ_INSERT_HEAD(&nchead, ncp, nc_entry);
 	}
-	vfs_removename(ncp->nc_name);
+	nc_limbo_removename(ncp->nc_name);
 	ncp->nc_name = NULL;
 }
 
@@ -2265,6 +3240,8 @@ cache_purge(vnode_t vp)
 
 	if (vp->v_parent)
 	        vp->v_parent->v_nc_generation++;
+	/* for the path cache, vp's cached rights are going */
+	vp->v_nc_generation++;
 
 	while ( (ncp = LIST_FIRST(&vp->v_nclinks)) )
 	        cache_delete(ncp, 1);
@@ -2275,9 +3252,11 @@ cache_purge(vnode_t vp)
 	/*
 	 * Use a temp variable to avoid kauth_cred_unref() while NAME_CACHE_LOCK is held
 	 */
+	vnode_nc_seq_write_begin(vp);
 	tcred = vp->v_cred;
 	vp->v_cred = NOCRED;
 	vp->v_authorized_actions = 0;
+	vnode_nc_seq_write_end(vp);
 
 	NAME_CACHE_UNLOCK();
 
@@ -2320,8 +3299,12 @@ cache_purgevfs(struct mount *mp)
 {
 	struct nchashhead *ncpp;
 	struct namecache *ncp;
+	u_long i;
 
 	NAME_CACHE_LOCK();
+	/* the covered directories are no longer crossed into mp */
+	nc_path_generation++;
+
 	/* Scan hash tables for applicable entries */
 	for (ncpp = &nchashtbl[nchash - 1]; ncpp >= nchashtbl; ncpp--) {
 restart:	  
@@ -2332,6 +3315,19 @@ restart:
 			}
 		}
 	}
+	/* and the chains a resize hasn't moved yet */
+	if (nchashtbl_old != NULL) {
+		for (i = nc_resize_cursor; i <= nchashmask_old; i++) {
+			ncpp = &nchashtbl_old[i];
+restart_old:
+			for (ncp = ncpp->lh_first; ncp != 0; ncp = ncp->nc_hash.le_next) {
+				if (ncp->nc_dvp->v_mount == mp) {
+					cache_delete(ncp, 0);
+					goto restart_old;
+				}
+			}
+		}
+	}
 	NAME_CACHE_UNLOCK();
 }
 
@@ -84,6 +84,7 @@
 #include <mach/vm_map.h>
 #include <mach/upl.h>
 #include <kern/task.h>
+#include <kern/clock.h>
 #include <kern/policy_internal.h>
 
 #include <vm/vm_kern.h>
@@ -123,6 +124,7 @@
 #define	CL_ENCRYPTED	0x10000
 #define CL_RAW_ENCRYPTED	0x20000
 #define CL_NOCACHE	0x40000
+#define CL_PUSHBATCH	0x80000
 
 #define MAX_VECTOR_UPL_ELEMENTS	8
 #define MAX_VECTOR_UPL_SIZE	(2 * MAX_UPL_SIZE_BYTES)
@@ -210,7 +212,7 @@ static int cluster_align_phys_io(vnode_t vp, struct uio *uio, addr64_t usr_paddr
 static int 	cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
 static void	cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *ra, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
 
-static int	cluster_push_now(vnode_t vp, struct cl_extent *, off_t EOF, int flags, int (*)(buf_t, void *), void *callback_arg);
+static int	cluster_push_now(vnode_t vp, struct cl_extent *, off_t EOF, int flags, int push_flag, int (*)(buf_t, void *), void *callback_arg);
 
 static int	cluster_try_push(struct cl_writebehind *, vnode_t vp, off_t EOF, int push_flag, int flags, int (*)(buf_t, void *), void *callback_arg, int *err);
 
@@ -271,6 +273,47 @@ int (*bootcache_contains_block)(dev_t device, u_int64_t blkno) = NULL;
 uint32_t speculative_prefetch_max = (MAX_UPL_SIZE_BYTES * 3);	/* maximum bytes in a specluative read-ahead */
 uint32_t speculative_prefetch_max_iosize = (512 * 1024);	/* maximum I/O size to use in a specluative read-ahead on SSDs*/
 
+/*
+ * read ahead streams... see cluster_get_rap
+ */
+uint32_t cluster_ra_streams = CL_RA_STREAMS;	/* streams tracked per vnode */
+uint32_t cluster_ra_stride_max = 256;		/* furthest apart (in pages) two reads of a strided stream can be */
+uint32_t cluster_ra_slow_usecs = 2000;		/* demand reads slower than this ramp the read ahead up faster */
+
+static SInt64 cluster_ra_hits;		/* pages read that the read ahead had already prefetched */
+static SInt64 cluster_ra_wasted;	/* prefetched pages abandoned unread */
+static SInt64 cluster_ra_throttled;	/* reads that ran without read ahead because of I/O throttling */
+static SInt64 cluster_ra_strided;	/* pages prefetched for strided streams */
+static SInt64 cluster_ra_recycled;	/* streams recycled for a new reader */
+
+SYSCTL_NODE(_kern, OID_AUTO, readahead, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "cluster read ahead");
+SYSCTL_UINT(_kern_readahead, OID_AUTO, streams, CTLFLAG_RW | CTLFLAG_LOCKED, &cluster_ra_streams, 0, "");
+SYSCTL_UINT(_kern_readahead, OID_AUTO, stride_max, CTLFLAG_RW | CTLFLAG_LOCKED, &cluster_ra_stride_max, 0, "");
+SYSCTL_UINT(_kern_readahead, OID_AUTO, slow_usecs, CTLFLAG_RW | CTLFLAG_LOCKED, &cluster_ra_slow_usecs, 0, "");
+SYSCTL_QUAD(_kern_readahead, OID_AUTO, hits, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_ra_hits, "");
+SYSCTL_QUAD(_kern_readahead, OID_AUTO, wasted, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_ra_wasted, "");
+SYSCTL_QUAD(_kern_readahead, OID_AUTO, throttled, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_ra_throttled, "");
+SYSCTL_QUAD(_kern_readahead, OID_AUTO, strided, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_ra_strided, "");
+SYSCTL_QUAD(_kern_readahead, OID_AUTO, recycled, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_ra_recycled, "");
+
+/*
+ * write back... a PUSH_ALL of a vnode's clusters or sparse map keeps up to
+ * cluster_push_depth writes in flight instead of the usual async throttle
+ */
+uint32_t cluster_push_depth = 64;
+
+static SInt64 cluster_push_batches;	/* PUSH_ALL pushes */
+static SInt64 cluster_push_extents;	/* extents written by PUSH_ALL pushes */
+static SInt64 cluster_push_merged;	/* adjacent clusters folded into a single push */
+static SInt64 cluster_push_coalesced;	/* sparse map extents coalesced to make room */
+
+SYSCTL_NODE(_kern, OID_AUTO, writeback, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "cluster write back");
+SYSCTL_UINT(_kern_writeback, OID_AUTO, depth, CTLFLAG_RW | CTLFLAG_LOCKED, &cluster_push_depth, 0, "");
+SYSCTL_QUAD(_kern_writeback, OID_AUTO, batches, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_push_batches, "");
+SYSCTL_QUAD(_kern_writeback, OID_AUTO, extents, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_push_extents, "");
+SYSCTL_QUAD(_kern_writeback, OID_AUTO, merged, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_push_merged, "");
+SYSCTL_QUAD(_kern_writeback, OID_AUTO, coalesced, CTLFLAG_RD | CTLFLAG_LOCKED, &cluster_push_coalesced, "");
+
 
 #define IO_SCALE(vp, base)		(vp->v_mount->mnt_ioscale * (base))
 #define MAX_CLUSTER_SIZE(vp)		(cluster_max_io_size(vp->v_mount, CL_WRITE))
@@ -371,52 +414,123 @@ cluster_max_io_size(mount_t mp, int type)
 #define CLW_IOPASSIVE	0x08
 
 /*
- * if the read ahead context doesn't yet exist,
- * allocate and initialize it...
+ * if the read ahead streams don't yet exist,
+ * allocate and initialize them...
  * the vnode lock serializes multiple callers
  * during the actual assignment... first one
  * to grab the lock wins... the other callers
  * will release the now unnecessary storage
  * 
- * once the context is present, try to grab (but don't block on)
- * the lock associated with it... if someone
- * else currently owns it, than the read
- * will run without read-ahead.  this allows
- * multiple readers to run in parallel and
- * since there's only 1 read ahead context,
- * there's no real loss in only allowing 1
- * reader to have read-ahead enabled.
+ * the stream for a read starting at 'b_addr' is the one the read
+ * continues sequentially or by its stride, else the one whose last
+ * read is closest below 'b_addr' (so that a stride can be learnt),
+ * else an unused or the least recently used stream, which is recycled.
+ * stream state is examined without the stream locks held... it's
+ * only used to pick a stream
+ *
+ * once a stream is picked, try to grab (but don't block on)
+ * the lock associated with it... if another reader currently
+ * owns it, then this read will run without read-ahead.  readers
+ * working through different parts of the file use different
+ * streams and so run in parallel with read-ahead enabled.
  */
+static void
+cluster_ra_stream_reset(struct cl_readahead *rap)
+{
+	if (rap->cl_lastr != -1 && rap->cl_maxra > rap->cl_lastr)
+		OSAddAtomic64(rap->cl_maxra - rap->cl_lastr, &cluster_ra_wasted);
+
+	rap->cl_lastr = -1;
+	rap->cl_maxra = 0;
+	rap->cl_ralen = 0;
+	rap->cl_ramax = 0;
+	rap->cl_lastb = -1;
+	rap->cl_stride = 0;
+	rap->cl_strra = -1;
+	rap->cl_rdlat = 0;
+}
+
 static struct cl_readahead *
-cluster_get_rap(vnode_t vp)
+cluster_get_rap(vnode_t vp, daddr64_t b_addr)
 {
         struct ubc_info		*ubc;
-	struct cl_readahead	*rap;
+	struct cl_readahead_set	*rasp;
+	struct cl_readahead	*rap, *match = NULL, *near = NULL, *lru = NULL;
+	daddr64_t		near_dist = 0;
+	int			i;
 
 	ubc = vp->v_ubcinfo;
 
-        if ((rap = ubc->cl_rahead) == NULL) {
-	        MALLOC_ZONE(rap, struct cl_readahead *, sizeof *rap, M_CLRDAHEAD, M_WAITOK);
+        if ((rasp = ubc->cl_rahead) == NULL) {
+	        MALLOC_ZONE(rasp, struct cl_readahead_set *, sizeof *rasp, M_CLRDAHEAD, M_WAITOK);
 
-		bzero(rap, sizeof *rap);
-		rap->cl_lastr = -1;
-		lck_mtx_init(&rap->cl_lockr, cl_mtx_grp, cl_mtx_attr);
+		bzero(rasp, sizeof *rasp);
+		lck_mtx_init(&rasp->cl_lockset, cl_mtx_grp, cl_mtx_attr);
 
+		for (i = 0; i < CL_RA_STREAMS; i++) {
+			rap = &rasp->cl_streams[i];
+			rap->cl_lastr = -1;
+			rap->cl_lastb = -1;
+			rap->cl_strra = -1;
+			lck_mtx_init(&rap->cl_lockr, cl_mtx_grp, cl_mtx_attr);
+		}
 		vnode_lock(vp);
 		
 		if (ubc->cl_rahead == NULL)
-		        ubc->cl_rahead = rap;
+		        ubc->cl_rahead = rasp;
 		else {
-		        lck_mtx_destroy(&rap->cl_lockr, cl_mtx_grp);
-		        FREE_ZONE((void *)rap, sizeof *rap, M_CLRDAHEAD);
-			rap = ubc->cl_rahead;
+			for (i = 0; i < CL_RA_STREAMS; i++)
+				lck_mtx_destroy(&rasp->cl_streams[i].cl_lockr, cl_mtx_grp);
+		        lck_mtx_destroy(&rasp->cl_lockset, cl_mtx_grp);
+		        FREE_ZONE((void *)rasp, sizeof *rasp, M_CLRDAHEAD);
+			rasp = ubc->cl_rahead;
 		}
 		vnode_unlock(vp);
 	}
-	if (lck_mtx_try_lock(&rap->cl_lockr) == TRUE)
-	        return(rap);
-	
-	return ((struct cl_readahead *)NULL);
+	lck_mtx_lock_spin(&rasp->cl_lockset);
+
+	for (i = 0; i < cluster_ra_streams && i < CL_RA_STREAMS; i++) {
+		rap = &rasp->cl_streams[i];
+
+		if (rap->cl_lastr == -1) {
+			if (lru == NULL || lru->cl_lastr != -1)
+				lru = rap;
+			continue;
+		}
+		if ((b_addr >= rap->cl_lastr && b_addr <= MAX(rap->cl_lastr, rap->cl_maxra) + 1) ||
+		    (rap->cl_stride && b_addr == rap->cl_lastb + rap->cl_stride)) {
+			match = rap;
+			break;
+		}
+		if (b_addr > rap->cl_lastb && (b_addr - rap->cl_lastb) <= cluster_ra_stride_max &&
+		    (near == NULL || (b_addr - rap->cl_lastb) < near_dist)) {
+			near = rap;
+			near_dist = b_addr - rap->cl_lastb;
+		}
+		if (lru == NULL || (lru->cl_lastr != -1 && rap->cl_lastuse < lru->cl_lastuse))
+			lru = rap;
+	}
+	if (match == NULL)
+		match = near;
+
+	if (match != NULL) {
+		if (lck_mtx_try_lock(&match->cl_lockr) == FALSE)
+			match = NULL;
+	} else if (lru != NULL && lck_mtx_try_lock(&lru->cl_lockr) == TRUE) {
+		/*
+		 * a new stream... recycle the least recently used one
+		 */
+		if (lru->cl_lastr != -1)
+			OSIncrementAtomic64(&cluster_ra_recycled);
+		cluster_ra_stream_reset(lru);
+		match = lru;
+	}
+	if (match != NULL)
+		match->cl_lastuse = ++rasp->cl_clock;
+
+	lck_mtx_unlock(&rasp->cl_lockset);
+
+	return (match);
 }
 
 
@@ -1206,6 +1320,9 @@ cluster_io(vnode_t vp, upl_t upl, vm_offset_t upl_offset, off_t f_offset, int no
 					scale += MAX_CLUSTERS;
 				
 			        async_throttle = min(IO_SCALE(vp, VNODE_ASYNC_THROTTLE), ((scale * max_cluster_size) / max_cluster) - 1);
+
+				if ((flags & CL_PUSHBATCH) && async_throttle < (int)cluster_push_depth)
+				        async_throttle = cluster_push_depth;
 			}
 		}
 	}
@@ -1922,6 +2039,106 @@ cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, in
 
 
 
+/*
+ * credit the read ahead with the pages of this read it had already
+ * prefetched... a stream that keeps being read all the way into its
+ * prefetch earns back the window it lost by wasting one earlier
+ */
+static void
+cluster_ra_account(struct cl_readahead *rap, struct cl_extent *extent, u_int max_prefetch)
+{
+	daddr64_t	first;
+	daddr64_t	last;
+
+	if (rap->cl_lastr == -1)
+		return;
+
+	if (rap->cl_stride && extent->b_addr == rap->cl_lastb + rap->cl_stride) {
+		if (rap->cl_strra >= extent->b_addr)
+			OSAddAtomic64((extent->e_addr + 1) - extent->b_addr, &cluster_ra_hits);
+		return;
+	}
+	if (rap->cl_ralen == 0 || (extent->b_addr != rap->cl_lastr && extent->b_addr != rap->cl_lastr + 1))
+		return;
+
+	first = MAX(extent->b_addr, rap->cl_lastr + 1);
+	last = MIN(extent->e_addr, rap->cl_maxra);
+
+	if (last >= first) {
+		OSAddAtomic64((last + 1) - first, &cluster_ra_hits);
+
+		if (rap->cl_ramax && last == extent->e_addr) {
+			if ((u_int)(rap->cl_ramax << 1) >= max_prefetch / PAGE_SIZE)
+				rap->cl_ramax = 0;
+			else
+				rap->cl_ramax <<= 1;
+		}
+	}
+}
+
+
+/*
+ * a read that doesn't continue its stream sequentially may still be
+ * part of a strided pattern... once two consecutive reads are the same
+ * distance apart, prefetch the next reads of the pattern, ramping up
+ * the number of strides covered the way the sequential read ahead
+ * ramps up its length.  returns 0 if the read isn't strided
+ */
+static int
+cluster_read_ahead_stride(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *rap, u_int ra_max,
+			  int (*callback)(buf_t, void *), void *callback_arg, int bflag)
+{
+	daddr64_t	stride;
+	daddr64_t	read_size;
+	daddr64_t	next;
+	daddr64_t	last;
+	off_t		f_offset;
+	int		nstrides;
+	int		size_of_prefetch;
+
+	if (rap->cl_lastb == -1 || extent->b_addr <= rap->cl_lastb) {
+		rap->cl_stride = 0;
+		return (0);
+	}
+	stride = extent->b_addr - rap->cl_lastb;
+	read_size = (extent->e_addr + 1) - extent->b_addr;
+
+	if (stride != rap->cl_stride || stride <= read_size || stride > cluster_ra_stride_max || read_size > ra_max) {
+		/*
+		 * remember the distance... if the next read is
+		 * the same distance away, the stream is strided
+		 */
+		rap->cl_stride = (stride > read_size && stride <= cluster_ra_stride_max) ? stride : 0;
+		rap->cl_strra = -1;
+		return (0);
+	}
+	nstrides = rap->cl_ralen ? (rap->cl_ralen << 1) : 1;
+
+	if (nstrides * read_size > ra_max)
+		nstrides = (int)(ra_max / read_size);
+	rap->cl_ralen = nstrides;
+
+	next = extent->b_addr + stride;
+	if (rap->cl_strra >= next)
+		next = rap->cl_strra + stride;
+	last = extent->b_addr + (nstrides * stride);
+
+	for ( ; next <= last; next += stride) {
+		f_offset = (off_t)(next * PAGE_SIZE_64);
+
+		if (f_offset >= filesize)
+			break;
+		size_of_prefetch = cluster_read_prefetch(vp, f_offset, (int)(read_size * PAGE_SIZE), filesize, callback, callback_arg, bflag);
+
+		if (size_of_prefetch == 0)
+			break;
+		OSAddAtomic64(size_of_prefetch, &cluster_ra_strided);
+		rap->cl_strra = next;
+	}
+	return (1);
+}
+
+
 static void
 cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *rap, int (*callback)(buf_t, void *), void *callback_arg,
 		   int bflag)
@@ -1930,6 +2147,7 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 	off_t		f_offset;
 	int		size_of_prefetch;
 	u_int		max_prefetch;
+	u_int		ra_max;
 
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_START,
@@ -1940,8 +2158,35 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 0, 0);
 		return;
 	}
+	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), (vp->v_mount->mnt_kern_flag & MNTK_SSD));
+
+	if (max_prefetch > speculative_prefetch_max)
+		max_prefetch = speculative_prefetch_max;
+
+	/*
+	 * the window can't grow past the cap this stream earned
+	 * by wasting what was prefetched for it before
+	 */
+	ra_max = max_prefetch / PAGE_SIZE;
+
+	if (rap->cl_ramax && (u_int)rap->cl_ramax < ra_max)
+		ra_max = rap->cl_ramax;
+
 	if (rap->cl_lastr == -1 || (extent->b_addr != rap->cl_lastr && extent->b_addr != (rap->cl_lastr + 1))) {
-	        rap->cl_ralen = 0;
+		if (rap->cl_lastr != -1 && rap->cl_maxra > rap->cl_lastr) {
+			/*
+			 * the stream moved away from what was prefetched
+			 * for it... if most of the last prefetch went
+			 * unread, stop the window from growing that large
+			 */
+			OSAddAtomic64(rap->cl_maxra - rap->cl_lastr, &cluster_ra_wasted);
+
+			if (rap->cl_ralen >= 8 && (rap->cl_maxra - rap->cl_lastr) > (rap->cl_ralen / 2))
+				rap->cl_ramax = rap->cl_ralen / 2;
+		}
+		if (max_prefetch <= PAGE_SIZE ||
+		    cluster_read_ahead_stride(vp, extent, filesize, rap, ra_max, callback, callback_arg, bflag) == 0)
+			rap->cl_ralen = 0;
 		rap->cl_maxra = 0;
 
 		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
@@ -1949,11 +2194,6 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 
 		return;
 	}
-	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), (vp->v_mount->mnt_kern_flag & MNTK_SSD));
-
-	if (max_prefetch > speculative_prefetch_max)
-		max_prefetch = speculative_prefetch_max;
-
 	if (max_prefetch <= PAGE_SIZE) {
 		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
 			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 6, 0);
@@ -1981,8 +2221,15 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 	}
 	if (f_offset < filesize) {
 	        daddr64_t read_size;
+		int	  shift;
 
-	        rap->cl_ralen = rap->cl_ralen ? min(max_prefetch / PAGE_SIZE, rap->cl_ralen << 1) : 1;
+		/*
+		 * when the device is slow to satisfy the reads that
+		 * miss, ramp up faster so the window covers its latency
+		 */
+		shift = (rap->cl_rdlat > cluster_ra_slow_usecs) ? 2 : 1;
+
+	        rap->cl_ralen = rap->cl_ralen ? min(ra_max, rap->cl_ralen << shift) : 1;
 
 		read_size = (extent->e_addr + 1) - extent->b_addr;
 
@@ -3592,7 +3839,7 @@ issue_io:
 			 * cluster_push_now to wait until all the I/Os have completed... cluster_push_now is also
 			 * responsible for generating the correct sized I/O(s)
 			 */
-			retval = cluster_push_now(vp, &cl, newEOF, flags, callback, callback_arg);
+			retval = cluster_push_now(vp, &cl, newEOF, flags, 0, callback, callback_arg);
 		}
 	}
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 40)) | DBG_FUNC_END, retval, 0, io_resid, 0, 0);
@@ -3730,6 +3977,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 	int		 take_reference = 1;
 	int		 policy = IOPOL_DEFAULT;
 	boolean_t	 iolock_inited = FALSE;
+	uint64_t	 demand_start = 0;
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 32)) | DBG_FUNC_START,
 		     (int)uio->uio_offset, io_req_size, (int)filesize, flags, 0);
@@ -3777,12 +4025,16 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 			prefetch_enabled = 0;
 
 			max_rd_size = THROTTLE_MAX_IOSIZE;
+
+			OSIncrementAtomic64(&cluster_ra_throttled);
 		}
-	        if ((rap = cluster_get_rap(vp)) == NULL)
+	        if ((rap = cluster_get_rap(vp, uio->uio_offset / PAGE_SIZE_64)) == NULL)
 		        rd_ahead_enabled = 0;
 		else {
 			extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
 			extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
+
+			cluster_ra_account(rap, &extent, max_prefetch);
 		}
 	}
 	if (rap != NULL && rap->cl_ralen && (rap->cl_lastr == extent.b_addr || (rap->cl_lastr + 1) == extent.b_addr)) {
@@ -3886,6 +4138,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 				        if (extent.e_addr < rap->cl_lastr)
 					        rap->cl_maxra = 0;
 					rap->cl_lastr = extent.e_addr;
+					rap->cl_lastb = extent.b_addr;
 				}
 			        break;
 			}
@@ -4007,6 +4260,8 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 			/*
 			 * issue an asynchronous read to cluster_io
 			 */
+			if (rap)
+				demand_start = mach_absolute_time();
 
 			error = cluster_io(vp, upl, upl_offset, upl_f_offset + upl_offset,
 					   io_size, CL_READ | CL_ASYNC | bflag, (buf_t)NULL, &iostate, callback, callback_arg);
@@ -4098,11 +4353,25 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 				        if (extent.e_addr < rap->cl_lastr)
 					        rap->cl_maxra = 0;
 					rap->cl_lastr = extent.e_addr;
+					rap->cl_lastb = extent.b_addr;
 				}
 			}
 			if (iolock_inited == TRUE)
 				cluster_iostate_wait(&iostate, 0, "cluster_read_copy");
 
+			if (rap && start_pg < last_pg) {
+				/*
+				 * track how long this stream waits on the
+				 * device when the read ahead didn't cover it
+				 */
+				uint64_t	demand_ns;
+				uint32_t	demand_usecs;
+
+				absolutetime_to_nanoseconds(mach_absolute_time() - demand_start, &demand_ns);
+				demand_usecs = (uint32_t)MIN(demand_ns / NSEC_PER_USEC, UINT32_MAX);
+
+				rap->cl_rdlat = rap->cl_rdlat ? ((rap->cl_rdlat * 3) + demand_usecs) / 4 : demand_usecs;
+			}
 			if (iostate.io_error)
 			        error = iostate.io_error;
 			else {
@@ -4185,6 +4454,8 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 			        rd_ahead_enabled = 0;
 				prefetch_enabled = 0;
 				max_rd_size = THROTTLE_MAX_IOSIZE;
+
+				OSIncrementAtomic64(&cluster_ra_throttled);
 			} else {
 			        if (max_rd_size == THROTTLE_MAX_IOSIZE) {
 				        /*
@@ -5441,7 +5712,8 @@ __private_extern__ void
 cluster_release(struct ubc_info *ubc)
 {
         struct cl_writebehind *wbp;
-	struct cl_readahead   *rap;
+	struct cl_readahead_set *rasp;
+	int	i;
 
 	if ((wbp = ubc->cl_wbehind)) {
 
@@ -5453,20 +5725,20 @@ cluster_release(struct ubc_info *ubc)
 	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 81)) | DBG_FUNC_START, ubc, 0, 0, 0, 0);
 	}
 
-	rap = ubc->cl_rahead;
-
 	if (wbp != NULL) {
 	        lck_mtx_destroy(&wbp->cl_lockw, cl_mtx_grp);
 	        FREE_ZONE((void *)wbp, sizeof *wbp, M_CLWRBEHIND);
 	}
-	if ((rap = ubc->cl_rahead)) {
-	        lck_mtx_destroy(&rap->cl_lockr, cl_mtx_grp);
-	        FREE_ZONE((void *)rap, sizeof *rap, M_CLRDAHEAD);
+	if ((rasp = ubc->cl_rahead)) {
+		for (i = 0; i < CL_RA_STREAMS; i++)
+		        lck_mtx_destroy(&rasp->cl_streams[i].cl_lockr, cl_mtx_grp);
+	        lck_mtx_destroy(&rasp->cl_lockset, cl_mtx_grp);
+	        FREE_ZONE((void *)rasp, sizeof *rasp, M_CLRDAHEAD);
 	}
 	ubc->cl_rahead  = NULL;
 	ubc->cl_wbehind = NULL;
 
-	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 81)) | DBG_FUNC_END, ubc, rap, wbp, 0, 0);
+	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 81)) | DBG_FUNC_END, ubc, rasp, wbp, 0, 0);
 }
 
 
@@ -5552,6 +5824,9 @@ cluster_try_push(struct cl_writebehind *wbp, vnode_t vp, off_t EOF, int push_fla
 		                goto dont_try;
 		}
 	}
+	if (push_flag & PUSH_ALL)
+	        OSIncrementAtomic64(&cluster_push_batches);
+
 	for (cl_index = 0; cl_index < cl_len; cl_index++) {
 	        int	flags;
 		struct	cl_extent cl;
@@ -5568,25 +5843,53 @@ cluster_try_push(struct cl_writebehind *wbp, vnode_t vp, off_t EOF, int push_fla
 		if (l_clusters[cl_index].io_flags & CLW_IOPASSIVE)
 		        flags |= IO_PASSIVE;
 
-		if (push_flag & PUSH_SYNC)
+		/*
+		 * when pushing everything synchronously, issue the whole
+		 * batch asynchronously and wait for it once at the end
+		 */
+		if ((push_flag & (PUSH_SYNC | PUSH_ALL)) == PUSH_SYNC)
 		        flags |= IO_SYNC;
 
 		cl.b_addr = l_clusters[cl_index].b_addr;
 		cl.e_addr = l_clusters[cl_index].e_addr;
 
-		retval = cluster_push_now(vp, &cl, EOF, flags, callback, callback_arg);
-
-		if (error == 0 && retval)
-			error = retval;
-
 		l_clusters[cl_index].b_addr = 0;
 		l_clusters[cl_index].e_addr = 0;
 
 		cl_pushed++;
 
+		if (push_flag & PUSH_ALL) {
+		        /*
+			 * the clusters are sorted... fold any that pick up where
+			 * this one leaves off into the same push
+			 */
+		        while (cl_index + 1 < cl_len &&
+			       l_clusters[cl_index + 1].b_addr == cl.e_addr &&
+			       l_clusters[cl_index + 1].io_flags == l_clusters[cl_index].io_flags &&
+			       (l_clusters[cl_index + 1].e_addr - cl.b_addr) <= max_cluster_pgcount) {
+
+			        cl_index++;
+				cl.e_addr = l_clusters[cl_index].e_addr;
+
+				l_clusters[cl_index].b_addr = 0;
+				l_clusters[cl_index].e_addr = 0;
+
+				cl_pushed++;
+				OSIncrementAtomic64(&cluster_push_merged);
+			}
+			OSIncrementAtomic64(&cluster_push_extents);
+		}
+		retval = cluster_push_now(vp, &cl, EOF, flags, push_flag, callback, callback_arg);
+
+		if (error == 0 && retval)
+			error = retval;
+
 		if ( !(push_flag & PUSH_ALL) )
 		        break;
 	}
+	if ((push_flag & (PUSH_SYNC | PUSH_ALL)) == (PUSH_SYNC | PUSH_ALL))
+	        (void)vnode_waitforwrites(vp, 0, 0, 0, "cluster_try_push");
+
 	if (err)
 		*err = error;
 
@@ -5656,7 +5959,7 @@ dont_try:
 
 
 static int
-cluster_push_now(vnode_t vp, struct cl_extent *cl, off_t EOF, int flags, int (*callback)(buf_t, void *), void *callback_arg)
+cluster_push_now(vnode_t vp, struct cl_extent *cl, off_t EOF, int flags, int push_flag, int (*callback)(buf_t, void *), void *callback_arg)
 {
 	upl_page_info_t *pl;
 	upl_t            upl;
@@ -5683,6 +5986,9 @@ cluster_push_now(vnode_t vp, struct cl_extent *cl, off_t EOF, int flags, int (*c
 	if (flags & IO_SKIP_ENCRYPTION)
 		bflag |= CL_ENCRYPTED;
 
+	if (push_flag & PUSH_ALL)
+		bflag |= CL_PUSHBATCH;
+
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 51)) | DBG_FUNC_START,
 		     (int)cl->b_addr, (int)cl->e_addr, (int)EOF, flags, 0);
 
@@ -5875,8 +6181,12 @@ sparse_cluster_push(void **scmap, vnode_t vp, off_t EOF, int push_flag, int io_f
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 79)) | DBG_FUNC_START, kdebug_vnode(vp), (*scmap), 0, push_flag, 0);
 
 	if (push_flag & PUSH_ALL)
-	        vfs_drt_control(scmap, 1);
+	        OSIncrementAtomic64(&cluster_push_batches);
 
+	/*
+	 * the map hands back its extents in file order, so a PUSH_ALL
+	 * issues the writes sorted by offset
+	 */
 	for (;;) {
 		int retval;
 	        if (vfs_drt_get_cluster(scmap, &offset, &length) != KERN_SUCCESS)
@@ -5885,7 +6195,10 @@ sparse_cluster_push(void **scmap, vnode_t vp, off_t EOF, int push_flag, int io_f
 		cl.b_addr = (daddr64_t)(offset / PAGE_SIZE_64);
 		cl.e_addr = (daddr64_t)((offset + length) / PAGE_SIZE_64);
 
-		retval = cluster_push_now(vp, &cl, EOF, io_flags & (IO_PASSIVE|IO_CLOSE), callback, callback_arg);
+		if (push_flag & PUSH_ALL)
+		        OSIncrementAtomic64(&cluster_push_extents);
+
+		retval = cluster_push_now(vp, &cl, EOF, io_flags & (IO_PASSIVE|IO_CLOSE), push_flag, callback, callback_arg);
 		if (error == 0 && retval)
 			error = retval;
 
@@ -6203,155 +6516,71 @@ is_file_clean(vnode_t vp, off_t filesize)
  *
  * The implementation assumes that the dirty regions are pages.
  *
- * To represent dirty pages within the file, we store bit vectors in a
- * variable-size circular hash.
- */
-
-/*
- * Bitvector size.  This determines the number of pages we group in a
- * single hashtable entry.  Each hashtable entry is aligned to this
- * size within the file.
- */
-#define DRT_BITVECTOR_PAGES		((1024 * 1024) / PAGE_SIZE)
-
-/*
- * File offset handling.
+ * To represent dirty pages within the file, we store a sorted array of
+ * extents, each packed into 64 bits.  Scattered dirty pages cost 8 bytes
+ * per run rather than a bitvector per megabyte of file, and clusters come
+ * back out in file order.
  *
-  * DRT_ADDRESS_MASK is dependent on DRT_BITVECTOR_PAGES;
- * the correct formula is  (~((DRT_BITVECTOR_PAGES * PAGE_SIZE) - 1))
+ * An extent may also cover pages that are clean.  When the map is full,
+ * the two extents closest together are coalesced to make room instead of
+ * forcing a push; cluster_push_now only writes the pages that are dirty.
  */
-#define DRT_ADDRESS_MASK		(~((DRT_BITVECTOR_PAGES * PAGE_SIZE) - 1))
-#define DRT_ALIGN_ADDRESS(addr)		((addr) & DRT_ADDRESS_MASK)
 
 /*
- * Hashtable address field handling.
- *
- * The low-order bits of the hashtable address are used to conserve
- * space.
- *
- * DRT_HASH_COUNT_MASK must be large enough to store the range
- * 0-DRT_BITVECTOR_PAGES inclusive, as well as have one value
- * to indicate that the bucket is actually unoccupied.
+ * Extent packing.  The low DRT_EXTENT_COUNT_BITS hold the number of pages
+ * in the extent, the rest hold the index of its first page in the file.
  */
-#define DRT_HASH_GET_ADDRESS(scm, i)	((scm)->scm_hashtable[(i)].dhe_control & DRT_ADDRESS_MASK)
-#define DRT_HASH_SET_ADDRESS(scm, i, a)									\
-	do {												\
-		(scm)->scm_hashtable[(i)].dhe_control =							\
-		    ((scm)->scm_hashtable[(i)].dhe_control & ~DRT_ADDRESS_MASK) | DRT_ALIGN_ADDRESS(a);	\
-	} while (0)
-#define DRT_HASH_COUNT_MASK		0x1ff
-#define DRT_HASH_GET_COUNT(scm, i)	((scm)->scm_hashtable[(i)].dhe_control & DRT_HASH_COUNT_MASK)
-#define DRT_HASH_SET_COUNT(scm, i, c)											\
-	do {														\
-		(scm)->scm_hashtable[(i)].dhe_control =									\
-		    ((scm)->scm_hashtable[(i)].dhe_control & ~DRT_HASH_COUNT_MASK) | ((c) & DRT_HASH_COUNT_MASK);	\
-	} while (0)
-#define DRT_HASH_CLEAR(scm, i)                                                                                          \
-	do {														\
-		(scm)->scm_hashtable[(i)].dhe_control =	0;								\
-	} while (0)
-#define DRT_HASH_VACATE(scm, i)		DRT_HASH_SET_COUNT((scm), (i), DRT_HASH_COUNT_MASK)
-#define DRT_HASH_VACANT(scm, i)		(DRT_HASH_GET_COUNT((scm), (i)) == DRT_HASH_COUNT_MASK)
-#define DRT_HASH_COPY(oscm, oi, scm, i)									\
-	do {												\
-		(scm)->scm_hashtable[(i)].dhe_control = (oscm)->scm_hashtable[(oi)].dhe_control;	\
-		DRT_BITVECTOR_COPY(oscm, oi, scm, i);							\
-	} while(0);
-
+#define DRT_EXTENT_COUNT_BITS		20
+#define DRT_EXTENT_COUNT_MAX		((1ULL << DRT_EXTENT_COUNT_BITS) - 1)
+#define DRT_EXTENT(page, count)		(((u_int64_t)(page) << DRT_EXTENT_COUNT_BITS) | (u_int64_t)(count))
+#define DRT_EXTENT_PAGE(e)		((e) >> DRT_EXTENT_COUNT_BITS)
+#define DRT_EXTENT_COUNT(e)		((e) & DRT_EXTENT_COUNT_MAX)
+#define DRT_EXTENT_END(e)		(DRT_EXTENT_PAGE(e) + DRT_EXTENT_COUNT(e))
 
 /*
- * Hash table moduli.
- *
- * Since the hashtable entry's size is dependent on the size of
- * the bitvector, and since the hashtable size is constrained to
- * both being prime and fitting within the desired allocation
- * size, these values need to be manually determined.
- *
- * For DRT_BITVECTOR_SIZE = 256, the entry size is 40 bytes.
- *
- * The small hashtable allocation is 1024 bytes, so the modulus is 23.
- * The large hashtable allocation is 16384 bytes, so the modulus is 401.
+ * Largest cluster returned by vfs_drt_get_cluster, in pages.
  */
-#define DRT_HASH_SMALL_MODULUS	23
-#define DRT_HASH_LARGE_MODULUS	401
+#define DRT_CLUSTER_PAGES		((1024 * 1024) / PAGE_SIZE)
 
 /*
- * Physical memory required before the large hash modulus is permitted.
- *
- * On small memory systems, the large hash modulus can lead to phsyical
- * memory starvation, so we avoid using it there.
+ * Extents at most this many pages apart may be coalesced to make room.
  */
-#define DRT_HASH_LARGE_MEMORY_REQUIRED	(1024LL * 1024LL * 1024LL)	/* 1GiB */
-
-#define DRT_SMALL_ALLOCATION	1024	/* 104 bytes spare */
-#define DRT_LARGE_ALLOCATION	16384	/* 344 bytes spare */
-
-/* *** nothing below here has secret dependencies on DRT_BITVECTOR_PAGES *** */
+#define DRT_COALESCE_PAGES		16
 
 /*
- * Hashtable bitvector handling.
+ * Physical memory required before the large map is permitted.
  *
- * Bitvector fields are 32 bits long.
+ * On small memory systems, the large map can lead to phsyical
+ * memory starvation, so we avoid using it there.
  */
+#define DRT_LARGE_MEMORY_REQUIRED	(1024LL * 1024LL * 1024LL)	/* 1GiB */
 
-#define DRT_HASH_SET_BIT(scm, i, bit)				\
-	(scm)->scm_hashtable[(i)].dhe_bitvector[(bit) / 32] |= (1 << ((bit) % 32))
-
-#define DRT_HASH_CLEAR_BIT(scm, i, bit)				\
-	(scm)->scm_hashtable[(i)].dhe_bitvector[(bit) / 32] &= ~(1 << ((bit) % 32))
-    
-#define DRT_HASH_TEST_BIT(scm, i, bit) 				\
-	((scm)->scm_hashtable[(i)].dhe_bitvector[(bit) / 32] & (1 << ((bit) % 32)))
-    
-#define DRT_BITVECTOR_CLEAR(scm, i) 				\
-	bzero(&(scm)->scm_hashtable[(i)].dhe_bitvector[0], (DRT_BITVECTOR_PAGES / 32) * sizeof(u_int32_t))
-
-#define DRT_BITVECTOR_COPY(oscm, oi, scm, i)			\
-	bcopy(&(oscm)->scm_hashtable[(oi)].dhe_bitvector[0],	\
-	    &(scm)->scm_hashtable[(i)].dhe_bitvector[0],	\
-	    (DRT_BITVECTOR_PAGES / 32) * sizeof(u_int32_t))
-
-
- 
-/*
- * Hashtable entry.
- */
-struct vfs_drt_hashentry {
-	u_int64_t	dhe_control;
-/*
-* dhe_bitvector was declared as dhe_bitvector[DRT_BITVECTOR_PAGES / 32];
-* DRT_BITVECTOR_PAGES is defined as ((1024 * 1024) / PAGE_SIZE)
-* Since PAGE_SIZE is only known at boot time, 
-*	-define MAX_DRT_BITVECTOR_PAGES for smallest supported page size (4k) 
-*	-declare dhe_bitvector array for largest possible length
-*/
-#define MAX_DRT_BITVECTOR_PAGES (1024 * 1024)/( 4 * 1024)
-	u_int32_t	dhe_bitvector[MAX_DRT_BITVECTOR_PAGES/32];
-};
+#define DRT_SMALL_ALLOCATION	1024	/* 125 extents */
+#define DRT_LARGE_ALLOCATION	16384	/* 2045 extents */
 
 /*
  * Dirty Region Tracking structure.
  *
- * The hashtable is allocated entirely inside the DRT structure.
- *
- * The hash is a simple circular prime modulus arrangement, the structure
- * is resized from small to large if it overflows.
+ * The extent array is allocated entirely inside the DRT structure.  The
+ * live extents are scm_extents[scm_first] through
+ * scm_extents[scm_first + scm_count - 1], sorted by page and never
+ * overlapping or touching.  The structure is resized from small to large
+ * if it overflows.
  */
 
 struct vfs_drt_clustermap {
 	u_int32_t		scm_magic;	/* sanity/detection */
-#define DRT_SCM_MAGIC		0x12020003
-	u_int32_t		scm_modulus;	/* current ring size */
-	u_int32_t		scm_buckets;	/* number of occupied buckets */
-	u_int32_t		scm_lastclean;	/* last entry we cleaned */
-	u_int32_t		scm_iskips;	/* number of slot skips */
-
-	struct vfs_drt_hashentry scm_hashtable[0];
+#define DRT_SCM_MAGIC		0x12020004
+	u_int32_t		scm_size;	/* allocation size */
+	u_int32_t		scm_max;	/* number of extent slots */
+	u_int32_t		scm_first;	/* slot of the lowest extent */
+	u_int32_t		scm_count;	/* number of live extents */
+	u_int32_t		scm_coalesced;	/* extents coalesced to make room */
+
+	u_int64_t		scm_extents[0];
 };
 
-
-#define DRT_HASH(scm, addr)		((addr) % (scm)->scm_modulus)
-#define DRT_HASH_NEXT(scm, addr)	(((addr) + 1) % (scm)->scm_modulus)
+#define DRT_MAP_EXTENTS(size)	(((size) - sizeof(struct vfs_drt_clustermap)) / sizeof(u_int64_t))
 
 /*
  * Debugging codes and arguments.
@@ -6359,32 +6588,21 @@ struct vfs_drt_clustermap {
 #define DRT_DEBUG_EMPTYFREE	(FSDBG_CODE(DBG_FSRW, 82)) /* nil */
 #define DRT_DEBUG_RETCLUSTER	(FSDBG_CODE(DBG_FSRW, 83)) /* offset, length */
 #define DRT_DEBUG_ALLOC		(FSDBG_CODE(DBG_FSRW, 84)) /* copycount */
-#define DRT_DEBUG_INSERT	(FSDBG_CODE(DBG_FSRW, 85)) /* offset, iskip */
+#define DRT_DEBUG_INSERT	(FSDBG_CODE(DBG_FSRW, 85)) /* offset, slot */
 #define DRT_DEBUG_MARK		(FSDBG_CODE(DBG_FSRW, 86)) /* offset, length,
 							    * dirty */
 							   /* 0, setcount */
-							   /* 1 (clean, no map) */
 							   /* 2 (map alloc fail) */
-							   /* 3, resid (partial) */
+							   /* 3 (map full) */
 #define DRT_DEBUG_6		(FSDBG_CODE(DBG_FSRW, 87))
-#define DRT_DEBUG_SCMDATA	(FSDBG_CODE(DBG_FSRW, 88)) /* modulus, buckets,
-							    * lastclean, iskips */
+#define DRT_DEBUG_SCMDATA	(FSDBG_CODE(DBG_FSRW, 88)) /* size, count,
+							    * first, coalesced */
 
 
 static kern_return_t	vfs_drt_alloc_map(struct vfs_drt_clustermap **cmapp);
 static kern_return_t	vfs_drt_free_map(struct vfs_drt_clustermap *cmap);
-static kern_return_t	vfs_drt_search_index(struct vfs_drt_clustermap *cmap,
-	u_int64_t offset, int *indexp);
-static kern_return_t	vfs_drt_get_index(struct vfs_drt_clustermap **cmapp,
-	u_int64_t offset,
-	int *indexp,
-	int recursed);
-static kern_return_t	vfs_drt_do_mark_pages(
-	void		**cmapp,
-	u_int64_t	offset,
-	u_int    	length,
-	u_int		*setcountp,
-	int		dirty);
+static u_int32_t	vfs_drt_search(struct vfs_drt_clustermap *cmap, u_int64_t page);
+static kern_return_t	vfs_drt_coalesce(struct vfs_drt_clustermap *cmap);
 static void		vfs_drt_trace(
 	struct vfs_drt_clustermap *cmap,
 	int code,
@@ -6397,111 +6615,54 @@ static void		vfs_drt_trace(
 /*
  * Allocate and initialise a sparse cluster map.
  *
- * Will allocate a new map, resize or compact an existing map.
- *
- * XXX we should probably have at least one intermediate map size,
- * as the 1:16 ratio seems a bit drastic.
+ * Will allocate a new map or grow an existing small map to the large
+ * size.  Fails if the existing map can't grow any further.
  */
 static kern_return_t
 vfs_drt_alloc_map(struct vfs_drt_clustermap **cmapp)
 {
 	struct vfs_drt_clustermap *cmap, *ocmap;
 	kern_return_t	kret;
-	u_int64_t	offset;
-	u_int32_t	i;
-	int		nsize, active_buckets, index, copycount;
+	u_int32_t	nsize;
+
+	ocmap = *cmapp;
 
-	ocmap = NULL;
-	if (cmapp != NULL)
-		ocmap = *cmapp;
-	
 	/*
 	 * Decide on the size of the new map.
 	 */
-	if (ocmap == NULL) {
-		nsize = DRT_HASH_SMALL_MODULUS;
-	} else {
-		/* count the number of active buckets in the old map */
-		active_buckets = 0;
-		for (i = 0; i < ocmap->scm_modulus; i++) {
-			if (!DRT_HASH_VACANT(ocmap, i) &&
-			    (DRT_HASH_GET_COUNT(ocmap, i) != 0))
-				active_buckets++;
-		}
-		/*
-		 * If we're currently using the small allocation, check to
-		 * see whether we should grow to the large one.
-		 */
-		if (ocmap->scm_modulus == DRT_HASH_SMALL_MODULUS) {
-			/* 
-			 * If the ring is nearly full and we are allowed to
-			 * use the large modulus, upgrade.
-			 */
-			if ((active_buckets > (DRT_HASH_SMALL_MODULUS - 5)) &&
-			    (max_mem >= DRT_HASH_LARGE_MEMORY_REQUIRED)) {
-				nsize = DRT_HASH_LARGE_MODULUS;
-			} else {
-				nsize = DRT_HASH_SMALL_MODULUS;
-			}
-		} else {
-			/* already using the large modulus */
-			nsize = DRT_HASH_LARGE_MODULUS;
-			/*
-			 * If the ring is completely full, there's
-			 * nothing useful for us to do.  Behave as
-			 * though we had compacted into the new
-			 * array and return.
-			 */
-			if (active_buckets >= DRT_HASH_LARGE_MODULUS)
-				return(KERN_SUCCESS);
-		}
-	}
+	if (ocmap == NULL)
+		nsize = DRT_SMALL_ALLOCATION;
+	else if ((ocmap->scm_size == DRT_SMALL_ALLOCATION) &&
+		 (max_mem >= DRT_LARGE_MEMORY_REQUIRED))
+		nsize = DRT_LARGE_ALLOCATION;
+	else
+		return(KERN_FAILURE);
 
 	/*
 	 * Allocate and initialise the new map.
 	 */
-
-	kret = kmem_alloc(kernel_map, (vm_offset_t *)&cmap,
-	    (nsize == DRT_HASH_SMALL_MODULUS) ? DRT_SMALL_ALLOCATION : DRT_LARGE_ALLOCATION, VM_KERN_MEMORY_FILE);
+	kret = kmem_alloc(kernel_map, (vm_offset_t *)&cmap, nsize, VM_KERN_MEMORY_FILE);
 	if (kret != KERN_SUCCESS)
 		return(kret);
 	cmap->scm_magic = DRT_SCM_MAGIC;
-	cmap->scm_modulus = nsize;
-	cmap->scm_buckets = 0;
-	cmap->scm_lastclean = 0;
-	cmap->scm_iskips = 0;
-	for (i = 0; i < cmap->scm_modulus; i++) {
-	        DRT_HASH_CLEAR(cmap, i);
-		DRT_HASH_VACATE(cmap, i);
-		DRT_BITVECTOR_CLEAR(cmap, i);
-	}
+	cmap->scm_size = nsize;
+	cmap->scm_max = DRT_MAP_EXTENTS(nsize);
+	cmap->scm_first = 0;
+	cmap->scm_count = 0;
+	cmap->scm_coalesced = 0;
 
 	/*
-	 * If there's an old map, re-hash entries from it into the new map.
+	 * If there's an old map, copy its extents to the front of the new one.
 	 */
-	copycount = 0;
 	if (ocmap != NULL) {
-		for (i = 0; i < ocmap->scm_modulus; i++) {
-			/* skip empty buckets */
-			if (DRT_HASH_VACANT(ocmap, i) ||
-			    (DRT_HASH_GET_COUNT(ocmap, i) == 0))
-				continue;
-			/* get new index */
-			offset = DRT_HASH_GET_ADDRESS(ocmap, i);
-			kret = vfs_drt_get_index(&cmap, offset, &index, 1);
-			if (kret != KERN_SUCCESS) {
-				/* XXX need to bail out gracefully here */
-				panic("vfs_drt: new cluster map mysteriously too small");
-				index = 0;
-			}
-			/* copy */
-			DRT_HASH_COPY(ocmap, i, cmap, index);
-			copycount++;
-		}
+		bcopy(&ocmap->scm_extents[ocmap->scm_first], &cmap->scm_extents[0],
+		      ocmap->scm_count * sizeof(u_int64_t));
+		cmap->scm_count = ocmap->scm_count;
+		cmap->scm_coalesced = ocmap->scm_coalesced;
 	}
 
 	/* log what we've done */
-	vfs_drt_trace(cmap, DRT_DEBUG_ALLOC, copycount, 0, 0, 0);
+	vfs_drt_trace(cmap, DRT_DEBUG_ALLOC, cmap->scm_count, 0, 0, 0);
 	
 	/*
 	 * It's important to ensure that *cmapp always points to 
@@ -6512,10 +6673,10 @@ vfs_drt_alloc_map(struct vfs_drt_clustermap **cmapp)
 	if (ocmap != NULL) {
 		/* emit stats into trace buffer */
 		vfs_drt_trace(ocmap, DRT_DEBUG_SCMDATA,
-			      ocmap->scm_modulus,
-			      ocmap->scm_buckets,
-			      ocmap->scm_lastclean,
-			      ocmap->scm_iskips);
+			      ocmap->scm_size,
+			      ocmap->scm_count,
+			      ocmap->scm_first,
+			      ocmap->scm_coalesced);
 
 		vfs_drt_free_map(ocmap);
 	}
@@ -6529,248 +6690,196 @@ vfs_drt_alloc_map(struct vfs_drt_clustermap **cmapp)
 static kern_return_t
 vfs_drt_free_map(struct vfs_drt_clustermap *cmap)
 {
-	kmem_free(kernel_map, (vm_offset_t)cmap, 
-		  (cmap->scm_modulus == DRT_HASH_SMALL_MODULUS) ? DRT_SMALL_ALLOCATION : DRT_LARGE_ALLOCATION);
+	kmem_free(kernel_map, (vm_offset_t)cmap, cmap->scm_size);
 	return(KERN_SUCCESS);
 }
 
 
 /*
- * Find the hashtable slot currently occupied by an entry for the supplied offset.
+ * Find the slot of the first extent that ends at or after the supplied
+ * page, i.e. the first one that the page could overlap or extend.
  */
-static kern_return_t
-vfs_drt_search_index(struct vfs_drt_clustermap *cmap, u_int64_t offset, int *indexp)
+static u_int32_t
+vfs_drt_search(struct vfs_drt_clustermap *cmap, u_int64_t page)
 {
-	int		index;
-	u_int32_t	i;
-
-	offset = DRT_ALIGN_ADDRESS(offset);
-	index = DRT_HASH(cmap, offset);
-
-	/* traverse the hashtable */
-	for (i = 0; i < cmap->scm_modulus; i++) {
+	u_int32_t	lo, hi, mid;
 
-		/*
-		 * If the slot is vacant, we can stop.
-		 */
-		if (DRT_HASH_VACANT(cmap, index))
-			break;
+	lo = cmap->scm_first;
+	hi = cmap->scm_first + cmap->scm_count;
 
-		/*
-		 * If the address matches our offset, we have success.
-		 */
-		if (DRT_HASH_GET_ADDRESS(cmap, index) == offset) {
-			*indexp = index;
-			return(KERN_SUCCESS);
-		}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
 
-		/*
-		 * Move to the next slot, try again.
-		 */
-		index = DRT_HASH_NEXT(cmap, index);
+		if (DRT_EXTENT_END(cmap->scm_extents[mid]) < page)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	/*
-	 * It's not there.
-	 */
-	return(KERN_FAILURE);
+	return(lo);
 }
 
 /*
- * Find the hashtable slot for the supplied offset.  If we haven't allocated
- * one yet, allocate one and populate the address field.  Note that it will
- * not have a nonzero page count and thus will still technically be free, so
- * in the case where we are called to clean pages, the slot will remain free.
+ * Make room in a full map by merging the two neighbouring extents with
+ * the smallest gap between them, provided that gap is small.
  */
 static kern_return_t
-vfs_drt_get_index(struct vfs_drt_clustermap **cmapp, u_int64_t offset, int *indexp, int recursed)
+vfs_drt_coalesce(struct vfs_drt_clustermap *cmap)
 {
-	struct vfs_drt_clustermap *cmap;
-	kern_return_t	kret;
-	u_int32_t	index;
-	u_int32_t	i;
+	u_int64_t	*ext;
+	u_int64_t	gap, best_gap;
+	u_int64_t	page;
+	u_int32_t	i, best;
+
+	ext = &cmap->scm_extents[cmap->scm_first];
+	best_gap = DRT_COALESCE_PAGES + 1;
+	best = 0;
+
+	for (i = 0; i + 1 < cmap->scm_count; i++) {
+		gap = DRT_EXTENT_PAGE(ext[i + 1]) - DRT_EXTENT_END(ext[i]);
+
+		if (gap < best_gap &&
+		    (DRT_EXTENT_END(ext[i + 1]) - DRT_EXTENT_PAGE(ext[i])) <= DRT_EXTENT_COUNT_MAX) {
+			best_gap = gap;
+			best = i;
+		}
+	}
+	if (best_gap > DRT_COALESCE_PAGES)
+		return(KERN_FAILURE);
 
-	cmap = *cmapp;
+	page = DRT_EXTENT_PAGE(ext[best]);
+	ext[best] = DRT_EXTENT(page, DRT_EXTENT_END(ext[best + 1]) - page);
 
-	/* look for an existing entry */
-	kret = vfs_drt_search_index(cmap, offset, indexp);
-	if (kret == KERN_SUCCESS)
-		return(kret);
+	bcopy(&ext[best + 2], &ext[best + 1], (cmap->scm_count - best - 2) * sizeof(u_int64_t));
+	cmap->scm_count--;
+	cmap->scm_coalesced++;
 
-	/* need to allocate an entry */
-	offset = DRT_ALIGN_ADDRESS(offset);
-	index = DRT_HASH(cmap, offset);
-
-	/* scan from the index forwards looking for a vacant slot */
-	for (i = 0; i < cmap->scm_modulus; i++) {
-		/* slot vacant? */
-		if (DRT_HASH_VACANT(cmap, index) || DRT_HASH_GET_COUNT(cmap,index) == 0) {
-			cmap->scm_buckets++;
-			if (index < cmap->scm_lastclean)
-				cmap->scm_lastclean = index;
-			DRT_HASH_SET_ADDRESS(cmap, index, offset);
-			DRT_HASH_SET_COUNT(cmap, index, 0);
-			DRT_BITVECTOR_CLEAR(cmap, index);
-			*indexp = index;
-			vfs_drt_trace(cmap, DRT_DEBUG_INSERT, (int)offset, i, 0, 0);
-			return(KERN_SUCCESS);
-		}
-		cmap->scm_iskips += i;
-		index = DRT_HASH_NEXT(cmap, index);
-	}
+	OSIncrementAtomic64(&cluster_push_coalesced);
 
-	/*
-	 * We haven't found a vacant slot, so the map is full.  If we're not
-	 * already recursed, try reallocating/compacting it.
-	 */
-	if (recursed)
-		return(KERN_FAILURE);
-	kret = vfs_drt_alloc_map(cmapp);
-	if (kret == KERN_SUCCESS) {
-		/* now try to insert again */
-		kret = vfs_drt_get_index(cmapp, offset, indexp, 1);
-	}
-	return(kret);
+	return(KERN_SUCCESS);
 }
 
 /*
- * Implementation of set dirty/clean.
+ * Mark a set of pages as dirty.
+ *
+ * This is a public interface.
+ *
+ * cmapp
+ *	Pointer to storage suitable for holding a pointer.  Note that
+ *	this must either be NULL or a value set by this function.
+ *
+ * offset
+ *	Offset of the first page to be marked as dirty, in bytes.  Must be
+ *	page-aligned.
  *
- * In the 'clean' case, not finding a map is OK.
+ * length
+ *	Length of dirty region, in bytes.  Must be a multiple of PAGE_SIZE.
+ *
+ * setcountp
+ *	Number of pages newly marked dirty by this call (optional).
+ *
+ * Returns KERN_SUCCESS if all the pages were successfully marked.  On
+ * failure no pages have been marked.
  */
 static kern_return_t
-vfs_drt_do_mark_pages(
-	void		**private,
-	u_int64_t	offset,
-	u_int    	length,
-	u_int		*setcountp,
-	int		dirty)
+vfs_drt_mark_pages(void **private, off_t offset, u_int length, u_int *setcountp)
 {
 	struct vfs_drt_clustermap *cmap, **cmapp;
 	kern_return_t	kret;
-	int		i, index, pgoff, pgcount, setcount, ecount;
+	u_int64_t	*ext;
+	u_int64_t	page, end, e_page, e_end, covered;
+	u_int32_t	i, j, last;
 
 	cmapp = (struct vfs_drt_clustermap **)private;
 	cmap = *cmapp;
 
-	vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_START, (int)offset, (int)length, dirty, 0);
+	vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_START, (int)offset, (int)length, 1, 0);
 
 	if (setcountp != NULL)
 	        *setcountp = 0;
 	
 	/* allocate a cluster map if we don't already have one */
 	if (cmap == NULL) {
-		/* no cluster map, nothing to clean */
-		if (!dirty) {
-			vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 1, 0, 0, 0);
-			return(KERN_SUCCESS);
-		}
 		kret = vfs_drt_alloc_map(cmapp);
 		if (kret != KERN_SUCCESS) {
 			vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 2, 0, 0, 0);
 			return(kret);
 		}
+		cmap = *cmapp;
 	}
-	setcount = 0;
+	page = (u_int64_t)offset / PAGE_SIZE;
+	end = page + (length / PAGE_SIZE);
+
+	for (;;) {
+		ext = cmap->scm_extents;
+		last = cmap->scm_first + cmap->scm_count;
 
-	/*
-	 * Iterate over the length of the region.
-	 */
-	while (length > 0) {
 		/*
-		 * Get the hashtable index for this offset.
-		 *
-		 * XXX this will add blank entries if we are clearing a range
-		 * that hasn't been dirtied.
+		 * gather up every extent the new one overlaps or touches
 		 */
-		kret = vfs_drt_get_index(cmapp, offset, &index, 0);
-		cmap = *cmapp;	/* may have changed! */
-		/* this may be a partial-success return */
-		if (kret != KERN_SUCCESS) {
-		        if (setcountp != NULL)
-			        *setcountp = setcount;
-			vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 3, (int)length, 0, 0);
+		i = vfs_drt_search(cmap, page);
+		e_page = page;
+		e_end = end;
+		covered = 0;
 
-			return(kret);
+		for (j = i; j < last && DRT_EXTENT_PAGE(ext[j]) <= end; j++) {
+			covered += MIN(DRT_EXTENT_END(ext[j]), end) - MAX(DRT_EXTENT_PAGE(ext[j]), page);
+
+			e_page = MIN(e_page, DRT_EXTENT_PAGE(ext[j]));
+			e_end = MAX(e_end, DRT_EXTENT_END(ext[j]));
 		}
+		if ((e_end - e_page) > DRT_EXTENT_COUNT_MAX)
+			break;
 
-		/*
-		 * Work out how many pages we're modifying in this
-		 * hashtable entry.
-		 */
-		pgoff = (offset - DRT_ALIGN_ADDRESS(offset)) / PAGE_SIZE;
-		pgcount = min((length / PAGE_SIZE), (DRT_BITVECTOR_PAGES - pgoff));
+		if (j > i) {
+			/*
+			 * replace them with a single extent
+			 */
+			ext[i] = DRT_EXTENT(e_page, e_end - e_page);
 
+			bcopy(&ext[j], &ext[i + 1], (last - j) * sizeof(u_int64_t));
+			cmap->scm_count -= (j - i - 1);
+			goto done;
+		}
+		if (last < cmap->scm_max) {
+			/*
+			 * open up a slot for a new extent
+			 */
+			bcopy(&ext[i], &ext[i + 1], (last - i) * sizeof(u_int64_t));
+			ext[i] = DRT_EXTENT(page, end - page);
+			cmap->scm_count++;
+
+			vfs_drt_trace(cmap, DRT_DEBUG_INSERT, (int)offset, i, 0, 0);
+			goto done;
+		}
 		/*
-		 * Iterate over pages, dirty/clearing as we go.
+		 * out of slots... slide the live extents down over the ones
+		 * already handed out, grow the map, or make room by coalescing
 		 */
-		ecount = DRT_HASH_GET_COUNT(cmap, index);
-		for (i = 0; i < pgcount; i++) {
-			if (dirty) {
-				if (!DRT_HASH_TEST_BIT(cmap, index, pgoff + i)) {
-					DRT_HASH_SET_BIT(cmap, index, pgoff + i);
-					ecount++;
-					setcount++;
-				}
-			} else {
-				if (DRT_HASH_TEST_BIT(cmap, index, pgoff + i)) {
-					DRT_HASH_CLEAR_BIT(cmap, index, pgoff + i);
-					ecount--;
-					setcount++;
-				}
-			}
+		if (cmap->scm_first) {
+			bcopy(&ext[cmap->scm_first], &ext[0], cmap->scm_count * sizeof(u_int64_t));
+			cmap->scm_first = 0;
+			continue;
 		}
-		DRT_HASH_SET_COUNT(cmap, index, ecount);
-
-		offset += pgcount * PAGE_SIZE;
-		length -= pgcount * PAGE_SIZE;
+		if (vfs_drt_alloc_map(cmapp) == KERN_SUCCESS) {
+			cmap = *cmapp;	/* has changed! */
+			continue;
+		}
+		if (vfs_drt_coalesce(cmap) == KERN_SUCCESS)
+			continue;
+		break;
 	}
+	vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 3, (int)length, 0, 0);
+
+	return(KERN_FAILURE);
+done:
 	if (setcountp != NULL)
-		*setcountp = setcount;
+		*setcountp = (u_int)((end - page) - covered);
 
-	vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 0, setcount, 0, 0);
+	vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 0, (int)((end - page) - covered), 0, 0);
 
 	return(KERN_SUCCESS);
 }
 
-/*
- * Mark a set of pages as dirty/clean.
- *
- * This is a public interface.
- *
- * cmapp
- *	Pointer to storage suitable for holding a pointer.  Note that
- *	this must either be NULL or a value set by this function.
- *
- * size
- *	Current file size in bytes.
- *
- * offset
- *	Offset of the first page to be marked as dirty, in bytes.  Must be
- *	page-aligned.
- *
- * length
- *	Length of dirty region, in bytes.  Must be a multiple of PAGE_SIZE.
- *
- * setcountp
- *	Number of pages newly marked dirty by this call (optional).
- *
- * Returns KERN_SUCCESS if all the pages were successfully marked.
- */
-static kern_return_t
-vfs_drt_mark_pages(void **cmapp, off_t offset, u_int length, u_int *setcountp)
-{
-	/* XXX size unused, drop from interface */
-	return(vfs_drt_do_mark_pages(cmapp, offset, length, setcountp, 1));
-}
-
-#if 0
-static kern_return_t
-vfs_drt_unmark_pages(void **cmapp, off_t offset, u_int length)
-{
-	return(vfs_drt_do_mark_pages(cmapp, offset, length, NULL, 0));
-}
-#endif
-
 /*
  * Get a cluster of dirty pages.
  *
@@ -6786,78 +6895,59 @@ vfs_drt_unmark_pages(void **cmapp, off_t offset, u_int length)
  * lengthp
  *	Returns the length in bytes of the cluster of dirty pages.
  *
- * Returns success if a cluster was found.  If KERN_FAILURE is returned, there
- * are no dirty pages meeting the minmum size criteria.  Private storage will
- * be released if there are no more dirty pages left in the map
+ * Returns success if a cluster was found.  Clusters are returned lowest
+ * offset first and are at most DRT_CLUSTER_PAGES long.  If KERN_FAILURE
+ * is returned, there are no dirty pages left in the map and the private
+ * storage has been released.
  *
  */
 static kern_return_t
 vfs_drt_get_cluster(void **cmapp, off_t *offsetp, u_int *lengthp)
 {
 	struct vfs_drt_clustermap *cmap;
-	u_int64_t	offset;
-	u_int		length;
-	u_int32_t	j;
-	int		index, i, fs, ls;
+	u_int64_t	page, count;
 
 	/* sanity */
 	if ((cmapp == NULL) || (*cmapp == NULL))
 		return(KERN_FAILURE);
 	cmap = *cmapp;
 
-	/* walk the hashtable */
-	for (offset = 0, j = 0; j < cmap->scm_modulus; offset += (DRT_BITVECTOR_PAGES * PAGE_SIZE), j++) {
-	        index = DRT_HASH(cmap, offset);
-
-	        if (DRT_HASH_VACANT(cmap, index) || (DRT_HASH_GET_COUNT(cmap, index) == 0))
-			continue;
+	if (cmap->scm_count == 0) {
+		/*
+		 * map is empty
+		 * emit stats into trace buffer and
+		 * then free it
+		 */
+		vfs_drt_trace(cmap, DRT_DEBUG_SCMDATA,
+			      cmap->scm_size,
+			      cmap->scm_count,
+			      cmap->scm_first,
+			      cmap->scm_coalesced);
+	
+		vfs_drt_free_map(cmap);
+		*cmapp = NULL;
 
-		/* scan the bitfield for a string of bits */
-		fs = -1;
+		return(KERN_FAILURE);
+	}
+	page = DRT_EXTENT_PAGE(cmap->scm_extents[cmap->scm_first]);
+	count = DRT_EXTENT_COUNT(cmap->scm_extents[cmap->scm_first]);
 
-		for (i = 0; i < DRT_BITVECTOR_PAGES; i++) {
-		        if (DRT_HASH_TEST_BIT(cmap, index, i)) {
-			        fs = i;
-				break;
-			}
-		}
-		if (fs == -1) {
-		        /*  didn't find any bits set */
-		        panic("vfs_drt: entry summary count > 0 but no bits set in map");
-		}
-		for (ls = 0; i < DRT_BITVECTOR_PAGES; i++, ls++) {
-			if (!DRT_HASH_TEST_BIT(cmap, index, i))
-			        break;
-		}
-		
-		/* compute offset and length, mark pages clean */
-		offset = DRT_HASH_GET_ADDRESS(cmap, index) + (PAGE_SIZE * fs);
-		length = ls * PAGE_SIZE;
-		vfs_drt_do_mark_pages(cmapp, offset, length, NULL, 0);
-		cmap->scm_lastclean = index;
-
-		/* return successful */
-		*offsetp = (off_t)offset;
-		*lengthp = length;
-
-		vfs_drt_trace(cmap, DRT_DEBUG_RETCLUSTER, (int)offset, (int)length, 0, 0);
-		return(KERN_SUCCESS);
+	if (count > DRT_CLUSTER_PAGES) {
+		/*
+		 * hand back the front of the extent and keep the rest
+		 */
+		cmap->scm_extents[cmap->scm_first] = DRT_EXTENT(page + DRT_CLUSTER_PAGES, count - DRT_CLUSTER_PAGES);
+		count = DRT_CLUSTER_PAGES;
+	} else {
+		cmap->scm_first++;
+		cmap->scm_count--;
 	}
-	/*
-	 * We didn't find anything... hashtable is empty
-	 * emit stats into trace buffer and
-	 * then free it
-	 */
-	vfs_drt_trace(cmap, DRT_DEBUG_SCMDATA,
-		      cmap->scm_modulus,
-		      cmap->scm_buckets,
-		      cmap->scm_lastclean,
-		      cmap->scm_iskips);
-	
-	vfs_drt_free_map(cmap);
-	*cmapp = NULL;
+	*offsetp = (off_t)(page * PAGE_SIZE_64);
+	*lengthp = (u_int)(count * PAGE_SIZE);
 
-	return(KERN_FAILURE);
+	vfs_drt_trace(cmap, DRT_DEBUG_RETCLUSTER, (int)*offsetp, (int)*lengthp, 0, 0);
+
+	return(KERN_SUCCESS);
 }
 
 
@@ -6875,18 +6965,14 @@ vfs_drt_control(void **cmapp, int op_type)
 	case 0:
 		/* emit stats into trace buffer */
 		vfs_drt_trace(cmap, DRT_DEBUG_SCMDATA,
-			      cmap->scm_modulus,
-			      cmap->scm_buckets,
-			      cmap->scm_lastclean,
-			      cmap->scm_iskips);
+			      cmap->scm_size,
+			      cmap->scm_count,
+			      cmap->scm_first,
+			      cmap->scm_coalesced);
 
 		vfs_drt_free_map(cmap);
 		*cmapp = NULL;
 	        break;
-
-	case 1:
-	        cmap->scm_lastclean = 0;
-	        break;
 	}
 	return(KERN_SUCCESS);
 }
@@ -6914,25 +7000,17 @@ vfs_drt_trace(__unused struct vfs_drt_clustermap *cmap, __unused int code,
 
 #if 0
 /*
- * Perform basic sanity check on the hash entry summary count
- * vs. the actual bits set in the entry.
+ * Perform basic sanity check on the extent array: sorted, and no two
+ * extents overlapping or touching.
  */
 static void
 vfs_drt_sanity(struct vfs_drt_clustermap *cmap)
 {
-        int index, i;
-	int bits_on;
-	
-	for (index = 0; index < cmap->scm_modulus; index++) {
-	        if (DRT_HASH_VACANT(cmap, index))
-		        continue;
+        u_int32_t i;
 
-		for (bits_on = 0, i = 0; i < DRT_BITVECTOR_PAGES; i++) {
-			if (DRT_HASH_TEST_BIT(cmap, index, i))
-			        bits_on++;
-		}
-		if (bits_on != DRT_HASH_GET_COUNT(cmap, index))
-		        panic("bits_on = %d,  index = %d\n", bits_on, index);
-	}		
+	for (i = cmap->scm_first; i + 1 < cmap->scm_first + cmap->scm_count; i++) {
+		if (DRT_EXTENT_END(cmap->scm_extents[i]) >= DRT_EXTENT_PAGE(cmap->scm_extents[i + 1]))
+		        panic("vfs_drt: extent %d out of order\n", i);
+	}
 }
 #endif
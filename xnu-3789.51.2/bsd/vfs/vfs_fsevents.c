@@ -81,6 +81,7 @@ typedef struct kfs_event {
     const char    *str;
 
     struct kfs_event *dest;    // if this is a two-file op
+    uint16_t       recent;     // slot in kfse_recent[] that may point at this event
 } kfs_event;
 
 // flags for the flags field
@@ -114,6 +115,7 @@ typedef struct fs_event_watcher {
     struct fsevent_handle *fseh;
     pid_t        pid;
     char         proc_name[(2 * MAXCOMLEN) + 1];
+    char        *outbuf;                 // events are staged here and copied out a batch at a time
 } fs_event_watcher;
 
 // fs_event_watcher flags
@@ -126,6 +128,9 @@ typedef struct fs_event_watcher {
 #define MAX_WATCHERS  8
 static fs_event_watcher *watcher_table[MAX_WATCHERS];
 
+// size of each watcher's output buffer; a read copies out up to this much at a time
+#define FSEVENTS_OUTBUF_SIZE  (16 * 1024)
+
 #define DEFAULT_MAX_KFS_EVENTS   4096
 static int max_kfs_events = DEFAULT_MAX_KFS_EVENTS;
 
@@ -336,24 +341,132 @@ int num_recycled_rename = 0;
 static struct timeval last_print;
 
 //
-// These variables are used to track coalescing multiple identical
+// This table is used to track coalescing multiple identical
 // events for the same vnode/pathname.  If we get the same event
-// type and same vnode/pathname as the previous event, we just drop
-// the event since it's superfluous.  This improves some micro-
-// benchmarks considerably and actually has a real-world impact on
-// tests like a Finder copy where multiple stat-changed events can
-// get coalesced.
+// type and same vnode/pathname as a recent event that no watcher
+// has read yet, we just drop the event since it's superfluous.
+// This improves some micro-benchmarks considerably and actually
+// has a real-world impact on tests like a Finder copy or a build
+// where the same files see many stat-changed and content-modified
+// events.
+//
+// Slots are hashed on the vnode or path alone, so a slot holds the
+// latest event for its vnode or path and an event is only coalesced
+// into the one immediately before it for the same object: any event of
+// another type takes the slot over.  Events that can never be
+// coalesced (creates, deletes, renames and the like) may name the same
+// file by a path where the pending event used its vnode, so they bump
+// kfse_recent_gen instead, which invalidates every slot.
+//
+// Paths themselves are interned in the vfs string table by
+// vfs_addname(), so events for the same path share one copy.
 //
-static int     last_event_type=-1;
-static void   *last_ptr=NULL;
-static char    last_str[MAXPATHLEN];
-static int     last_nlen=0;
-static int     last_vid=-1;
-static uint64_t last_coalesced_time=0;
-static void   *last_event_ptr=NULL;
+// The table is protected by the fs event list lock.
+//
+#define KFSE_RECENT_SLOTS  256
+
+typedef struct kfse_recent {
+    kfs_event *kfse;            // the pending event, NULL if none
+    void      *vp;              // the vnode it was for, NULL for a path
+    int        vid;
+    uint32_t   gen;             // kfse_recent_gen when it was added
+    uint64_t   abstime;         // when it was added
+} kfse_recent;
+
+static kfse_recent kfse_recent_table[KFSE_RECENT_SLOTS];
+static uint32_t    kfse_recent_gen;
 int            last_coalesced = 0;
 static mach_timebase_info_data_t    sTimebaseInfo = { 0, 0 };
 
+static uint32_t fsevents_coalesce_window = 1000;   // in ms; 0 turns coalescing off
+static SInt64   fsevents_coalesced;                // events dropped as duplicates of a pending one
+static SInt64   fsevents_dropped;                  // events lost because a queue or the zone was full
+static SInt64   fsevents_delivered;                // events copied out to watchers
+static SInt64   fsevents_batches;                  // copyouts of staged events
+
+SYSCTL_NODE(_vfs, OID_AUTO, fsevents, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "fsevents");
+SYSCTL_UINT(_vfs_fsevents, OID_AUTO, coalesce_window_ms, CTLFLAG_RW | CTLFLAG_LOCKED, &fsevents_coalesce_window, 0, "");
+SYSCTL_QUAD(_vfs_fsevents, OID_AUTO, coalesced, CTLFLAG_RD | CTLFLAG_LOCKED, &fsevents_coalesced, "");
+SYSCTL_QUAD(_vfs_fsevents, OID_AUTO, dropped, CTLFLAG_RD | CTLFLAG_LOCKED, &fsevents_dropped, "");
+SYSCTL_QUAD(_vfs_fsevents, OID_AUTO, delivered, CTLFLAG_RD | CTLFLAG_LOCKED, &fsevents_delivered, "");
+SYSCTL_QUAD(_vfs_fsevents, OID_AUTO, batches, CTLFLAG_RD | CTLFLAG_LOCKED, &fsevents_batches, "");
+
+unsigned int hash_string(const char *cp, int len);
+
+static uint64_t
+fsevent_elapsed_ns(uint64_t then, uint64_t now)
+{
+    uint64_t elapsed = now - then;
+
+    if ( sTimebaseInfo.denom == 0 ) {
+	(void) clock_timebase_info(&sTimebaseInfo);
+    }
+
+    if (sTimebaseInfo.denom != sTimebaseInfo.numer) {
+	if (sTimebaseInfo.denom == 1) {
+	    elapsed *= sTimebaseInfo.numer;
+	} else {
+	    // this could overflow... the worst that will happen is that we'll
+	    // send (or not send) an extra event so I'm not going to worry about
+	    // doing the math right like dtrace_abs_to_nano() does.
+	    elapsed = (elapsed * sTimebaseInfo.numer) / (uint64_t)sTimebaseInfo.denom;
+	}
+    }
+
+    return elapsed;
+}
+
+static kfse_recent *
+kfse_recent_slot(void *ptr, int was_str)
+{
+    uint32_t hash;
+
+    if (was_str) {
+	hash = hash_string(ptr, 0);
+    } else {
+	hash = (uint32_t)((uintptr_t)ptr >> 6);
+    }
+
+    return &kfse_recent_table[hash % KFSE_RECENT_SLOTS];
+}
+
+//
+// The fs event list must be locked before calling this function.
+//
+static int
+kfse_recent_matches(kfse_recent *slot, int type, void *ptr, int vid, int was_str, int nlen, uint64_t now)
+{
+    kfs_event *kfse = slot->kfse;
+
+    if (kfse == NULL || kfse->type != type || (kfse->flags & KFSE_BEING_CREATED) ||
+	slot->gen != kfse_recent_gen) {
+	return 0;
+    }
+
+    if (fsevent_elapsed_ns(slot->abstime, now) >= (uint64_t)fsevents_coalesce_window * 1000000ULL) {
+	return 0;
+    }
+
+    if (was_str) {
+	return slot->vp == NULL && kfse->str != NULL && kfse->len == (nlen & 0x7fff) && strcmp(kfse->str, ptr) == 0;
+    }
+
+    return vid && slot->vp == ptr && slot->vid == vid;
+}
+
+//
+// Stop coalescing into kfse, either because it's going away or
+// because a watcher has read it.  The fs event list must be
+// locked before calling this function.
+//
+static void
+kfse_forget_recent(kfs_event *kfse)
+{
+    if (kfse_recent_table[kfse->recent].kfse == kfse) {
+	kfse_recent_table[kfse->recent].kfse = NULL;
+    }
+}
+
 
 int
 add_fsevent(int type, vfs_context_t ctx, ...) 
@@ -365,9 +478,10 @@ add_fsevent(int type, vfs_context_t ctx, ...)
     va_list           ap;
     int 	      error = 0, did_alloc=0;
     dev_t             dev = 0;
-    uint64_t          now, elapsed;
+    uint64_t          now;
     char             *pathbuff=NULL;
     int               pathbuff_len;
+    kfse_recent      *recent=NULL;
 
 
 
@@ -406,7 +520,6 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 		case FSE_ARG_VNODE: {
 		    ptr = va_arg(ap, void *);
 		    vid = vnode_vid((struct vnode *)ptr);
-		    last_str[0] = '\0';
 		    break;
 		}
 		case FSE_ARG_STRING: {
@@ -421,45 +534,28 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 	    }
 	}
 
-	if ( sTimebaseInfo.denom == 0 ) {
-	    (void) clock_timebase_info(&sTimebaseInfo);
-	}
-	
-	elapsed = (now - last_coalesced_time);
-	if (sTimebaseInfo.denom != sTimebaseInfo.numer) {
-	    if (sTimebaseInfo.denom == 1) {
-		elapsed *= sTimebaseInfo.numer;
-	    } else {
-		// this could overflow... the worst that will happen is that we'll
-		// send (or not send) an extra event so I'm not going to worry about
-		// doing the math right like dtrace_abs_to_nano() does.
-		elapsed = (elapsed * sTimebaseInfo.numer) / (uint64_t)sTimebaseInfo.denom;
-	    }
-	}
-	
-	if (type == last_event_type
-            && (elapsed < 1000000000)
-	    && 
-	    ((vid && vid == last_vid && last_ptr == ptr)
-	      ||
-	     (last_str[0] && last_nlen == nlen && ptr && strcmp(last_str, ptr) == 0))
-	   ) {
-	    
-	    last_coalesced++;
-	    unlock_fs_event_list();
-	    va_end(ap);
+	if (ptr != NULL && fsevents_coalesce_window != 0) {
+	    recent = kfse_recent_slot(ptr, was_str);
 
-	    return 0;
-	} else {
-	    last_ptr = ptr;
-	    if (was_str) {
-		strlcpy(last_str, ptr, sizeof(last_str));
+	    if (kfse_recent_matches(recent, type, ptr, vid, was_str, nlen, now)) {
+		last_coalesced++;
+		OSIncrementAtomic64(&fsevents_coalesced);
+		unlock_fs_event_list();
+		va_end(ap);
+
+		return 0;
 	    }
-	    last_nlen = nlen;
-	    last_vid = vid;
-	    last_event_type = type;
-	    last_coalesced_time = now;
+
+	    // this event takes over the slot once it's allocated below
+	    recent->kfse    = NULL;
+	    recent->vp      = was_str ? NULL : ptr;
+	    recent->vid     = vid;
+	    recent->gen     = kfse_recent_gen;
+	    recent->abstime = now;
 	}
+    } else {
+	// nothing queued before this event may absorb a later one
+	kfse_recent_gen++;
     }
     va_start(ap, ctx);
 
@@ -494,6 +590,7 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 		struct timeval current_tv;
 
 		num_dropped++;
+		OSIncrementAtomic64(&fsevents_dropped);
 
 		// only print a message at most once every 5 seconds
 		microuptime(&current_tv);
@@ -537,7 +634,10 @@ add_fsevent(int type, vfs_context_t ctx, ...)
     kfse->refcount = 1;
     OSBitOrAtomic16(KFSE_BEING_CREATED, &kfse->flags);
 
-    last_event_ptr = kfse;
+    if (recent != NULL) {
+	recent->kfse = kfse;
+	kfse->recent = (uint16_t)(recent - kfse_recent_table);
+    }
     kfse->type     = type;
     kfse->abstime  = now;
     kfse->pid      = p->p_pid;
@@ -806,6 +906,7 @@ done_with_args:
 	    
 	    if (watcher_add_event(watcher, kfse) != 0) {
 		watcher->num_dropped++;
+		OSIncrementAtomic64(&fsevents_dropped);
 		continue;
 	    }
 	}
@@ -843,11 +944,7 @@ release_event_ref(kfs_event *kfse)
     }
 
     lock_fs_event_list();
-    if (last_event_ptr == kfse) {
-	    last_event_ptr = NULL;
-	    last_event_type = -1;
-	    last_coalesced_time = 0;
-    }
+    kfse_forget_recent(kfse);
 
     if (kfse->refcount < 0) {
 	panic("release_event_ref: bogus kfse refcount %d\n", kfse->refcount);
@@ -953,11 +1050,12 @@ add_watcher(int8_t *event_list, int32_t num_events, int32_t eventq_size, fs_even
 	eventq_size = max_kfs_events;
     }
 
-    // Note: the event_queue follows the fs_event_watcher struct
-    //       in memory so we only have to do one allocation
+    // Note: the event_queue and then the output buffer follow the
+    //       fs_event_watcher struct in memory so we only have to do
+    //       one allocation
     MALLOC(watcher,
 	   fs_event_watcher *,
-	   sizeof(fs_event_watcher) + eventq_size * sizeof(kfs_event *),
+	   sizeof(fs_event_watcher) + eventq_size * sizeof(kfs_event *) + FSEVENTS_OUTBUF_SIZE,
 	   M_TEMP, M_WAITOK);
     if (watcher == NULL) {
 	return ENOMEM;
@@ -970,6 +1068,7 @@ add_watcher(int8_t *event_list, int32_t num_events, int32_t eventq_size, fs_even
     watcher->flags        = 0;
     watcher->event_queue  = (kfs_event **)&watcher[1];
     watcher->eventq_size  = eventq_size;
+    watcher->outbuf       = (char *)&watcher->event_queue[eventq_size];
     watcher->rd           = 0;
     watcher->wr           = 0;
     watcher->blockers     = 0;
@@ -1196,6 +1295,7 @@ watcher_add_event(fs_event_watcher *watcher, kfs_event *kfse)
 	OSSynchronizeIO();
 	if (kfse != NULL && kfse->type != FSE_INVALID && kfse->refcount >= 1) {
 	  release_event_ref(kfse);
+	  OSIncrementAtomic64(&fsevents_dropped);
 	}
       }
       watcher->flags |= WATCHER_DROPPED_EVENTS;
@@ -1282,17 +1382,23 @@ fill_buff(uint16_t type, int32_t size, const void *data,
 }
 
 
-static int copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)  __attribute__((noinline));
+static int copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio, int32_t *outbuf_idx)  __attribute__((noinline));
 
+//
+// Stage kfse in the watcher's output buffer after the *outbuf_idx
+// bytes already there.  The buffer is only copied out here if the
+// event doesn't fit in what's left of it; otherwise fmod_watch()
+// copies out everything that was staged at once.
+//
 static int
-copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
+copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio, int32_t *outbuf_idx)
 {
     int      error;
     uint16_t tmp16;
     int32_t  type;
     kfs_event *cur;
-    char     evbuff[512];
-    int      evbuff_idx = 0;
+    char    *evbuff = watcher->outbuf;
+    int      evbuff_idx = *outbuf_idx;
 
     if (kfse->type == FSE_INVALID) {
 	panic("fsevents: copy_out_kfse: asked to copy out an invalid event (kfse %p, refcount %d fref ptr %p)\n", kfse, kfse->refcount, kfse->str);
@@ -1302,6 +1408,19 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
 	return 0;
     }
 
+    // make sure there's room for the fixed size header
+    if ((FSEVENTS_OUTBUF_SIZE - evbuff_idx) < (int)(sizeof(int32_t) + sizeof(pid_t))) {
+	if (evbuff_idx > uio_resid(uio)) {
+	    error = ENOSPC;
+	    goto get_out;
+	}
+	error = uiomove(evbuff, evbuff_idx, uio);
+	if (error) {
+	    goto get_out;
+	}
+	evbuff_idx = 0;
+    }
+
     if (kfse->type == FSE_RENAME && kfse->dest == NULL) {
 	//
 	// This can happen if an event gets recycled but we had a
@@ -1329,7 +1448,7 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
     }
 
     // copy out the type of the event
-    memcpy(evbuff, &type, sizeof(int32_t));
+    memcpy(&evbuff[evbuff_idx], &type, sizeof(int32_t));
     evbuff_idx += sizeof(int32_t);
 
     // copy out the pid of the person that generated the event
@@ -1345,24 +1464,24 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
 	ino64_t    ino  = cur->ino;
 	uint64_t ival;
 
-	error = fill_buff(FSE_ARG_DEV, sizeof(dev_t), &dev, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_DEV, sizeof(dev_t), &dev, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
-	error = fill_buff(FSE_ARG_INO, sizeof(ino64_t), &ino, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_INO, sizeof(ino64_t), &ino, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
 	memcpy(&ino, &cur->str, sizeof(ino64_t));
-	error = fill_buff(FSE_ARG_INO, sizeof(ino64_t), &ino, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_INO, sizeof(ino64_t), &ino, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
 	memcpy(&ival, &cur->uid, sizeof(uint64_t));   // the docid gets stuffed into the ino field
-	error = fill_buff(FSE_ARG_INT64, sizeof(uint64_t), &ival, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_INT64, sizeof(uint64_t), &ival, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
@@ -1373,7 +1492,7 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
     if (kfse->type == FSE_UNMOUNT_PENDING) {
 	dev_t    dev  = cur->dev;
 
-	error = fill_buff(FSE_ARG_DEV, sizeof(dev_t), &dev, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_DEV, sizeof(dev_t), &dev, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
@@ -1383,9 +1502,9 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
 
     if (cur->str == NULL || cur->str[0] == '\0') {
 	printf("copy_out_kfse:2: empty/short path (%s)\n", cur->str);
-	error = fill_buff(FSE_ARG_STRING, 2, "/", evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_STRING, 2, "/", evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
     } else {
-	error = fill_buff(FSE_ARG_STRING, cur->len, cur->str, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_STRING, cur->len, cur->str, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
     }
     if (error != 0) {
 	goto get_out;
@@ -1404,32 +1523,32 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
 	int32_t finfo_size;
 	
 	finfo_size = sizeof(dev_t) + sizeof(ino64_t) + sizeof(int32_t) + sizeof(uid_t) + sizeof(gid_t);
-	error = fill_buff(FSE_ARG_FINFO, finfo_size, &cur->ino, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_FINFO, finfo_size, &cur->ino, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
     } else {
-	error = fill_buff(FSE_ARG_DEV, sizeof(dev_t), &cur->dev, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_DEV, sizeof(dev_t), &cur->dev, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
-	error = fill_buff(FSE_ARG_INO, sizeof(ino64_t), &cur->ino, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_INO, sizeof(ino64_t), &cur->ino, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
-	error = fill_buff(FSE_ARG_MODE, sizeof(int32_t), &cur->mode, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_MODE, sizeof(int32_t), &cur->mode, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
-	error = fill_buff(FSE_ARG_UID, sizeof(uid_t), &cur->uid, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_UID, sizeof(uid_t), &cur->uid, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
 
-	error = fill_buff(FSE_ARG_GID, sizeof(gid_t), &cur->gid, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+	error = fill_buff(FSE_ARG_GID, sizeof(gid_t), &cur->gid, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
 	if (error != 0) {
 	    goto get_out;
 	}
@@ -1443,13 +1562,13 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
 
   done:
     // very last thing: the time stamp
-    error = fill_buff(FSE_ARG_INT64, sizeof(uint64_t), &cur->abstime, evbuff, &evbuff_idx, sizeof(evbuff), uio);
+    error = fill_buff(FSE_ARG_INT64, sizeof(uint64_t), &cur->abstime, evbuff, &evbuff_idx, FSEVENTS_OUTBUF_SIZE, uio);
     if (error != 0) {
 	goto get_out;
     }
 
     // check if the FSE_ARG_DONE will fit
-    if (sizeof(uint16_t) > sizeof(evbuff) - evbuff_idx) {
+    if (sizeof(uint16_t) > FSEVENTS_OUTBUF_SIZE - evbuff_idx) {
 	if (evbuff_idx > uio_resid(uio)) {
 	    error = ENOSPC;
 	    goto get_out;
@@ -1465,15 +1584,13 @@ copy_out_kfse(fs_event_watcher *watcher, kfs_event *kfse, struct uio *uio)
     memcpy(&evbuff[evbuff_idx], &tmp16, sizeof(uint16_t));
     evbuff_idx += sizeof(uint16_t);
 
-    // flush any remaining data in the buffer (and hopefully
-    // in most cases this is the only uiomove we'll do)
+    // leave the event staged; just make sure it will fit
     if (evbuff_idx > uio_resid(uio)) {
 	error = ENOSPC;
-    } else {
-	error = uiomove(evbuff, evbuff_idx, uio);
     }
 
   get_out:
+    *outbuf_idx = evbuff_idx;
 
     return error;
 }
@@ -1484,12 +1601,11 @@ static int
 fmod_watch(fs_event_watcher *watcher, struct uio *uio)
 {
     int               error=0; 
-    user_ssize_t      last_full_event_resid;
+    user_ssize_t      start_resid, flushed;
+    int32_t           outbuf_idx, last_full_event;
     kfs_event        *kfse;
     uint16_t          tmp16;
-    int               skipped;
-
-    last_full_event_resid = uio_resid(uio);
+    int               skipped, stop, delivered, staged;
 
     // need at least 2048 bytes of space (maxpathlen + 1 event buf)
     if  (uio_resid(uio) < 2048 || watcher == NULL) {
@@ -1536,8 +1652,6 @@ fmod_watch(fs_event_watcher *watcher, struct uio *uio)
 	    
 	    tmp16 = FSE_ARG_DONE;  // makes it a consistent msg
 	    error = uiomove((caddr_t)&tmp16, sizeof(int16_t), uio);
-
-	    last_full_event_resid = uio_resid(uio);
 	} 
 
 	if (error) {
@@ -1548,10 +1662,22 @@ fmod_watch(fs_event_watcher *watcher, struct uio *uio)
 	watcher->flags &= ~WATCHER_DROPPED_EVENTS;
     }
 
+    //
+    // events are staged in the watcher's output buffer and copied
+    // out a buffer at a time instead of one event at a time.  the
+    // offsets below count bytes from start_resid whether they've
+    // been copied out yet or are still staged.
+    //
+    start_resid = uio_resid(uio);
+    outbuf_idx = 0;
+    last_full_event = 0;
     skipped = 0;
+    stop = 0;
+    delivered = 0;
+    staged = 0;                 // events with bytes still in the output buffer
 
     lck_rw_lock_shared(&event_handling_lock);
-    while (uio_resid(uio) > 0 && watcher->rd != watcher->wr) {
+    while (uio_resid(uio) - outbuf_idx > 0 && watcher->rd != watcher->wr) {
 	if (watcher->flags & WATCHER_CLOSING) {
 	    break;
 	}
@@ -1576,27 +1702,44 @@ fmod_watch(fs_event_watcher *watcher, struct uio *uio)
 	  } else {
 
 	    skipped = 0;
-	    if (last_event_ptr == kfse) {
-		last_event_ptr = NULL;
-		last_event_type = -1;
-		last_coalesced_time = 0;
+	    if (kfse_recent_table[kfse->recent].kfse == kfse) {
+		// someone has seen this event now, so don't coalesce into it
+		lock_fs_event_list();
+		kfse_forget_recent(kfse);
+		unlock_fs_event_list();
 	    }
-	    error = copy_out_kfse(watcher, kfse, uio);
-	    if (error != 0) {
+	    flushed = start_resid - uio_resid(uio);
+	    error = copy_out_kfse(watcher, kfse, uio, &outbuf_idx);
+	    if (error == 0) {
+		// a flush leaves only this event in the buffer
+		staged = (start_resid - uio_resid(uio) != flushed) ? 1 : staged + 1;
+	    } else {
 		// if an event won't fit or encountered an error while
 		// we were copying it out, then backup to the last full
 		// event and just bail out.  if the error was ENOENT
 		// then we can continue regular processing, otherwise
 		// we should unlock things and return.
-		uio_setresid(uio, last_full_event_resid);
+		flushed = start_resid - uio_resid(uio);
+		if (flushed > last_full_event) {
+		    // part of this event was already copied out
+		    uio_setresid(uio, start_resid - last_full_event);
+		    start_resid = uio_resid(uio);
+		    last_full_event = 0;
+		    outbuf_idx = 0;
+		    staged = 0;
+		} else {
+		    outbuf_idx = last_full_event - (int32_t)flushed;
+		}
 		if (error != ENOENT) {
-		    lck_rw_unlock_shared(&event_handling_lock);
 		    error = 0;
-		    goto get_out;
+		    stop = 1;
+		    break;
 		}
+	    } else {
+		delivered++;
 	    }
 
-	    last_full_event_resid = uio_resid(uio);
+	    last_full_event = (int32_t)(start_resid - uio_resid(uio)) + outbuf_idx;
 	  }
 	}
 
@@ -1607,11 +1750,27 @@ fmod_watch(fs_event_watcher *watcher, struct uio *uio)
     }
     lck_rw_unlock_shared(&event_handling_lock);
 
-    if (skipped && error == 0) {
+    if (outbuf_idx > 0) {
+	error = uiomove(watcher->outbuf, outbuf_idx, uio);
+	OSIncrementAtomic64(&fsevents_batches);
+	if (error) {
+	    // the staged events are off the queue already; tell the
+	    // watcher on its next read that it missed some
+	    delivered -= staged;
+	    OSAddAtomic64(staged, &fsevents_dropped);
+	    lock_watch_table();
+	    watcher->flags |= WATCHER_DROPPED_EVENTS;
+	    unlock_watch_table();
+	}
+    }
+    if (delivered) {
+	OSAddAtomic64(delivered, &fsevents_delivered);
+    }
+
+    if (!stop && skipped && error == 0) {
       goto restart_watch;
     }
 
-  get_out:
     OSAddAtomic(-1, &watcher->num_readers);
 
     return error;
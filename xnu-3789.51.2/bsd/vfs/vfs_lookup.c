@@ -365,10 +365,29 @@ retry_copy:
 	ndp->ni_dvp = NULLVP;
 	ndp->ni_vp  = NULLVP;
 
+	/*
+	 * Try to resolve the whole path in one go.
+	 */
+	error = cache_lookup_fullpath(ndp, dp, ctx);
+	if (error == -1) {
+		if (cnp->cn_flags & AUDITVNPATH1)
+			AUDIT_ARG(vnpath, ndp->ni_vp, ARG_VNODE1);
+		else if (cnp->cn_flags & AUDITVNPATH2)
+			AUDIT_ARG(vnpath, ndp->ni_vp, ARG_VNODE2);
+
+		if (kdebug_enable)
+		        kdebug_lookup(ndp->ni_vp, cnp);
+		return (0);
+	}
+	if (error)
+		goto error_out;
+
 	for (;;) {
 		ndp->ni_startdir = dp;
 
-		if ( (error = lookup(ndp)) ) {
+		error = lookup(ndp);
+		ndp->ni_flag &= ~NAMEI_PATHCACHE;
+		if (error) {
 			goto error_out;
 		}
 
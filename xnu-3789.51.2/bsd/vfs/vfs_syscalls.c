@@ -8711,6 +8711,8 @@ exchangedata (__unused proc_t p, struct exchangedata_args *uap, __unused int32_t
 					   (uintptr_t)fpath, (uintptr_t)spath);
 	    }
 	    name_cache_lock();
+	    vnode_nc_seq_write_begin(fvp);
+	    vnode_nc_seq_write_begin(svp);
 
 	    tmpname     = fvp->v_name;
 	    fvp->v_name = svp->v_name;
@@ -8723,6 +8725,8 @@ exchangedata (__unused proc_t p, struct exchangedata_args *uap, __unused int32_t
 		fvp->v_parent = svp->v_parent;
 		svp->v_parent = tmp;
 	    }
+	    vnode_nc_seq_write_end(svp);
+	    vnode_nc_seq_write_end(fvp);
 	    name_cache_unlock();
 
 #if CONFIG_FSE
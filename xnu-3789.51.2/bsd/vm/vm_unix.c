@@ -89,6 +89,7 @@
 
 #include <kern/kalloc.h>
 #include <vm/vm_map.h>
+#include <vm/vm_fault.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_pageout.h>
 
@@ -191,6 +192,176 @@ SYSCTL_INT(_vm, OID_AUTO, vm_shadow_max_enabled, CTLFLAG_RW | CTLFLAG_LOCKED, &v
 
 SYSCTL_INT(_vm, OID_AUTO, vm_debug_events, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_debug_events, 0, "");
 
+/*
+ * Faults on private anonymous memory handled without the map lock.
+ * See vm_fault_speculative() in osfmk/vm/vm_fault.c
+ */
+extern int vm_fault_spec_enabled;
+
+static int
+sysctl_vm_spec_fault_count SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, oidp)
+	uint64_t value = vm_fault_spec_count(arg2);
+
+	return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
+SYSCTL_INT(_vm, OID_AUTO, spec_fault_enabled, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_fault_spec_enabled, 0, "");
+SYSCTL_PROC(_vm, OID_AUTO, spec_fault_hits, CTLTYPE_QUAD|CTLFLAG_RD|CTLFLAG_LOCKED,
+    0, VM_FAULT_SPEC_HITS, &sysctl_vm_spec_fault_count, "Q", "");
+SYSCTL_PROC(_vm, OID_AUTO, spec_fault_misses, CTLTYPE_QUAD|CTLFLAG_RD|CTLFLAG_LOCKED,
+    0, VM_FAULT_SPEC_MISSES, &sysctl_vm_spec_fault_count, "Q", "");
+SYSCTL_PROC(_vm, OID_AUTO, spec_fault_fallbacks, CTLTYPE_QUAD|CTLFLAG_RD|CTLFLAG_LOCKED,
+    0, VM_FAULT_SPEC_FALLBACKS, &sysctl_vm_spec_fault_count, "Q", "");
+
+/*
+ * Fault-around on file-backed mappings.  fault_around_pages is the
+ * default for new maps; fault_around_self reads or sets it for the
+ * calling process' map only.  See vm_fault_around() in osfmk/vm/vm_fault.c
+ */
+extern unsigned int vm_fault_around_pages;
+extern unsigned int vm_fault_around_faults;
+extern unsigned int vm_fault_around_mapped;
+
+static int
+sysctl_vm_fault_around_pages SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	unsigned int value = vm_fault_around_pages;
+	int error;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error || !req->newptr)
+		return (error);
+	if (value > VM_FAULT_AROUND_MAX)
+		return (EINVAL);
+	vm_fault_around_pages = value;
+	return (0);
+}
+
+static int
+sysctl_vm_fault_around_self SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	vm_map_t map = current_map();
+	unsigned int value = vm_map_get_fault_around(map);
+	int error;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error || !req->newptr)
+		return (error);
+	if (value > VM_FAULT_AROUND_MAX)
+		return (EINVAL);
+	vm_map_set_fault_around(map, value);
+	return (0);
+}
+
+SYSCTL_PROC(_vm, OID_AUTO, fault_around_pages, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_fault_around_pages, "I", "");
+SYSCTL_PROC(_vm, OID_AUTO, fault_around_self, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_LOCKED|CTLFLAG_ANYBODY,
+    0, 0, &sysctl_vm_fault_around_self, "I", "");
+SYSCTL_UINT(_vm, OID_AUTO, fault_around_faults, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_fault_around_faults, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, fault_around_mapped, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_fault_around_mapped, 0, "");
+
+/*
+ * Per-cpu free page magazines.  free_magazine_release_limit is the
+ * number of freed pages a cpu may hold before draining back to the
+ * global free queues; 0 sends every vm_page_release() to the free
+ * queues.  See vm_page_free_magazine_put() in osfmk/vm/vm_resident.c
+ */
+extern unsigned int vm_free_magazine_refill_limit;
+extern unsigned int vm_free_magazine_release_limit;
+extern unsigned int vm_free_magazine_drains;
+extern unsigned int vm_free_magazine_drained;
+SYSCTL_UINT(_vm, OID_AUTO, free_magazine_refill_limit, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_refill_limit, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, free_magazine_release_limit, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_free_magazine_release_limit, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, free_magazine_drains, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_drains, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, free_magazine_drained, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_free_magazine_drained, 0, "");
+
+/*
+ * Promotion of fully resident anonymous 2MB blocks to superpages.
+ * superpage_promoted is the number of blocks currently promoted (and
+ * wired).  See vm_map_superpage_promote() in osfmk/vm/vm_map.c
+ */
+extern int vm_superpage_promote_enabled;
+extern unsigned int vm_superpage_promoted;
+extern unsigned int vm_superpage_promotions;
+extern unsigned int vm_superpage_demotions;
+extern unsigned int vm_superpage_promote_failures;
+SYSCTL_INT(_vm, OID_AUTO, superpage_promote, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_superpage_promote_enabled, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_promoted, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_promoted, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_promotions, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_promotions, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_demotions, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_demotions, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, superpage_promote_failures, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_superpage_promote_failures, 0, "");
+
+/*
+ * Deferred TLB shootdowns for the parent's copy-on-write ranges in fork.
+ * See vm_map_fork() in osfmk/vm/vm_map.c
+ */
+extern int vm_map_fork_batched_tlb_flush;
+extern unsigned int vm_map_fork_batched_tlb_flush_entries;
+SYSCTL_INT(_vm, OID_AUTO, fork_batched_tlb_flush, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_map_fork_batched_tlb_flush, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, fork_batched_tlb_flush_entries, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_map_fork_batched_tlb_flush_entries, 0, "");
+
+/*
+ * Unmapping with the translations torn down outside the map lock.
+ * See vm_map_remove_reserved() in osfmk/vm/vm_map.c
+ */
+extern int vm_map_remove_reserve;
+extern unsigned int vm_map_remove_reserved;
+SYSCTL_INT(_vm, OID_AUTO, remove_reserve, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_map_remove_reserve, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, remove_reserved, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_map_remove_reserved, 0, "");
+
+/*
+ * Evicted shared cache pages kept (compressed) with their slide applied.
+ * slid_page_cache_max is per cache and applies to shared regions slid
+ * after it is set; the oldest pages are evicted once a cache is full.
+ * See vm_shared_region_slid_cache_insert() in osfmk/vm/vm_shared_region.c
+ */
+extern int vm_slid_page_cache_enabled;
+extern unsigned int vm_slid_page_cache_max;
+extern unsigned int vm_slid_page_cache_count;
+extern unsigned int vm_slid_page_cache_inserts;
+extern unsigned int vm_slid_page_cache_hits;
+extern unsigned int vm_slid_page_cache_decompressions;
+extern unsigned int vm_slid_page_cache_evictions;
+SYSCTL_INT(_vm, OID_AUTO, slid_page_cache, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_slid_page_cache_enabled, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, slid_page_cache_max, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_slid_page_cache_max, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, slid_page_cache_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_slid_page_cache_count, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, slid_page_cache_inserts, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_slid_page_cache_inserts, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, slid_page_cache_hits, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_slid_page_cache_hits, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, slid_page_cache_decompressions, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_slid_page_cache_decompressions, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, slid_page_cache_evictions, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_slid_page_cache_evictions, 0, "");
+
+/*
+ * Reclaim threads sharing vm_pageout_scan's work.
+ * See vm_pageout_reclaim_handoff() in osfmk/vm/vm_pageout.c
+ */
+extern int vm_pageout_reclaim_thread_count;
+extern int vm_pageout_reclaim_threads;
+extern unsigned int vm_pageout_reclaim_handoffs;
+extern unsigned int vm_pageout_reclaim_backed_up;
+extern unsigned int vm_pageout_reclaim_freed;
+extern unsigned int vm_pageout_reclaim_redirtied;
+SYSCTL_INT(_vm, OID_AUTO, pageout_reclaim_thread_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_pageout_reclaim_thread_count, 0, "");
+SYSCTL_INT(_vm, OID_AUTO, pageout_reclaim_threads, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_pageout_reclaim_threads, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, pageout_reclaim_handoffs, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_pageout_reclaim_handoffs, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, pageout_reclaim_backed_up, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_pageout_reclaim_backed_up, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, pageout_reclaim_freed, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_pageout_reclaim_freed, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, pageout_reclaim_redirtied, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_pageout_reclaim_redirtied, 0, "");
+
+/*
+ * Purgeable token migrations between the FIFO and LIFO queues.
+ * See vm_purgeable_token_choose_and_delete_ripe() in osfmk/vm/vm_purgeable.c
+ */
+extern int purgeable_nonvolatile_count;
+extern unsigned int vm_purgeable_token_migrations;
+extern unsigned int vm_purgeable_token_migration_steps;
+SYSCTL_INT(_vm, OID_AUTO, purgeable_nonvolatile_count, CTLFLAG_RD | CTLFLAG_LOCKED, &purgeable_nonvolatile_count, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, purgeable_token_migrations, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_purgeable_token_migrations, 0, "");
+SYSCTL_UINT(_vm, OID_AUTO, purgeable_token_migration_steps, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_purgeable_token_migration_steps, 0, "");
+
 __attribute__((noinline)) int __KERNEL_WAITING_ON_TASKGATED_CHECK_ACCESS_UPCALL__(
 	mach_port_t task_access_port, int32_t calling_pid, uint32_t calling_gid, int32_t target_pid);
 /*
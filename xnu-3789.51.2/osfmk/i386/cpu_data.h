@@ -40,6 +40,7 @@
 #include <kern/queue.h>
 #include <kern/processor.h>
 #include <kern/pms.h>
+#include <kern/timer_call.h>
 #include <pexpert/pexpert.h>
 #include <mach/i386/thread_status.h>
 #include <mach/i386/vm_param.h>
@@ -66,7 +67,7 @@ struct prngContext;
  * Data structures embedded in per-cpu data:
  */
 typedef struct rtclock_timer {
-	mpqueue_head_t		queue;
+	struct timer_call_queue	queue;
 	uint64_t		deadline;
 	uint64_t		when_set;
 	boolean_t		has_expired;
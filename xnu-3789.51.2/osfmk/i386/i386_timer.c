@@ -87,7 +87,7 @@ timer_intr(int		user_mode,
 	mytimer = &pp->rtclock_timer;		/* Point to the event timer */
 
 	if ((timer_processed = ((mytimer->deadline <= abstime) ||
-		    (abstime >= (mytimer->queue.earliest_soft_deadline))))) {
+		    (abstime >= (mytimer->queue.mpq.earliest_soft_deadline))))) {
 		/*
 		 * Log interrupt service latency (-ve value expected by tool)
 		 * a non-PM event is expected next.
@@ -100,7 +100,7 @@ timer_intr(int		user_mode,
 		 * coalesced timers.
 		 */
 		if (latency < 0) {
-			TCOAL_DEBUG(0xEEEE0000, abstime, mytimer->queue.earliest_soft_deadline, abstime - mytimer->queue.earliest_soft_deadline, 0, 0);
+			TCOAL_DEBUG(0xEEEE0000, abstime, mytimer->queue.mpq.earliest_soft_deadline, abstime - mytimer->queue.mpq.earliest_soft_deadline, 0, 0);
 			latency = 0;
 		}
 
@@ -111,7 +111,7 @@ timer_intr(int		user_mode,
 			user_mode, 0, 0);
 
 		mytimer->has_expired = TRUE;	/* Remember that we popped */
-		mytimer->deadline = timer_queue_expire(&mytimer->queue, abstime);
+		mytimer->deadline = timer_queue_expire(&mytimer->queue.mpq, abstime);
 		mytimer->has_expired = FALSE;
 
 		/* Get the time again since we ran a bit */
@@ -206,7 +206,7 @@ timer_resync_deadlines(void)
 			DECR_SET_DEADLINE | DBG_FUNC_NONE,
 			decr, 2,
 			deadline,
-			mytimer->queue.count, 0);
+			mytimer->queue.mpq.count, 0);
 	}
 	splx(s);
 }
@@ -225,7 +225,7 @@ __unused void			*arg)
 	abstime = mach_absolute_time();
 
 	mytimer->has_expired = TRUE;
-	mytimer->deadline = timer_queue_expire(&mytimer->queue, abstime);
+	mytimer->deadline = timer_queue_expire(&mytimer->queue.mpq, abstime);
 	mytimer->has_expired = FALSE;
 	mytimer->when_set = mach_absolute_time();
 
@@ -247,7 +247,7 @@ __unused void			*arg)
 	abstime = mach_absolute_time();
 
 	mytimer->has_expired = TRUE;
-	mytimer->deadline = timer_queue_expire_with_options(&mytimer->queue, abstime, TRUE);
+	mytimer->deadline = timer_queue_expire_with_options(&mytimer->queue.mpq, abstime, TRUE);
 	mytimer->has_expired = FALSE;
 	mytimer->when_set = mach_absolute_time();
 
@@ -283,13 +283,13 @@ timer_queue_assign(
 	mpqueue_head_t		*queue;
 
 	if (cdp->cpu_running) {
-		queue = &cdp->rtclock_timer.queue;
+		queue = &cdp->rtclock_timer.queue.mpq;
 
 		if (deadline < cdp->rtclock_timer.deadline)
 			timer_set_deadline(deadline);
 	}
 	else
-		queue = &cpu_datap(master_cpu)->rtclock_timer.queue;
+		queue = &cpu_datap(master_cpu)->rtclock_timer.queue.mpq;
 
     return (queue);
 }
@@ -300,7 +300,7 @@ timer_queue_cancel(
     uint64_t        deadline,
     uint64_t        new_deadline)
 {
-    if (queue == &current_cpu_datap()->rtclock_timer.queue) {
+    if (queue == &current_cpu_datap()->rtclock_timer.queue.mpq) {
         if (deadline < new_deadline)
             timer_set_deadline(new_deadline);
     }
@@ -338,8 +338,8 @@ timer_queue_migrate_cpu(int target_cpu)
 	 * the earliest for the target processor. Since this would force a
 	 * resync, the move of this and all later requests is aborted.
 	 */
-	ntimers_moved = timer_queue_migrate(&cdp->rtclock_timer.queue,
-					    &target_cdp->rtclock_timer.queue);
+	ntimers_moved = timer_queue_migrate(&cdp->rtclock_timer.queue.mpq,
+					    &target_cdp->rtclock_timer.queue.mpq);
 
 	/*
 	 * Assuming we moved stuff, clear local deadline.
@@ -359,7 +359,7 @@ timer_queue_migrate_cpu(int target_cpu)
 mpqueue_head_t *
 timer_queue_cpu(int cpu)
 {
-	return &cpu_datap(cpu)->rtclock_timer.queue;
+	return &cpu_datap(cpu)->rtclock_timer.queue.mpq;
 }
 
 void
@@ -1478,7 +1478,7 @@ i386_deactivate_cpu(void)
 	 * Move all of this cpu's timers to the master/boot cpu,
 	 * and poke it in case there's a sooner deadline for it to schedule.
 	 */
-	timer_queue_shutdown(&cdp->rtclock_timer.queue);
+	timer_queue_shutdown(&cdp->rtclock_timer.queue.mpq);
 	mp_cpus_call(cpu_to_cpumask(master_cpu), ASYNC, timer_queue_expire_local, NULL);
 
 	/*
@@ -110,7 +110,7 @@ machine_idle(void)
 	boolean_t do_process_pending_timers = FALSE;
 
 	ctime = mach_absolute_time();
-	esdeadline = my_cpu->rtclock_timer.queue.earliest_soft_deadline;
+	esdeadline = my_cpu->rtclock_timer.queue.mpq.earliest_soft_deadline;
 	ehdeadline = my_cpu->rtclock_timer.deadline;
 /* Determine if pending timers exist */    
 	if ((ctime >= esdeadline) && (ctime < ehdeadline) &&
@@ -119,7 +119,7 @@ machine_idle(void)
 		do_process_pending_timers = TRUE;
 		goto machine_idle_exit;
 	} else {
-		TCOAL_DEBUG(0xCCCC0000, ctime, my_cpu->rtclock_timer.queue.earliest_soft_deadline, my_cpu->rtclock_timer.deadline, idle_pending_timers_processed, 0);
+		TCOAL_DEBUG(0xCCCC0000, ctime, my_cpu->rtclock_timer.queue.mpq.earliest_soft_deadline, my_cpu->rtclock_timer.deadline, idle_pending_timers_processed, 0);
 	}
     
 	my_cpu->lcpu.state = LCPU_IDLE;
@@ -492,6 +492,8 @@ pmap_enter_options(
 	boolean_t		old_pa_locked;
 	/* 2MiB mappings are confined to x86_64 by VM */
 	boolean_t		superpage = flags & VM_MEM_SUPERPAGE;
+	/* a 2MiB mapping is accounted as the base pages it covers */
+	int			npages = superpage ? SUPERPAGE_NBASEPAGES : 1;
 	vm_object_t		delpage_pm_obj = NULL;
 	uint64_t		delpage_pde_index = 0;
 	pt_entry_t		old_pte;
@@ -568,6 +570,20 @@ Retry:
 				return kr_expand;
 			PMAP_LOCK(pmap);
 		}
+		if (pmap != kernel_pmap && pte == pmap64_pde(pmap, vaddr)) {
+			/*
+			 * vaddr is still covered by a 2MB mapping.  The VM
+			 * demotes promoted superpages before it maps base
+			 * pages into them, so this is only a backstop: drop
+			 * the large mapping and enter the base page into a
+			 * fresh page table.
+			 */
+			PMAP_UNLOCK(pmap);
+			pmap_remove(pmap,
+				    (addr64_t)(vaddr & ~(pde_mapped_size - 1)),
+				    (addr64_t)((vaddr & ~(pde_mapped_size - 1)) + pde_mapped_size));
+			goto Retry;
+		}
 	}
 	if (options & PMAP_EXPAND_OPTIONS_NOENTER) {
 		PMAP_UNLOCK(pmap);
@@ -961,21 +977,21 @@ dont_update_pte:
 	         * only count the mapping
 	         * for 'managed memory'
 	         */
-		pmap_ledger_credit(pmap, task_ledgers.phys_mem, PAGE_SIZE);
-		OSAddAtomic(+1,  &pmap->stats.resident_count);
+		pmap_ledger_credit(pmap, task_ledgers.phys_mem, machine_ptob(npages));
+		OSAddAtomic(+npages,  &pmap->stats.resident_count);
 		if (pmap->stats.resident_count > pmap->stats.resident_max) {
 			pmap->stats.resident_max = pmap->stats.resident_count;
 		}
 		if (pmap != kernel_pmap) {
 			/* update pmap stats */
 			if (IS_REUSABLE_PAGE(pai)) {
-				OSAddAtomic(+1, &pmap->stats.reusable);
+				OSAddAtomic(+npages, &pmap->stats.reusable);
 				PMAP_STATS_PEAK(pmap->stats.reusable);
 			} else if (IS_INTERNAL_PAGE(pai)) {
-				OSAddAtomic(+1, &pmap->stats.internal);
+				OSAddAtomic(+npages, &pmap->stats.internal);
 				PMAP_STATS_PEAK(pmap->stats.internal);
 			} else {
-				OSAddAtomic(+1, &pmap->stats.external);
+				OSAddAtomic(+npages, &pmap->stats.external);
 				PMAP_STATS_PEAK(pmap->stats.external);
 			}
 
@@ -983,8 +999,8 @@ dont_update_pte:
 			if (is_altacct) {
 				/* internal but also alternate accounting */
 				assert(IS_INTERNAL_PAGE(pai));
-				pmap_ledger_credit(pmap, task_ledgers.internal, PAGE_SIZE);
-				pmap_ledger_credit(pmap, task_ledgers.alternate_accounting, PAGE_SIZE);
+				pmap_ledger_credit(pmap, task_ledgers.internal, machine_ptob(npages));
+				pmap_ledger_credit(pmap, task_ledgers.alternate_accounting, machine_ptob(npages));
 				/* alternate accounting, so not in footprint */
 			} else if (IS_REUSABLE_PAGE(pai)) {
 				assert(!is_altacct);
@@ -994,8 +1010,8 @@ dont_update_pte:
 				assert(!is_altacct);
 				assert(!IS_REUSABLE_PAGE(pai));
 				/* internal: add to footprint */
-				pmap_ledger_credit(pmap, task_ledgers.internal, PAGE_SIZE);
-				pmap_ledger_credit(pmap, task_ledgers.phys_footprint, PAGE_SIZE);
+				pmap_ledger_credit(pmap, task_ledgers.internal, machine_ptob(npages));
+				pmap_ledger_credit(pmap, task_ledgers.phys_footprint, machine_ptob(npages));
 			} else {
 				/* not internal: not in footprint */
 			}
@@ -1064,8 +1080,8 @@ dont_update_pte:
 		template = pte_remove_ex(template, is_ept);
 	if (wired) {
 		template |= INTEL_PTE_WIRED;
-		OSAddAtomic(+1,  & pmap->stats.wired_count);
-		pmap_ledger_credit(pmap, task_ledgers.wired_mem, PAGE_SIZE);
+		OSAddAtomic(+npages,  & pmap->stats.wired_count);
+		pmap_ledger_credit(pmap, task_ledgers.wired_mem, machine_ptob(npages));
 	}
 	if (superpage)
 		template |= INTEL_PTE_PS;
@@ -1165,6 +1181,15 @@ pmap_remove_range_options(
 	vm_map_offset_t		vaddr;
 	boolean_t		is_ept = is_ept_pmap(pmap);
 	boolean_t		was_altacct;
+	int			npages;
+
+	/*
+	 * pmap_remove_options() hands us a single level 2 entry
+	 * for a 2MiB mapping, which stands for all of its base pages.
+	 */
+	npages = 1;
+	if (epte == spte + 1 && pmap64_pde(pmap, start_vaddr) == spte)
+		npages = SUPERPAGE_NBASEPAGES;
 
 	num_removed = 0;
 	num_unwired = 0;
@@ -1340,6 +1365,15 @@ update_counts:
 	/*
 	 *	Update the counts
 	 */
+	if (npages != 1) {
+		num_removed *= npages;
+		num_unwired *= npages;
+		stats_external *= npages;
+		stats_internal *= npages;
+		stats_reusable *= npages;
+		ledgers_internal *= npages;
+		ledgers_alt_internal *= npages;
+	}
 #if TESTING
 	if (pmap->stats.resident_count < num_removed)
 	        panic("pmap_remove_range: resident_count");
@@ -1579,6 +1613,7 @@ pmap_page_protect_options(
 	boolean_t		remove;
 	pt_entry_t		new_pte_value;
 	boolean_t		is_ept;
+	int			npages;
 
 	pmap_intr_assert();
 	assert(pn != vm_page_fictitious_addr);
@@ -1650,6 +1685,9 @@ pmap_page_protect_options(
 		}
 		nexth = (pv_hashed_entry_t) queue_next(&pvh_e->qlink);
 
+		/* a 2MiB mapping stands for all of its base pages */
+		npages = (pte == pmap64_pde(pmap, vaddr)) ? SUPERPAGE_NBASEPAGES : 1;
+
 		/*
 		 * Remove the mapping if new protection is NONE
 		 */
@@ -1657,10 +1695,15 @@ pmap_page_protect_options(
 
 			/* Remove per-pmap wired count */
 			if (iswired(*pte)) {
-				OSAddAtomic(-1, &pmap->stats.wired_count);
-				pmap_ledger_debit(pmap, task_ledgers.wired_mem, PAGE_SIZE);
+				OSAddAtomic(-npages, &pmap->stats.wired_count);
+				pmap_ledger_debit(pmap, task_ledgers.wired_mem, machine_ptob(npages));
 			}
 
+			if (npages != 1) {
+				/* a level 2 entry can't hold a "compressed" marker */
+				options &= ~(PMAP_OPTIONS_COMPRESSOR |
+					     PMAP_OPTIONS_COMPRESSOR_IFF_MODIFIED);
+			}
 			if (pmap != kernel_pmap &&
 			    (options & PMAP_OPTIONS_COMPRESSOR) &&
 			    IS_INTERNAL_PAGE(pai)) {
@@ -1723,9 +1766,9 @@ pmap_page_protect_options(
 			if (pmap->stats.resident_count < 1)
 				panic("pmap_page_protect: resident_count");
 #endif
-			pmap_ledger_debit(pmap, task_ledgers.phys_mem, PAGE_SIZE);
-			assert(pmap->stats.resident_count >= 1);
-			OSAddAtomic(-1,  &pmap->stats.resident_count);
+			pmap_ledger_debit(pmap, task_ledgers.phys_mem, machine_ptob(npages));
+			assert(pmap->stats.resident_count >= npages);
+			OSAddAtomic(-npages,  &pmap->stats.resident_count);
 
 			/*
 			 * We only ever compress internal pages.
@@ -1737,13 +1780,13 @@ pmap_page_protect_options(
 				/* update pmap stats */
 				if (IS_REUSABLE_PAGE(pai)) {
 					assert(pmap->stats.reusable > 0);
-					OSAddAtomic(-1, &pmap->stats.reusable);
+					OSAddAtomic(-npages, &pmap->stats.reusable);
 				} else if (IS_INTERNAL_PAGE(pai)) {
 					assert(pmap->stats.internal > 0);
-					OSAddAtomic(-1, &pmap->stats.internal);
+					OSAddAtomic(-npages, &pmap->stats.internal);
 				} else {
 					assert(pmap->stats.external > 0);
-					OSAddAtomic(-1, &pmap->stats.external);
+					OSAddAtomic(-npages, &pmap->stats.external);
 				}
 				if ((options & PMAP_OPTIONS_COMPRESSOR) &&
 				    IS_INTERNAL_PAGE(pai)) {
@@ -1756,8 +1799,8 @@ pmap_page_protect_options(
 				/* update ledgers */
 				if (IS_ALTACCT_PAGE(pai, pv_e)) {
 					assert(IS_INTERNAL_PAGE(pai));
-					pmap_ledger_debit(pmap, task_ledgers.internal, PAGE_SIZE);
-					pmap_ledger_debit(pmap, task_ledgers.alternate_accounting, PAGE_SIZE);
+					pmap_ledger_debit(pmap, task_ledgers.internal, machine_ptob(npages));
+					pmap_ledger_debit(pmap, task_ledgers.alternate_accounting, machine_ptob(npages));
 					if (options & PMAP_OPTIONS_COMPRESSOR) {
 						pmap_ledger_credit(pmap, task_ledgers.internal_compressed, PAGE_SIZE);
 						pmap_ledger_credit(pmap, task_ledgers.alternate_accounting_compressed, PAGE_SIZE);
@@ -1773,7 +1816,7 @@ pmap_page_protect_options(
 				} else if (IS_INTERNAL_PAGE(pai)) {
 					assert(!IS_ALTACCT_PAGE(pai, pv_e));
 					assert(!IS_REUSABLE_PAGE(pai));
-					pmap_ledger_debit(pmap, task_ledgers.internal, PAGE_SIZE);
+					pmap_ledger_debit(pmap, task_ledgers.internal, machine_ptob(npages));
 					/*
 					 * Update all stats related to physical
 					 * footprint, which only deals with
@@ -1795,7 +1838,7 @@ pmap_page_protect_options(
 						 * so adjust stats to keep 
 						 * phys_footprint up to date.
 						 */
-						pmap_ledger_debit(pmap, task_ledgers.phys_footprint, PAGE_SIZE);
+						pmap_ledger_debit(pmap, task_ledgers.phys_footprint, machine_ptob(npages));
 					}
 				}
 			}
@@ -427,7 +427,7 @@ interrupt(x86_saved_state_t *state)
 
 		if ((int_latency < TCOAL_ILAT_THRESHOLD) &&
 		    interrupt_timer_coalescing_enabled) {
-			esdeadline = cdp->rtclock_timer.queue.earliest_soft_deadline;
+			esdeadline = cdp->rtclock_timer.queue.mpq.earliest_soft_deadline;
 			ehdeadline = cdp->rtclock_timer.deadline;
 			if ((ctime >= esdeadline) && (ctime < ehdeadline)) {
 				interrupt_coalesced_timers++;
@@ -435,7 +435,7 @@ interrupt(x86_saved_state_t *state)
 				rtclock_intr(state);
 				TCOAL_DEBUG(0x88880000 | DBG_FUNC_END, ctime, esdeadline, interrupt_coalesced_timers, 0, 0);
 			} else {
-				TCOAL_DEBUG(0x77770000, ctime, cdp->rtclock_timer.queue.earliest_soft_deadline, cdp->rtclock_timer.deadline, interrupt_coalesced_timers, 0);
+				TCOAL_DEBUG(0x77770000, ctime, cdp->rtclock_timer.queue.mpq.earliest_soft_deadline, cdp->rtclock_timer.deadline, interrupt_coalesced_timers, 0);
 			}
 		}
 
@@ -106,6 +106,8 @@
 
 #include <mach/machine/ndr_def.h>   /* NDR_record */
 
+#include <pexpert/pexpert.h>
+
 vm_map_t ipc_kernel_map;
 vm_size_t ipc_kernel_map_size = 1024 * 1024;
 
@@ -224,6 +226,7 @@ ipc_bootstrap(void)
  */
 #define MSG_OOL_SIZE_SMALL_MAX (2*PAGE_SIZE)
 vm_size_t msg_ool_size_small;
+vm_size_t msg_ool_copy_threshold;
 
 /*
  *	Routine:	ipc_init
@@ -236,6 +239,7 @@ ipc_init(void)
 {
 	kern_return_t retval;
 	vm_offset_t min;
+	vm_size_t threshold;
 
 	retval = kmem_suballoc(kernel_map, &min, ipc_kernel_map_size,
 			       TRUE, VM_FLAGS_ANYWHERE | VM_MAKE_TAG(VM_KERN_MEMORY_IPC), &ipc_kernel_map);
@@ -267,6 +271,20 @@ ipc_init(void)
 	/* account for overhead to avoid spilling over a page */
 	msg_ool_size_small -= cpy_kdata_hdr_sz;
 
+	/*
+	 * Regions below msg_ool_copy_threshold are physically copied
+	 * rather than remapped.  It starts out at msg_ool_size_small
+	 * and may only be lowered, either by the "ipc_ool_copy_threshold"
+	 * boot-arg or by the adaptive estimator in ipc_kmsg.c.
+	 */
+	msg_ool_copy_threshold = msg_ool_size_small;
+	if (PE_parse_boot_argn("ipc_ool_copy_threshold", &threshold,
+			       sizeof (threshold))) {
+		ipc_kmsg_ool_adaptive = 0;
+		if (threshold < msg_ool_copy_threshold)
+			msg_ool_copy_threshold = threshold;
+	}
+
 	ipc_host_init();
 
 }
@@ -92,6 +92,7 @@
 #include <kern/misc_protos.h>
 #include <kern/counters.h>
 #include <kern/cpu_data.h>
+#include <kern/clock.h>
 #include <kern/policy_internal.h>
 
 #include <machine/machlimits.h>
@@ -508,6 +509,84 @@ extern vm_size_t	msg_ool_size_small;
 
 #define MSG_OOL_SIZE_SMALL	msg_ool_size_small
 
+/*
+ * Adaptive copy-vs-remap threshold for out-of-line memory.
+ *
+ * vm_map_copyin() physically copies regions smaller than
+ * msg_ool_copy_threshold into a kernel buffer and remaps anything
+ * larger.  The static cutoff (msg_ool_size_small) is sized for the
+ * worst case; on machines where setting up a virtual copy is cheap
+ * relative to memory bandwidth it is better to remap earlier.
+ *
+ * Copyin of OOL descriptors is sampled (roughly 1 in 64, keyed off
+ * the timestamp so no shared counter is written on the fast path)
+ * and two moving averages are kept: the cost of copying a KB into a
+ * kernel buffer, and the fixed cost of building a virtual copy.  The
+ * break-even size between the two becomes the new threshold.  The
+ * remap estimate does not include the deferred copy-on-write faults,
+ * so the threshold is only ever lowered below msg_ool_size_small,
+ * never raised above it.
+ *
+ * Setting kern.ipc_ool_adaptive to 0 (or passing the
+ * ipc_ool_copy_threshold boot-arg) pins the threshold.
+ */
+#define IPC_KMSG_OOL_SAMPLE_MASK	0x3f
+#define IPC_KMSG_OOL_EWMA_SHIFT		3
+
+int		ipc_kmsg_ool_adaptive = 1;
+uint64_t	ipc_kmsg_ool_kbuf_cost;		/* abs time per KB copied */
+uint64_t	ipc_kmsg_ool_remap_cost;	/* abs time per virtual copy */
+uint64_t	ipc_kmsg_ool_batched_copyouts;
+
+static inline uint64_t
+ipc_kmsg_ool_ewma(uint64_t avg, uint64_t sample)
+{
+	if (avg == 0)
+		return sample;
+	return avg - (avg >> IPC_KMSG_OOL_EWMA_SHIFT) +
+		(sample >> IPC_KMSG_OOL_EWMA_SHIFT);
+}
+
+static void
+ipc_kmsg_ool_sample(
+	vm_map_copy_t	copy,
+	vm_size_t	length,
+	uint64_t	start,
+	uint64_t	end)
+{
+	uint64_t	kbuf, remap, threshold;
+
+	if (!ipc_kmsg_ool_adaptive || end <= start)
+		return;
+	if (((start >> 4) & IPC_KMSG_OOL_SAMPLE_MASK) != 0)
+		return;
+
+	if (copy->type == VM_MAP_COPY_KERNEL_BUFFER && length >= 1024) {
+		/* below a KB the kalloc overhead swamps the per-byte cost */
+		ipc_kmsg_ool_kbuf_cost = ipc_kmsg_ool_ewma(
+			ipc_kmsg_ool_kbuf_cost, ((end - start) << 10) / length);
+	} else if (copy->type == VM_MAP_COPY_ENTRY_LIST &&
+		   length <= 4 * MSG_OOL_SIZE_SMALL) {
+		/* only near-threshold sizes say anything about the cutoff */
+		ipc_kmsg_ool_remap_cost = ipc_kmsg_ool_ewma(
+			ipc_kmsg_ool_remap_cost, end - start);
+	} else {
+		return;
+	}
+
+	kbuf = ipc_kmsg_ool_kbuf_cost;
+	remap = ipc_kmsg_ool_remap_cost;
+	if (kbuf == 0 || remap == 0)
+		return;
+
+	threshold = (remap << 10) / kbuf;
+	if (threshold < PAGE_SIZE)
+		threshold = PAGE_SIZE;
+	if (threshold > MSG_OOL_SIZE_SMALL)
+		threshold = MSG_OOL_SIZE_SMALL;
+	msg_ool_copy_threshold = (vm_size_t)threshold;
+}
+
 #if defined(__LP64__)
 #define MAP_SIZE_DIFFERS(map)	(map->max_offset < MACH_VM_MAX_ADDRESS)
 #define OTHER_OOL_DESCRIPTOR	mach_msg_ool_descriptor32_t
@@ -2719,6 +2798,7 @@ ipc_kmsg_copyin_ool_descriptor(
          * NOTE: A virtual copy is OK if the original is being
          * deallocted, even if a physical copy was requested.
          */
+        uint64_t start = mach_absolute_time();
         kern_return_t kr = vm_map_copyin(map, addr, 
                 (vm_map_size_t)length, dealloc, copy);
         if (kr != KERN_SUCCESS) {
@@ -2727,6 +2807,8 @@ ipc_kmsg_copyin_ool_descriptor(
                 MACH_SEND_INVALID_MEMORY;
             return NULL;
         }
+        if (!dealloc)
+            ipc_kmsg_ool_sample(*copy, length, start, mach_absolute_time());
         dsc->address = (void *)*copy;
     }
     return user_dsc;
@@ -3954,9 +4036,9 @@ ipc_kmsg_copyout_port_descriptor(mach_msg_descriptor_t *dsc,
 }
 
 mach_msg_descriptor_t *
-ipc_kmsg_copyout_ool_descriptor(mach_msg_ool_descriptor_t *dsc, mach_msg_descriptor_t *user_dsc, int is_64bit, vm_map_t map, mach_msg_return_t *mr);
+ipc_kmsg_copyout_ool_descriptor(mach_msg_ool_descriptor_t *dsc, mach_msg_descriptor_t *user_dsc, int is_64bit, vm_map_t map, vm_map_address_t batch_addr, mach_msg_return_t *mr);
 mach_msg_descriptor_t *
-ipc_kmsg_copyout_ool_descriptor(mach_msg_ool_descriptor_t *dsc, mach_msg_descriptor_t *user_dsc, int is_64bit, vm_map_t map, mach_msg_return_t *mr)
+ipc_kmsg_copyout_ool_descriptor(mach_msg_ool_descriptor_t *dsc, mach_msg_descriptor_t *user_dsc, int is_64bit, vm_map_t map, vm_map_address_t batch_addr, mach_msg_return_t *mr)
 {
     vm_map_copy_t			copy;
     vm_map_address_t			rcv_addr;
@@ -3972,7 +4054,10 @@ ipc_kmsg_copyout_ool_descriptor(mach_msg_ool_descriptor_t *dsc, mach_msg_descrip
     assert(copy_options != MACH_MSG_KALLOC_COPY_T);
     dsc_type = dsc->type;
 
-    if (copy != VM_MAP_COPY_NULL) {
+    if (batch_addr != 0) {
+        /* already copied out by ipc_kmsg_copyout_ool_batch() */
+        rcv_addr = batch_addr;
+    } else if (copy != VM_MAP_COPY_NULL) {
 	kern_return_t kr;
 
         rcv_addr = 0;
@@ -4195,6 +4280,75 @@ ipc_kmsg_copyout_ool_ports_descriptor(mach_msg_ool_ports_descriptor_t *dsc,
     return user_dsc;
 }
 
+/*
+ *	Routine:	ipc_kmsg_copyout_ool_batch
+ *	Purpose:
+ *		Copy out all the small (kernel buffer) out-of-line
+ *		regions of a message in as few vm_map operations as
+ *		possible.  Each region still lands at its own page
+ *		aligned address, but space for up to
+ *		IPC_KMSG_OOL_BATCH_MAX of them is allocated with a
+ *		single map lock/unlock.
+ *
+ *		batch_addrs[i] is set to the receive address for every
+ *		descriptor that was handled here, 0 otherwise.  Any
+ *		descriptor left at 0 takes the regular path in
+ *		ipc_kmsg_copyout_ool_descriptor().
+ *	Conditions:
+ *		Nothing locked.
+ */
+#define IPC_KMSG_OOL_BATCH_MAX	16
+
+static void
+ipc_kmsg_copyout_ool_batch(
+	mach_msg_descriptor_t	*kern_dsc,
+	mach_msg_type_number_t	dsc_count,
+	vm_map_t		map,
+	vm_map_address_t	*batch_addrs)
+{
+    vm_map_copy_t		copies[IPC_KMSG_OOL_BATCH_MAX];
+    vm_map_address_t		addrs[IPC_KMSG_OOL_BATCH_MAX];
+    mach_msg_type_number_t	index[IPC_KMSG_OOL_BATCH_MAX];
+    mach_msg_type_number_t	i, j, n;
+
+    i = 0;
+    while (i < dsc_count) {
+        n = 0;
+        for (; i < dsc_count && n < IPC_KMSG_OOL_BATCH_MAX; i++) {
+            mach_msg_ool_descriptor_t *dsc;
+            vm_map_copy_t copy;
+
+            batch_addrs[i] = 0;
+            switch (kern_dsc[i].type.type) {
+            case MACH_MSG_OOL_VOLATILE_DESCRIPTOR:
+            case MACH_MSG_OOL_DESCRIPTOR:
+                break;
+            default:
+                continue;
+            }
+
+            dsc = (mach_msg_ool_descriptor_t *)&kern_dsc[i];
+            copy = (vm_map_copy_t)dsc->address;
+            if (copy == VM_MAP_COPY_NULL ||
+                copy->type != VM_MAP_COPY_KERNEL_BUFFER ||
+                copy->size != dsc->size)
+                continue;
+
+            copies[n] = copy;
+            index[n] = i;
+            n++;
+        }
+
+        /* a batch of one gains nothing over the regular path */
+        if (n > 1 &&
+            vm_map_copyout_kernel_buffers(map, copies, addrs, n) == KERN_SUCCESS) {
+            for (j = 0; j < n; j++)
+                batch_addrs[index[j]] = addrs[j];
+            ipc_kmsg_ool_batched_copyouts += n;
+        }
+    }
+}
+
 /*
  *	Routine:	ipc_kmsg_copyout_body
  *	Purpose:
@@ -4228,6 +4382,8 @@ ipc_kmsg_copyout_body(
     int i;
     mach_msg_return_t 		mr = MACH_MSG_SUCCESS;
     boolean_t 			is_task_64bit = (map->max_offset > VM_MAX_ADDRESS);
+    vm_map_address_t		batch_addrs_small[IPC_KMSG_OOL_BATCH_MAX];
+    vm_map_address_t		*batch_addrs = NULL;
 
     body = (mach_msg_body_t *) (kmsg->ikm_header + 1);
     dsc_count = body->msgh_descriptor_count;
@@ -4246,6 +4402,22 @@ ipc_kmsg_copyout_body(
 	sdsc_count = 0;
     }
 
+    /*
+     * Batch the small out-of-line regions so the receiver's map is
+     * locked once for all of them rather than once per descriptor.
+     * The kernel's own map is left to the regular path.  Only
+     * messages with more descriptors than fit on the stack pay for
+     * an allocation.
+     */
+    if (map != kernel_map && dsc_count > 1) {
+        if (dsc_count <= IPC_KMSG_OOL_BATCH_MAX)
+            batch_addrs = batch_addrs_small;
+        else
+            batch_addrs = kalloc(dsc_count * sizeof (vm_map_address_t));
+        if (batch_addrs != NULL)
+            ipc_kmsg_copyout_ool_batch(kern_dsc, dsc_count, map, batch_addrs);
+    }
+
     /* Now process the descriptors */
     for (i = dsc_count-1; i >= 0; i--) {
         switch (kern_dsc[i].type.type) {
@@ -4256,7 +4428,8 @@ ipc_kmsg_copyout_body(
             case MACH_MSG_OOL_VOLATILE_DESCRIPTOR:
             case MACH_MSG_OOL_DESCRIPTOR : 
                 user_dsc = ipc_kmsg_copyout_ool_descriptor(
-                        (mach_msg_ool_descriptor_t *)&kern_dsc[i], user_dsc, is_task_64bit, map, &mr);
+                        (mach_msg_ool_descriptor_t *)&kern_dsc[i], user_dsc, is_task_64bit, map,
+                        (batch_addrs != NULL) ? batch_addrs[i] : 0, &mr);
                 break;
             case MACH_MSG_OOL_PORTS_DESCRIPTOR : 
                 user_dsc = ipc_kmsg_copyout_ool_ports_descriptor(
@@ -4268,6 +4441,9 @@ ipc_kmsg_copyout_body(
         }
     }
 
+    if (batch_addrs != NULL && batch_addrs != batch_addrs_small)
+        kfree(batch_addrs, dsc_count * sizeof (vm_map_address_t));
+
     if(user_dsc != kern_dsc) {
         vm_offset_t dsc_adjust = (vm_offset_t)user_dsc - (vm_offset_t)kern_dsc;
         memmove((char *)((vm_offset_t)kmsg->ikm_header + dsc_adjust), kmsg->ikm_header, sizeof(mach_msg_base_t));
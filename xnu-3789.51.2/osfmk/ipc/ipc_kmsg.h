@@ -257,6 +257,12 @@ extern boolean_t ipc_kmsg_delayed_destroy(
 /* Process all the delayed message destroys */
 extern void ipc_kmsg_reap_delayed(void);
 
+/* Copy-vs-remap tuning for out-of-line memory descriptors */
+extern int		ipc_kmsg_ool_adaptive;
+extern uint64_t		ipc_kmsg_ool_kbuf_cost;
+extern uint64_t		ipc_kmsg_ool_remap_cost;
+extern uint64_t		ipc_kmsg_ool_batched_copyouts;
+
 /* Preallocate a kernel message buffer */
 extern ipc_kmsg_t ipc_kmsg_prealloc(
 	mach_msg_size_t	size);
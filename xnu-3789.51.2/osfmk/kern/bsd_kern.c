@@ -323,6 +323,7 @@ swap_task_map(task_t task, thread_t thread, vm_map_t map)
 
 	old_map = task->map;
 	thread->map = task->map = map;
+	thread->spec_fault_map = VM_MAP_NULL;
 	vm_commit_pagezero_status(map);
 
 	if (doswitch) {
@@ -44,6 +44,7 @@
 
 #include <libkern/OSAtomic.h>
 #include <mach/mach_types.h>
+#include <machine/machine_routines.h>
 #include <os/overflow.h>
 
 /*
@@ -174,8 +175,11 @@ static kern_return_t ledger_perform_blocking(ledger_t l);
 static uint32_t flag_set(volatile uint32_t *flags, uint32_t bit);
 static uint32_t flag_clear(volatile uint32_t *flags, uint32_t bit);
 
-static void ledger_entry_check_new_balance(ledger_t ledger, int entry,
-					   struct ledger_entry *le);
+static void ledger_entry_check_new_balance(thread_t thread, ledger_t ledger,
+					   int entry, struct ledger_entry *le);
+static boolean_t ledger_defer_update(ledger_t ledger, int entry,
+		struct ledger_entry *le, ledger_amount_t credit, ledger_amount_t debit);
+static void ledger_defer_sync(ledger_t ledger);
 
 #if 0
 static void
@@ -678,7 +682,8 @@ ledger_refill(uint64_t now, ledger_t ledger, int entry)
 #define TOCKSTAMP_IS_STALE(now, tock) ((((now) - (tock)) < NTOCKS) ? FALSE : TRUE)
 
 void
-ledger_entry_check_new_balance(ledger_t ledger, int entry, struct ledger_entry *le)
+ledger_entry_check_new_balance(thread_t thread, ledger_t ledger,
+			       int entry, struct ledger_entry *le)
 {
 	ledger_amount_t	credit, debit;
 
@@ -723,7 +728,7 @@ ledger_entry_check_new_balance(ledger_t ledger, int entry, struct ledger_entry *
 		if ((le->le_flags & LEDGER_ACTION_BLOCK) ||
 		    (!(le->le_flags & LF_CALLED_BACK) &&
 		    entry_get_callback(ledger, entry))) {
-			set_astledger(current_thread());
+			set_astledger(thread);
 		}
 	} else {
 		/*
@@ -752,7 +757,7 @@ ledger_entry_check_new_balance(ledger_t ledger, int entry, struct ledger_entry *
 		 			 * set the AST so it can be done before returning
 		 			 * to userland.
 		 			 */
-					set_astledger(current_thread());
+					set_astledger(thread);
 				}
 			} else {
 				/*
@@ -766,7 +771,7 @@ ledger_entry_check_new_balance(ledger_t ledger, int entry, struct ledger_entry *
 					 * know the ledger balance is now back below
 					 * the warning level.
 					 */
-					set_astledger(current_thread());
+					set_astledger(thread);
 				}
 			}
 		}
@@ -791,9 +796,164 @@ ledger_check_new_balance(ledger_t ledger, int entry)
 	struct ledger_entry *le;
 	assert(entry > 0 && entry <= ledger->l_size);
 	le = &ledger->l_entries[entry];
-	ledger_entry_check_new_balance(ledger, entry, le);
+	ledger_entry_check_new_balance(current_thread(), ledger, entry, le);
 }
 
+/*
+ * Deferred updates.
+ *
+ * Every credit and debit is an atomic add to the shared ledger entry, and
+ * the threads of a busy task all hit the same entries of the task ledger.
+ * A thread instead batches its updates to entries of its own t_ledger in
+ * t_ledger_defer, provided the entry gives ledger_entry_check_new_balance()
+ * nothing to do: no limit or warning level, no refill, no rolling maximum,
+ * no panic on a negative balance and no callback state to clear.  The sum
+ * is applied and checked as a single update when the thread is switched
+ * out, when a slot has batched ledger_defer_max_updates updates, or when
+ * the thread next updates an entry that has stopped qualifying, so that
+ * any update which could cross a limit is checked as it is made.
+ * task_ledgers.cpu_time is never batched.
+ *
+ * Setting kern.ledger_defer to 0 applies every update directly.
+ */
+#define	LF_DEFER_INELIGIBLE						\
+	(LEDGER_ACTION_BLOCK | LF_WAKE_NEEDED | LF_REFILL_SCHEDULED |	\
+	 LF_CALLED_BACK | LF_WARNED | LF_TRACKING_MAX | LF_PANIC_ON_NEGATIVE)
+
+int ledger_defer_enable = 1;
+uint32_t ledger_defer_max_updates = 32;
+
+static inline boolean_t
+ledger_entry_deferrable(struct ledger_entry *le)
+{
+	return (((le->le_flags & LF_DEFER_INELIGIBLE) == 0) &&
+	    (le->le_limit == LEDGER_LIMIT_INFINITY) &&
+	    (le->le_warn_level == LEDGER_LIMIT_INFINITY));
+}
+
+static void
+ledger_defer_apply(thread_t thread, struct ledger_defer_slot *slot,
+    ledger_amount_t credit, ledger_amount_t debit)
+{
+	ledger_t ledger = thread->t_ledger;
+	struct ledger_entry *le = &ledger->l_entries[slot->lds_entry];
+
+	if (credit != 0)
+		OSAddAtomic64(credit, &le->le_credit);
+	if (debit != 0)
+		OSAddAtomic64(debit, &le->le_debit);
+	ledger_entry_check_new_balance(thread, ledger, slot->lds_entry, le);
+
+	slot->lds_updates = 0;
+}
+
+/*
+ * Apply everything batched by a thread.  The thread must be the current
+ * thread with preemption disabled, or not running at all.
+ */
+static void
+ledger_defer_drain(thread_t thread)
+{
+	struct ledger_defer_slot *slot;
+	int i;
+
+	for (i = 0; i < LEDGER_DEFER_SLOTS; i++) {
+		slot = &thread->t_ledger_defer.ld_slots[i];
+		if (slot->lds_updates != 0)
+			ledger_defer_apply(thread, slot, slot->lds_credit,
+			    slot->lds_debit);
+	}
+}
+
+/*
+ * Called from thread_dispatch() for the thread being switched out.
+ */
+void
+ledger_defer_flush(thread_t thread)
+{
+	if (thread->t_ledger != LEDGER_NULL)
+		ledger_defer_drain(thread);
+}
+
+/*
+ * Make the current thread's own updates visible before reading its ledger.
+ */
+static void
+ledger_defer_sync(ledger_t ledger)
+{
+	thread_t thread = current_thread();
+
+	if (ledger != thread->t_ledger || ml_at_interrupt_context())
+		return;
+
+	disable_preemption();
+	ledger_defer_drain(thread);
+	enable_preemption();
+}
+
+/*
+ * Batch an update to an entry of the current thread's ledger.  Returns
+ * FALSE if the caller must apply the update itself.
+ */
+static boolean_t
+ledger_defer_update(ledger_t ledger, int entry, struct ledger_entry *le,
+    ledger_amount_t credit, ledger_amount_t debit)
+{
+	thread_t thread = current_thread();
+	struct ledger_defer_slot *slot, *free_slot = NULL;
+	int i;
+
+	/*
+	 * CPU time is credited by thread_dispatch() on behalf of the thread
+	 * being switched out, while current_thread() is already the incoming
+	 * thread, so it would land in the wrong thread's batch.
+	 */
+	if (ledger != thread->t_ledger || entry == task_ledgers.cpu_time ||
+	    !ledger_defer_enable || ml_at_interrupt_context())
+		return (FALSE);
+
+	disable_preemption();
+
+	for (i = 0; i < LEDGER_DEFER_SLOTS; i++) {
+		slot = &thread->t_ledger_defer.ld_slots[i];
+		if (slot->lds_updates == 0) {
+			if (free_slot == NULL)
+				free_slot = slot;
+		} else if (slot->lds_entry == entry) {
+			break;
+		}
+	}
+
+	if (i < LEDGER_DEFER_SLOTS) {
+		if (!ledger_entry_deferrable(le) ||
+		    slot->lds_updates + 1 >= ledger_defer_max_updates) {
+			/*
+			 * Apply the batch together with this update, so the
+			 * entry sees and checks them as one.
+			 */
+			slot->lds_updates++;
+			ledger_defer_apply(thread, slot,
+			    slot->lds_credit + credit, slot->lds_debit + debit);
+			enable_preemption();
+			return (TRUE);
+		}
+	} else if (free_slot != NULL && ledger_entry_deferrable(le)) {
+		slot = free_slot;
+		slot->lds_entry = entry;
+		slot->lds_credit = 0;
+		slot->lds_debit = 0;
+	} else {
+		enable_preemption();
+		return (FALSE);
+	}
+
+	slot->lds_credit += credit;
+	slot->lds_debit += debit;
+	slot->lds_updates++;
+
+	enable_preemption();
+	return (TRUE);
+}
 
 /*
  * Add value to an entry in a ledger.
@@ -812,10 +972,13 @@ ledger_credit(ledger_t ledger, int entry, ledger_amount_t amount)
 
 	le = &ledger->l_entries[entry];
 
+	if (ledger_defer_update(ledger, entry, le, amount, 0))
+		return (KERN_SUCCESS);
+
 	old = OSAddAtomic64(amount, &le->le_credit);
 	new = old + amount;
 	lprintf(("%p Credit %lld->%lld\n", current_thread(), old, new));
-	ledger_entry_check_new_balance(ledger, entry, le);
+	ledger_entry_check_new_balance(current_thread(), ledger, entry, le);
 
 	return (KERN_SUCCESS);
 }
@@ -1249,15 +1412,19 @@ ledger_debit(ledger_t ledger, int entry, ledger_amount_t amount)
 
 	if (le->le_flags & LF_TRACK_CREDIT_ONLY) {
 		assert(le->le_debit == 0);
+		if (ledger_defer_update(ledger, entry, le, -amount, 0))
+			return (KERN_SUCCESS);
 		old = OSAddAtomic64(-amount, &le->le_credit);
 		new = old - amount;
 	} else {
+		if (ledger_defer_update(ledger, entry, le, 0, amount))
+			return (KERN_SUCCESS);
 		old = OSAddAtomic64(amount, &le->le_debit);
 		new = old + amount;
 	}
 	lprintf(("%p Debit %lld->%lld\n", thread, old, new));
 
-	ledger_entry_check_new_balance(ledger, entry, le);
+	ledger_entry_check_new_balance(current_thread(), ledger, entry, le);
 	return (KERN_SUCCESS);
 
 }
@@ -1487,6 +1654,7 @@ ledger_get_entries(ledger_t ledger, int entry, ledger_amount_t *credit,
 		return (KERN_INVALID_ARGUMENT);
 
 	le = &ledger->l_entries[entry];
+	ledger_defer_sync(ledger);
 
 	*credit = le->le_credit;
 	*debit = le->le_debit;
@@ -1533,6 +1701,7 @@ ledger_get_balance(ledger_t ledger, int entry, ledger_amount_t *balance)
 		return (KERN_INVALID_ARGUMENT);
 
 	le = &ledger->l_entries[entry];
+	ledger_defer_sync(ledger);
 
 	if (le->le_flags & LF_TRACK_CREDIT_ONLY) {
 		assert(le->le_debit == 0);
@@ -1623,6 +1792,7 @@ ledger_get_task_entry_info_multiple(task_t task, void **buf, int *len)
 	*buf = lei;
 
 	le = l->l_entries;
+	ledger_defer_sync(l);
 
 	for (i = 0; i < *len; i++) {
 		ledger_fill_entry_info(le, lei, now);
@@ -1645,6 +1815,7 @@ ledger_get_entry_info(ledger_t                  ledger,
 
 	if (entry >= 0 && entry < ledger->l_size) {
 		struct ledger_entry *le = &ledger->l_entries[entry];
+		ledger_defer_sync(ledger);
 		ledger_fill_entry_info(le, lei, now);
 	}
 }
@@ -167,6 +167,10 @@ ledger_get_entry_info(ledger_t ledger, int entry,
 
 extern int ledger_template_info(void **buf, int *len);
 
+#ifdef MACH_KERNEL_PRIVATE
+extern void ledger_defer_flush(thread_t thread);
+#endif /* MACH_KERNEL_PRIVATE */
+
 #endif /* KERNEL_PRIVATE */
 
 #endif	/* _KERN_LEDGER_H_ */
@@ -144,6 +144,108 @@ static void lt_elem_set_type(struct lt_elem *elem, int type)
 }
 
 
+/* the free list shard preferred by the current CPU */
+static inline struct lt_free_shard *lt_local_shard(struct link_table *table)
+{
+	return &table->free[cpu_number() & LT_FREE_SHARD_MASK];
+}
+
+/**
+ * lt_free_list_push: push a chain of free elements onto a free list shard
+ *
+ * 'head' through 'tail' must already be linked via lt_next_idx. The chain is
+ * atomically spliced onto the front of 'shard's free list.
+ */
+static void lt_free_list_push(struct link_table *table,
+                              struct lt_free_shard *shard,
+                              struct lt_elem *head, struct lt_elem *tail)
+{
+	struct ltable_id free_id;
+
+again:
+	free_id = shard->free_list;
+	if (free_id.idx >= table->nelem)
+		tail->lt_next_idx = LT_IDX_MAX;
+	else
+		tail->lt_next_idx = free_id.idx;
+
+	/* store barrier */
+	OSMemoryBarrier();
+	if (OSCompareAndSwap64(free_id.id, head->lt_id.id,
+			       &shard->free_list.id) == FALSE)
+		goto again;
+}
+
+/**
+ * lt_free_list_pop: pop 'nelem' elements off a free list shard
+ *
+ * Returns the first element of the popped chain (terminated with
+ * LT_IDX_MAX), or NULL if the shard doesn't hold enough elements or if we
+ * lost a race with another thread (in which case '*raced' is set).
+ *
+ * The last element on a shard's list is never handed out: the list head must
+ * always name a real element so that the CAS below has something to swap in.
+ */
+static struct lt_elem *lt_free_list_pop(struct link_table *table,
+                                        struct lt_free_shard *shard,
+                                        int nelem, int *raced)
+{
+	struct ltable_id free_id, next_id;
+	struct lt_elem *elem = NULL;
+	uint32_t table_size = table->nelem;
+	int nalloc;
+
+	*raced = 0;
+
+	/* read this value only once before the CAS */
+	free_id = shard->free_list;
+	if (free_id.idx >= table_size)
+		return NULL;
+
+	/*
+	 * Find the item on the free list which will become the new free list
+	 * head, but be careful not to modify any memory (read only)!  Other
+	 * threads can alter table state at any time up until the CAS.  We
+	 * don't modify any memory until we've successfully swapped out the
+	 * free list head with the one we've investigated.
+	 */
+	next_id.id = 0;
+	nalloc = 0;
+	for (struct lt_elem *next_elem = lt_elem_idx(table, free_id.idx);
+	     nalloc < nelem;
+	     nalloc++) {
+		elem = next_elem;
+		next_id.generation = 0;
+		next_id.idx = next_elem->lt_next_idx;
+		if (next_id.idx < table->nelem) {
+			next_elem = lt_elem_idx(table, next_id.idx);
+			next_id.id = next_elem->lt_id.id;
+		} else {
+			/* not enough here, or the list changed under us */
+			if (shard->free_list.id != free_id.id)
+				*raced = 1;
+			return NULL;
+		}
+	}
+	/* 'elem' points to the last element being allocated */
+
+	if (OSCompareAndSwap64(free_id.id, next_id.id,
+			       &shard->free_list.id) == FALSE) {
+		*raced = 1;
+		return NULL;
+	}
+
+	/* load barrier */
+	OSMemoryBarrier();
+
+	/* end the list of allocated elements */
+	elem->lt_next_idx = LT_IDX_MAX;
+
+	/* return the first allocated element */
+	return lt_elem_idx(table, free_id.idx);
+}
+
+
 /**
  * ltable_bootstrap: bootstrap a link table
  *
@@ -178,6 +280,7 @@ void ltable_init(struct link_table *table, const char *name,
 	uint32_t slab_sz, slab_shift, slab_msk, slab_elem;
 	zone_t slab_zone;
 	size_t max_tbl_sz;
+	uint32_t shard_elem;
 	struct lt_elem *e, **base;
 
 #ifndef CONFIG_LTABLE_STATS
@@ -262,6 +365,33 @@ void ltable_init(struct link_table *table, const char *name,
 
 	lck_mtx_init(&table->lock, &g_lt_lck_grp, LCK_ATTR_NULL);
 
+	/*
+	 * Carve the first slab up evenly between the free list shards. Any
+	 * shard left without elements starts out with a never-valid head.
+	 */
+	shard_elem = slab_elem / LT_FREE_SHARDS;
+	for (int i = 0; i < LT_FREE_SHARDS; i++) {
+		table->free[i].free_list.id = 0;
+		table->free[i].free_list.idx = LT_IDX_MAX;
+		table->free[i].nused = 0;
+#if CONFIG_LTABLE_STATS
+		table->free[i].nsteals = 0;
+#endif
+		if (shard_elem == 0) {
+			if (i == 0)
+				table->free[0].free_list.id = base[0]->lt_id.id;
+			continue;
+		}
+		e = lt_elem_ofst_slab(base[0], slab_msk,
+				      (i * shard_elem) * elem_sz);
+		table->free[i].free_list.id = e->lt_id.id;
+		if (i < LT_FREE_SHARDS - 1) {
+			e = lt_elem_ofst_slab(base[0], slab_msk,
+					      ((i + 1) * shard_elem - 1) * elem_sz);
+			e->lt_next_idx = LT_IDX_MAX;
+		}
+	}
+
 	table->slab_sz = slab_sz;
 	table->slab_shift = slab_shift;
 	table->slab_msk = slab_msk;
@@ -270,13 +400,11 @@ void ltable_init(struct link_table *table, const char *name,
 
 	table->elem_sz = elem_sz;
 	table->nelem = slab_elem;
-	table->used_elem = 0;
 	table->elem_sz = elem_sz;
 	table->poison = poison;
 
 	table->table = base;
 	table->next_free_slab = &base[1];
-	table->free_list.id = base[0]->lt_id.id;
 
 #if CONFIG_LTABLE_STATS
 	table->nslabs = 1;
@@ -305,15 +433,14 @@ void ltable_grow(struct link_table *table, uint32_t min_free)
 {
 	struct lt_elem *slab, **slot;
 	struct lt_elem *e = NULL, *first_new_elem, *last_new_elem;
-	struct ltable_id free_id;
-	uint32_t free_elem;
+	uint32_t free_elem, new_elem, shard_elem;
 
 	assert(get_preemption_level() == 0);
 	assert(table && table->slab_zone);
 
 	lck_mtx_lock(&table->lock);
 
-	free_elem = table->nelem - table->used_elem;
+	free_elem = table->nelem - ltable_used_elem(table);
 
 	/*
 	 * If the caller just wanted to ensure a minimum number of elements,
@@ -335,13 +462,13 @@ void ltable_grow(struct link_table *table, uint32_t min_free)
 		 * before we panic, check one more time to see if any other
 		 * threads have free'd from space in the table.
 		 */
-		if ((table->nelem - table->used_elem) > 0) {
+		if ((table->nelem - ltable_used_elem(table)) > LT_FREE_SHARDS) {
 			/* there's at least 1 free element: don't panic yet */
 			lck_mtx_unlock(&table->lock);
 			return;
 		}
 		panic("No more room to grow table: %p (nelem: %d, used: %d)",
-		      table, table->nelem, table->used_elem);
+		      table, table->nelem, ltable_used_elem(table));
 	}
 	slot = table->next_free_slab;
 	table->next_free_slab++;
@@ -360,6 +487,7 @@ void ltable_grow(struct link_table *table, uint32_t min_free)
 
 	/* put the new elements into a freelist */
 	ltdbg_v("    init %d new links...", table->slab_elem);
+	new_elem = 0;
 	for (unsigned l = 0; l < table->slab_elem; l++) {
 		uint32_t idx = l + table->nelem;
 		if (idx >= (LT_IDX_MAX - 1))
@@ -367,11 +495,9 @@ void ltable_grow(struct link_table *table, uint32_t min_free)
 		e = lt_elem_ofst_slab(slab, table->slab_msk, l * table->elem_sz);
 		e->lt_id.idx = idx;
 		e->lt_next_idx = idx + 1;
+		new_elem++;
 	}
-	last_new_elem = e;
-	assert(last_new_elem != NULL);
-
-	first_new_elem = lt_elem_ofst_slab(slab, table->slab_msk, 0);
+	assert(e != NULL);
 
 	/* update table book keeping, and atomically swap the freelist head */
 	*slot = slab;
@@ -385,18 +511,27 @@ void ltable_grow(struct link_table *table, uint32_t min_free)
 #endif
 
 	/*
-	 * The atomic swap of the free list head marks the end of table
+	 * The atomic swaps of the free list heads mark the end of table
 	 * growth. Incoming requests may now use the newly allocated slab
-	 * of table elements
+	 * of table elements. The slab is spread across all the shards so
+	 * that a burst of allocation on one CPU doesn't immediately turn
+	 * into steals on every other CPU.
 	 */
-	free_id = table->free_list;
-	/* connect the existing free list to the end of the new free list */
-	last_new_elem->lt_next_idx = free_id.idx;
-	while (OSCompareAndSwap64(free_id.id, first_new_elem->lt_id.id,
-				  &table->free_list.id) == FALSE) {
-		OSMemoryBarrier();
-		free_id = table->free_list;
-		last_new_elem->lt_next_idx = free_id.idx;
+	shard_elem = new_elem / LT_FREE_SHARDS;
+	if (shard_elem == 0)
+		shard_elem = new_elem;
+	for (uint32_t first = 0, i = 0; first < new_elem; first += shard_elem, i++) {
+		uint32_t last = first + shard_elem - 1;
+		if (last >= new_elem || i == LT_FREE_SHARDS - 1)
+			last = new_elem - 1;
+		first_new_elem = lt_elem_ofst_slab(slab, table->slab_msk,
+						   first * table->elem_sz);
+		last_new_elem = lt_elem_ofst_slab(slab, table->slab_msk,
+						  last * table->elem_sz);
+		lt_free_list_push(table, &table->free[i & LT_FREE_SHARD_MASK],
+				  first_new_elem, last_new_elem);
+		if (last == new_elem - 1)
+			break;
 	}
 	OSMemoryBarrier();
 
@@ -423,9 +558,9 @@ struct lt_elem *ltable_alloc_elem(struct link_table *table, int type,
 				  int nelem, int nattempts)
 {
 	int nspins = 0, ntries = 0, nalloc = 0;
+	int local, raced;
 	uint32_t table_size;
 	struct lt_elem *elem = NULL;
-	struct ltable_id free_id, next_id;
 
 	static const int max_retries = 500;
 
@@ -456,9 +591,9 @@ try_again:
 			return NULL;
 		}
 
-		if (table->used_elem + nelem >= table_size)
+		if (ltable_used_elem(table) + nelem >= table_size)
 			panic("No more room to grow table: 0x%p size:%d, used:%d, requested elem:%d",
-			      table, table_size, table->used_elem, nelem);
+			      table, table_size, ltable_used_elem(table), nelem);
 		if (nelem == 1)
 			panic("Too many alloc retries: %d, table:%p, type:%d, nelem:%d",
 			      ntries, table, type, nelem);
@@ -477,7 +612,11 @@ try_again:
 	nalloc = 0;
 	table_size = table->nelem;
 
-	if (table->used_elem + nelem >= table_size) {
+	/*
+	 * Each shard holds back one element (see lt_free_list_pop), so the
+	 * table is effectively full LT_FREE_SHARDS elements early.
+	 */
+	if (ltable_used_elem(table) + nelem + LT_FREE_SHARDS >= table_size) {
 		if (get_preemption_level() != 0) {
 #if CONFIG_LTABLE_STATS
 			table->nspins += 1;
@@ -492,55 +631,44 @@ try_again:
 			delay(1);
 			goto try_again;
 		}
-		ltable_grow(table, nelem);
+		ltable_grow(table, nelem + LT_FREE_SHARDS);
 		goto try_again;
 	}
 
-	/* read this value only once before the CAS */
-	free_id = table->free_list;
-	if (free_id.idx >= table_size)
-		goto try_again;
-
 	/*
-	 * Find the item on the free list which will become the new free list
-	 * head, but be careful not to modify any memory (read only)!  Other
-	 * threads can alter table state at any time up until the CAS.  We
-	 * don't modify any memory until we've successfully swapped out the
-	 * free list head with the one we've investigated.
+	 * Try the local CPU's shard first, then steal from the others.
 	 */
-	for (struct lt_elem *next_elem = lt_elem_idx(table, free_id.idx);
-	     nalloc < nelem;
-	     nalloc++) {
-		elem = next_elem;
-		next_id.generation = 0;
-		next_id.idx = next_elem->lt_next_idx;
-		if (next_id.idx < table->nelem) {
-			next_elem = lt_elem_idx(table, next_id.idx);
-			next_id.id = next_elem->lt_id.id;
-		} else {
-			goto try_again;
+	local = cpu_number();
+	for (int i = 0; i < LT_FREE_SHARDS; i++) {
+		elem = lt_free_list_pop(table,
+				&table->free[(local + i) & LT_FREE_SHARD_MASK],
+				nelem, &raced);
+		if (elem != NULL) {
+#if CONFIG_LTABLE_STATS
+			if (i != 0)
+				table->free[local & LT_FREE_SHARD_MASK].nsteals += 1;
+#endif
+			break;
 		}
+		if (raced)
+			goto try_again;
 	}
-	/* 'elem' points to the last element being allocated */
 
-	if (OSCompareAndSwap64(free_id.id, next_id.id,
-			       &table->free_list.id) == FALSE)
+	if (elem == NULL) {
+		/*
+		 * There's room in the table, but no single shard can satisfy
+		 * the request: allocate one-at-a-time rather than spinning.
+		 */
+		if (nelem > 1)
+			ntries = max_retries + 1;
 		goto try_again;
-
-	/* load barrier */
-	OSMemoryBarrier();
+	}
 
 	/*
-	 * After the CAS, we know that we own free_id, and it points to a
-	 * valid table entry (checked above). Grab the table pointer and
-	 * reset some values.
+	 * After the CAS, we own the popped chain, and it points to valid
+	 * table entries (checked in lt_free_list_pop). Reset some values.
 	 */
-	OSAddAtomic(nelem, &table->used_elem);
-
-	/* end the list of allocated elements */
-	elem->lt_next_idx = LT_IDX_MAX;
-	/* reset 'elem' to point to the first allocated element */
-	elem = lt_elem_idx(table, free_id.idx);
+	OSAddAtomic(nelem, &lt_local_shard(table)->nused);
 
 	/*
 	 * Update the generation count, and return the element(s)
@@ -553,7 +681,7 @@ try_again:
 	for (struct lt_elem *tmp = elem; ; ) {
 		assert(!lt_bits_valid(tmp->lt_bits) &&
 		       (lt_bits_refcnt(tmp->lt_bits) == 0));
-		--nalloc;
+		++nalloc;
 		tmp->lt_id.generation += 1;
 		tmp->lt_bits = 1;
 		lt_elem_set_type(tmp, type);
@@ -562,19 +690,20 @@ try_again:
 		assert(tmp->lt_next_idx != LT_IDX_MAX);
 		tmp = lt_elem_idx(table, tmp->lt_next_idx);
 	}
-	assert(nalloc == 0);
+	assert(nalloc == nelem);
 
 #if CONFIG_LTABLE_STATS
 	uint64_t nreservations;
+	uint32_t used_elem = ltable_used_elem(table);
 	table->nallocs += nelem;
 	if (type == LT_RESERVED)
 		OSIncrementAtomic64(&table->nreservations);
 	nreservations = table->nreservations;
-	if (table->used_elem > table->max_used)
-		table->max_used = table->used_elem;
+	if (used_elem > table->max_used)
+		table->max_used = used_elem;
 	if (nreservations > table->max_reservations)
 		table->max_reservations = nreservations;
-	table->avg_used = (table->avg_used + table->used_elem) / 2;
+	table->avg_used = (table->avg_used + used_elem) / 2;
 	table->avg_reservations = (table->avg_reservations + nreservations) / 2;
 #endif
 
@@ -634,16 +763,17 @@ void ltable_realloc_elem(struct link_table *table, struct lt_elem *elem, int typ
  */
 static void ltable_free_elem(struct link_table *table, struct lt_elem *elem)
 {
-	struct ltable_id next_id;
+	struct lt_free_shard *shard;
 
 	assert(lt_elem_in_range(elem, table) &&
 	       !lt_bits_valid(elem->lt_bits) &&
 	       (lt_bits_refcnt(elem->lt_bits) == 0));
 
-	OSDecrementAtomic(&table->used_elem);
+	shard = lt_local_shard(table);
+	OSDecrementAtomic(&shard->nused);
 
 #if CONFIG_LTABLE_STATS
-	table->avg_used = (table->avg_used + table->used_elem) / 2;
+	table->avg_used = (table->avg_used + ltable_used_elem(table)) / 2;
 	if (lt_bits_type(elem->lt_bits) == LT_RESERVED)
 		OSDecrementAtomic64(&table->nreservations);
 	table->avg_reservations = (table->avg_reservations + table->nreservations) / 2;
@@ -654,18 +784,7 @@ static void ltable_free_elem(struct link_table *table, struct lt_elem *elem)
 	if (table->poison)
 		(table->poison)(table, elem);
 
-again:
-	next_id = table->free_list;
-	if (next_id.idx >= table->nelem)
-		elem->lt_next_idx = LT_IDX_MAX;
-	else
-		elem->lt_next_idx = next_id.idx;
-
-	/* store barrier */
-	OSMemoryBarrier();
-	if (OSCompareAndSwap64(next_id.id, elem->lt_id.id,
-			       &table->free_list.id) == FALSE)
-		goto again;
+	lt_free_list_push(table, shard, elem, elem);
 }
 
 
@@ -952,7 +1071,7 @@ int lt_elem_list_release(struct link_table *table, struct lt_elem *head,
                          int __assert_only type)
 {
 	struct lt_elem *elem;
-	struct ltable_id free_id;
+	struct lt_free_shard *shard;
 	int nelem = 0;
 
 	if (!head)
@@ -976,24 +1095,13 @@ int lt_elem_list_release(struct link_table *table, struct lt_elem *head,
 
 	/*
 	 * 'elem' now points to the end of our list, and 'head' points to the
-	 * beginning. We want to atomically swap the free list pointer with
-	 * the 'head' and ensure that 'elem' points to the previous free list
-	 * head.
+	 * beginning. We want to atomically swap the local shard's free list
+	 * pointer with the 'head' and ensure that 'elem' points to the
+	 * previous free list head.
 	 */
+	shard = lt_local_shard(table);
+	lt_free_list_push(table, shard, head, elem);
 
-again:
-	free_id = table->free_list;
-	if (free_id.idx >= table->nelem)
-		elem->lt_next_idx = LT_IDX_MAX;
-	else
-		elem->lt_next_idx = free_id.idx;
-
-	/* store barrier */
-	OSMemoryBarrier();
-	if (OSCompareAndSwap64(free_id.id, head->lt_id.id,
-			       &table->free_list.id) == FALSE)
-		goto again;
-
-	OSAddAtomic(-nelem, &table->used_elem);
+	OSAddAtomic(-nelem, &shard->nused);
 	return nelem;
 }
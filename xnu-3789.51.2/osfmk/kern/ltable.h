@@ -116,6 +116,31 @@ enum lt_elem_type {
 struct link_table;
 typedef void (*ltable_poison_func)(struct link_table *, struct lt_elem *);
 
+/*
+ * link table free list shards
+ *
+ * The free list is split into LT_FREE_SHARDS independent lock-free stacks,
+ * each on its own cache line. Elements are freed onto (and preferentially
+ * allocated from) the shard of the current CPU, so that waitq linking and
+ * prepost traffic on different CPUs doesn't serialize on a single
+ * compare-and-swap target. When the local shard runs dry, allocation steals
+ * from the other shards before growing the table.
+ *
+ * The count of used elements is likewise kept per-shard: a shard's count
+ * may go negative (elements allocated on one CPU and freed on another), only
+ * the sum across shards is meaningful. Use ltable_used_elem() to read it.
+ */
+#define LT_FREE_SHARDS      (8)
+#define LT_FREE_SHARD_MASK  (LT_FREE_SHARDS - 1)
+
+struct lt_free_shard {
+	struct ltable_id free_list __attribute__((aligned(8)));
+	int32_t          nused;
+#if CONFIG_LTABLE_STATS
+	uint32_t         nsteals;
+#endif
+} __attribute__((aligned(64)));
+
 /*
  * link_table structure
  *
@@ -129,7 +154,6 @@ typedef void (*ltable_poison_func)(struct link_table *, struct lt_elem *);
 struct link_table {
 	struct lt_elem **table;   /* an array of 'slabs' of elements */
 	struct lt_elem **next_free_slab;
-	struct ltable_id free_list __attribute__((aligned(8)));
 
 	uint32_t         elem_sz;  /* size of a table element (bytes) */
 	uint32_t         slab_shift;
@@ -138,7 +162,6 @@ struct link_table {
 	uint32_t         slab_sz;  /* size of a table 'slab' object (bytes) */
 
 	uint32_t         nelem;
-	uint32_t         used_elem;
 	zone_t           slab_zone;
 
 	ltable_poison_func poison;
@@ -161,9 +184,26 @@ struct link_table {
 	uint64_t         max_reservations;
 	uint64_t         avg_reservations;
 #endif
+
+	struct lt_free_shard free[LT_FREE_SHARDS];
 } __attribute__((aligned(8)));
 
 
+/**
+ * ltable_used_elem: number of elements currently allocated from 'table'
+ *
+ * This is a racy sum of the per-shard counts, suitable for sizing decisions
+ * and statistics only.
+ */
+static inline uint32_t ltable_used_elem(struct link_table *table)
+{
+	int32_t used = 0;
+	for (int i = 0; i < LT_FREE_SHARDS; i++)
+		used += table->free[i].nused;
+	return (used < 0) ? 0 : (uint32_t)used;
+}
+
+
 /**
  * ltable_bootstrap: bootstrap a link table
  *
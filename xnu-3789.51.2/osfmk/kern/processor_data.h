@@ -92,6 +92,7 @@ struct processor_data {
 	int						start_color;
 	unsigned long			page_grab_count;
 	void					*free_pages;
+	unsigned int			free_pages_count;
 	struct processor_sched_statistics sched_stats;
 	uint64_t	timer_call_ttd; /* current timer call time-to-deadline */
 	uint64_t	wakeups_issued_total; /* Count of thread wakeups issued
@@ -2476,6 +2476,12 @@ thread_dispatch(
 
 			consumed = thread->quantum_remaining - remainder;
 
+			/*
+			 * Apply the ledger updates the thread batched while it
+			 * was running.
+			 */
+			ledger_defer_flush(thread);
+
 			if ((thread->reason & AST_LEDGER) == 0) {
 				/*
 				 * Bill CPU time to both the task and
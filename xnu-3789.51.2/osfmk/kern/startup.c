@@ -104,6 +104,7 @@
 #include <prng/random.h>
 #include <console/serial_protos.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_fault.h>
 #include <vm/vm_init.h>
 #include <vm/vm_map.h>
 #include <vm/vm_object.h>
@@ -601,6 +602,7 @@ kernel_bootstrap_thread(void)
 	serial_keyboard_init();		/* Start serial keyboard if wanted */
 
 	vm_page_init_local_q();
+	vm_fault_spec_init();
 
 	thread_bind(PROCESSOR_NULL);
 
@@ -339,6 +339,7 @@ thread_bootstrap(void)
 	thread_template.t_page_creation_throttled = 0;
 	thread_template.t_page_creation_count = 0;
 	thread_template.t_page_creation_time = 0;
+	thread_template.spec_fault_map = VM_MAP_NULL;
 
 	thread_template.affinity_set = NULL;
 	
@@ -347,6 +348,7 @@ thread_bootstrap(void)
 
 	thread_template.t_ledger = LEDGER_NULL;
 	thread_template.t_threadledger = LEDGER_NULL;
+	thread_template.t_ledger_defer = (struct ledger_defer) {};
 #ifdef CONFIG_BANK
 	thread_template.t_bankledger = LEDGER_NULL;
 	thread_template.t_deduct_bank_ledger_time = 0;
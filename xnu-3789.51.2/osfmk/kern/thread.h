@@ -129,6 +129,23 @@
 #include <machine/cpu_data.h>
 #include <machine/thread.h>
 
+/*
+ * Updates to the entries of a thread's own ledger that have been batched
+ * in the thread instead of being applied to the shared ledger entry
+ * (see kern/ledger.c).  A slot is free when lds_updates is zero.
+ */
+#define	LEDGER_DEFER_SLOTS	4
+
+struct ledger_defer_slot {
+	int		lds_entry;
+	uint32_t	lds_updates;
+	ledger_amount_t	lds_credit;
+	ledger_amount_t	lds_debit;
+};
+
+struct ledger_defer {
+	struct ledger_defer_slot ld_slots[LEDGER_DEFER_SLOTS];
+};
 
 struct thread {
 
@@ -448,6 +465,17 @@ struct thread {
 	        uint64_t    t_page_creation_throttled_soft;
 #endif /* DEVELOPMENT || DEBUG */
 
+	/* Last anonymous map entry faulted on, see vm_fault_speculative() */
+	vm_map_t		spec_fault_map;
+	uint64_t		spec_fault_seq;
+	int			spec_fault_tag;
+	vm_prot_t		spec_fault_prot;
+	vm_map_offset_t		spec_fault_start;
+	vm_map_offset_t		spec_fault_end;
+	struct vm_object	*spec_fault_object;	/* not referenced, see spec_fault_object_gen */
+	uint64_t		spec_fault_object_gen;
+	vm_object_offset_t	spec_fault_offset;
+
 #ifdef KPERF
 /* The high 7 bits are the number of frames to sample of a user callstack. */
 #define T_KPERF_CALLSTACK_DEPTH_OFFSET     (25)
@@ -484,6 +512,7 @@ struct thread {
 	uint32_t		syscalls_mach;
 	ledger_t		t_ledger;
 	ledger_t		t_threadledger;	/* per thread ledger */
+	struct ledger_defer	t_ledger_defer;	/* batched updates to t_ledger */
 #ifdef CONFIG_BANK
 	ledger_t		t_bankledger;  		   /* ledger to charge someone */
 	uint64_t		t_deduct_bank_ledger_time; /* cpu time to be deducted from bank ledger */
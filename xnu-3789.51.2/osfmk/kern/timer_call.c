@@ -39,6 +39,8 @@
 #include <kern/call_entry.h>
 #include <kern/thread.h>
 #include <kern/policy_internal.h>
+#include <kern/kalloc.h>
+#include <kern/bits.h>
 
 #include <sys/kdebug.h>
 
@@ -89,6 +91,7 @@ lck_grp_attr_t          timer_longterm_lck_grp_attr;
 
 #define QUEUE(x)	((queue_t)(x))
 #define MPQUEUE(x)	((mpqueue_head_t *)(x))
+#define TIMER_CALL_QUEUE(x)	((struct timer_call_queue *)(x))
 #define TIMER_CALL(x)	((timer_call_t)(x))
 #define TCE(x)		(&(x->call_entry))
 /*
@@ -121,7 +124,7 @@ typedef struct {
 } threshold_t;
 
 typedef struct {
-	mpqueue_head_t	queue;		/* longterm timer list */
+	struct timer_call_queue queue;	/* longterm timer list */
 	uint64_t	enqueues;	/* num timers queued */
 	uint64_t	dequeues;	/* num timers dequeued */
 	uint64_t	escalates;	/* num timers becoming shortterm */
@@ -181,6 +184,42 @@ mpqueue_head_t	*timer_call_dequeue_unlocked(
 
 timer_coalescing_priority_params_t tcoal_prio_params;
 
+/*
+ * Insertion hints.
+ *
+ * Each per-cpu timer queue remains a list sorted by deadline: expiry,
+ * migration, the earliest soft deadline and the platform layer all consume
+ * it from the head.  So that arming a timer does not usually walk every
+ * timer already armed, struct timer_call_queue also keeps two levels of
+ * insertion hints.  Hint w of a level points at the last queued timer whose
+ * deadline falls in window w of that level, or is NULL.  Insertion starts
+ * from the hint for its own window, or for the nearest preceding window
+ * that has one, and then walks the timers sharing its window; with no
+ * usable hint it still walks from the head.
+ *
+ * Level 0 windows are about a millisecond, the granularity at which
+ * timer_call_slop() coalesces most kernel and timeshare timers, so timers
+ * coalesced onto a common deadline share a slot.  A level 1 window spans
+ * all of level 0.  Hints are only maintained under the queue lock.
+ */
+#define TIMER_HINT_LEVELS	2
+#define TIMER_HINT_L0_SLOTS	128
+#define TIMER_HINT_L1_SLOTS	(TIMER_CALL_INSERT_HINTS - TIMER_HINT_L0_SLOTS)
+#define TIMER_HINT_L0_WINDOW_NS	NSEC_PER_MSEC
+#define TIMER_HINT_PROBES	4	/* preceding windows tried per level */
+
+static uint32_t	timer_hint_shift[TIMER_HINT_LEVELS];
+
+#if DEVELOPMENT || DEBUG
+/* not worth shared cache line traffic on every arm in release kernels */
+uint64_t	timer_insert_hint_hits;	/* insertions started from a hint */
+uint64_t	timer_insert_hint_misses;	/* insertions scanned from the head */
+uint64_t	timer_insert_appends;	/* insertions at the tail */
+#define TIMER_INSERT_STAT(stat)	((stat)++)
+#else
+#define TIMER_INSERT_STAT(stat)
+#endif /* DEVELOPMENT || DEBUG */
+
 #if TCOAL_PRIO_STATS
 int32_t nc_tcl, rt_tcl, bg_tcl, kt_tcl, fp_tcl, ts_tcl, qos_tcl;
 #define TCOAL_PRIO_STAT(x) (x++)
@@ -195,6 +234,9 @@ timer_call_init_abstime(void)
 	uint64_t result;
 	timer_coalescing_priority_params_ns_t * tcoal_prio_params_init = timer_call_get_priority_params();
 	nanoseconds_to_absolutetime(PAST_DEADLINE_TIMER_ADJUSTMENT_NS, &past_deadline_timer_adjustment);
+	nanoseconds_to_absolutetime(TIMER_HINT_L0_WINDOW_NS, &result);
+	timer_hint_shift[0] = bit_floor(result);
+	timer_hint_shift[1] = timer_hint_shift[0] + bit_log2(TIMER_HINT_L0_SLOTS);
 	nanoseconds_to_absolutetime(tcoal_prio_params_init->idle_entry_timer_processing_hdeadline_threshold_ns, &result);
 	tcoal_prio_params.idle_entry_timer_processing_hdeadline_threshold_abstime = (uint32_t)result;
 	nanoseconds_to_absolutetime(tcoal_prio_params_init->interrupt_timer_coalescing_ilat_threshold_ns, &result);
@@ -240,10 +282,12 @@ timer_call_init(void)
 
 
 void
-timer_call_queue_init(mpqueue_head_t *queue)
+timer_call_queue_init(struct timer_call_queue *queue)
 {
 	DBG("timer_call_queue_init(%p)\n", queue);
-	mpqueue_init(queue, &timer_call_lck_grp, &timer_call_lck_attr);
+	mpqueue_init(&queue->mpq, &timer_call_lck_grp, &timer_call_lck_attr);
+	bzero(queue->insert_hint, sizeof(queue->insert_hint));
+	bzero(queue->latency, sizeof(queue->latency));
 }
 
 
@@ -258,6 +302,147 @@ timer_call_setup(
 	simple_lock_init(&(call)->lock, 0);
 	call->async_dequeue = FALSE;
 }
+
+static __inline__ uint64_t
+timer_hint_window(
+	uint64_t		deadline,
+	int			level)
+{
+	return (deadline >> timer_hint_shift[level]);
+}
+
+static __inline__ queue_entry_t *
+timer_hint_slot(
+	mpqueue_head_t		*queue,
+	uint64_t		window,
+	int			level)
+{
+	queue_entry_t	*hints = TIMER_CALL_QUEUE(queue)->insert_hint;
+
+	if (level == 0)
+		return (&hints[window & (TIMER_HINT_L0_SLOTS - 1)]);
+	return (&hints[TIMER_HINT_L0_SLOTS +
+	    (window & (TIMER_HINT_L1_SLOTS - 1))]);
+}
+
+/*
+ * Drop an entry about to be removed from the queue from the hints:
+ * if it was the last timer of its window, its predecessor takes over
+ * when it shares the window.  Queue locked.
+ */
+static __inline__ void
+timer_hint_remove(
+	mpqueue_head_t		*queue,
+	timer_call_t		entry)
+{
+	queue_entry_t	prev = queue_prev(qe(entry));
+	uint64_t	deadline = TCE(entry)->deadline;
+	int		level;
+
+	for (level = 0; level < TIMER_HINT_LEVELS; level++) {
+		uint64_t	window = timer_hint_window(deadline, level);
+		queue_entry_t	*slot = timer_hint_slot(queue, window, level);
+
+		if (*slot != qe(entry))
+			continue;
+		if (!queue_end(&queue->head, prev) &&
+		    timer_hint_window(CE(prev)->deadline, level) == window)
+			*slot = prev;
+		else
+			*slot = NULL;
+	}
+}
+
+/*
+ * Insert an unqueued entry in deadline order, after any timers with the
+ * same deadline, and make it the hint for its window if it now ends it.
+ * Queue locked.
+ */
+static __inline__ void
+timer_queue_insert(
+	mpqueue_head_t		*queue,
+	timer_call_t		entry,
+	uint64_t		deadline)
+{
+	queue_t		head = &queue->head;
+	queue_entry_t	current = NULL;
+	int		level, probe;
+
+	if (queue_empty(head) || CE(queue_last(head))->deadline <= deadline) {
+		current = queue_last(head);
+		TIMER_INSERT_STAT(timer_insert_appends);
+	} else {
+		for (level = 0; level < TIMER_HINT_LEVELS && current == NULL; level++) {
+			uint64_t	window = timer_hint_window(deadline, level);
+
+			for (probe = 0; probe < TIMER_HINT_PROBES; probe++, window--) {
+				queue_entry_t	hint = *timer_hint_slot(queue, window, level);
+
+				if (hint != NULL &&
+				    timer_hint_window(CE(hint)->deadline, level) == window) {
+					current = hint;
+					break;
+				}
+			}
+		}
+
+		if (current != NULL) {
+			TIMER_INSERT_STAT(timer_insert_hint_hits);
+		} else {
+			TIMER_INSERT_STAT(timer_insert_hint_misses);
+			current = (queue_entry_t)head;
+		}
+
+		/*
+		 * Settle on the last timer due no later than this one;
+		 * a hint for our own window may lie beyond it.
+		 */
+		if (queue_end(head, current) || CE(current)->deadline <= deadline) {
+			while (!queue_end(head, queue_next(current)) &&
+			    CE(queue_next(current))->deadline <= deadline)
+				current = queue_next(current);
+		} else {
+			do {
+				current = queue_prev(current);
+			} while (!queue_end(head, current) &&
+			    CE(current)->deadline > deadline);
+		}
+	}
+
+	insque(qe(entry), current);
+	TCE(entry)->queue = QUEUE(queue);
+	TCE(entry)->deadline = deadline;
+
+	for (level = 0; level < TIMER_HINT_LEVELS; level++) {
+		uint64_t	window = timer_hint_window(deadline, level);
+		queue_entry_t	next = queue_next(qe(entry));
+
+		if (queue_end(head, next) ||
+		    timer_hint_window(CE(next)->deadline, level) != window)
+			*timer_hint_slot(queue, window, level) = qe(entry);
+	}
+}
+
+/*
+ * Account the lateness of an expiring timer relative to its soft deadline:
+ * bin 0 counts callouts under a microsecond late, bin n those under 2^n
+ * microseconds and the last bin everything later.  Queue locked.
+ */
+static __inline__ void
+timer_call_latency_record(
+	mpqueue_head_t		*queue,
+	uint64_t		now,
+	uint64_t		soft_deadline)
+{
+	uint64_t	latency;
+	int		bin;
+
+	absolutetime_to_nanoseconds(now - soft_deadline, &latency);
+	bin = bit_floor(latency / NSEC_PER_USEC) + 1;
+	if (bin >= TIMER_CALL_LATENCY_BINS)
+		bin = TIMER_CALL_LATENCY_BINS - 1;
+	TIMER_CALL_QUEUE(queue)->latency[bin]++;
+}
 #if TIMER_ASSERT
 static __inline__ mpqueue_head_t *
 timer_call_entry_dequeue(
@@ -277,6 +462,7 @@ timer_call_entry_dequeue(
 		panic("_call_entry_dequeue() "
 			"queue %p is not locked\n", old_queue);
 
+	timer_hint_remove(old_queue, entry);
 	call_entry_dequeue(TCE(entry));
 	old_queue->count--;
 
@@ -302,7 +488,11 @@ timer_call_entry_enqueue_deadline(
 		panic("_call_entry_enqueue_deadline() "
 			"old_queue %p != queue", old_queue);
 
-	call_entry_enqueue_deadline(TCE(entry), QUEUE(queue), deadline);
+	if (old_queue != NULL) {
+		timer_hint_remove(old_queue, entry);
+		(void) remque(qe(entry));
+	}
+	timer_queue_insert(queue, entry, deadline);
 
 /* For efficiency, track the earliest soft deadline on the queue, so that
  * fuzzy decisions can be made without lock acquisitions.
@@ -326,6 +516,7 @@ timer_call_entry_dequeue(
 {
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 
+	timer_hint_remove(old_queue, entry);
 	call_entry_dequeue(TCE(entry));
 	old_queue->count--;
 
@@ -340,7 +531,11 @@ timer_call_entry_enqueue_deadline(
 {
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 
-	call_entry_enqueue_deadline(TCE(entry), QUEUE(queue), deadline);
+	if (old_queue != NULL) {
+		timer_hint_remove(old_queue, entry);
+		(void) remque(qe(entry));
+	}
+	timer_queue_insert(queue, entry, deadline);
 
 	/* For efficiency, track the earliest soft deadline on the queue,
 	 * so that fuzzy decisions can be made without lock acquisitions.
@@ -379,6 +574,7 @@ timer_call_entry_dequeue_async(
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 	if (old_queue) {
 		old_queue->count--;
+		timer_hint_remove(old_queue, entry);
 		(void) remque(qe(entry));
 		entry->async_dequeue = TRUE;
 	}
@@ -540,9 +736,10 @@ timer_call_dequeue_unlocked(
 /*
  * Inlines timer_call_entry_dequeue() and timer_call_entry_enqueue_deadline()
  * cast between pointer types (mpqueue_head_t *) and (queue_t) so that
- * we can use the call_entry_dequeue() and call_entry_enqueue_deadline()
- * methods to operate on timer_call structs as if they are call_entry structs.
- * These structures are identical except for their queue head pointer fields.
+ * we can use the call_entry_dequeue() method to operate on timer_call
+ * structs as if they are call_entry structs. These structures are identical
+ * except for their queue head pointer fields. Ordered insertion goes through
+ * timer_queue_insert() rather than call_entry_enqueue_deadline().
  *
  * In the debug case, we assert that the timer call locking protocol 
  * is being obeyed.
@@ -846,6 +1043,7 @@ timer_queue_expire_with_options(
 			}
 
 			timer_call_entry_dequeue(call);
+			timer_call_latency_record(queue, cur_deadline, call->soft_deadline);
 
 			func = TCE(call)->func;
 			param0 = TCE(call)->param0;
@@ -1297,10 +1495,10 @@ timer_longterm_update_locked(timer_longterm_t *tlp)
 
 	TIMER_KDEBUG_TRACE(KDEBUG_TRACE, 
 		DECR_TIMER_UPDATE | DBG_FUNC_START,
-		VM_KERNEL_UNSLIDE_OR_PERM(&tlp->queue),
+		VM_KERNEL_UNSLIDE_OR_PERM(&tlp->queue.mpq),
 		tlp->threshold.deadline,
 		tlp->threshold.preempted,
-		tlp->queue.count, 0);
+		tlp->queue.mpq.count, 0);
 
 	tlp->scan_time = mach_absolute_time();
 	if (tlp->threshold.preempted != TIMER_LONGTERM_NONE) {
@@ -1344,10 +1542,10 @@ timer_longterm_update_locked(timer_longterm_t *tlp)
 
 	TIMER_KDEBUG_TRACE(KDEBUG_TRACE, 
 		DECR_TIMER_UPDATE | DBG_FUNC_END,
-		VM_KERNEL_UNSLIDE_OR_PERM(&tlp->queue),
+		VM_KERNEL_UNSLIDE_OR_PERM(&tlp->queue.mpq),
 		tlp->threshold.deadline,
 		tlp->threshold.scans,
-		tlp->queue.count, 0);
+		tlp->queue.mpq.count, 0);
 }
 
 void
@@ -1378,7 +1576,7 @@ timer_longterm_init(void)
 	uint32_t		longterm;
 	timer_longterm_t	*tlp = &timer_longterm;
 
-	DBG("timer_longterm_init() tlp: %p, queue: %p\n", tlp, &tlp->queue);
+	DBG("timer_longterm_init() tlp: %p, queue: %p\n", tlp, &tlp->queue.mpq);
 
 	/*
 	 * Set the longterm timer threshold. Defaults to TIMER_LONGTERM_THRESHOLD
@@ -1411,19 +1609,20 @@ timer_longterm_init(void)
 	lck_grp_attr_setdefault(&timer_longterm_lck_grp_attr);
 	lck_grp_init(&timer_longterm_lck_grp,
 		     "timer_longterm", &timer_longterm_lck_grp_attr);
-	mpqueue_init(&tlp->queue,
+	mpqueue_init(&tlp->queue.mpq,
 		     &timer_longterm_lck_grp, &timer_longterm_lck_attr);
 
 	timer_call_setup(&tlp->threshold.timer,
 			 timer_longterm_callout, (timer_call_param_t) tlp);
 
-	timer_longterm_queue = &tlp->queue;
+	timer_longterm_queue = &tlp->queue.mpq;
 }
 
 enum {
 	THRESHOLD, QCOUNT,
 	ENQUEUES, DEQUEUES, ESCALATES, SCANS, PREEMPTS,
-	LATENCY, LATENCY_MIN, LATENCY_MAX
+	LATENCY, LATENCY_MIN, LATENCY_MAX,
+	INSERT_HINT_HITS, INSERT_HINT_MISSES, INSERT_APPENDS, INSERT_TEST
 };
 uint64_t
 timer_sysctl_get(int oid)
@@ -1435,7 +1634,7 @@ timer_sysctl_get(int oid)
 		return (tlp->threshold.interval == TIMER_LONGTERM_NONE) ?
 			0 : tlp->threshold.interval / NSEC_PER_MSEC;
 	case QCOUNT:
-		return tlp->queue.count;
+		return tlp->queue.mpq.count;
 	case ENQUEUES:
 		return tlp->enqueues;
 	case DEQUEUES:
@@ -1452,6 +1651,14 @@ timer_sysctl_get(int oid)
 		return tlp->threshold.latency_min;
 	case LATENCY_MAX:
 		return tlp->threshold.latency_max;
+#if DEVELOPMENT || DEBUG
+	case INSERT_HINT_HITS:
+		return timer_insert_hint_hits;
+	case INSERT_HINT_MISSES:
+		return timer_insert_hint_misses;
+	case INSERT_APPENDS:
+		return timer_insert_appends;
+#endif /* DEVELOPMENT || DEBUG */
 	default:
 		return 0;
 	}
@@ -1573,6 +1780,64 @@ timer_sysctl_set_threshold(uint64_t value)
 	splx(s);
 }
 
+#if DEVELOPMENT || DEBUG
+/*
+ * Exercise the timer queue insert and remove paths from user space.
+ * A population of up to TIMER_INSERT_TEST_TIMERS local timers, due a minute
+ * from now and spread over a second, is armed and then each operation
+ * cancels one and re-arms it at a new deadline.  None is expected to fire.
+ */
+#define TIMER_INSERT_TEST_TIMERS		(64 * 1024)
+
+static void
+timer_insert_test_callout(
+	__unused timer_call_param_t	p0,
+	__unused timer_call_param_t	p1)
+{
+}
+
+static int
+timer_insert_test(uint64_t operations)
+{
+	timer_call_data_t	*calls;
+	vm_size_t		size;
+	uint64_t		base, spread, op;
+	uint32_t		ncalls, i;
+
+	if (operations == 0)
+		return KERN_INVALID_ARGUMENT;
+
+	ncalls = (operations < TIMER_INSERT_TEST_TIMERS) ?
+	    (uint32_t)operations : TIMER_INSERT_TEST_TIMERS;
+	size = ncalls * sizeof(timer_call_data_t);
+	calls = (timer_call_data_t *)kalloc(size);
+	if (calls == NULL)
+		return KERN_RESOURCE_SHORTAGE;
+
+	for (i = 0; i < ncalls; i++)
+		timer_call_setup(&calls[i], timer_insert_test_callout, NULL);
+
+	nanoseconds_to_absolutetime(60 * NSEC_PER_SEC, &base);
+	nanoseconds_to_absolutetime(NSEC_PER_SEC, &spread);
+	base += mach_absolute_time();
+
+	for (op = 0; op < operations; op++) {
+		timer_call_t	call = &calls[op % ncalls];
+
+		/* Scatter deadlines across the spread, many sharing a window */
+		(void) timer_call_cancel(call);
+		timer_call_enter(call, base + (op * 2654435761ULL) % spread,
+		    TIMER_CALL_LOCAL | TIMER_CALL_SYS_NORMAL);
+	}
+
+	for (i = 0; i < ncalls; i++)
+		(void) timer_call_cancel(&calls[i]);
+
+	kfree(calls, size);
+	return KERN_SUCCESS;
+}
+#endif /* DEVELOPMENT || DEBUG */
+
 int
 timer_sysctl_set(int oid, uint64_t value)
 {
@@ -1583,11 +1848,39 @@ timer_sysctl_set(int oid, uint64_t value)
 			(void (*)(void *)) timer_sysctl_set_threshold,
 			(void *) value);
 		return KERN_SUCCESS;
+#if DEVELOPMENT || DEBUG
+	case INSERT_TEST:
+		return timer_insert_test(value);
+#endif
 	default:
 		return KERN_INVALID_ARGUMENT;
 	}
 }
 
+/*
+ * Sum the expiry latency histograms of all processors' timer queues.
+ */
+void
+timer_sysctl_latency_histogram(uint64_t *bins, unsigned int nbins)
+{
+	processor_t	processor;
+	unsigned int	i;
+
+	for (i = 0; i < nbins; i++)
+		bins[i] = 0;
+	if (nbins > TIMER_CALL_LATENCY_BINS)
+		nbins = TIMER_CALL_LATENCY_BINS;
+
+	for (processor = processor_list; processor != NULL;
+	    processor = processor->processor_list) {
+		struct timer_call_queue	*queue;
+
+		queue = TIMER_CALL_QUEUE(timer_queue_cpu(processor->cpu_id));
+		for (i = 0; i < nbins; i++)
+			bins[i] += queue->latency[i];
+	}
+}
+
 
 /* Select timer coalescing window based on per-task quality-of-service hints */
 static boolean_t tcoal_qos_adjust(thread_t t, int32_t *tshift, uint64_t *tmax_abstime, boolean_t *pratelimited) {
@@ -40,11 +40,27 @@
 #include <kern/call_entry.h>
 #include <kern/simple_lock.h>
 
+/* log2 microsecond bins of expiry latency, see kern.timer.latency_histogram */
+#define TIMER_CALL_LATENCY_BINS		16
+
 #ifdef MACH_KERNEL_PRIVATE
 #include <kern/queue.h>
 
+/*
+ * A timer call queue: the locked, deadline-sorted list the platform layer
+ * arms from, plus state only the timer call code uses.  Timer calls record
+ * the address of the mpqueue, so it must come first.
+ */
+#define TIMER_CALL_INSERT_HINTS		(128 + 32)	/* both hint levels */
+
+struct timer_call_queue {
+	mpqueue_head_t		mpq;
+	queue_entry_t		insert_hint[TIMER_CALL_INSERT_HINTS];
+	uint64_t		latency[TIMER_CALL_LATENCY_BINS];
+};
+
 extern boolean_t mach_timer_coalescing_enabled;
-extern void timer_call_queue_init(mpqueue_head_t *);
+extern void timer_call_queue_init(struct timer_call_queue *);
 #endif
 
 /*
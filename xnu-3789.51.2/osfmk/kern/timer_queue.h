@@ -183,6 +183,9 @@ extern void		timer_queue_trace_cpu(int cpu);
 
 extern uint64_t		timer_sysctl_get(int oid);
 extern int		timer_sysctl_set(int oid, uint64_t value);
+extern void		timer_sysctl_latency_histogram(
+				uint64_t		*bins,
+				unsigned int		nbins);
 
 #endif	/* MACH_KERNEL_PRIVATE */
 
@@ -322,13 +322,13 @@ static void wql_init(void)
 
 static void wql_ensure_free_space(void)
 {
-	if (g_wqlinktable.nelem - g_wqlinktable.used_elem < g_min_free_table_elem) {
+	if (g_wqlinktable.nelem - ltable_used_elem(&g_wqlinktable) < g_min_free_table_elem) {
 		/*
 		 * we don't hold locks on these values, so check for underflow
 		 */
-		if (g_wqlinktable.used_elem <= g_wqlinktable.nelem) {
+		if (ltable_used_elem(&g_wqlinktable) <= g_wqlinktable.nelem) {
 			wqdbg_v("Forcing table growth: nelem=%d, used=%d, min_free=%d",
-				g_wqlinktable.nelem, g_wqlinktable.used_elem,
+				g_wqlinktable.nelem, ltable_used_elem(&g_wqlinktable),
 				g_min_free_table_elem);
 			ltable_grow(&g_wqlinktable, g_min_free_table_elem);
 		}
@@ -741,15 +741,15 @@ static void wq_prepost_ensure_free_space(void)
 	/*
 	 * Now ensure that we have a sufficient amount of free table space
 	 */
-	free_elem = g_prepost_table.nelem - g_prepost_table.used_elem;
+	free_elem = g_prepost_table.nelem - ltable_used_elem(&g_prepost_table);
 	min_free = g_min_free_table_elem + g_min_free_cache;
 	if (free_elem < min_free) {
 		/*
 		 * we don't hold locks on these values, so check for underflow
 		 */
-		if (g_prepost_table.used_elem <= g_prepost_table.nelem) {
+		if (ltable_used_elem(&g_prepost_table) <= g_prepost_table.nelem) {
 			wqdbg_v("Forcing table growth: nelem=%d, used=%d, min_free=%d+%d",
-				g_prepost_table.nelem, g_prepost_table.used_elem,
+				g_prepost_table.nelem, ltable_used_elem(&g_prepost_table),
 				g_min_free_table_elem, g_min_free_cache);
 			ltable_grow(&g_prepost_table, min_free);
 		}
@@ -1525,7 +1525,7 @@ static void wq_table_stats(struct link_table *table, struct wq_table_stats *stat
 {
 	stats->version = WAITQ_STATS_VERSION;
 	stats->table_elements = table->nelem;
-	stats->table_used_elems = table->used_elem;
+	stats->table_used_elems = ltable_used_elem(table);
 	stats->table_elem_sz = table->elem_sz;
 	stats->table_slabs = table->nslabs;
 	stats->table_slab_sz = table->slab_sz;
@@ -1538,6 +1538,10 @@ static void wq_table_stats(struct link_table *table, struct wq_table_stats *stat
 	stats->table_avg_used = table->avg_used;
 	stats->table_max_reservations = table->max_reservations;
 	stats->table_avg_reservations = table->avg_reservations;
+
+	stats->table_num_steals = 0;
+	for (int i = 0; i < LT_FREE_SHARDS; i++)
+		stats->table_num_steals += table->free[i].nsteals;
 }
 
 void waitq_link_stats(struct wq_table_stats *stats)
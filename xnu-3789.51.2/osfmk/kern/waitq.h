@@ -438,7 +438,7 @@ extern int waitq_irq_safe(struct waitq *waitq);
 /*
  * waitq statistics
  */
-#define WAITQ_STATS_VERSION 1
+#define WAITQ_STATS_VERSION 2
 struct wq_table_stats {
 	uint32_t version;
 	uint32_t table_elements;
@@ -455,6 +455,9 @@ struct wq_table_stats {
 	uint64_t table_avg_used;
 	uint64_t table_max_reservations;
 	uint64_t table_avg_reservations;
+
+	/* allocations satisfied from another CPU's free list shard */
+	uint64_t table_num_steals;
 };
 
 extern void waitq_link_stats(struct wq_table_stats *stats);
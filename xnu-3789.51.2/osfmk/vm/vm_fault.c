@@ -82,6 +82,7 @@
 #include <kern/thread.h>
 #include <kern/sched_prim.h>
 #include <kern/host.h>
+#include <kern/kalloc.h>
 #include <kern/xpr.h>
 #include <kern/mach_param.h>
 #include <kern/macro_help.h>
@@ -89,6 +90,9 @@
 #include <kern/misc_protos.h>
 #include <kern/policy_internal.h>
 
+#include <machine/machine_cpu.h>
+#include <machine/machine_routines.h>
+
 #include <vm/vm_compressor.h>
 #include <vm/vm_compressor_pager.h>
 #include <vm/vm_fault.h>
@@ -1568,6 +1572,15 @@ vm_fault_page(
 					return (VM_FAULT_RETRY);
 				}
 			}
+			if (object->object_slid &&
+			    m == VM_PAGE_NULL &&
+			    vm_shared_region_slid_cache_lookup(object, offset)) {
+				/*
+				 * the slid contents came back from the slid
+				 * page cache... look the page up again
+				 */
+				continue;
+			}
 			if (object->internal) {
 				int compressed_count_delta;
 
@@ -3343,6 +3356,128 @@ after_the_pmap_enter:
 	return kr;
 }
 
+
+/*
+ * Fault-around: once a fault on a file-backed mapping has been resolved,
+ * also map up to map->fault_around of the neighbouring pages that are
+ * already resident in the object, so that touching them later doesn't
+ * cost a minor fault each.  The window follows the access pattern
+ * vm_fault_is_sequential() has recorded for the object: ahead of the
+ * fault while it's moving forward, behind it while it's moving backward,
+ * and around it otherwise.  Neighbours are always mapped read-only, so
+ * a first write still takes a fault and gets the usual dirty tracking
+ * and copy object handling.
+ *
+ * The map is held shared and "object" is locked by the caller.  Pages
+ * that still need code signing validation are only validated here if
+ * "validate_cs" says the caller holds the object exclusive and can
+ * cope with vm_page_validate_cs() dropping the lock; otherwise they're
+ * left for their own fault.
+ */
+unsigned int	vm_fault_around_pages = 16;
+unsigned int	vm_fault_around_faults = 0;
+unsigned int	vm_fault_around_mapped = 0;
+
+static void
+vm_fault_around(
+	vm_map_t		map,
+	pmap_t			pmap,
+	vm_map_offset_t		vaddr,
+	vm_object_t		object,
+	vm_object_offset_t	offset,
+	vm_prot_t		prot,
+	vm_object_fault_info_t	fault_info,
+	boolean_t		validate_cs)
+{
+	vm_object_offset_t	start, end, cur, window;
+	vm_map_offset_t		va;
+	vm_page_t		m;
+	unsigned int		npages, mapped;
+	int			type_of_fault;
+	boolean_t		need_retry = FALSE;
+
+	npages = map->fault_around;
+	prot &= ~VM_PROT_WRITE;
+
+	if (npages == 0 ||
+	    prot == VM_PROT_NONE ||
+	    fault_info->behavior == VM_BEHAVIOR_RANDOM ||
+	    object->internal ||
+	    object->object_slid ||
+	    object->phys_contiguous ||
+	    object->blocked_access)
+		return;
+
+	window = ptoa_64(npages);
+
+	if (object->sequential > 0) {
+		start = offset + PAGE_SIZE_64;
+		end = start + window;
+	} else if (object->sequential < 0) {
+		end = offset;
+		start = (end > window) ? end - window : 0;
+	} else {
+		start = (offset > window / 2) ? offset - window / 2 : 0;
+		end = start + window + PAGE_SIZE_64;
+	}
+	if (start < fault_info->lo_offset)
+		start = fault_info->lo_offset;
+	if (end > fault_info->hi_offset)
+		end = fault_info->hi_offset;
+
+	for (mapped = 0, cur = start; cur < end; cur += PAGE_SIZE_64) {
+		if (cur == offset)
+			continue;
+		va = vaddr + (cur - offset);
+
+		m = vm_page_lookup(object, cur);
+
+		if (m == VM_PAGE_NULL ||
+		    m->busy ||
+		    m->laundry ||
+		    m->encrypted ||
+		    m->cs_tainted ||
+		    VM_PAGE_GET_PHYS_PAGE(m) == vm_page_guard_addr ||
+		    (m->unusual && (m->error || m->restart || m->private || m->absent)))
+			continue;
+
+		if (VM_FAULT_NEED_CS_VALIDATION(pmap, m, object)) {
+			if (!validate_cs)
+				continue;
+			vm_page_validate_cs(m);
+
+			if (!m->cs_validated || m->cs_tainted)
+				continue;
+		}
+		if (pmap_find_phys(pmap, va) != 0)
+			continue;
+
+		type_of_fault = DBG_CACHE_HIT_FAULT;
+
+		if (vm_fault_enter(m, pmap, va, prot, VM_PROT_READ,
+				   FALSE,	/* wired */
+				   FALSE,	/* change_wiring */
+				   fault_info->no_cache,
+				   fault_info->cs_bypass,
+				   fault_info->user_tag,
+				   fault_info->pmap_options,
+				   &need_retry,
+				   &type_of_fault) == KERN_SUCCESS && !need_retry)
+			mapped++;
+
+		if (need_retry) {
+			/*
+			 * the pmap needs to grow... not worth blocking
+			 * for pages nobody has asked for yet
+			 */
+			break;
+		}
+	}
+	OSAddAtomic(1, &vm_fault_around_faults);
+	if (mapped)
+		OSAddAtomic(mapped, &vm_fault_around_mapped);
+}
+
 void
 vm_pre_fault(vm_map_offset_t vaddr)
 {
@@ -3380,6 +3515,311 @@ unsigned long vm_fault_collapse_total = 0;
 unsigned long vm_fault_collapse_skipped = 0;
 
 
+/*
+ * Speculative faults on anonymous memory.
+ *
+ * vm_fault_internal() looks the faulting address up with the map lock
+ * held shared, so every fault in a task bounces the same lock and stalls
+ * behind any thread holding the map for writing (mmap, munmap, mprotect).
+ * For a private anonymous entry all the lookup produces is the entry's
+ * object, offset and protection, so each thread remembers the last such
+ * entry it faulted on, along with the map's fault_seq at the time, and
+ * later faults in that range use it without the map lock for as long
+ * as fault_seq hasn't moved.
+ *
+ * The thread counts itself in the map's spec_faults before it looks at
+ * fault_seq and stays counted until it has entered the page (or given
+ * up), and vm_map_fault_seq_enter() waits for spec_faults to drain
+ * before a writer can change anything.  So once fault_seq has been
+ * found unchanged, the entry, its object reference and the pmap range
+ * all stay as they were until we're done: a writer's pmap_remove()
+ * comes after our pmap_enter(), and vm_map_entry_delete() can't get to
+ * the object before we've let go of it.  Nothing in between blocks for
+ * long: the object is only try-locked, and vm_fault_enter() is told to
+ * report a pmap that needs expanding rather than wait for memory.
+ *
+ * The thread holds no reference on the object (the fast path wants
+ * ref_count == 1, and an idle thread shouldn't keep an unmapped object
+ * alive), so it also remembers the object's vo_generation and checks it
+ * once the object is locked.  fault_seq is 64 bits and can't wrap.
+ */
+#define VM_FAULT_SPEC_SPIN	1000	/* cpu_pause()s before a writer sleeps */
+
+struct vm_fault_spec_slot {
+	uint64_t	counts[VM_FAULT_SPEC_NCOUNTS];
+} __attribute__((aligned(64)));
+
+static struct vm_fault_spec_slot	*vm_fault_spec_slots = NULL;
+static unsigned int			vm_fault_spec_nslots = 0;
+
+int		vm_fault_spec_enabled = 1;
+
+void
+vm_fault_spec_init(void)
+{
+	unsigned int	num_cpus;
+	vm_size_t	size;
+
+	num_cpus = ml_get_max_cpus();
+	size = num_cpus * sizeof(struct vm_fault_spec_slot);
+
+	vm_fault_spec_slots = (struct vm_fault_spec_slot *)kalloc(size);
+	bzero(vm_fault_spec_slots, size);
+	OSMemoryBarrier();
+	vm_fault_spec_nslots = num_cpus;
+}
+
+static void
+vm_fault_spec_count_one(
+	int		which)
+{
+	disable_preemption();
+	vm_fault_spec_slots[cpu_number()].counts[which]++;
+	enable_preemption();
+}
+
+/*
+ * Sum of one of the per-CPU counters (VM_FAULT_SPEC_HITS, _MISSES or
+ * _FALLBACKS), for the vm.spec_fault_* sysctls.
+ */
+uint64_t
+vm_fault_spec_count(
+	int		which)
+{
+	uint64_t	total = 0;
+	unsigned int	i;
+
+	if (which < 0 || which >= VM_FAULT_SPEC_NCOUNTS)
+		return 0;
+
+	for (i = 0; i < vm_fault_spec_nslots; i++)
+		total += vm_fault_spec_slots[i].counts[which];
+	return total;
+}
+
+/*
+ * Called with "map" just locked for writing: make fault_seq odd, then
+ * wait out any speculative fault that validated the old value.  Those
+ * only try-lock the object and enter one page, so spin for a while
+ * before backing off.
+ */
+void
+vm_map_fault_seq_enter(
+	vm_map_t	map)
+{
+	uint32_t	i;
+
+	map->fault_seq = (map->fault_seq + 1) | 1;
+	OSMemoryBarrier();
+
+	for (i = 0; map->spec_faults != 0; i++) {
+		if (i < VM_FAULT_SPEC_SPIN)
+			cpu_pause();
+		else
+			mutex_pause(i - VM_FAULT_SPEC_SPIN);
+	}
+}
+
+/*
+ * Called after a successful vm_map_lookup_locked() with "map" held
+ * shared: remember the entry containing "vaddr" if later faults in it
+ * can go through vm_fault_speculative().
+ */
+static void
+vm_fault_spec_record(
+	vm_map_t	map,
+	vm_map_offset_t	vaddr,
+	vm_object_t	object,
+	vm_prot_t	prot)
+{
+	thread_t	thread = current_thread();
+	vm_map_entry_t	entry;
+
+	if (thread->spec_fault_map == map &&
+	    thread->spec_fault_seq == map->fault_seq &&
+	    vaddr >= thread->spec_fault_start &&
+	    vaddr < thread->spec_fault_end)
+		return;
+
+	thread->spec_fault_map = VM_MAP_NULL;
+
+	if (!vm_map_lookup_entry(map, vaddr, &entry) ||
+	    entry->is_sub_map ||
+	    entry->needs_copy ||
+	    entry->is_shared ||
+	    entry->in_transition ||
+	    entry->wired_count != 0 ||
+	    entry->used_for_jit ||
+	    entry->vme_resilient_codesign ||
+	    entry->iokit_acct ||
+	    !entry->use_pmap ||
+	    entry->no_cache ||
+	    entry->superpage_size ||
+	    VME_OBJECT(entry) != object ||
+	    !object->internal)
+		return;
+
+	thread->spec_fault_seq = map->fault_seq;
+	thread->spec_fault_tag = VME_ALIAS(entry);
+	thread->spec_fault_prot = prot;
+	thread->spec_fault_start = entry->vme_start;
+	thread->spec_fault_end = entry->vme_end;
+	thread->spec_fault_object = object;
+	thread->spec_fault_object_gen = object->vo_generation;
+	thread->spec_fault_offset = VME_OFFSET(entry);
+	thread->spec_fault_map = map;
+}
+
+/*
+ * Try to resolve a fault in the entry remembered by vm_fault_spec_record()
+ * without the map lock.  Only the simple cases are handled here: the page
+ * is resident in the entry's object, or it can be zero-filled because the
+ * compressor has nothing for that offset.  Returns FALSE if the caller
+ * should take the normal path.
+ */
+static boolean_t
+vm_fault_speculative(
+	vm_map_t	map,
+	vm_map_offset_t	vaddr,
+	vm_prot_t	fault_type,
+	int		*type_of_fault)
+{
+	thread_t			thread = current_thread();
+	vm_object_t			object;
+	vm_object_offset_t		offset;
+	vm_page_t			m;
+	vm_prot_t			prot;
+	uint64_t			seq;
+	boolean_t			need_retry = FALSE;
+	kern_return_t			kr;
+
+	if (vm_fault_spec_nslots == 0)
+		return FALSE;
+
+	if (thread->spec_fault_map != map ||
+	    vaddr < thread->spec_fault_start ||
+	    vaddr >= thread->spec_fault_end) {
+		vm_fault_spec_count_one(VM_FAULT_SPEC_MISSES);
+		return FALSE;
+	}
+	prot = thread->spec_fault_prot;
+
+	if ((fault_type & ~VM_PROT_ALL) != 0 ||
+	    (fault_type & prot) != fault_type)
+		return FALSE;
+
+	seq = thread->spec_fault_seq;
+	object = thread->spec_fault_object;
+	offset = thread->spec_fault_offset + (vaddr - thread->spec_fault_start);
+
+	/*
+	 * count ourselves in before looking at fault_seq... a writer
+	 * makes it odd before waiting for spec_faults to drain, so
+	 * either it waits for us or we see the new value and back off
+	 */
+	OSIncrementAtomic(&map->spec_faults);
+	OSMemoryBarrier();
+
+	if (map->fault_seq != seq) {
+		OSDecrementAtomic(&map->spec_faults);
+		thread->spec_fault_map = VM_MAP_NULL;
+		vm_fault_spec_count_one(VM_FAULT_SPEC_MISSES);
+		return FALSE;
+	}
+	if (!_vm_object_lock_try(object)) {
+		OSDecrementAtomic(&map->spec_faults);
+		vm_fault_spec_count_one(VM_FAULT_SPEC_FALLBACKS);
+		return FALSE;
+	}
+	if (object->vo_generation != thread->spec_fault_object_gen) {
+		thread->spec_fault_map = VM_MAP_NULL;
+		goto fallback;
+	}
+	if (!object->alive ||
+	    object->terminating ||
+	    object->ref_count != 1 ||
+	    object->shadow != VM_OBJECT_NULL ||
+	    object->copy != VM_OBJECT_NULL ||
+	    object->true_share ||
+	    object->phys_contiguous ||
+	    object->blocked_access ||
+	    VM_OBJECT_PURGEABLE_FAULT_ERROR(object))
+		goto fallback;
+
+	m = vm_page_lookup(object, offset);
+
+	if (m != VM_PAGE_NULL) {
+		if (m->busy ||
+		    m->laundry ||
+		    m->encrypted ||
+		    VM_PAGE_WIRED(m) ||
+		    VM_PAGE_GET_PHYS_PAGE(m) == vm_page_guard_addr ||
+		    (m->unusual && (m->error || m->restart || m->private || m->absent)))
+			goto fallback;
+
+		*type_of_fault = DBG_CACHE_HIT_FAULT;
+	} else {
+		if (map->no_zero_fill ||
+		    (object->pager_created &&
+		     VM_COMPRESSOR_PAGER_STATE_GET(object, offset) != VM_EXTERNAL_STATE_ABSENT))
+			goto fallback;
+
+		if (vm_backing_store_low &&
+		    !(current_task()->priv_flags & VM_BACKING_STORE_PRIV))
+			goto fallback;
+
+		/*
+		 * the normal path delays zero-fills while the pageout
+		 * daemon is behind (see vm_fault_check)... leave that
+		 * to it rather than sleep here with the map counted
+		 */
+		if (vm_page_throttled(FALSE))
+			goto fallback;
+
+		m = vm_page_alloc(object, offset);
+
+		if (m == VM_PAGE_NULL)
+			goto fallback;
+
+		*type_of_fault = vm_fault_zero_page(m, FALSE);
+	}
+	kr = vm_fault_enter(m,
+			    map->pmap,
+			    vaddr,
+			    prot,
+			    fault_type,
+			    FALSE,		/* wired */
+			    FALSE,		/* change_wiring */
+			    FALSE,		/* no_cache */
+			    FALSE,		/* cs_bypass */
+			    thread->spec_fault_tag,
+			    0,			/* pmap_options */
+			    &need_retry,
+			    type_of_fault);
+
+	if (m->busy)
+		PAGE_WAKEUP_DONE(m);
+
+	vm_object_unlock(object);
+	OSDecrementAtomic(&map->spec_faults);
+
+	if (kr != KERN_SUCCESS || need_retry) {
+		/* the normal path expands the pmap if that's what it needs */
+		vm_fault_spec_count_one(VM_FAULT_SPEC_FALLBACKS);
+		return FALSE;
+	}
+	vm_fault_spec_count_one(VM_FAULT_SPEC_HITS);
+
+	return TRUE;
+
+fallback:
+	vm_object_unlock(object);
+	OSDecrementAtomic(&map->spec_faults);
+	vm_fault_spec_count_one(VM_FAULT_SPEC_FALLBACKS);
+
+	return FALSE;
+}
+
 kern_return_t
 vm_fault(
 	vm_map_t	map,
@@ -3435,6 +3875,7 @@ vm_fault_internal(
 	boolean_t		need_collapse = FALSE;
 	boolean_t		need_retry = FALSE;
 	boolean_t		*need_retry_ptr = NULL;
+	boolean_t		fault_around = FALSE;
 	int			object_lock_type = 0;
 	int			cur_object_lock_type;
 	vm_object_t		top_object = VM_OBJECT_NULL;
@@ -3507,6 +3948,16 @@ RetryFault:
 	 */
 	fault_type = original_fault_type;
 	map = original_map;
+
+	if (vm_fault_spec_enabled &&
+	    !change_wiring &&
+	    caller_pmap == PMAP_NULL &&
+	    physpage_p == NULL &&
+	    map == current_map() &&
+	    vm_fault_speculative(map, vaddr, fault_type, &type_of_fault)) {
+		kr = KERN_SUCCESS;
+		goto done;
+	}
 	vm_map_lock_read(map);
 
 	kr = vm_map_lookup_locked(&map, vaddr, fault_type,
@@ -3527,6 +3978,15 @@ RetryFault:
 	fault_info.mark_zf_absent = FALSE;
 	fault_info.batch_pmap_op = FALSE;
 
+	if (vm_fault_spec_enabled &&
+	    !change_wiring &&
+	    !wired &&
+	    map == original_map &&
+	    real_map == map &&
+	    map == current_map() &&
+	    map != kernel_map)
+		vm_fault_spec_record(map, vaddr, object, prot);
+
 	/*
 	 * If the page is wired, we must fault for the current protection
 	 * value, to avoid further faults.
@@ -3973,6 +4433,12 @@ upgrade_for_validation:
 FastPmapEnter:
 				assert(m_object == VM_PAGE_OBJECT(m));
 
+				/*
+				 * the page is from the top-level object unless
+				 * we had to switch to a shadow for it
+				 */
+				fault_around = (top_object == VM_OBJECT_NULL);
+
 				/*
 				 * prepare for the pmap_enter...
 				 * object and map are both locked
@@ -4069,6 +4535,12 @@ FastPmapEnter:
 
 					vm_fault_deactivate_behind(object, cur_offset, fault_info.behavior);
 				}
+				if (fault_around &&
+				    need_retry == FALSE &&
+				    kr == KERN_SUCCESS &&
+				    caller_pmap == PMAP_NULL &&
+				    !wired && !change_wiring)
+					vm_fault_around(map, pmap, vaddr, object, offset, prot, &fault_info, FALSE);
 				/*
 				 * That's it, clean up and return.
 				 */
@@ -4924,6 +5396,16 @@ handle_copy_delay:
 				m->dirty = TRUE;
 			}
 		}
+		if (top_page == VM_PAGE_NULL &&
+		    m_object == object &&
+		    caller_pmap == PMAP_NULL &&
+		    !wired && !change_wiring) {
+			/*
+			 * "m" is still busy and we hold its object
+			 * exclusive, so neighbours may be validated
+			 */
+			vm_fault_around(map, pmap, vaddr, m_object, m->offset, prot, &fault_info, TRUE);
+		}
 	} else {
 
 		vm_map_entry_t		entry;
@@ -5070,6 +5552,23 @@ handle_copy_delay:
 done:
 	thread_interrupt_level(interruptible_state);
 
+	if (kr == KERN_SUCCESS &&
+	    type_of_fault == DBG_ZERO_FILL_FAULT &&
+	    !change_wiring &&
+	    caller_pmap == PMAP_NULL &&
+	    physpage_p == NULL &&
+	    original_map != kernel_map) {
+		unsigned int	index;
+
+		/*
+		 * filling the first or last page of a 2MB block is a hint
+		 * that the rest of it may be resident too
+		 */
+		index = (unsigned int)((vaddr & (SUPERPAGE_SIZE - 1)) >> PAGE_SHIFT);
+		if (index == 0 || index == SUPERPAGE_NBASEPAGES - 1)
+			vm_map_superpage_hint(original_map, vaddr);
+	}
+
 	/*
 	 * Only I/O throttle on faults which cause a pagein/swapin.
 	 */
@@ -97,6 +97,14 @@ extern kern_return_t vm_fault(
 
 extern void vm_pre_fault(vm_map_offset_t);
 
+/* per-CPU counters kept by vm_fault_speculative() */
+#define VM_FAULT_SPEC_HITS		0
+#define VM_FAULT_SPEC_MISSES		1	/* no valid entry remembered */
+#define VM_FAULT_SPEC_FALLBACKS		2	/* validated, but took the normal path */
+#define VM_FAULT_SPEC_NCOUNTS		3
+
+extern uint64_t vm_fault_spec_count(int which);
+
 #ifdef	MACH_KERNEL_PRIVATE
 
 #include <vm/vm_page.h>
@@ -104,6 +112,9 @@ extern void vm_pre_fault(vm_map_offset_t);
 #include <vm/vm_map.h>
 
 extern void vm_fault_init(void);
+extern void vm_fault_spec_init(void);
+
+extern unsigned int vm_fault_around_pages;	/* default for new maps */
 
 /*
  *	Page fault handling based on vm_object only.
@@ -85,6 +85,8 @@
 #include <kern/backtrace.h>
 #include <kern/counters.h>
 #include <kern/kalloc.h>
+#include <kern/processor.h>
+#include <kern/task.h>
 #include <kern/zalloc.h>
 
 #include <vm/cpm.h>
@@ -318,6 +320,17 @@ static kern_return_t	vm_map_pageout(
 	vm_map_offset_t	end);
 #endif /* MACH_ASSERT */
 
+static void		vm_map_superpage_demote(
+	vm_map_t	map,
+	vm_map_entry_t	entry,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end);
+
+static void		vm_map_superpage_demote_range(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end);
+
 /*
  * Macros to copy a vm_map_entry. We must be careful to correctly
  * manage the wired page count. vm_map_entry_copy() creates a new
@@ -344,6 +357,7 @@ boolean_t _vmec_reserved = (NEW)->from_reserved_zone;	\
 	(NEW)->vme_resilient_codesign = FALSE; \
 	(NEW)->vme_resilient_media = FALSE;	\
 	(NEW)->vme_atomic = FALSE; 	\
+	(NEW)->vme_promoted = FALSE;	\
 MACRO_END
 
 #define vm_map_entry_copy_full(NEW,OLD)			\
@@ -964,6 +978,8 @@ vm_map_create(
 	result->first_free = vm_map_to_entry(result);
 	result->hint = vm_map_to_entry(result);
 	result->color_rr = (color_seed++) & vm_color_mask;
+	result->fault_around = vm_fault_around_pages;
+	result->superpage_promoted = 0;
  	result->jit_entry_exists = FALSE;
 
 	if (vm_map_supports_hole_optimization && pmap != kernel_pmap) {
@@ -1631,6 +1647,7 @@ vm_map_find_space(
 	new_entry->iokit_acct = FALSE;
 	new_entry->vme_resilient_codesign = FALSE;
 	new_entry->vme_resilient_media = FALSE;
+	new_entry->vme_promoted = FALSE;
 	if (flags & VM_FLAGS_ATOMIC_ENTRY)	
 		new_entry->vme_atomic = TRUE;
 	else
@@ -4177,6 +4194,12 @@ vm_map_clip_start(
 		if (entry->vme_atomic) {
 			panic("Attempting to clip an atomic VM entry! (map: %p, entry: %p)\n", map, entry);
 		} 
+		if (entry->vme_promoted && (startaddr & (SUPERPAGE_SIZE - 1))) {
+			/* the block straddling the clip can't stay promoted */
+			vm_map_superpage_demote(map, entry,
+						SUPERPAGE_ROUND_DOWN(startaddr),
+						SUPERPAGE_ROUND_DOWN(startaddr) + SUPERPAGE_SIZE);
+		}
 		_vm_map_clip_start(&map->hdr, entry, startaddr);
 		if (map->holelistenabled) {
 			vm_map_store_update_first_free(map, NULL, FALSE);
@@ -4285,6 +4308,12 @@ vm_map_clip_end(
 		if (entry->vme_atomic) {
 			panic("Attempting to clip an atomic VM entry! (map: %p, entry: %p)\n", map, entry);
 		}
+		if (entry->vme_promoted && (endaddr & (SUPERPAGE_SIZE - 1))) {
+			/* the block straddling the clip can't stay promoted */
+			vm_map_superpage_demote(map, entry,
+						SUPERPAGE_ROUND_DOWN(endaddr),
+						SUPERPAGE_ROUND_DOWN(endaddr) + SUPERPAGE_SIZE);
+		}
 		_vm_map_clip_end(&map->hdr, entry, endaddr);
 		if (map->holelistenabled) {
 			vm_map_store_update_first_free(map, NULL, FALSE);
@@ -4582,6 +4611,9 @@ vm_map_protect(
 	if (entry->superpage_size)
  		end = SUPERPAGE_ROUND_UP(end);
 
+	/* promoted blocks are mapped with their entry's protection */
+	vm_map_superpage_demote_range(map, start, end);
+
 	/*
 	 *	Make a first pass to check for protection and address
 	 *	violations.
@@ -4983,6 +5015,9 @@ vm_map_wire_nested(
 		return KERN_SUCCESS;
 	}
 
+	/* user wirings are counted on the base pages */
+	vm_map_superpage_demote_range(map, start, end);
+
 	need_wakeup = FALSE;
 	cur_thread = current_thread();
 
@@ -6316,6 +6351,9 @@ vm_map_delete(
 			vm_map_clip_end(map, entry, end);
 		}
 
+		/* give the pages of promoted blocks back to the paging queues */
+		vm_map_superpage_demote(map, entry, entry->vme_start, entry->vme_end);
+
 		if (entry->permanent) {
 			panic("attempt to remove permanent VM map entry "
 			      "%p [0x%llx:0x%llx]\n",
@@ -6645,10 +6683,11 @@ vm_map_delete(
 
 		/*
 		 * All pmap mappings for this map entry must have been
-		 * cleared by now.
+		 * cleared by now, unless the caller is doing it.
 		 */
 #if DEBUG
-		assert(vm_map_pmap_is_empty(map,
+		assert((flags & VM_MAP_REMOVE_NO_PMAP_CLEANUP) ||
+		       vm_map_pmap_is_empty(map,
 					    entry->vme_start,
 					    entry->vme_end));
 #endif /* DEBUG */
@@ -6739,6 +6778,143 @@ vm_map_delete(
 	return KERN_SUCCESS;
 }
 
+/*
+ * Range reservation for vm_map_remove().
+ *
+ * Tearing down the translations for a range (pmap_remove() and the TLB
+ * shootdown that goes with it) is the expensive part of an unmap, and
+ * doing it with the map locked for writing serializes every thread
+ * allocating and deallocating memory in the task, even in unrelated
+ * parts of the address space.  For the common case of a user range
+ * made only of plain, unwired mappings, vm_map_remove_reserved() moves
+ * the entries out to a private "zap" map and leaves an in_transition
+ * placeholder with no access in their place, which keeps anyone else
+ * from using or reusing that range exactly as a wiring in progress
+ * does.  The pmap and the objects are then cleaned up with the map
+ * unlocked, and the placeholders are removed at the end.  Operations on
+ * other ranges, and faults anywhere else, proceed in the meantime.
+ */
+int vm_map_remove_reserve = 1;
+unsigned int vm_map_remove_reserved = 0;
+
+static boolean_t
+vm_map_remove_reserve_ok(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	vm_map_entry_t	entry;
+	boolean_t	has_object = FALSE;
+
+	if (map->pmap == kernel_pmap || map->mapped_in_other_pmaps)
+		return FALSE;
+	if (vm_map_lookup_entry(map, start, &entry) == FALSE)
+		entry = entry->vme_next;
+	for (;
+	     entry != vm_map_to_entry(map) && entry->vme_start < end;
+	     entry = entry->vme_next) {
+		if (entry->in_transition ||
+		    entry->is_sub_map ||
+		    entry->wired_count != 0 ||
+		    entry->user_wired_count != 0 ||
+		    entry->permanent ||
+		    entry->superpage_size)
+			return FALSE;
+		if (VME_OBJECT(entry) != VM_OBJECT_NULL)
+			has_object = TRUE;
+	}
+	/* without an object there are no translations to tear down */
+	return has_object;
+}
+
+/*
+ * Called with "map" locked for writing; returns with it unlocked.
+ */
+static kern_return_t
+vm_map_remove_reserved(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end,
+	vm_map_t	zap_map)
+{
+	vm_map_entry_t	entry, prev, next;
+	boolean_t	need_wakeup = FALSE;
+
+	(void) vm_map_delete(map, start, end,
+			     (VM_MAP_REMOVE_SAVE_ENTRIES |
+			      VM_MAP_REMOVE_NO_PMAP_CLEANUP),
+			     zap_map);
+
+	for (entry = vm_map_first_entry(zap_map);
+	     entry != vm_map_to_entry(zap_map);
+	     entry = entry->vme_next) {
+		if (vm_map_lookup_entry(map, entry->vme_start, &prev))
+			panic("vm_map_remove_reserved(%p,0x%llx,0x%llx): "
+			      "entry %p still mapped at 0x%llx\n",
+			      map, (uint64_t)start, (uint64_t)end,
+			      prev, (uint64_t)entry->vme_start);
+		(void) vm_map_entry_insert(map, prev,
+					   entry->vme_start, entry->vme_end,
+					   VM_OBJECT_NULL, 0,
+					   FALSE, FALSE,
+					   TRUE,	/* in_transition */
+					   VM_PROT_NONE, VM_PROT_NONE,
+					   VM_BEHAVIOR_DEFAULT,
+					   VM_INHERIT_NONE,
+					   0, FALSE, FALSE, 0, FALSE, FALSE);
+	}
+	vm_map_remove_reserved++;
+	vm_map_unlock(map);
+
+	for (entry = vm_map_first_entry(zap_map);
+	     entry != vm_map_to_entry(zap_map);
+	     entry = entry->vme_next) {
+		if (VME_OBJECT(entry) != VM_OBJECT_NULL) {
+			pmap_remove_options(map->pmap,
+					    (addr64_t)entry->vme_start,
+					    (addr64_t)entry->vme_end,
+					    PMAP_OPTIONS_REMOVE);
+		}
+	}
+
+	/*
+	 * Nobody can have deleted or merged a placeholder while it was
+	 * in transition, but it may have been clipped.
+	 */
+	vm_map_lock(map);
+	for (entry = vm_map_first_entry(zap_map);
+	     entry != vm_map_to_entry(zap_map);
+	     entry = entry->vme_next) {
+		if (!vm_map_lookup_entry(map, entry->vme_start, &prev))
+			panic("vm_map_remove_reserved(%p,0x%llx,0x%llx): "
+			      "no placeholder at 0x%llx\n",
+			      map, (uint64_t)start, (uint64_t)end,
+			      (uint64_t)entry->vme_start);
+		while (prev != vm_map_to_entry(map) &&
+		       prev->vme_start < entry->vme_end) {
+			assert(prev->in_transition);
+			assert(VME_OBJECT(prev) == VM_OBJECT_NULL);
+			next = prev->vme_next;
+			if (prev->needs_wakeup)
+				need_wakeup = TRUE;
+			vm_map_store_entry_unlink(map, prev);
+			map->size -= prev->vme_end - prev->vme_start;
+			vm_map_entry_dispose(map, prev);
+			prev = next;
+		}
+	}
+	if (map->wait_for_space)
+		thread_wakeup((event_t) map);
+	if (need_wakeup)
+		vm_map_entry_wakeup(map);
+	vm_map_unlock(map);
+
+	/* the translations are gone: drop the objects */
+	vm_map_destroy(zap_map, VM_MAP_REMOVE_NO_PMAP_CLEANUP);
+
+	return KERN_SUCCESS;
+}
+
 /*
  *	vm_map_remove:
  *
@@ -6753,6 +6929,7 @@ vm_map_remove(
 	 boolean_t	flags)
 {
 	kern_return_t	result;
+	vm_map_t	zap_map;
 
 	vm_map_lock(map);
 	VM_MAP_RANGE_CHECK(map, start, end);
@@ -6765,6 +6942,23 @@ vm_map_remove(
 	 */
 	if ((map == zone_map) && (start == end))
 		panic("Nothing being freed to the zone_map. start = end = %p\n", (void *)start);
+	if (flags == VM_MAP_NO_FLAGS &&
+	    vm_map_remove_reserve &&
+	    start < end &&
+	    vm_map_remove_reserve_ok(map, start, end)) {
+		/*
+		 * Only a user map gets here, so allocating the zap map
+		 * with the map locked can't recurse into it.
+		 */
+		zap_map = vm_map_create(PMAP_NULL,
+					start,
+					end,
+					map->hdr.entries_pageable);
+		vm_map_set_page_shift(zap_map, VM_MAP_PAGE_SHIFT(map));
+		vm_map_disable_hole_optimization(zap_map);
+		/* unlocks the map and consumes zap_map */
+		return vm_map_remove_reserved(map, start, end, zap_map);
+	}
 	result = vm_map_delete(map, start, end, flags, VM_MAP_NULL);
 	vm_map_unlock(map);
 
@@ -8289,6 +8483,10 @@ vm_map_copy_overwrite_aligned(
 		assert((tmp_entry->vme_end - tmp_entry->vme_start) == size);
 		assert((copy_entry->vme_end - copy_entry->vme_start) == size);
 
+		/* the destination's pages may be thrown away below */
+		vm_map_superpage_demote(dst_map, entry,
+					entry->vme_start, entry->vme_end);
+
 		/*
 		 *	If the destination contains temporary unshared memory,
 		 *	we can perform the copy by throwing it away and
@@ -8786,6 +8984,100 @@ vm_map_copyout_kernel_buffer(
 	return kr;
 }
 		
+/*
+ *	Routine: vm_map_copyout_kernel_buffers
+ *
+ *	Description:
+ *		Batched form of vm_map_copyout_kernel_buffer() for callers
+ *		(mach message copyout) that have several small kernel
+ *		buffer copies destined for the same map.  Space for all of
+ *		them is allocated with a single vm_map_enter(), so the
+ *		destination map is locked once rather than once per copy,
+ *		and the address space switch (if any) is done once.
+ *
+ *		Each copy gets its own map-page-aligned slot so that the
+ *		receiver may deallocate the regions individually.
+ *
+ *		If successful, consumes all the copy objects and fills in
+ *		addrs[].  Otherwise, nothing is consumed, the space is
+ *		released and the caller is responsible for the copies.
+ */
+kern_return_t
+vm_map_copyout_kernel_buffers(
+	vm_map_t		map,
+	vm_map_copy_t		*copies,
+	vm_map_address_t	*addrs,		/* OUT */
+	unsigned int		count)
+{
+	kern_return_t		kr;
+	thread_t		thread = current_thread();
+	vm_map_address_t	base, slot;
+	vm_map_size_t		total, copy_size;
+	vm_map_t		oldmap = VM_MAP_NULL;
+	unsigned int		i;
+
+	total = 0;
+	for (i = 0; i < count; i++) {
+		assert(copies[i]->type == VM_MAP_COPY_KERNEL_BUFFER);
+		copy_size = copies[i]->size;
+		if (copy_size > msg_ool_size_small || copies[i]->offset)
+			panic("Invalid vm_map_copy_t sz:%lld, ofst:%lld",
+			      (long long)copy_size,
+			      (long long)copies[i]->offset);
+		total += vm_map_round_page(copy_size, VM_MAP_PAGE_MASK(map));
+	}
+
+	base = 0;
+	kr = vm_map_enter(map,
+			  &base,
+			  total,
+			  (vm_map_offset_t) 0,
+			  VM_FLAGS_ANYWHERE,
+			  VM_OBJECT_NULL,
+			  (vm_object_offset_t) 0,
+			  FALSE,
+			  VM_PROT_DEFAULT,
+			  VM_PROT_ALL,
+			  VM_INHERIT_DEFAULT);
+	if (kr != KERN_SUCCESS)
+		return kr;
+
+	if (thread->map != map) {
+		vm_map_reference(map);
+		oldmap = vm_map_switch(map);
+	}
+
+	slot = base;
+	for (i = 0; i < count; i++) {
+		copy_size = copies[i]->size;
+		assert((vm_size_t)copy_size == copy_size);
+		if (copyout(copies[i]->cpy_kdata, slot, (vm_size_t)copy_size)) {
+			vm_map_copyout_kernel_buffer_failures++;
+			kr = KERN_INVALID_ADDRESS;
+			break;
+		}
+		addrs[i] = slot;
+		slot += vm_map_round_page(copy_size, VM_MAP_PAGE_MASK(map));
+	}
+
+	if (oldmap != VM_MAP_NULL) {
+		(void) vm_map_switch(oldmap);
+		vm_map_deallocate(map);
+	}
+
+	if (kr != KERN_SUCCESS) {
+		(void) vm_map_remove(map, base, base + total, VM_MAP_NO_FLAGS);
+		for (i = 0; i < count; i++)
+			addrs[i] = 0;
+		return kr;
+	}
+
+	for (i = 0; i < count; i++) {
+		kfree(copies[i], copies[i]->size + cpy_kdata_hdr_sz);
+	}
+	return KERN_SUCCESS;
+}
+
 /*
  *	Macro:		vm_map_copy_insert
  *	
@@ -9476,9 +9768,11 @@ vm_map_copyin_internal(
 	 * If the copy is sufficiently small, use a kernel buffer instead
 	 * of making a virtual copy.  The theory being that the cost of
 	 * setting up VM (and taking C-O-W faults) dominates the copy costs
-	 * for small regions.
+	 * for small regions.  The cutoff, msg_ool_copy_threshold, never
+	 * exceeds msg_ool_size_small but may be lowered by the IPC layer
+	 * when it measures remapping to be cheaper (see ipc_kmsg.c).
 	 */
-	if ((len < msg_ool_size_small) &&
+	if ((len < msg_ool_copy_threshold) &&
 	    !use_maxprot &&
 	    !preserve_purgeable &&
 	    !(flags & VM_MAP_COPYIN_ENTRY_LIST) &&
@@ -9559,6 +9853,9 @@ vm_map_copyin_internal(
 
  	vm_map_lock(src_map);
 
+	/* copy-on-write works on base pages */
+	vm_map_superpage_demote_range(src_map, src_start, src_end);
+
 	/*
 	 * Lookup the original "src_addr" rather than the truncated
 	 * "src_start", in case "src_start" falls in a non-map-aligned
@@ -10693,6 +10990,14 @@ vm_map_fork_copy(
 	return TRUE;
 }
 
+/*
+ * Batch the parent's copy-on-write TLB shootdowns in vm_map_fork().
+ * This only makes the write-protect pass cheaper: every entry of the
+ * parent is still duplicated into the child up front.
+ */
+int vm_map_fork_batched_tlb_flush = 1;
+unsigned int vm_map_fork_batched_tlb_flush_entries = 0;
+
 /*
  *	vm_map_fork:
  *
@@ -10717,6 +11022,9 @@ vm_map_fork(
 	boolean_t	new_entry_needs_copy;
 	boolean_t	pmap_is64bit;
 	int		vm_map_copyin_flags;
+	pmap_flush_context	pmap_flush_context_storage;
+	boolean_t	delayed_pmap_flush = FALSE;
+	boolean_t	batch_flush;
 
 	if (options & ~(VM_MAP_FORK_SHARE_IF_INHERIT_NONE |
 			VM_MAP_FORK_PRESERVE_PURGEABLE)) {
@@ -10743,6 +11051,21 @@ vm_map_fork(
 	vm_commit_pagezero_status(new_map);
 	/* inherit the parent map's page size */
 	vm_map_set_page_shift(new_map, VM_MAP_PAGE_SHIFT(old_map));
+	new_map->fault_around = old_map->fault_around;
+
+	/*
+	 * Write-protecting the parent's copy-on-write entries one at a
+	 * time costs a TLB shootdown per entry, which dominates fork of a
+	 * large, fragmented address space.  For entries mapped only in the
+	 * parent's pmap, accumulate them instead and invalidate once
+	 * before the map is unlocked: the parent can't take a fault on
+	 * those ranges until then, and the child can't run yet, so a stale
+	 * writable translation used in the meantime is no different from
+	 * a write that happened before the fork.
+	 */
+	batch_flush = (vm_map_fork_batched_tlb_flush != 0);
+	pmap_flush_context_init(&pmap_flush_context_storage);
+
 	for (
 		old_entry = vm_map_first_entry(old_map);
 		old_entry != vm_map_to_entry(old_map);
@@ -10750,6 +11073,10 @@ vm_map_fork(
 
 		entry_size = old_entry->vme_end - old_entry->vme_start;
 
+		/* the child shares or copies base pages */
+		vm_map_superpage_demote(old_map, old_entry,
+					old_entry->vme_start, old_entry->vme_end);
+
 		switch (old_entry->inheritance) {
 		case VM_INHERIT_NONE:
 			/*
@@ -10817,17 +11144,38 @@ vm_map_fork(
 				    && prot)
 				        prot |= VM_PROT_EXECUTE;
 
-				vm_object_pmap_protect(
-					VME_OBJECT(old_entry),
-					VME_OFFSET(old_entry),
-					(old_entry->vme_end -
-					 old_entry->vme_start),
-					((old_entry->is_shared 
-					  || old_map->mapped_in_other_pmaps)
-					 ? PMAP_NULL :
-					 old_map->pmap),
-					old_entry->vme_start,
-					prot);
+				if (old_entry->is_shared ||
+				    old_map->mapped_in_other_pmaps) {
+					vm_object_pmap_protect(
+						VME_OBJECT(old_entry),
+						VME_OFFSET(old_entry),
+						(old_entry->vme_end -
+						 old_entry->vme_start),
+						PMAP_NULL,
+						old_entry->vme_start,
+						prot);
+				} else if (batch_flush) {
+					vm_object_pmap_protect_delayed(
+						VME_OBJECT(old_entry),
+						VME_OFFSET(old_entry),
+						(old_entry->vme_end -
+						 old_entry->vme_start),
+						old_map->pmap,
+						old_entry->vme_start,
+						prot,
+						&pmap_flush_context_storage);
+					delayed_pmap_flush = TRUE;
+					vm_map_fork_batched_tlb_flush_entries++;
+				} else {
+					vm_object_pmap_protect(
+						VME_OBJECT(old_entry),
+						VME_OFFSET(old_entry),
+						(old_entry->vme_end -
+						 old_entry->vme_start),
+						old_map->pmap,
+						old_entry->vme_start,
+						prot);
+				}
 
 				assert(old_entry->wired_count == 0);
 				old_entry->needs_copy = TRUE;
@@ -10845,6 +11193,15 @@ vm_map_fork(
 			break;
 
 		slow_vm_map_fork_copy:
+			/*
+			 * vm_map_fork_copy() drops the map lock, after which
+			 * the parent may fault on the ranges protected so far.
+			 */
+			if (delayed_pmap_flush == TRUE) {
+				pmap_flush(&pmap_flush_context_storage);
+				pmap_flush_context_init(&pmap_flush_context_storage);
+				delayed_pmap_flush = FALSE;
+			}
 			vm_map_copyin_flags = 0;
 			if (options & VM_MAP_FORK_PRESERVE_PURGEABLE) {
 				vm_map_copyin_flags |=
@@ -10861,6 +11218,8 @@ vm_map_fork(
 		old_entry = old_entry->vme_next;
 	}
 
+	if (delayed_pmap_flush == TRUE)
+		pmap_flush(&pmap_flush_context_storage);
 
 	new_map->size = new_size;
 	vm_map_unlock(old_map);
@@ -12636,7 +12995,8 @@ vm_map_simplify_entry(
 	    (prev_entry->is_shared == FALSE) &&
 	    (this_entry->is_shared == FALSE) &&
 	    (prev_entry->superpage_size == FALSE) &&
-	    (this_entry->superpage_size == FALSE)
+	    (this_entry->superpage_size == FALSE) &&
+	    (prev_entry->vme_promoted == this_entry->vme_promoted)
 		) {
 		vm_map_store_entry_unlink(map, prev_entry);
 		assert(prev_entry->vme_start < this_entry->vme_end);
@@ -12879,6 +13239,16 @@ vm_map_behavior_set(
 		return KERN_NO_SPACE;
 	}
 
+	if ((new_behavior == VM_BEHAVIOR_DONTNEED ||
+	     new_behavior == VM_BEHAVIOR_FREE ||
+	     new_behavior == VM_BEHAVIOR_REUSABLE) &&
+	    map->superpage_promoted != 0) {
+		/* these act on individual pages, which have to be pageable */
+		vm_map_lock(map);
+		vm_map_superpage_demote_range(map, start, end);
+		vm_map_unlock(map);
+	}
+
 	switch (new_behavior) {
 
 	/*
@@ -12936,6 +13306,7 @@ vm_map_behavior_set(
 	case VM_BEHAVIOR_WILLNEED:
 		return vm_map_willneed(map, start, end);
 
+
 	case VM_BEHAVIOR_DONTNEED:
 		return vm_map_msync(map, start, end - start, VM_SYNC_DEACTIVATE | VM_SYNC_CONTIGUOUS);
 
@@ -13684,6 +14055,7 @@ vm_map_entry_insert(
 	new_entry->vme_resilient_codesign = FALSE;
 	new_entry->vme_resilient_media = FALSE;
 	new_entry->vme_atomic = FALSE;
+	new_entry->vme_promoted = FALSE;
 
 	/*
 	 *	Insert the new entry into the list.
@@ -13770,6 +14142,8 @@ vm_map_remap_extract(
 	 *	multiple map entries, need to loop on them.
 	 */
 	vm_map_lock(map);
+	/* the new mapping shares or copies base pages */
+	vm_map_superpage_demote_range(map, src_start, src_start + size);
 	while (mapped_size != size) {
 		vm_map_size_t	entry_size;
 
@@ -14538,6 +14912,7 @@ vm_map_switch(
 	 *	Deactivate the current map and activate the requested map
 	 */
 	PMAP_SWITCH_USER(thread, map, mycpu);
+	thread->spec_fault_map = VM_MAP_NULL;
 
 	mp_enable_preemption();
 	return(oldmap);
@@ -15592,6 +15967,593 @@ vm_map_set_jumbo(vm_map_t map)
 	(void) map;
 }
 
+/*
+ * Set how many already-resident neighbouring pages a fault on a
+ * file-backed mapping in "map" may map along with the faulting one.
+ * 0 turns fault-around off for the map.
+ */
+void
+vm_map_set_fault_around(
+	vm_map_t	map,
+	unsigned int	pages)
+{
+	if (pages > VM_FAULT_AROUND_MAX)
+		pages = VM_FAULT_AROUND_MAX;
+	map->fault_around = pages;
+}
+
+unsigned int
+vm_map_get_fault_around(
+	vm_map_t	map)
+{
+	return map->fault_around;
+}
+
+/*
+ * Superpage promotion.
+ *
+ * Anonymous memory is faulted in a base page at a time, so a large heap
+ * ends up mapped with 4K translations even once every page of an aligned
+ * 2MB block is resident, and a random walk over it misses the TLB on
+ * almost every access.  When a zero-fill fault fills in the first or the
+ * last page of a block, vm_fault_internal() hands the block to
+ * vm_map_superpage_hint(); the superpage thread then checks it and, if it
+ * qualifies, copies its pages into a physically contiguous run and maps
+ * the run with a single 2MB translation.  Promotion is off by default
+ * (vm.superpage_promote) because of the wiring described below.
+ *
+ * Only blocks of a private anonymous object with nothing behind it and no
+ * other mappings qualify.  The pageout daemon and the compressor only deal
+ * in base pages, so the pages of a promoted block stay wired until it's
+ * demoted again.  That wiring is the task's, not the kernel's: the pages
+ * carry the VM_KERN_MEMORY_MLOCK tag like any other user-wired memory,
+ * promotion stays within the user wire limits, and the 2MB translation is
+ * entered wired so the task's wired_mem ledger is charged for the block.
+ * Anything that has to act on individual pages of a block
+ * (clipping, protection changes, wiring, copy-on-write, removal, madvise)
+ * demotes it first, which takes the 2MB translation out and unwires the
+ * pages; they fault back in as base pages.  Under memory pressure,
+ * vm_pageout_continue() has the thread demote everything.
+ *
+ * The 2MB copy is done with only the object locked, after the block has
+ * been write protected; the map is locked for writing just to swap the
+ * copied pages in, which gives up if any page was written to or replaced
+ * in the meantime.
+ */
+int		vm_superpage_promote_enabled = 0;
+unsigned int	vm_superpage_promoted = 0;		/* blocks currently promoted */
+unsigned int	vm_superpage_promotions = 0;
+unsigned int	vm_superpage_demotions = 0;
+unsigned int	vm_superpage_promote_failures = 0;	/* no run, or the block changed while copied */
+
+#define VM_SUPERPAGE_HINTS	64
+
+static struct {
+	vm_map_t	map;
+	vm_map_offset_t	start;
+} vm_superpage_hints[VM_SUPERPAGE_HINTS];	/* protected by vm_superpage_lock_data */
+static unsigned int	vm_superpage_hint_first = 0;
+static unsigned int	vm_superpage_hint_count = 0;
+static boolean_t	vm_superpage_demote_wanted = FALSE;
+static boolean_t	vm_superpage_thread_running = FALSE;
+
+static lck_mtx_t	vm_superpage_lock_data;
+static lck_mtx_ext_t	vm_superpage_lock_data_ext;
+
+static void	vm_superpage_thread(void);
+
+/* pages the last copy was taken from; only the superpage thread uses it */
+static ppnum_t		vm_superpage_copied[SUPERPAGE_NBASEPAGES];
+
+/*
+ * Can the 2MB block at "start" in "entry" be promoted, as far as the
+ * map entry goes?
+ */
+static boolean_t
+vm_map_superpage_entry_ok(
+	vm_map_entry_t	entry,
+	vm_map_offset_t	start)
+{
+	return (start >= entry->vme_start &&
+		start + SUPERPAGE_SIZE <= entry->vme_end &&
+		!entry->is_sub_map &&
+		!entry->needs_copy &&
+		!entry->is_shared &&
+		!entry->superpage_size &&
+		!entry->in_transition &&
+		!entry->used_for_jit &&
+		!entry->iokit_acct &&
+		!entry->vme_atomic &&
+		entry->use_pmap &&
+		entry->wired_count == 0 &&
+		(entry->protection & (VM_PROT_READ | VM_PROT_WRITE)) ==
+		    (VM_PROT_READ | VM_PROT_WRITE) &&
+		!(entry->protection & VM_PROT_EXECUTE) &&
+		VME_OBJECT(entry) != VM_OBJECT_NULL);
+}
+
+/*
+ * ... and as far as its object and pages go.  Called with the object
+ * locked.
+ */
+static boolean_t
+vm_map_superpage_object_ok(
+	vm_object_t		object,
+	vm_object_offset_t	offset)
+{
+	vm_page_t	m;
+	int		i;
+
+	if (!object->internal ||
+	    !object->alive ||
+	    object->terminating ||
+	    object->phys_contiguous ||
+	    object->purgable != VM_PURGABLE_DENY ||
+	    object->shadow != VM_OBJECT_NULL ||
+	    object->copy != VM_OBJECT_NULL ||
+	    object->ref_count != 1 ||
+	    object->copy_strategy != MEMORY_OBJECT_COPY_SYMMETRIC ||
+	    object->true_share ||
+	    object->all_reusable ||
+	    object->paging_in_progress != 0 ||
+	    object->activity_in_progress != 0 ||
+	    object->wimg_bits != VM_WIMG_USE_DEFAULT ||
+	    object->resident_page_count < SUPERPAGE_NBASEPAGES)
+		return FALSE;
+
+	for (i = 0; i < SUPERPAGE_NBASEPAGES; i++, offset += PAGE_SIZE) {
+		m = vm_page_lookup(object, offset);
+
+		if (m == VM_PAGE_NULL ||
+		    m->busy ||
+		    m->cleaning ||
+		    m->laundry ||
+		    m->encrypted ||
+		    m->encrypted_cleaning ||
+		    m->fictitious ||
+		    m->unusual ||
+		    m->precious ||
+		    m->overwriting ||
+		    m->reusable ||
+		    m->superpage_promoted ||
+		    VM_PAGE_WIRED(m))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Look up the block at "start" and check that it can be promoted.  On
+ * success with "exclusive", the entry's object is returned locked.
+ */
+static boolean_t
+vm_map_superpage_candidate(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	boolean_t	exclusive,
+	vm_map_entry_t	*entry_p)
+{
+	vm_map_entry_t	entry;
+	vm_object_t	object;
+	boolean_t	ok;
+
+	if (!vm_map_lookup_entry(map, start, &entry) ||
+	    !vm_map_superpage_entry_ok(entry, start))
+		return FALSE;
+
+	object = VME_OBJECT(entry);
+	if (exclusive)
+		vm_object_lock(object);
+	else
+		vm_object_lock_shared(object);
+
+	ok = vm_map_superpage_object_ok(object,
+					VME_OFFSET(entry) + (start - entry->vme_start));
+	if (!ok || !exclusive)
+		vm_object_unlock(object);
+
+	*entry_p = entry;
+	return ok;
+}
+
+static void
+vm_map_superpage_free_run(
+	vm_page_t	pages)
+{
+	vm_page_t	m;
+
+	vm_page_lockspin_queues();
+	while ((m = pages) != VM_PAGE_NULL) {
+		pages = NEXT_PAGE(m);
+		*(NEXT_PAGE_PTR(m)) = VM_PAGE_NULL;
+		vm_page_free(m);
+	}
+	vm_page_unlock_queues();
+}
+
+/*
+ * Take the 2MB translation at "start" out and unwire the pages of the
+ * block at "offset" in "object", if it's promoted.  Called with the map
+ * locked for writing and the object locked.
+ */
+static void
+vm_map_superpage_demote_block(
+	vm_map_t		map,
+	vm_object_t		object,
+	vm_object_offset_t	offset,
+	vm_map_offset_t		start)
+{
+	vm_page_t	m;
+	int		i;
+
+	m = vm_page_lookup(object, offset);
+	if (m == VM_PAGE_NULL || !m->superpage_promoted)
+		return;
+
+	pmap_remove(map->pmap, start, start + SUPERPAGE_SIZE);
+
+	vm_page_lockspin_queues();
+	for (i = 0; i < SUPERPAGE_NBASEPAGES; i++, offset += PAGE_SIZE) {
+		m = vm_page_lookup(object, offset);
+		assert(m != VM_PAGE_NULL && m->superpage_promoted);
+
+		m->superpage_promoted = FALSE;
+		vm_page_unwire(m, TRUE);
+	}
+	vm_page_unlock_queues();
+
+	assert(map->superpage_promoted > 0);
+	map->superpage_promoted--;
+	OSAddAtomic(-1, &vm_superpage_promoted);
+	OSAddAtomic(1, &vm_superpage_demotions);
+}
+
+/*
+ * Demote the promoted blocks of "entry" that overlap [start, end).
+ * Called with the map locked for writing.
+ */
+static void
+vm_map_superpage_demote(
+	vm_map_t	map,
+	vm_map_entry_t	entry,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	vm_object_t	object;
+	vm_map_offset_t	addr;
+
+	if (!entry->vme_promoted)
+		return;
+
+	if (start < entry->vme_start)
+		start = entry->vme_start;
+	if (end > entry->vme_end)
+		end = entry->vme_end;
+
+	object = VME_OBJECT(entry);
+	vm_object_lock(object);
+	for (addr = SUPERPAGE_ROUND_DOWN(start); addr < end; addr += SUPERPAGE_SIZE) {
+		if (addr < entry->vme_start ||
+		    addr + SUPERPAGE_SIZE > entry->vme_end)
+			continue;
+		vm_map_superpage_demote_block(map, object,
+					      VME_OFFSET(entry) + (addr - entry->vme_start),
+					      addr);
+	}
+	vm_object_unlock(object);
+
+	if (start == entry->vme_start && end == entry->vme_end)
+		entry->vme_promoted = FALSE;
+}
+
+/*
+ * Demote every promoted block in [start, end).  Called with the map
+ * locked for writing.
+ */
+static void
+vm_map_superpage_demote_range(
+	vm_map_t	map,
+	vm_map_offset_t	start,
+	vm_map_offset_t	end)
+{
+	vm_map_entry_t	entry;
+
+	if (map->superpage_promoted == 0)
+		return;
+
+	if (!vm_map_lookup_entry(map, start, &entry))
+		entry = entry->vme_next;
+	for (; entry != vm_map_to_entry(map) && entry->vme_start < end;
+	     entry = entry->vme_next)
+		vm_map_superpage_demote(map, entry, start, end);
+}
+
+/*
+ * Copy the block at "start" into a physically contiguous run and map it
+ * with a 2MB translation, if it still qualifies.
+ */
+static void
+vm_map_superpage_promote(
+	vm_map_t	map,
+	vm_map_offset_t	start)
+{
+	vm_map_entry_t		entry;
+	vm_object_t		object;
+	vm_object_offset_t	offset;
+	vm_page_t		pages, m, old_m;
+	ppnum_t			phys_page;
+	int			i;
+	kern_return_t		kr;
+
+	/* cheap check with the map shared before going for a run */
+	vm_map_lock_read(map);
+	if (!vm_map_superpage_candidate(map, start, FALSE, &entry)) {
+		vm_map_unlock_read(map);
+		return;
+	}
+	vm_map_unlock_read(map);
+
+	if (vm_page_free_count < vm_page_free_target + SUPERPAGE_NBASEPAGES)
+		return;
+
+	/* same limits as a user wiring of the block would be held to */
+	if (SUPERPAGE_SIZE + ptoa_64(vm_page_wire_count + vm_lopage_free_count) > vm_global_user_wire_limit ||
+	    SUPERPAGE_SIZE + ptoa_64(vm_page_wire_count + vm_lopage_free_count) > max_mem - vm_global_no_user_wire_amount)
+		return;
+
+	kr = cpm_allocate(SUPERPAGE_SIZE, &pages, 0, SUPERPAGE_NBASEPAGES - 1,
+			  TRUE, KMA_NOPAGEWAIT);
+	if (kr != KERN_SUCCESS) {
+		OSAddAtomic(1, &vm_superpage_promote_failures);
+		return;
+	}
+
+	/*
+	 * Write protect the block and copy it with only the object locked:
+	 * faults elsewhere in the map, and read faults on the block itself,
+	 * carry on in the meantime.  A write to the block faults, waits for
+	 * the object and sets the modify bit cleared here.
+	 */
+	vm_map_lock_read(map);
+	if (!vm_map_superpage_candidate(map, start, TRUE, &entry)) {
+		vm_map_unlock_read(map);
+		vm_map_superpage_free_run(pages);
+		return;
+	}
+	object = VME_OBJECT(entry);
+	offset = VME_OFFSET(entry) + (start - entry->vme_start);
+	vm_object_reference_locked(object);
+	pmap_protect(map->pmap, start, start + SUPERPAGE_SIZE, VM_PROT_READ);
+	vm_map_unlock_read(map);
+
+	for (i = 0, m = pages; i < SUPERPAGE_NBASEPAGES; i++, m = NEXT_PAGE(m)) {
+		old_m = vm_page_lookup(object, offset + ptoa(i));
+		assert(old_m != VM_PAGE_NULL);
+		vm_superpage_copied[i] = VM_PAGE_GET_PHYS_PAGE(old_m);
+		/* the page keeps its data if the promotion is given up */
+		if (pmap_is_modified(vm_superpage_copied[i]))
+			SET_PAGE_DIRTY(old_m, FALSE);
+		pmap_clear_modify(vm_superpage_copied[i]);
+		pmap_copy_page(vm_superpage_copied[i], VM_PAGE_GET_PHYS_PAGE(m));
+	}
+	vm_object_unlock(object);
+	vm_object_deallocate(object);
+
+	/* swap the copies in, unless the block changed under the copy */
+	vm_map_lock(map);
+	if (!vm_map_superpage_candidate(map, start, TRUE, &entry)) {
+		vm_map_unlock(map);
+		vm_map_superpage_free_run(pages);
+		return;
+	}
+	object = VME_OBJECT(entry);
+	offset = VME_OFFSET(entry) + (start - entry->vme_start);
+	for (i = 0; i < SUPERPAGE_NBASEPAGES; i++) {
+		old_m = vm_page_lookup(object, offset + ptoa(i));
+		if (VM_PAGE_GET_PHYS_PAGE(old_m) != vm_superpage_copied[i] ||
+		    pmap_is_modified(vm_superpage_copied[i])) {
+			vm_object_unlock(object);
+			vm_map_unlock(map);
+			vm_map_superpage_free_run(pages);
+			OSAddAtomic(1, &vm_superpage_promote_failures);
+			return;
+		}
+	}
+	phys_page = VM_PAGE_GET_PHYS_PAGE(pages);
+
+	pmap_remove(map->pmap, start, start + SUPERPAGE_SIZE);
+
+	for (i = 0; i < SUPERPAGE_NBASEPAGES; i++) {
+		m = pages;
+		pages = NEXT_PAGE(m);
+		*(NEXT_PAGE_PTR(m)) = VM_PAGE_NULL;
+
+		old_m = vm_page_lookup(object, offset + ptoa(i));
+		vm_page_lockspin_queues();
+		vm_page_free(old_m);
+		vm_page_unlock_queues();
+
+		m->busy = FALSE;
+		vm_page_insert_wired(m, object, offset + ptoa(i), VM_KERN_MEMORY_MLOCK);
+		SET_PAGE_DIRTY(m, FALSE);
+		m->reference = TRUE;
+		m->pmapped = TRUE;
+		m->wpmapped = TRUE;
+		m->superpage_promoted = TRUE;
+	}
+	entry->vme_promoted = TRUE;
+	map->superpage_promoted++;
+	OSAddAtomic(1, &vm_superpage_promoted);
+	OSAddAtomic(1, &vm_superpage_promotions);
+
+	kr = pmap_enter_options(map->pmap, start, phys_page,
+				entry->protection, VM_PROT_NONE,
+				(VM_WIMG_MASK & (int)object->wimg_bits) | VM_MEM_SUPERPAGE,
+				TRUE,		/* wired: charged to the task */
+				PMAP_OPTIONS_INTERNAL | PMAP_OPTIONS_NOWAIT,
+				NULL);
+	if (kr != KERN_SUCCESS) {
+		/* keep the copy, but as base pages */
+		vm_map_superpage_demote_block(map, object, offset, start);
+	}
+	vm_object_unlock(object);
+	vm_map_unlock(map);
+}
+
+/*
+ * Called by vm_fault_internal() once a zero-fill fault has filled in the
+ * first or last page of a 2MB block.
+ */
+void
+vm_map_superpage_hint(
+	vm_map_t	map,
+	vm_map_offset_t	vaddr)
+{
+	vm_map_offset_t	start;
+	unsigned int	i, slot;
+
+	if (!vm_superpage_promote_enabled || !vm_superpage_thread_running)
+		return;
+
+	start = SUPERPAGE_ROUND_DOWN(vaddr);
+
+	lck_mtx_lock(&vm_superpage_lock_data);
+	if (vm_superpage_hint_count == VM_SUPERPAGE_HINTS) {
+		lck_mtx_unlock(&vm_superpage_lock_data);
+		return;
+	}
+	for (i = 0; i < vm_superpage_hint_count; i++) {
+		slot = (vm_superpage_hint_first + i) % VM_SUPERPAGE_HINTS;
+		if (vm_superpage_hints[slot].map == map &&
+		    vm_superpage_hints[slot].start == start) {
+			lck_mtx_unlock(&vm_superpage_lock_data);
+			return;
+		}
+	}
+	slot = (vm_superpage_hint_first + vm_superpage_hint_count) % VM_SUPERPAGE_HINTS;
+	vm_map_reference(map);
+	vm_superpage_hints[slot].map = map;
+	vm_superpage_hints[slot].start = start;
+	vm_superpage_hint_count++;
+	thread_wakeup((event_t) &vm_superpage_hint_count);
+	lck_mtx_unlock(&vm_superpage_lock_data);
+}
+
+/*
+ * Called by the pageout daemon when it's about to go looking for pages:
+ * promoted blocks are wired, so give them back to the paging queues.
+ */
+void
+vm_map_superpage_demote_all(void)
+{
+	if (vm_superpage_promoted == 0 || !vm_superpage_thread_running)
+		return;
+
+	lck_mtx_lock_spin(&vm_superpage_lock_data);
+	if (!vm_superpage_demote_wanted) {
+		vm_superpage_demote_wanted = TRUE;
+		thread_wakeup((event_t) &vm_superpage_hint_count);
+	}
+	lck_mtx_unlock(&vm_superpage_lock_data);
+}
+
+#define VM_SUPERPAGE_DEMOTE_BATCH	16
+
+static void
+vm_superpage_demote_maps(void)
+{
+	vm_map_t	maps[VM_SUPERPAGE_DEMOTE_BATCH];
+	task_t		task;
+	int		i, count;
+
+	do {
+		count = 0;
+
+		lck_mtx_lock(&tasks_threads_lock);
+		queue_iterate(&tasks, task, task_t, tasks) {
+			if (task->map == VM_MAP_NULL ||
+			    task->map->superpage_promoted == 0)
+				continue;
+			if ((maps[count] = get_task_map_reference(task)) == VM_MAP_NULL)
+				continue;
+			if (++count == VM_SUPERPAGE_DEMOTE_BATCH)
+				break;
+		}
+		lck_mtx_unlock(&tasks_threads_lock);
+
+		for (i = 0; i < count; i++) {
+			vm_map_lock(maps[i]);
+			vm_map_superpage_demote_range(maps[i],
+						      vm_map_min(maps[i]),
+						      vm_map_max(maps[i]));
+			vm_map_unlock(maps[i]);
+			vm_map_deallocate(maps[i]);
+		}
+	} while (count == VM_SUPERPAGE_DEMOTE_BATCH);
+}
+
+static void
+vm_superpage_thread(void)
+{
+	vm_map_t	map;
+	vm_map_offset_t	start;
+
+	lck_mtx_lock_spin(&vm_superpage_lock_data);
+
+	for (;;) {
+		if (vm_superpage_demote_wanted) {
+			vm_superpage_demote_wanted = FALSE;
+			lck_mtx_unlock(&vm_superpage_lock_data);
+
+			vm_superpage_demote_maps();
+		} else if (vm_superpage_hint_count != 0) {
+			map = vm_superpage_hints[vm_superpage_hint_first].map;
+			start = vm_superpage_hints[vm_superpage_hint_first].start;
+			vm_superpage_hints[vm_superpage_hint_first].map = VM_MAP_NULL;
+			vm_superpage_hint_first = (vm_superpage_hint_first + 1) % VM_SUPERPAGE_HINTS;
+			vm_superpage_hint_count--;
+			lck_mtx_unlock(&vm_superpage_lock_data);
+
+			if (vm_superpage_promote_enabled)
+				vm_map_superpage_promote(map, start);
+			vm_map_deallocate(map);
+		} else
+			break;
+
+		lck_mtx_lock_spin(&vm_superpage_lock_data);
+	}
+
+	/* wait for more work... */
+	assert_wait((event_t) &vm_superpage_hint_count, THREAD_UNINT);
+
+	lck_mtx_unlock(&vm_superpage_lock_data);
+
+	thread_block((thread_continue_t) vm_superpage_thread);
+	/*NOTREACHED*/
+}
+
+void
+vm_map_superpage_init(void)
+{
+	kern_return_t	kr;
+	thread_t	thread;
+
+	lck_mtx_init_ext(&vm_superpage_lock_data, &vm_superpage_lock_data_ext,
+			 &vm_map_lck_grp, &vm_map_lck_attr);
+
+	kr = kernel_thread_start_priority(
+		(thread_continue_t) vm_superpage_thread,
+		NULL,
+		MINPRI_KERNEL,
+		&thread);
+	if (kr != KERN_SUCCESS) {
+		panic("failed to launch vm_superpage_thread kr=0x%x", kr);
+	}
+	thread_deallocate(thread);
+
+	vm_superpage_thread_running = TRUE;
+}
+
 vm_map_offset_t
 vm_compute_max_offset(boolean_t is64)
 {
@@ -303,7 +303,8 @@ struct vm_map_entry {
 	/* boolean_t */ vme_resilient_codesign:1,
 	/* boolean_t */ vme_resilient_media:1,
 	/* boolean_t */ vme_atomic:1, /* entry cannot be split/coalesced */
-		__unused:5;
+	/* boolean_t */ vme_promoted:1, /* has 2MB blocks promoted to superpages */
+		__unused:4;
 ;
 
 	unsigned short		wired_count;	/* can be paged if = 0 */
@@ -432,7 +433,11 @@ struct _vm_map {
 	/* boolean_t */		is_nested_map:1,
 	/* reserved */		pad:23;
 	unsigned int		timestamp;	/* Version number */
+	uint64_t		fault_seq;	/* odd while write-locked, see vm_fault_speculative() */
+	volatile int		spec_faults;	/* speculative faults in progress */
 	unsigned int		color_rr;	/* next color (not protected by a lock) */
+	unsigned int		fault_around;	/* resident neighbours to map per fault (not protected by a lock) */
+	unsigned int		superpage_promoted; /* 2MB blocks currently promoted (map lock) */
 
  	boolean_t		jit_entry_exists;
 } ;
@@ -546,21 +551,43 @@ struct vm_map_copy {
  *	(See vm_map.c::vm_remap())
  */
 
+/*
+ * The fault sequence is made odd whenever the map is taken for writing
+ * and even again when it is released, so that vm_fault_speculative()
+ * can validate a map entry it looked up earlier without taking the map
+ * lock; taking it for writing also waits for spec_faults to drain.  vm_map_unlock() can be called on a read-held map (see
+ * vm_map_lookup_locked), so the release always lands on a new even value
+ * rather than just incrementing.
+ */
+extern void		vm_map_fault_seq_enter(vm_map_t map);
+#define vm_map_fault_seq_exit(map)					\
+	((map)->fault_seq = ((map)->fault_seq | 1) + 1)
+
 #define vm_map_lock_init(map)						\
 	((map)->timestamp = 0 ,						\
+	(map)->fault_seq = 0 ,						\
+	(map)->spec_faults = 0 ,					\
 	lck_rw_init(&(map)->lock, &vm_map_lck_grp, &vm_map_lck_rw_attr))
 
-#define vm_map_lock(map)		lck_rw_lock_exclusive(&(map)->lock)
+#define vm_map_lock(map)						\
+	MACRO_BEGIN							\
+	lck_rw_lock_exclusive(&(map)->lock);				\
+	vm_map_fault_seq_enter(map);					\
+	MACRO_END
 #define vm_map_unlock(map)						\
-		((map)->timestamp++ ,	lck_rw_done(&(map)->lock))
+		((map)->timestamp++ ,	vm_map_fault_seq_exit(map) ,	\
+		 lck_rw_done(&(map)->lock))
 #define vm_map_lock_read(map)		lck_rw_lock_shared(&(map)->lock)
 #define vm_map_unlock_read(map)		lck_rw_done(&(map)->lock)
 #define vm_map_lock_write_to_read(map)					\
-		((map)->timestamp++ ,	lck_rw_lock_exclusive_to_shared(&(map)->lock))
+		((map)->timestamp++ ,	vm_map_fault_seq_exit(map) ,	\
+		 lck_rw_lock_exclusive_to_shared(&(map)->lock))
 /* lock_read_to_write() returns FALSE on failure.  Macro evaluates to 
  * zero on success and non-zero value on failure.
  */
-#define vm_map_lock_read_to_write(map)	(lck_rw_lock_shared_to_exclusive(&(map)->lock) != TRUE)
+#define vm_map_lock_read_to_write(map)					\
+	(lck_rw_lock_shared_to_exclusive(&(map)->lock) != TRUE ||	\
+	 (vm_map_fault_seq_enter(map), FALSE))
 
 #if MACH_ASSERT || DEBUG
 #define vm_map_lock_assert_held(map) \
@@ -1165,6 +1192,13 @@ extern kern_return_t vm_map_copyout_size(
 				vm_map_copy_t		copy,
 				vm_map_size_t		copy_size);
 
+/* Place several small kernel buffer copies into a map at once */
+extern kern_return_t	vm_map_copyout_kernel_buffers(
+				vm_map_t		map,
+				vm_map_copy_t		*copies,
+				vm_map_address_t	*addrs,		/* OUT */
+				unsigned int		count);
+
 extern kern_return_t	vm_map_copyout_internal(
 	vm_map_t		dst_map,
 	vm_map_address_t	*dst_addr,	/* OUT */
@@ -1227,6 +1261,23 @@ extern void		vm_map_set_32bit(
 extern void		vm_map_set_jumbo(
 			        vm_map_t		map);
 
+#define VM_FAULT_AROUND_MAX	64	/* pages */
+
+extern void		vm_map_set_fault_around(
+			        vm_map_t		map,
+			        unsigned int		pages);
+
+extern unsigned int	vm_map_get_fault_around(
+			        vm_map_t		map);
+
+extern void		vm_map_superpage_init(void);
+
+extern void		vm_map_superpage_hint(
+			        vm_map_t		map,
+			        vm_map_offset_t		vaddr);
+
+extern void		vm_map_superpage_demote_all(void);
+
 extern boolean_t	vm_map_has_hard_pagezero(
 		       		vm_map_t		map,
 				vm_map_offset_t		pagezero_size);
@@ -525,6 +525,13 @@ vm_object_hash_entry_free(
  *	Returns a new object with the given size.
  */
 
+/*
+ * Source of vm_object.vo_generation: never 0 for an allocated object and
+ * never reused, so a cached object pointer plus its generation can't
+ * match a different object that later got the same zone element.
+ */
+static volatile SInt64 vm_object_generation_next = 1;
+
 __private_extern__ void
 _vm_object_allocate(
 	vm_object_size_t	size,
@@ -542,6 +549,7 @@ _vm_object_allocate(
 #endif
 	vm_object_lock_init(object);
 	object->vo_size = size;
+	object->vo_generation = (uint64_t)OSIncrementAtomic64(&vm_object_generation_next);
 
 #if VM_OBJECT_TRACKING_OP_CREATED
 	if (vm_object_tracking_inited) {
@@ -716,6 +724,8 @@ vm_object_bootstrap(void)
 	vm_object_template.scan_collisions = 0;
 #if CONFIG_PHANTOM_CACHE
 	vm_object_template.phantom_object_id = 0;
+	vm_object_template.phantom_refaults = 0;
+	vm_object_template.phantom_refault_distance = 0;
 #endif
 	vm_object_template.cow_hint = ~(vm_offset_t)0;
 #if	MACH_ASSERT
@@ -764,6 +774,8 @@ vm_object_bootstrap(void)
 	vm_object_template.__object3_unused_bits = 0;
 #endif /* CONFIG_SECLUDED_MEMORY */
 	
+	vm_object_template.vo_generation = 0;
+
 #if DEBUG
 	bzero(&vm_object_template.purgeable_owner_bt[0],
 	      sizeof (vm_object_template.purgeable_owner_bt));
@@ -3159,6 +3171,16 @@ vm_object_reuse_pages(
  *              pmap.
  */
 
+static void vm_object_pmap_protect_internal(
+	vm_object_t			object,
+	vm_object_offset_t		offset,
+	vm_object_size_t		size,
+	pmap_t				pmap,
+	vm_map_offset_t			pmap_start,
+	vm_prot_t			prot,
+	int				options,
+	pmap_flush_context		*caller_pfc);
+
 __private_extern__ void
 vm_object_pmap_protect(
 	vm_object_t			object,
@@ -3181,8 +3203,50 @@ vm_object_pmap_protect_options(
 	vm_map_offset_t			pmap_start,
 	vm_prot_t			prot,
 	int				options)
+{
+	vm_object_pmap_protect_internal(object, offset, size, pmap,
+					pmap_start, prot,
+					options & ~PMAP_OPTIONS_NOFLUSH, NULL);
+}
+
+/*
+ *	vm_object_pmap_protect_delayed:
+ *
+ *	Same as vm_object_pmap_protect(), but the TLB invalidations
+ *	are accumulated in the caller's flush context instead of being
+ *	issued here.  The caller must pmap_flush() the context before
+ *	anything relies on the new protection, which lets a caller
+ *	protecting many ranges (vm_map_fork) pay for one shootdown.
+ */
+__private_extern__ void
+vm_object_pmap_protect_delayed(
+	vm_object_t			object,
+	vm_object_offset_t		offset,
+	vm_object_size_t		size,
+	pmap_t				pmap,
+	vm_map_offset_t			pmap_start,
+	vm_prot_t			prot,
+	pmap_flush_context		*pfc)
+{
+	assert(pfc != NULL);
+	vm_object_pmap_protect_internal(object, offset, size, pmap,
+					pmap_start, prot,
+					PMAP_OPTIONS_NOFLUSH, pfc);
+}
+
+static void
+vm_object_pmap_protect_internal(
+	vm_object_t			object,
+	vm_object_offset_t		offset,
+	vm_object_size_t		size,
+	pmap_t				pmap,
+	vm_map_offset_t			pmap_start,
+	vm_prot_t			prot,
+	int				options,
+	pmap_flush_context		*caller_pfc)
 {
 	pmap_flush_context	pmap_flush_context_storage;
+	pmap_flush_context	*pfc;
 	boolean_t		delayed_pmap_flush = FALSE;
 
 	if (object == VM_OBJECT_NULL)
@@ -3199,8 +3263,8 @@ vm_object_pmap_protect_options(
 					     pmap_start,
 					     pmap_start + size,
 					     prot,
-					     options & ~PMAP_OPTIONS_NOFLUSH,
-					     NULL);
+					     options,
+					     caller_pfc);
 		} else {
 			vm_object_offset_t phys_start, phys_end, phys_addr;
 
@@ -3210,7 +3274,12 @@ vm_object_pmap_protect_options(
 			assert(phys_end <= object->vo_shadow_offset + object->vo_size);
 			vm_object_unlock(object);
 
-			pmap_flush_context_init(&pmap_flush_context_storage);
+			if (caller_pfc != NULL) {
+				pfc = caller_pfc;
+			} else {
+				pfc = &pmap_flush_context_storage;
+				pmap_flush_context_init(pfc);
+			}
 			delayed_pmap_flush = FALSE;
 
 			for (phys_addr = phys_start;
@@ -3220,11 +3289,11 @@ vm_object_pmap_protect_options(
 					(ppnum_t) (phys_addr >> PAGE_SHIFT),
 					prot,
 					options | PMAP_OPTIONS_NOFLUSH,
-					(void *)&pmap_flush_context_storage);
+					(void *)pfc);
 				delayed_pmap_flush = TRUE;
 			}
-			if (delayed_pmap_flush == TRUE)
-				pmap_flush(&pmap_flush_context_storage);
+			if (delayed_pmap_flush == TRUE && caller_pfc == NULL)
+				pmap_flush(pfc);
 		}
 		return;
 	}
@@ -3235,11 +3304,16 @@ vm_object_pmap_protect_options(
 	   if (ptoa_64(object->resident_page_count) > size/2 && pmap != PMAP_NULL) {
 		vm_object_unlock(object);
 		pmap_protect_options(pmap, pmap_start, pmap_start + size, prot,
-				     options & ~PMAP_OPTIONS_NOFLUSH, NULL);
+				     options, caller_pfc);
 		return;
 	    }
 
-	   pmap_flush_context_init(&pmap_flush_context_storage);
+	   if (caller_pfc != NULL) {
+		   pfc = caller_pfc;
+	   } else {
+		   pfc = &pmap_flush_context_storage;
+		   pmap_flush_context_init(pfc);
+	   }
 	   delayed_pmap_flush = FALSE;
 
 	    /*
@@ -3266,13 +3340,13 @@ vm_object_pmap_protect_options(
 						start + PAGE_SIZE_64,
 						prot,
 						options | PMAP_OPTIONS_NOFLUSH,
-						&pmap_flush_context_storage);
+						pfc);
 				else
 					pmap_page_protect_options(
 						VM_PAGE_GET_PHYS_PAGE(p),
 						prot,
 						options | PMAP_OPTIONS_NOFLUSH,
-						&pmap_flush_context_storage);
+						pfc);
 					delayed_pmap_flush = TRUE;
 			}
 		}
@@ -3301,19 +3375,19 @@ vm_object_pmap_protect_options(
 						start + PAGE_SIZE_64,
 						prot,
 						options | PMAP_OPTIONS_NOFLUSH,
-						&pmap_flush_context_storage);
+						pfc);
 				else
 					pmap_page_protect_options(
 						VM_PAGE_GET_PHYS_PAGE(p),
 						prot,
 						options | PMAP_OPTIONS_NOFLUSH,
-						&pmap_flush_context_storage);
+						pfc);
 					delayed_pmap_flush = TRUE;
 		    	}
 		}
 	    }
-	    if (delayed_pmap_flush == TRUE)
-		    pmap_flush(&pmap_flush_context_storage);
+	    if (delayed_pmap_flush == TRUE && caller_pfc == NULL)
+		    pmap_flush(pfc);
 
 	    if (prot == VM_PROT_NONE) {
 		/*
@@ -389,6 +389,8 @@ struct vm_object {
 
 #if CONFIG_PHANTOM_CACHE
 	uint32_t		phantom_object_id;
+	uint16_t		phantom_refaults;		/* pages refaulted from the ghost filter */
+	uint16_t		phantom_refault_distance;	/* their average refault distance, in ghost epochs */
 #endif
 #if CONFIG_IOSCHED || UPL_DEBUG
 	queue_head_t		uplq;		/* List of outstanding upls */
@@ -407,6 +409,7 @@ struct vm_object {
 #endif	/* VM_PIP_DEBUG  */
 
         queue_chain_t		objq;      /* object queue - currently used for purgable queues */
+	uint64_t		vo_generation;	/* unique for the object's lifetime */
 
 #if DEBUG
 	void *purgeable_owner_bt[16];
@@ -651,6 +654,15 @@ __private_extern__ void		vm_object_pmap_protect_options(
 					vm_prot_t		prot,
 					int			options);
 
+__private_extern__ void		vm_object_pmap_protect_delayed(
+					vm_object_t		object,
+					vm_object_offset_t	offset,
+					vm_object_size_t	size,
+					pmap_t			pmap,
+					vm_map_offset_t		pmap_start,
+					vm_prot_t		prot,
+					pmap_flush_context	*pfc);
+
 __private_extern__ void		vm_object_page_remove(
 					vm_object_t		object,
 					vm_object_offset_t	start,
@@ -289,7 +289,8 @@ struct vm_page {
 		        lopage:1,
 			slid:1,
 		        written_by_kernel:1,	/* page was written by kernel (i.e. decompressed) */
-			__unused_object_bits:5;  /* 5 bits available here */
+			superpage_promoted:1,	/* wired as part of a promoted 2MB block (O) */
+			__unused_object_bits:4;  /* 4 bits available here */
 
 	ppnum_t		phys_page;	/* Physical address of page, passed
 					 *  to pmap_enter (read-only) */
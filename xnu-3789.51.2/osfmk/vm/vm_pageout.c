@@ -222,6 +222,17 @@ unsigned int	vm_page_speculative_percentage = 5;
 #define	VM_PAGE_INACTIVE_TARGET(avail)	((avail) * 1 / 2)
 #endif	/* VM_PAGE_INACTIVE_TARGET */
 
+/*
+ *	When refaults show that a larger inactive queue would have kept
+ *	pages resident, the phantom cache asks for a larger share.
+ */
+#if CONFIG_PHANTOM_CACHE
+#define	VM_PAGE_INACTIVE_TARGET_ADJUSTED(avail)	\
+	(VM_PAGE_INACTIVE_TARGET(avail) + vm_phantom_cache_inactive_boost(avail))
+#else
+#define	VM_PAGE_INACTIVE_TARGET_ADJUSTED(avail)	VM_PAGE_INACTIVE_TARGET(avail)
+#endif
+
 /*
  *	Once the pageout daemon starts running, it keeps going
  *	until vm_page_free_count meets or exceeds vm_page_free_target.
@@ -297,6 +308,29 @@ struct cq {
 
 struct cq ciq[MAX_COMPRESSOR_THREAD_COUNT];
 
+/*
+ * Reclaim threads: vm_pageout_scan() hands them clean file pages it has
+ * decided to steal, and they tear down the mappings (the TLB shootdowns
+ * are most of the cost of stealing a mapped page) and free the pages.
+ * Pages are spread across the threads by physical page number.
+ */
+struct rq {
+	vm_page_t		rq_pages;	/* chained through snext */
+	int			rq_count;
+	boolean_t		rq_idle;
+	int			id;
+};
+#define MAX_RECLAIM_THREAD_COUNT	8
+
+struct rq reclaim_q[MAX_RECLAIM_THREAD_COUNT];
+
+int		vm_pageout_reclaim_thread_count = 0;	/* threads started */
+int		vm_pageout_reclaim_threads = 0;		/* threads handed pages */
+unsigned int	vm_pageout_reclaim_handoffs = 0;
+unsigned int	vm_pageout_reclaim_backed_up = 0;
+unsigned int	vm_pageout_reclaim_freed = 0;
+unsigned int	vm_pageout_reclaim_redirtied = 0;
+
 void	*vm_pageout_immediate_chead;
 char	*vm_pageout_immediate_scratch_buf;
 
@@ -313,6 +347,8 @@ boolean_t VM_PRESSURE_CRITICAL_TO_WARNING(void);
 static void vm_pageout_garbage_collect(int);
 static void vm_pageout_iothread_external(void);
 static void vm_pageout_iothread_internal(struct cq *cq);
+static void vm_pageout_reclaim_thread(struct rq *rq);
+static boolean_t vm_pageout_reclaim_handoff(vm_page_t m);
 static void vm_pageout_adjust_io_throttles(struct vm_pageout_queue *, struct vm_pageout_queue *, boolean_t);
 
 extern void vm_pageout_continue(void);
@@ -1716,7 +1752,7 @@ Restart:
 	/*
 	 *	Recalculate vm_page_inactivate_target.
 	 */
-	vm_page_inactive_target = VM_PAGE_INACTIVE_TARGET(vm_page_active_count +
+	vm_page_inactive_target = VM_PAGE_INACTIVE_TARGET_ADJUSTED(vm_page_active_count +
 							  vm_page_inactive_count +
 							  vm_page_speculative_count);
 
@@ -2151,7 +2187,7 @@ done_moving_active_pages:
 			/*
 			 * recalculate vm_page_inactivate_target
 			 */
-			vm_page_inactive_target = VM_PAGE_INACTIVE_TARGET(vm_page_active_count +
+			vm_page_inactive_target = VM_PAGE_INACTIVE_TARGET_ADJUSTED(vm_page_active_count +
 									  vm_page_inactive_count +
 									  vm_page_speculative_count);
 			if (((vm_page_inactive_count + vm_page_speculative_count) < vm_page_inactive_target) &&
@@ -3471,6 +3507,19 @@ throttle_inactive:
 		 * pmap_disconnect().  m->dirty could have been set in anticipation
 		 * of likely usage of the page.
 		 */
+		/*
+		 * a clean file page off the inactive queue only needs its
+		 * mappings torn down before it can be freed... unless the
+		 * reclaim threads are backed up, let one of them do that
+		 */
+		if (m->pmapped == TRUE &&
+		    !m->dirty && !m->precious && !object->internal &&
+		    page_prev_q_state == VM_PAGE_ON_INACTIVE_EXTERNAL_Q &&
+		    vm_pageout_reclaim_handoff(m)) {
+			m = VM_PAGE_NULL;
+			inactive_burst_count = 0;
+			goto done_with_inactivepage;
+		}
 		if (m->pmapped == TRUE) {
 			int pmap_options;
 
@@ -3568,6 +3617,17 @@ throttle_inactive:
 			}
 #endif /* CONFIG_SECLUDED_MEMORY */
 
+			/*
+			 * A slid page is expensive to bring back (read and
+			 * slide again): keep its contents in the slid page
+			 * cache, where they'll be compressed, if there's room.
+			 */
+			if (m->slid &&
+			    vm_shared_region_slid_cache_insert(m)) {
+				m = VM_PAGE_NULL;
+				goto done_with_inactivepage;
+			}
+
 			/*
 			 * OK, at this point we have found a page we are going to free.
 			 */
@@ -3725,6 +3785,9 @@ vm_pageout_continue(void)
 	vm_pageout_running = TRUE;
 	lck_mtx_unlock(&vm_page_queue_free_lock);
 
+	/* promoted superpages are wired: have them broken up */
+	vm_map_superpage_demote_all();
+
 	vm_pageout_scan();
 	/*
 	 * we hold both the vm_page_queue_free_lock
@@ -4311,6 +4374,175 @@ vm_pageout_iothread_internal(struct cq *cq)
 	/*NOTREACHED*/
 }
 
+
+/*
+ * Called from vm_pageout_scan() with the page queues and the page's
+ * object locked, for a clean file page it is about to steal.  Returns
+ * TRUE if one of the reclaim threads now owns the page.
+ */
+static boolean_t
+vm_pageout_reclaim_handoff(vm_page_t m)
+{
+	vm_object_t	object;
+	struct rq	*rq;
+	int		nthreads;
+
+	object = VM_PAGE_OBJECT(m);
+
+	LCK_MTX_ASSERT(&vm_page_queue_lock, LCK_MTX_ASSERT_OWNED);
+	vm_object_lock_assert_exclusive(object);
+
+	nthreads = MIN(vm_pageout_reclaim_threads, vm_pageout_reclaim_thread_count);
+	if (nthreads <= 0)
+		return (FALSE);
+#if CONFIG_SECLUDED_MEMORY
+	/* vm_pageout_scan() may want it for the secluded queue */
+	if (secluded_for_filecache && object->eligible_for_secluded)
+		return (FALSE);
+#endif /* CONFIG_SECLUDED_MEMORY */
+
+	rq = &reclaim_q[(VM_PAGE_GET_PHYS_PAGE(m) >> 4) % nthreads];
+
+	if (rq->rq_count >= (int)VM_PAGE_LAUNDRY_MAX) {
+		vm_pageout_reclaim_backed_up++;
+		return (FALSE);
+	}
+	assert(!m->busy && !m->cleaning && !m->laundry);
+	assert(m->vm_page_q_state == VM_PAGE_NOT_ON_Q);
+
+	/*
+	 * busy keeps faults from mapping it again until the
+	 * reclaim thread is done with it
+	 */
+	m->busy = TRUE;
+	vm_object_paging_begin(object);
+
+	m->snext = rq->rq_pages;
+	rq->rq_pages = m;
+	rq->rq_count++;
+
+	vm_pageout_reclaim_handoffs++;
+
+	if (rq->rq_idle == TRUE) {
+		rq->rq_idle = FALSE;
+		thread_wakeup((event_t) &rq->rq_pages);
+	}
+	return (TRUE);
+}
+
+
+static void
+vm_pageout_reclaim_continue(struct rq *rq)
+{
+	vm_page_t	m;
+	vm_page_t	local_q;
+	vm_page_t	local_freeq = NULL;
+	int		local_freed = 0;
+	vm_object_t	object;
+	int		refmod_state;
+
+	while (TRUE) {
+		vm_page_lockspin_queues();
+
+		if ((local_q = rq->rq_pages) == NULL)
+			break;
+		rq->rq_pages = NULL;
+		rq->rq_count = 0;
+
+		vm_page_unlock_queues();
+
+		while (local_q) {
+			m = local_q;
+			local_q = m->snext;
+			m->snext = NULL;
+
+			object = VM_PAGE_OBJECT(m);
+
+			/*
+			 * the page is busy and its object has a paging
+			 * reference, so it can't be mapped again or go away:
+			 * no need for the object lock to disconnect it
+			 */
+			refmod_state = pmap_disconnect(VM_PAGE_GET_PHYS_PAGE(m));
+
+			vm_object_lock(object);
+
+			if (refmod_state & VM_MEM_MODIFIED)
+				SET_PAGE_DIRTY(m, FALSE);
+
+			vm_page_lockspin_queues();
+
+			PAGE_WAKEUP_DONE(m);
+
+			if (m->dirty) {
+				/*
+				 * modified since vm_pageout_scan() looked
+				 * at it... it'll get laundered next time
+				 */
+				vm_page_deactivate_internal(m, FALSE);
+				vm_pageout_reclaim_redirtied++;
+
+			} else if (m->slid && vm_shared_region_slid_cache_insert(m)) {
+				/* see vm_pageout_scan() */
+			} else {
+#if CONFIG_PHANTOM_CACHE
+				vm_phantom_cache_add_ghost(m);
+#endif
+				m->busy = TRUE;
+				vm_page_remove(m, TRUE);
+
+				m->snext = local_freeq;
+				local_freeq = m;
+				local_freed++;
+
+				vm_pageout_inactive_clean++;
+				vm_pageout_freed_from_inactive_clean++;
+				vm_pageout_stats[vm_pageout_stat_now].reclaimed++;
+				vm_pageout_reclaim_freed++;
+			}
+			vm_page_unlock_queues();
+
+			vm_object_paging_end(object);
+			vm_object_unlock(object);
+
+			if (local_freed >= MAX_FREE_BATCH) {
+				vm_page_free_list(local_freeq, TRUE);
+				local_freeq = NULL;
+				local_freed = 0;
+			}
+		}
+		if (local_freeq) {
+			vm_page_free_list(local_freeq, TRUE);
+			local_freeq = NULL;
+			local_freed = 0;
+		}
+	}
+	/*
+	 * queue lock is held and our q is empty
+	 */
+	rq->rq_idle = TRUE;
+
+	assert_wait((event_t) &rq->rq_pages, THREAD_UNINT);
+	vm_page_unlock_queues();
+
+	thread_block_parameter((thread_continue_t)vm_pageout_reclaim_continue, (void *) rq);
+	/*NOTREACHED*/
+}
+
+
+static void
+vm_pageout_reclaim_thread(struct rq *rq)
+{
+	thread_t	self = current_thread();
+
+	self->options |= TH_OPT_VMPRIV;
+
+	vm_pageout_reclaim_continue(rq);
+
+	/*NOTREACHED*/
+}
+
+
 kern_return_t
 vm_set_buffer_cleanup_callout(boolean_t (*func)(int)) 
 {
@@ -4599,6 +4831,7 @@ vm_pageout(void)
 	thread_t	thread;
 	kern_return_t	result;
 	spl_t		s;
+	int		i;
 
 	/*
 	 * Set thread privileges.
@@ -4713,6 +4946,28 @@ vm_pageout(void)
 
 	thread_deallocate(thread);
 
+	/*
+	 * 1 reclaim thread for every 4 cpus... on smaller systems
+	 * vm_pageout_scan keeps up on its own
+	 */
+	vm_pageout_reclaim_thread_count = MIN(processor_count / 4, MAX_RECLAIM_THREAD_COUNT);
+
+	for (i = 0; i < vm_pageout_reclaim_thread_count; i++) {
+		reclaim_q[i].id = i;
+		reclaim_q[i].rq_pages = NULL;
+		reclaim_q[i].rq_count = 0;
+		reclaim_q[i].rq_idle = FALSE;
+
+		result = kernel_thread_start_priority((thread_continue_t)vm_pageout_reclaim_thread, (void *)&reclaim_q[i],
+						      BASEPRI_PREEMPT - 1,
+						      &thread);
+		if (result != KERN_SUCCESS)
+			panic("vm_pageout_reclaim_thread: create failed");
+
+		thread_deallocate(thread);
+	}
+	vm_pageout_reclaim_threads = vm_pageout_reclaim_thread_count;
+
 #if VM_PRESSURE_EVENTS
 	result = kernel_thread_start_priority((thread_continue_t)vm_pressure_thread, NULL,
 						BASEPRI_DEFAULT,
@@ -4725,6 +4980,7 @@ vm_pageout(void)
 #endif
 
 	vm_object_reaper_init();
+	vm_map_superpage_init();
 
 
 	bzero(&vm_config, sizeof(vm_config));
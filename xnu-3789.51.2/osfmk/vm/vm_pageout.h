@@ -187,6 +187,17 @@ extern vm_tag_t iopl_set_tag(
 	upl_t			upl_ptr,
 	vm_tag_t                tag);
 
+/*
+ * Phantom cache refault distances (file pages evicted between a page's
+ * eviction and its refault) are counted in buckets relative to the size
+ * of memory: bucket 0 is under 1/64th of memory, each following bucket
+ * doubles the limit, and the last bucket counts refaults from more than
+ * a memory's worth ago.  See vm_phantom_cache.c
+ */
+#define		VM_GHOST_REFAULT_BUCKETS	8
+
+extern	uint64_t	vm_phantom_refault_histogram[VM_GHOST_REFAULT_BUCKETS];
+
 #endif	/* XNU_KERNEL_PRIVATE */
 
 extern struct vnode * upl_lookup_vnode(upl_t upl);
@@ -55,6 +55,8 @@ uint32_t	sample_period_ghost_added_count = 0;
 uint32_t	sample_period_ghost_added_count_ssd = 0;
 uint32_t	sample_period_ghost_found_count = 0;
 uint32_t	sample_period_ghost_found_count_ssd = 0;
+uint32_t	sample_period_refault_count = 0;
+uint32_t	sample_period_refault_fixable_count = 0;
 
 uint32_t	vm_phantom_object_id = 1;
 #define		VM_PHANTOM_OBJECT_ID_AFTER_WRAP	1000000
@@ -71,6 +73,55 @@ uint32_t	vm_ghost_hash_mask;		/* Mask for hash function */
 uint32_t	vm_ghost_bucket_hash;		/* Basic bucket hash */
 
 
+/*
+ * Ghost filter.
+ *
+ * The ring above only remembers 1/4 of memory's worth of ghost entries,
+ * and can't be indexed past VM_GHOST_INDEX_BITS, so on large memory
+ * configurations it forgets evicted pages long before they'd be read
+ * back in by a working set that doesn't quite fit.  The ghost filter
+ * remembers evicted pages much more compactly: every evicted page gets a
+ * 16-bit tag holding an 8-bit fingerprint of its object id and offset,
+ * and the "epoch" it was evicted in, in one of 2 candidate slots picked
+ * by hashing the same key (the older of the 2 tags is the one replaced).
+ * An epoch is 1/VM_GHOST_EPOCHS of memory's worth of evictions, so the
+ * age of a tag found on refault gives the refault distance: the number
+ * of file pages evicted in the meantime.  It is approximate, like a bloom
+ * filter: the fingerprint can match a page that wasn't evicted, and tags
+ * older than VM_GHOST_EPOCHS epochs alias younger ones.
+ *
+ * Protected by the page queues lock, like the ring.
+ */
+#define		VM_GHOST_EPOCHS		255	/* epoch 0 marks an empty slot */
+
+typedef	uint16_t	vm_ghost_tag_t;
+
+#define	VM_GHOST_TAG(epoch, fp)		((vm_ghost_tag_t)(((epoch) << 8) | (fp)))
+#define	VM_GHOST_TAG_EPOCH(tag)		((uint32_t)(tag) >> 8)
+#define	VM_GHOST_TAG_FP(tag)		((uint32_t)(tag) & 0xff)
+
+vm_ghost_tag_t	*vm_ghost_filter;
+uint32_t	vm_ghost_filter_mask;
+vm_size_t	vm_ghost_filter_size;
+uint32_t	vm_ghost_epoch_shift;		/* 1 << shift evictions per epoch */
+uint64_t	vm_ghost_evictions = 0;
+uint64_t	vm_ghost_mem_pages;
+
+uint64_t	vm_phantom_refault_histogram[VM_GHOST_REFAULT_BUCKETS];
+
+/*
+ * Refaults of pages that would still have been resident had the inactive
+ * queue been as large as the active queue (their refault distance is
+ * smaller than the active queue) mean that a larger inactive target would
+ * have kept them... vm_phantom_cache_inactive_boost() grows the target
+ * in steps of 5% of the active and inactive pages while that is what
+ * most refaults look like, and gives it back slowly when it isn't.
+ */
+int		phantom_cache_adapt_inactive = 1;
+uint32_t	phantom_cache_inactive_boost = 0;	/* percent */
+uint32_t	phantom_cache_inactive_boost_max = 25;
+
+
 int pg_masks[4] = {
 	0x1, 0x2, 0x4, 0x8
 };
@@ -91,9 +142,137 @@ struct phantom_cache_stats {
 	uint32_t	pcs_lookup_page_not_in_entry;
 
 	uint32_t	pcs_updated_phantom_state;
+	uint32_t	pcs_found_in_filter_only;
+	uint32_t	pcs_filter_too_far;
 } phantom_cache_stats;
 
 
+static inline uint64_t
+vm_ghost_filter_hash(uint32_t obj_id, vm_object_offset_t offset)
+{
+	uint64_t	key;
+
+	key = ((uint64_t)obj_id << 32) ^ (offset >> PAGE_SHIFT);
+
+	/* 64-bit finalizer from MurmurHash3 */
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return (key);
+}
+
+static inline uint32_t
+vm_ghost_current_epoch(void)
+{
+	return ((uint32_t)((vm_ghost_evictions >> vm_ghost_epoch_shift) % VM_GHOST_EPOCHS) + 1);
+}
+
+static inline uint32_t
+vm_ghost_epoch_age(uint32_t epoch)
+{
+	return ((vm_ghost_current_epoch() + VM_GHOST_EPOCHS - epoch) % VM_GHOST_EPOCHS);
+}
+
+static void
+vm_ghost_filter_insert(uint32_t obj_id, vm_object_offset_t offset)
+{
+	uint64_t	hash;
+	uint32_t	h1, h2, fp, slot;
+	vm_ghost_tag_t	t1, t2;
+
+	hash = vm_ghost_filter_hash(obj_id, offset);
+	h1 = (uint32_t)hash & vm_ghost_filter_mask;
+	h2 = (uint32_t)(hash >> 32) & vm_ghost_filter_mask;
+	fp = (uint32_t)((hash * 0x9e3779b97f4a7c15ULL) >> 56);
+
+	t1 = vm_ghost_filter[h1];
+	t2 = vm_ghost_filter[h2];
+
+	if (t1 && VM_GHOST_TAG_FP(t1) == fp)
+		slot = h1;
+	else if (t2 && VM_GHOST_TAG_FP(t2) == fp)
+		slot = h2;
+	else if (t1 == 0)
+		slot = h1;
+	else if (t2 == 0)
+		slot = h2;
+	else if (vm_ghost_epoch_age(VM_GHOST_TAG_EPOCH(t1)) >= vm_ghost_epoch_age(VM_GHOST_TAG_EPOCH(t2)))
+		slot = h1;
+	else
+		slot = h2;
+
+	vm_ghost_filter[slot] = VM_GHOST_TAG(vm_ghost_current_epoch(), fp);
+}
+
+/*
+ * Returns TRUE, and the page's refault distance in "distance", if the
+ * page looks like it was recently evicted... and forgets it.
+ */
+static boolean_t
+vm_ghost_filter_remove(uint32_t obj_id, vm_object_offset_t offset, uint64_t *distance)
+{
+	uint64_t	hash;
+	uint32_t	h1, h2, fp, slot;
+	vm_ghost_tag_t	tag;
+
+	hash = vm_ghost_filter_hash(obj_id, offset);
+	h1 = (uint32_t)hash & vm_ghost_filter_mask;
+	h2 = (uint32_t)(hash >> 32) & vm_ghost_filter_mask;
+	fp = (uint32_t)((hash * 0x9e3779b97f4a7c15ULL) >> 56);
+
+	if ((tag = vm_ghost_filter[h1]) && VM_GHOST_TAG_FP(tag) == fp)
+		slot = h1;
+	else if ((tag = vm_ghost_filter[h2]) && VM_GHOST_TAG_FP(tag) == fp)
+		slot = h2;
+	else
+		return (FALSE);
+
+	vm_ghost_filter[slot] = 0;
+	*distance = (uint64_t)vm_ghost_epoch_age(VM_GHOST_TAG_EPOCH(tag)) << vm_ghost_epoch_shift;
+
+	return (TRUE);
+}
+
+/*
+ * Returns FALSE if the refault is too distant to count: a page that was
+ * evicted more than the active and inactive queues' worth of evictions
+ * ago wouldn't have stayed resident with any inactive target, and at
+ * that age its tag is as likely to be an alias of a younger one.
+ */
+static boolean_t
+vm_phantom_cache_record_refault(vm_object_t object, uint64_t distance)
+{
+	uint64_t	ratio;
+	int		bucket;
+
+	/* bucket 0 is under 1/64th of memory, then powers of 2 */
+	ratio = (distance * 64) / vm_ghost_mem_pages;
+	for (bucket = 0; ratio && bucket < VM_GHOST_REFAULT_BUCKETS - 1; bucket++)
+		ratio >>= 1;
+	vm_phantom_refault_histogram[bucket]++;
+
+	if (distance > (uint64_t)vm_page_active_count + vm_page_inactive_count) {
+		phantom_cache_stats.pcs_filter_too_far++;
+		return (FALSE);
+	}
+
+	/* running average of the object's refault distances, in epochs */
+	if (object->phantom_refaults < 0xffff)
+		object->phantom_refaults++;
+	object->phantom_refault_distance = (uint16_t)
+		((object->phantom_refault_distance * 7 + (distance >> vm_ghost_epoch_shift)) / 8);
+
+	OSAddAtomic(1, &sample_period_refault_count);
+	if (distance < vm_page_active_count)
+		OSAddAtomic(1, &sample_period_refault_fixable_count);
+
+	return (TRUE);
+}
+
+
 void
 vm_phantom_cache_init()
 {
@@ -104,6 +283,10 @@ vm_phantom_cache_init()
 	if ( !VM_CONFIG_COMPRESSOR_IS_ACTIVE)
 		return;
 	num_entries = (uint32_t)(((max_mem / PAGE_SIZE) / 4) / VM_GHOST_PAGES_PER_ENTRY);
+
+	/* g_next_index can't address any more than this */
+	if (num_entries > (1U << VM_GHOST_INDEX_BITS))
+		num_entries = 1U << VM_GHOST_INDEX_BITS;
 	vm_phantom_cache_num_entries = 1;
 
 	while (vm_phantom_cache_num_entries < num_entries)
@@ -140,6 +323,27 @@ vm_phantom_cache_init()
 
 	if (vm_ghost_hash_mask & vm_phantom_cache_num_entries)
 		printf("vm_phantom_cache_init: WARNING -- strange page hash\n");
+
+	/*
+	 * size the ghost filter at 1 slot for every 2 pages of memory
+	 */
+	vm_ghost_mem_pages = max_mem / PAGE_SIZE;
+	num_entries = 1;
+
+	while (num_entries < vm_ghost_mem_pages / 2 && num_entries < (1U << 31))
+		num_entries <<= 1;
+
+	vm_ghost_filter_mask = num_entries - 1;
+	vm_ghost_filter_size = sizeof(vm_ghost_tag_t) * (vm_size_t)num_entries;
+
+	if (kernel_memory_allocate(kernel_map, (vm_offset_t *)(&vm_ghost_filter), vm_ghost_filter_size, 0, KMA_KOBJECT | KMA_PERMANENT, VM_KERN_MEMORY_PHANTOM_CACHE) != KERN_SUCCESS)
+		panic("vm_phantom_cache_init: kernel_memory_allocate failed\n");
+	bzero(vm_ghost_filter, vm_ghost_filter_size);
+
+	vm_ghost_epoch_shift = 0;
+
+	while ((vm_ghost_mem_pages >> vm_ghost_epoch_shift) > VM_GHOST_EPOCHS)
+		vm_ghost_epoch_shift++;
 }
 
 
@@ -235,6 +439,9 @@ vm_phantom_cache_add_ghost(vm_page_t m)
 	vm_phantom_cache_hash[ghost_hash_index] = ghost_index;
 
 done:
+	vm_ghost_filter_insert(object->phantom_object_id, m->offset);
+	vm_ghost_evictions++;
+
 	if (object->phantom_isssd)
 		OSAddAtomic(1, &sample_period_ghost_added_count_ssd);
 	else
@@ -293,13 +500,15 @@ vm_phantom_cache_update(vm_page_t m)
 	int		pg_mask;
 	vm_ghost_t      vpce;
 	vm_object_t	object;
+	uint64_t	distance;
+	boolean_t	in_filter;
 
 	object = VM_PAGE_OBJECT(m);
 
 	LCK_MTX_ASSERT(&vm_page_queue_lock, LCK_MTX_ASSERT_OWNED);
 	vm_object_lock_assert_exclusive(object);
 
-	if (vm_phantom_cache_num_entries == 0)
+	if (vm_phantom_cache_num_entries == 0 || object->phantom_object_id == 0)
 		return;
 	
 	pg_mask = pg_masks[(m->offset >> PAGE_SHIFT) & VM_GHOST_PAGE_MASK];
@@ -309,6 +518,20 @@ vm_phantom_cache_update(vm_page_t m)
 		vpce->g_pages_held &= ~pg_mask;
 
 		phantom_cache_stats.pcs_updated_phantom_state++;
+	}
+	in_filter = vm_ghost_filter_remove(object->phantom_object_id, m->offset, &distance);
+
+	if (in_filter && !vm_phantom_cache_record_refault(object, distance))
+		in_filter = FALSE;
+
+	if (vpce || in_filter) {
+		/*
+		 * pages that have fallen out of the ring but are still
+		 * in the filter count as found too, so that thrashing of
+		 * working sets larger than the ring is detected
+		 */
+		if (vpce == NULL)
+			phantom_cache_stats.pcs_found_in_filter_only++;
 
 		if (object->phantom_isssd)
 			OSAddAtomic(1, &sample_period_ghost_found_count_ssd);
@@ -367,6 +590,43 @@ is_thrashing(uint32_t added, uint32_t found, uint32_t threshold)
 	return TRUE;
 }
 
+/*
+ * Adjust the inactive target boost at the end of a sampling period from
+ * the refaults seen during it.
+ */
+static void
+vm_phantom_cache_adapt_inactive(uint32_t refaults, uint32_t fixable)
+{
+	if (!phantom_cache_adapt_inactive) {
+		phantom_cache_inactive_boost = 0;
+		return;
+	}
+	if (fixable >= phantom_cache_thrashing_threshold && fixable >= refaults / 2) {
+		phantom_cache_inactive_boost += 5;
+
+		if (phantom_cache_inactive_boost > phantom_cache_inactive_boost_max)
+			phantom_cache_inactive_boost = phantom_cache_inactive_boost_max;
+	} else if (fixable < phantom_cache_thrashing_threshold / 2 && phantom_cache_inactive_boost)
+		phantom_cache_inactive_boost--;
+}
+
+/*
+ * Number of pages to add to vm_pageout_scan's inactive target, out of
+ * "avail" active, inactive and speculative pages.
+ */
+uint32_t
+vm_phantom_cache_inactive_boost(uint32_t avail)
+{
+	uint32_t	boost;
+
+	if ((boost = phantom_cache_inactive_boost) == 0)
+		return (0);
+	/* whatever the sysctl says, leave the active queue something */
+	if (boost > 40)
+		boost = 40;
+	return ((uint32_t)(((uint64_t)avail * boost) / 100));
+}
+
 /*
  * the following function is never called
  * from multiple threads simultaneously due
@@ -411,10 +671,15 @@ vm_phantom_cache_check_pressure()
 		if (sample_period_ghost_counts_indx >= 256)
 			sample_period_ghost_counts_indx = 0;
 #endif
+		vm_phantom_cache_adapt_inactive(sample_period_refault_count,
+						sample_period_refault_fixable_count);
+
 		sample_period_ghost_added_count = 0;
 		sample_period_ghost_found_count = 0;
 		sample_period_ghost_added_count_ssd = 0;
 		sample_period_ghost_found_count_ssd = 0;
+		sample_period_refault_count = 0;
+		sample_period_refault_fixable_count = 0;
 
 		pc_start_of_eval_period_sec = cur_ts_sec;
 		pc_start_of_eval_period_nsec = cur_ts_nsec;
@@ -27,6 +27,7 @@
  */
 
 #include <vm/vm_page.h>
+#include <vm/vm_pageout.h>
 
 #define		VM_GHOST_OFFSET_BITS	39
 #define		VM_GHOST_OFFSET_MASK	0x7FFFFFFFFF
@@ -46,6 +47,7 @@ struct	vm_ghost
 
 typedef	struct vm_ghost	*vm_ghost_t;
 
+/* VM_GHOST_REFAULT_BUCKETS and vm_phantom_refault_histogram are in vm_pageout.h */
 
 extern	void		vm_phantom_cache_init(void);
 extern	void		vm_phantom_cache_add_ghost(vm_page_t);
@@ -53,3 +55,4 @@ extern	vm_ghost_t	vm_phantom_cache_lookup_ghost(vm_page_t, uint32_t);
 extern	void		vm_phantom_cache_update(vm_page_t);
 extern	boolean_t	vm_phantom_cache_check_pressure(void);
 extern  void		vm_phantom_cache_restart_sample(void);
+extern	uint32_t	vm_phantom_cache_inactive_boost(uint32_t);
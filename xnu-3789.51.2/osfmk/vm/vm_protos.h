@@ -88,6 +88,7 @@ extern int max_task_footprint_mb;	/* Per-task limit on physical memory consumpti
 
 extern vm_map_t		kalloc_map;
 extern vm_size_t	msg_ool_size_small;
+extern vm_size_t	msg_ool_copy_threshold;
 extern vm_map_t		zone_map;
 
 extern void consider_machine_adjust(void);
@@ -63,6 +63,11 @@ int             available_for_purge = 0;	/* increase when ripe token
 						 * protected by page_queue_lock 
 						 */
 
+unsigned int	vm_purgeable_token_migrations = 0;	/* unripe tokens moved
+							 * between FIFO and LIFO */
+unsigned int	vm_purgeable_token_migration_steps = 0;	/* tokens walked to
+							 * place them */
+
 static int token_q_allocating = 0;		/* flag for singlethreading 
 						 * allocator */
 
@@ -71,6 +76,7 @@ queue_head_t purgeable_nonvolatile_queue;
 int purgeable_nonvolatile_count;
 
 decl_lck_mtx_data(,vm_purgeable_queue_lock)
+decl_lck_mtx_data(,vm_purgeable_nonvolatile_queue_lock)
 
 static token_idx_t vm_purgeable_token_remove_first(purgeable_q_t queue);
 
@@ -124,6 +130,7 @@ vm_purgeable_token_check_queue(purgeable_q_t queue)
 	if (unripe)
 		assert(queue->token_q_unripe == unripe);
 	assert(token_cnt == queue->debug_count_tokens);
+	assert((token_cnt_t) page_cnt == queue->token_q_pages);
 	
 	/* obsolete queue doesn't maintain token counts */
 	if(queue->type != PURGEABLE_Q_TYPE_OBSOLETE)
@@ -251,6 +258,7 @@ find_available_token:
 		tokens[token].count = 0;	/* all obsolete items are
 						 * ripe immediately */
 	queue->new_pages = 0;
+	queue->token_q_pages += tokens[token].count;
 
 	/* put token on token counter list */
 	tokens[token].next = 0;
@@ -330,6 +338,7 @@ vm_purgeable_token_remove_first(purgeable_q_t queue)
 			 * created token
 			 */
 			queue->new_pages += tokens[token].count;
+			queue->token_q_pages -= tokens[token].count;
 			/* if head is zero, tail is too */
 			queue->token_q_tail = 0;
 		}
@@ -393,6 +402,7 @@ vm_purgeable_token_remove_last(purgeable_q_t queue)
 		}
 
 		queue->new_pages += tokens[token].count;
+		queue->token_q_pages -= tokens[token].count;
 
 #if MACH_ASSERT
 		queue->debug_count_tokens--;
@@ -485,6 +495,7 @@ vm_purgeable_q_advance_all()
 			if (tokens[queue->token_q_unripe].count && num_pages)
 			{
 				tokens[queue->token_q_unripe].count -= 1;
+				queue->token_q_pages -= 1;
 				num_pages -= 1;
 			}
 
@@ -596,11 +607,39 @@ vm_purgeable_token_choose_and_delete_ripe(purgeable_q_t queue, purgeable_q_t que
 		/* migrate to queue2 */
 		/* go to migration target loc */
 
-		token_idx_t token_to_insert_before = queue2->token_q_head, token_to_insert_after;
+		token_idx_t token_to_insert_before, token_to_insert_after;
+
+		vm_purgeable_token_migrations++;
 
-		while (token_to_insert_before != 0 && count > tokens[token_to_insert_before].count) {
-			count -= tokens[token_to_insert_before].count;
-			token_to_insert_before = tokens[token_to_insert_before].next;
+		/*
+		 * The token goes in front of the first token whose running
+		 * total reaches "count".  queue2 keeps the sum of its
+		 * counters, so going past the end costs nothing, and
+		 * otherwise we walk in from whichever end is closer.
+		 */
+		if (count > queue2->token_q_pages) {
+			token_to_insert_before = 0;
+			count -= queue2->token_q_pages;
+		} else if (count > queue2->token_q_pages / 2) {
+			token_cnt_t	ahead;	/* pages on the tokens in front
+						 * of token_to_insert_before */
+
+			token_to_insert_before = queue2->token_q_tail;
+			ahead = queue2->token_q_pages - tokens[token_to_insert_before].count;
+			while (ahead >= count) {
+				token_to_insert_before = tokens[token_to_insert_before].prev;
+				assert(token_to_insert_before);
+				ahead -= tokens[token_to_insert_before].count;
+				vm_purgeable_token_migration_steps++;
+			}
+			count -= ahead;
+		} else {
+			token_to_insert_before = queue2->token_q_head;
+			while (token_to_insert_before != 0 && count > tokens[token_to_insert_before].count) {
+				count -= tokens[token_to_insert_before].count;
+				token_to_insert_before = tokens[token_to_insert_before].next;
+				vm_purgeable_token_migration_steps++;
+			}
 		}
 
 		/* token_to_insert_before is now set correctly */
@@ -634,6 +673,7 @@ vm_purgeable_token_choose_and_delete_ripe(purgeable_q_t queue, purgeable_q_t que
 
 			assert(queue2->new_pages >= (int32_t) count);
 			queue2->new_pages -= count;
+			queue2->token_q_pages += count;
 		}
 
 		if (token_to_insert_after != 0) {
@@ -767,6 +807,7 @@ vm_purgeable_object_find_and_lock(
 #endif /* DEBUG */
 
 	/* keep queue of non-volatile objects */
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 	queue_enter(&purgeable_nonvolatile_queue, object,
 		    vm_object_t, objq);
 	assert(purgeable_nonvolatile_count >= 0);
@@ -774,6 +815,7 @@ vm_purgeable_object_find_and_lock(
 	assert(purgeable_nonvolatile_count > 0);
 	/* one more nonvolatile object for this object's owner */
 	vm_purgeable_nonvolatile_owner_update(object->vo_purgeable_owner, +1);
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 
 #if MACH_ASSERT
 	queue->debug_count_objects--;
@@ -994,6 +1036,7 @@ vm_purgeable_object_add(vm_object_t object, purgeable_q_t queue, int group)
 	vm_object_lock_assert_exclusive(object);
 	lck_mtx_lock(&vm_purgeable_queue_lock);
 
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 	assert(object->objq.next != NULL);
 	assert(object->objq.prev != NULL);
 	queue_remove(&purgeable_nonvolatile_queue, object,
@@ -1005,6 +1048,7 @@ vm_purgeable_object_add(vm_object_t object, purgeable_q_t queue, int group)
 	assert(purgeable_nonvolatile_count >= 0);
 	/* one less nonvolatile object for this object's owner */
 	vm_purgeable_nonvolatile_owner_update(object->vo_purgeable_owner, -1);
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 
 	if (queue->type == PURGEABLE_Q_TYPE_OBSOLETE)
 		group = 0;
@@ -1076,6 +1120,7 @@ vm_purgeable_object_remove(vm_object_t object)
 	/* keep queue of non-volatile objects */
 	if (object->alive && !object->terminating) {
 		task_t	owner;
+		lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 		queue_enter(&purgeable_nonvolatile_queue, object,
 			    vm_object_t, objq);
 		assert(purgeable_nonvolatile_count >= 0);
@@ -1084,6 +1129,7 @@ vm_purgeable_object_remove(vm_object_t object)
 		/* one more nonvolatile object for this object's owner */
 		owner = object->vo_purgeable_owner;
 		vm_purgeable_nonvolatile_owner_update(owner, +1);
+		lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 	}
 
 #if MACH_ASSERT
@@ -1200,7 +1246,7 @@ vm_purgeable_account(
 	acnt_info->pvm_nonvolatile_count = 0;
 	acnt_info->pvm_nonvolatile_compressed_count = 0;
 
-	lck_mtx_lock(&vm_purgeable_queue_lock);
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 
 	nonvolatile_q = &purgeable_nonvolatile_queue;
 	for (object = (vm_object_t) queue_first(nonvolatile_q);
@@ -1220,6 +1266,10 @@ vm_purgeable_account(
 		}
 	}
 
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
+
+	lck_mtx_lock(&vm_purgeable_queue_lock);
+
 	volatile_q = &purgeable_queues[PURGEABLE_Q_TYPE_OBSOLETE];
 	vm_purgeable_account_volatile_queue(volatile_q, 0, task, acnt_info);
 
@@ -1311,9 +1361,12 @@ vm_purgeable_disown(
 
 	/*
 	 * Scan the purgeable objects queues for objects owned by "task".
-	 * This has to be done "atomically" under the "vm_purgeable_queue"
-	 * lock, to ensure that no new purgeable object get associated
-	 * with this task or moved between queues while we're scanning.
+	 * No new purgeable object can get associated with this task once
+	 * "task_purgeable_disowning" is set, but objects can still move
+	 * between the non-volatile and volatile queues while we're
+	 * scanning.  Such moves happen with both purgeable queue locks
+	 * held, so we re-check the task's counters with both locks held
+	 * and start over if anything sneaked past us.
 	 */
 
 	/*
@@ -1329,7 +1382,7 @@ again:
 		assert(task->task_nonvolatile_objects == 0);
 		return;
 	}
-	lck_mtx_lock(&vm_purgeable_queue_lock);
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 
 	nonvolatile_q = &purgeable_nonvolatile_queue;
 	for (object = (vm_object_t) queue_first(nonvolatile_q);
@@ -1354,7 +1407,7 @@ again:
 #endif /* DEBUG */
 		if (object->vo_purgeable_owner == task) {
 			if (!vm_object_lock_try(object)) {
-				lck_mtx_unlock(&vm_purgeable_queue_lock);
+				lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 				mutex_pause(collisions++);
 				goto again;
 			}
@@ -1368,7 +1421,9 @@ again:
 		}
 	}
 
-	lck_mtx_yield(&vm_purgeable_queue_lock);
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
+
+	lck_mtx_lock(&vm_purgeable_queue_lock);
 
 	/*
 	 * Scan volatile queues for objects owned by "task".
@@ -1390,9 +1445,12 @@ again:
 		lck_mtx_yield(&vm_purgeable_queue_lock);
 	}
 
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
+
 	if (task->task_volatile_objects != 0 ||
 	    task->task_nonvolatile_objects != 0) {
 		/* some purgeable objects sneaked into a queue: find them */
+		lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 		lck_mtx_unlock(&vm_purgeable_queue_lock);
 		mutex_pause(collisions++);
 		goto again;
@@ -1406,6 +1464,7 @@ again:
 	/* and we don't need to try and disown again */
 	task->task_purgeable_disowned = TRUE;
 
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 	lck_mtx_unlock(&vm_purgeable_queue_lock);
 }
 
@@ -1460,6 +1519,7 @@ look_again:
 #if DEBUG
 		object->vo_purgeable_volatilizer = NULL;
 #endif /* DEBUG */
+		lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 		queue_enter(&purgeable_nonvolatile_queue, object,
 			    vm_object_t, objq);
 		assert(purgeable_nonvolatile_count >= 0);
@@ -1468,6 +1528,7 @@ look_again:
 		/* one more nonvolatile object for this object's owner */
 		assert(object->vo_purgeable_owner == task);
 		vm_purgeable_nonvolatile_owner_update(task, +1);
+		lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 
 		/* unlock purgeable queues */
 		lck_mtx_unlock(&vm_purgeable_queue_lock);
@@ -1538,7 +1599,7 @@ vm_purgeable_nonvolatile_enqueue(
 	assert(object->purgable == VM_PURGABLE_NONVOLATILE);
 	assert(object->vo_purgeable_owner == NULL);
 
-	lck_mtx_lock(&vm_purgeable_queue_lock);
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 
 	if (owner != NULL &&
 	    owner->task_purgeable_disowning) {
@@ -1576,7 +1637,7 @@ vm_purgeable_nonvolatile_enqueue(
 	/* one more nonvolatile object for this object's owner */
 	assert(object->vo_purgeable_owner == owner);
 	vm_purgeable_nonvolatile_owner_update(owner, +1);
-	lck_mtx_unlock(&vm_purgeable_queue_lock);
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 
 	vm_object_lock_assert_exclusive(object);
 }
@@ -1603,7 +1664,7 @@ vm_purgeable_nonvolatile_dequeue(
 					TRUE); /* disown */
 	}
 
-	lck_mtx_lock(&vm_purgeable_queue_lock);
+	lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 	assert(object->objq.next != NULL);
 	assert(object->objq.prev != NULL);
 	queue_remove(&purgeable_nonvolatile_queue, object,
@@ -1613,7 +1674,7 @@ vm_purgeable_nonvolatile_dequeue(
 	assert(purgeable_nonvolatile_count > 0);
 	purgeable_nonvolatile_count--;
 	assert(purgeable_nonvolatile_count >= 0);
-	lck_mtx_unlock(&vm_purgeable_queue_lock);
+	lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
 
 	vm_object_lock_assert_exclusive(object);
 }
@@ -55,6 +55,7 @@ struct purgeable_q {
 	token_idx_t token_q_head;    /* first token */
 	token_idx_t token_q_tail;    /* last token  */
 	token_idx_t token_q_unripe;  /* first token which is not ripe */
+	token_cnt_t token_q_pages;   /* sum of the token counters */
 	int32_t new_pages;
 	queue_head_t objq[NUM_VOLATILE_GROUPS];
 	enum purgeable_q_type type;
@@ -81,8 +82,12 @@ extern int available_for_purge;
  * the purgeable page queues are protected by a separate lock since they're
  * mostly used on a user context and we don't want any contention with the
  * pageout daemon.
+ * the non-volatile queue has its own lock, so that creating and destroying
+ * non-volatile objects doesn't wait for the purger to scan the volatile
+ * queues.  When both are needed, vm_purgeable_queue_lock is taken first.
  */
 decl_lck_mtx_data(extern,vm_purgeable_queue_lock)
+decl_lck_mtx_data(extern,vm_purgeable_nonvolatile_queue_lock)
 
 /* add a new token to queue. called by vm_object_purgeable_control */
 /* enter with page queue locked */
@@ -126,6 +126,7 @@ boolean_t	vm_lopage_needed = FALSE;
 lck_mtx_ext_t	vm_page_queue_lock_ext;
 lck_mtx_ext_t	vm_page_queue_free_lock_ext;
 lck_mtx_ext_t	vm_purgeable_queue_lock_ext;
+lck_mtx_ext_t	vm_purgeable_nonvolatile_queue_lock_ext;
 
 int		speculative_age_index = 0;
 int		speculative_steal_index = 0;
@@ -275,6 +276,17 @@ unsigned int    vm_color_mask;			/* mask is == (vm_colors-1) */
 unsigned int	vm_cache_geometry_colors = 0;	/* set by hw dependent code during startup */
 unsigned int	vm_free_magazine_refill_limit = 0;
 
+/*
+ * vm_page_release() parks freed pages on the per-cpu free list instead of
+ * the global free queues while memory is plentiful.  Once a cpu holds more
+ * than vm_free_magazine_release_limit pages, all but a refill's worth go
+ * back to the free queues under a single hold of the free queue lock.
+ * Setting the limit to 0 sends every release straight to the free queues.
+ */
+unsigned int	vm_free_magazine_release_limit = 0;
+unsigned int	vm_free_magazine_drains = 0;
+unsigned int	vm_free_magazine_drained = 0;
+
 
 struct vm_page_queue_free_head {
 	vm_page_queue_head_t	qhead;
@@ -496,6 +508,7 @@ vm_page_set_colors( void )
 	vm_color_mask = n - 1;
 
 	vm_free_magazine_refill_limit = vm_colors * COLOR_GROUPS_TO_STEAL;
+	vm_free_magazine_release_limit = 2 * vm_free_magazine_refill_limit;
 }
 
 
@@ -640,6 +653,7 @@ vm_page_bootstrap(
 	m->slid = FALSE;
 	m->xpmapped = FALSE;
 	m->written_by_kernel = FALSE;
+	m->superpage_promoted = FALSE;
 	m->__unused_object_bits = 0;
 
 	/*
@@ -650,12 +664,14 @@ vm_page_bootstrap(
 	lck_mtx_init_ext(&vm_page_queue_free_lock, &vm_page_queue_free_lock_ext, &vm_page_lck_grp_free, &vm_page_lck_attr);
 	lck_mtx_init_ext(&vm_page_queue_lock, &vm_page_queue_lock_ext, &vm_page_lck_grp_queue, &vm_page_lck_attr);
 	lck_mtx_init_ext(&vm_purgeable_queue_lock, &vm_purgeable_queue_lock_ext, &vm_page_lck_grp_purge, &vm_page_lck_attr);
+	lck_mtx_init_ext(&vm_purgeable_nonvolatile_queue_lock, &vm_purgeable_nonvolatile_queue_lock_ext, &vm_page_lck_grp_purge, &vm_page_lck_attr);
     
 	for (i = 0; i < PURGEABLE_Q_TYPE_MAX; i++) {
 		int group;
 
 		purgeable_queues[i].token_q_head = 0;
 		purgeable_queues[i].token_q_tail = 0;
+		purgeable_queues[i].token_q_pages = 0;
 		for (group = 0; group < NUM_VOLATILE_GROUPS; group++)
 		        queue_init(&purgeable_queues[i].objq[group]);
 
@@ -2531,6 +2547,9 @@ vm_page_grablo(void)
  * 	pageout_scan thread if we moved pages from the global
  *	list... no need for the wakeup if we've satisfied the
  *	request from the per-cpu queue.
+ *	vm_page_release() refills the per-cpu list too, while
+ *	free memory is above vm_page_free_target, and drains the
+ *	excess back to the global free queues in batches.
  */
 
 #if CONFIG_SECLUDED_MEMORY
@@ -2557,6 +2576,7 @@ return_page_from_cpu_list:
 
 	        PROCESSOR_DATA(current_processor(), page_grab_count) += 1;
 	        PROCESSOR_DATA(current_processor(), free_pages) = mem->snext;
+	        PROCESSOR_DATA(current_processor(), free_pages_count) -= 1;
 
 	        enable_preemption();
 		VM_PAGE_ZERO_PAGEQ_ENTRY(mem);
@@ -2635,6 +2655,7 @@ return_page_from_cpu_list:
 	       vm_page_t	head;
 	       vm_page_t	tail;
 	       unsigned int	pages_to_steal;
+	       unsigned int	pages_stolen;
 	       unsigned int	color;
 
 	       while ( vm_page_free_count == 0 ) {
@@ -2673,6 +2694,7 @@ return_page_from_cpu_list:
 		head = tail = NULL;
 
 		vm_page_free_count -= pages_to_steal;
+		pages_stolen = pages_to_steal;
 
 		while (pages_to_steal--) {
 
@@ -2712,6 +2734,7 @@ return_page_from_cpu_list:
 		lck_mtx_unlock(&vm_page_queue_free_lock);
 
 		PROCESSOR_DATA(current_processor(), free_pages) = head->snext;
+		PROCESSOR_DATA(current_processor(), free_pages_count) = pages_stolen - 1;
 		PROCESSOR_DATA(current_processor(), start_color) = color;
 
 		/*
@@ -2898,6 +2921,195 @@ vm_page_grab_secluded(void)
 }
 #endif /* CONFIG_SECLUDED_MEMORY */
 
+/*
+ *	vm_page_free_magazine_drain:
+ *
+ *	Move a chain of pages taken off a per-cpu free list
+ *	back onto the global free queues, sorted by color,
+ *	under a single hold of the free queue lock.  Waiters
+ *	are woken the same way vm_page_free_list() does it.
+ */
+static void
+vm_page_free_magazine_drain(
+	vm_page_t	mem,
+	unsigned int	pg_count)
+{
+	vm_page_t	nxt;
+	unsigned int	color;
+	unsigned int	avail_free_count;
+	unsigned int	need_wakeup = 0;
+	unsigned int	need_priv_wakeup = 0;
+#if CONFIG_SECLUDED_MEMORY
+	unsigned int	need_wakeup_secluded = 0;
+#endif /* CONFIG_SECLUDED_MEMORY */
+
+	lck_mtx_lock_spin(&vm_page_queue_free_lock);
+
+	while (mem) {
+		nxt = mem->snext;
+
+		assert(mem->vm_page_q_state == VM_PAGE_ON_FREE_LOCAL_Q);
+		assert(mem->busy);
+		VM_PAGE_ZERO_PAGEQ_ENTRY(mem);
+		mem->vm_page_q_state = VM_PAGE_ON_FREE_Q;
+
+		color = VM_PAGE_GET_PHYS_PAGE(mem) & vm_color_mask;
+		vm_page_queue_enter_first(&vm_page_queue_free[color].qhead,
+					  mem,
+					  vm_page_t,
+					  pageq);
+		mem = nxt;
+	}
+	vm_page_free_count += pg_count;
+	avail_free_count = vm_page_free_count;
+
+	vm_free_magazine_drains++;
+	vm_free_magazine_drained += pg_count;
+
+	if (vm_page_free_wanted_privileged > 0) {
+		need_priv_wakeup = 1;
+		if (avail_free_count < vm_page_free_wanted_privileged) {
+			vm_page_free_wanted_privileged -= avail_free_count;
+			avail_free_count = 0;
+		} else {
+			avail_free_count -= vm_page_free_wanted_privileged;
+			vm_page_free_wanted_privileged = 0;
+		}
+	}
+#if CONFIG_SECLUDED_MEMORY
+	if (vm_page_free_wanted_secluded > 0 &&
+	    avail_free_count > vm_page_free_reserved) {
+		unsigned int	available_pages;
+
+		available_pages = avail_free_count - vm_page_free_reserved;
+
+		if (available_pages < vm_page_free_wanted_secluded) {
+			need_wakeup_secluded = available_pages;
+			vm_page_free_wanted_secluded -= available_pages;
+			avail_free_count -= available_pages;
+		} else {
+			need_wakeup_secluded = vm_page_free_wanted_secluded;
+			avail_free_count -= vm_page_free_wanted_secluded;
+			vm_page_free_wanted_secluded = 0;
+		}
+	}
+#endif /* CONFIG_SECLUDED_MEMORY */
+	if (vm_page_free_wanted > 0 && avail_free_count > vm_page_free_reserved) {
+		unsigned int	available_pages;
+
+		available_pages = avail_free_count - vm_page_free_reserved;
+
+		if (available_pages >= vm_page_free_wanted) {
+			need_wakeup = vm_page_free_wanted;
+			vm_page_free_wanted = 0;
+		} else {
+			need_wakeup = available_pages;
+			vm_page_free_wanted -= available_pages;
+		}
+	}
+	lck_mtx_unlock(&vm_page_queue_free_lock);
+
+	if (need_priv_wakeup != 0)
+		thread_wakeup((event_t)&vm_page_free_wanted_privileged);
+#if CONFIG_SECLUDED_MEMORY
+	if (need_wakeup_secluded != 0 && vm_page_free_wanted_secluded == 0)
+		thread_wakeup((event_t)&vm_page_free_wanted_secluded);
+	else for (; need_wakeup_secluded != 0; need_wakeup_secluded--)
+		thread_wakeup_one((event_t)&vm_page_free_wanted_secluded);
+#endif /* CONFIG_SECLUDED_MEMORY */
+	if (need_wakeup != 0 && vm_page_free_wanted == 0)
+		thread_wakeup((event_t)&vm_page_free_count);
+	else for (; need_wakeup != 0; need_wakeup--)
+		thread_wakeup_one((event_t)&vm_page_free_count);
+}
+
+/*
+ *	vm_page_free_magazine_put:
+ *
+ *	Try to free a page onto the current cpu's free list
+ *	without taking the free queue lock.  This is only done
+ *	while we're above the free target with nobody waiting
+ *	for a page, so vm_page_wait() and the reserve checks in
+ *	vm_page_grab() see the same free count they always did;
+ *	pages parked here are simply not counted as free until
+ *	they are grabbed again or drained.  Pages that belong on
+ *	the lopage or secluded queues always take the slow path.
+ *
+ *	Returns TRUE if the page was taken.
+ */
+static boolean_t
+vm_page_free_magazine_put(
+	vm_page_t	mem)
+{
+	processor_t	processor;
+	vm_page_t	drain;
+	unsigned int	count;
+	unsigned int	keep;
+
+	if (vm_free_magazine_release_limit == 0 ||
+	    mem->lopage == TRUE || vm_lopage_refill == TRUE)
+		return FALSE;
+	if (vm_page_free_count <= vm_page_free_target ||
+	    vm_page_free_wanted > 0 || vm_page_free_wanted_privileged > 0)
+		return FALSE;
+#if CONFIG_SECLUDED_MEMORY
+	if (vm_page_free_wanted_secluded > 0 ||
+	    (vm_page_secluded_count < vm_page_secluded_target &&
+	     num_tasks_can_use_secluded_mem == 0))
+		return FALSE;
+#endif /* CONFIG_SECLUDED_MEMORY */
+
+	assert(mem->vm_page_q_state == VM_PAGE_NOT_ON_Q);
+	assert(mem->busy);
+	assert(!mem->laundry);
+	assert(mem->vm_page_object == 0);
+	assert(mem->pageq.next == 0 && mem->pageq.prev == 0);
+	assert(mem->listq.next == 0 && mem->listq.prev == 0);
+#if CONFIG_BACKGROUND_QUEUE
+	assert(mem->vm_page_backgroundq.next == 0 &&
+	       mem->vm_page_backgroundq.prev == 0 &&
+	       mem->vm_page_on_backgroundq == FALSE);
+#endif
+	mem->vm_page_q_state = VM_PAGE_ON_FREE_LOCAL_Q;
+
+	disable_preemption();
+	processor = current_processor();
+
+	mem->snext = PROCESSOR_DATA(processor, free_pages);
+	PROCESSOR_DATA(processor, free_pages) = mem;
+	count = ++PROCESSOR_DATA(processor, free_pages_count);
+
+	drain = VM_PAGE_NULL;
+
+	if (count > vm_free_magazine_release_limit) {
+		vm_page_t	last;
+		unsigned int	i;
+
+		/*
+		 * keep the most recently freed (and most likely
+		 * still cache warm) refill's worth, hand back
+		 * the rest
+		 */
+		keep = MIN(vm_free_magazine_refill_limit, vm_free_magazine_release_limit);
+		if (keep == 0)
+			keep = 1;
+
+		for (last = mem, i = 1; i < keep; i++)
+			last = last->snext;
+		drain = last->snext;
+		last->snext = VM_PAGE_NULL;
+
+		PROCESSOR_DATA(processor, free_pages_count) = keep;
+		count -= keep;
+	}
+	enable_preemption();
+
+	if (drain != VM_PAGE_NULL)
+		vm_page_free_magazine_drain(drain, count);
+
+	return TRUE;
+}
+
 /*
  *	vm_page_release:
  *
@@ -2930,6 +3142,13 @@ vm_page_release(
 
 	pmap_clear_noencrypt(VM_PAGE_GET_PHYS_PAGE(mem));
 
+	/*
+	 * the free count doesn't change when the page stays
+	 * on this cpu, so there's no memorystatus update to do
+	 */
+	if (vm_page_free_magazine_put(mem) == TRUE)
+		return;
+
 	lck_mtx_lock_spin(&vm_page_queue_free_lock);
 
 	assert(mem->vm_page_q_state == VM_PAGE_NOT_ON_Q);
@@ -3117,6 +3336,14 @@ vm_page_wait(
 	int          	need_wakeup = 0;
 	int		is_privileged = current_thread()->options & TH_OPT_VMPRIV;
 
+	/*
+	 * vm_page_grab() hands out this cpu's free list
+	 * before looking at the reserve, so don't block
+	 * while there are pages parked on it.
+	 */
+	if (PROCESSOR_DATA(current_processor(), free_pages) != NULL)
+		return TRUE;
+
 	lck_mtx_lock_spin(&vm_page_queue_free_lock);
 
 	if (is_privileged && vm_page_free_count) {
@@ -5567,7 +5794,11 @@ done_scanning:
 #if MACH_ASSERT
 	vm_page_verify_free_lists();
 #endif
-	if (m == NULL && zone_gc_called == FALSE) {
+	if (m == NULL && zone_gc_called == FALSE && !(flags & KMA_NOPAGEWAIT)) {
+		/*
+		 * opportunistic callers (superpage promotion) would rather
+		 * fail than flush the buffer cache and zones for a run
+		 */
 		printf("%s(num=%d,low=%d): found %d pages at 0x%llx...scanned %d pages...  yielded %d times...  dumped run %d times... stole %d pages... stole %d compressed pages... wired count is %d\n",
 		       __func__, contig_pages, max_pnum, npages, (vm_object_offset_t)start_pnum << PAGE_SHIFT,
 		       scanned, yielded, dumped_run, stolen_pages, compressed_pages, vm_page_wire_count);
@@ -6524,6 +6755,7 @@ hibernate_vm_lock_queues(void)
     vm_page_lock_queues();
     lck_mtx_lock(&vm_page_queue_free_lock);
     lck_mtx_lock(&vm_purgeable_queue_lock);
+    lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
 
     if (vm_page_local_q) {
 	uint32_t  i;
@@ -6546,6 +6778,7 @@ hibernate_vm_unlock_queues(void)
 	    VPL_UNLOCK(&lq->vpl_lock);
 	}
     }
+    lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
     lck_mtx_unlock(&vm_purgeable_queue_lock);
     lck_mtx_unlock(&vm_page_queue_free_lock);
     vm_page_unlock_queues();
@@ -8094,7 +8327,7 @@ vm_page_iterate_objects(mach_memory_info_t * sites, unsigned int num_sites,
     }
     lck_spin_unlock(&vm_objects_wired_lock);
 
-    lck_mtx_lock(&vm_purgeable_queue_lock);
+    lck_mtx_lock(&vm_purgeable_nonvolatile_queue_lock);
     nonvolatile_q = &purgeable_nonvolatile_queue;
     for (object = (vm_object_t) queue_first(nonvolatile_q);
 	 !queue_end(nonvolatile_q, (queue_entry_t) object);
@@ -8102,6 +8335,9 @@ vm_page_iterate_objects(mach_memory_info_t * sites, unsigned int num_sites,
     {
 	proc(sites, num_sites, object);
     }
+    lck_mtx_unlock(&vm_purgeable_nonvolatile_queue_lock);
+
+    lck_mtx_lock(&vm_purgeable_queue_lock);
 
     volatile_q = &purgeable_queues[PURGEABLE_Q_TYPE_OBSOLETE];
     vm_page_iterate_purgeable_objects(sites, num_sites, proc, volatile_q, 0);
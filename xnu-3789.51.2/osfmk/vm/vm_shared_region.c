@@ -104,7 +104,9 @@
 
 #include <mach/mach_vm.h>
 
+#include <vm/vm_compressor_pager.h>
 #include <vm/vm_map.h>
+#include <vm/vm_page.h>
 #include <vm/vm_shared_region.h>
 
 #include <vm/vm_protos.h>
@@ -156,6 +158,11 @@ static void vm_shared_region_destroy(vm_shared_region_t shared_region);
 static void vm_shared_region_timeout(thread_call_param_t param0,
 				     thread_call_param_t param1);
 
+extern unsigned int vm_slid_page_cache_max;
+static void vm_shared_region_slid_cache_trim(thread_call_param_t param0,
+					     thread_call_param_t param1);
+static void vm_shared_region_slid_cache_destroy(vm_shared_region_slide_info_t si);
+
 static int __commpage_setup = 0;
 #if defined(__i386__) || defined(__x86_64__)
 static int __system_power_source = 1;	/* init to extrnal power source */
@@ -752,6 +759,13 @@ vm_shared_region_create(
 	si->slide_object = NULL;
 	si->slide_info_size = 0;
 	si->slide_info_entry = NULL;
+	si->slide_cache_object = VM_OBJECT_NULL;
+	si->slide_cache_ring = NULL;
+	si->slide_cache_ring_size = 0;
+	si->slide_cache_ring_first = 0;
+	si->slide_cache_ring_count = 0;
+	si->slide_cache_count = 0;
+	si->slide_cache_trim_call = NULL;
 
 done:
 	if (shared_region) {
@@ -848,6 +862,7 @@ vm_shared_region_destroy(
 			  (vm_offset_t) si->slide_info_entry,
 			  (vm_size_t) si->slide_info_size);
 		vm_object_deallocate(si->slide_object);
+		vm_shared_region_slid_cache_destroy(si);
 	}
 #endif 
 
@@ -1588,6 +1603,10 @@ vm_shared_region_slide_init(
 	vm_shared_region_slide_info_t si = vm_shared_region_get_slide_info(sr);
 	vm_offset_t slide_info_entry;
 	
+	vm_object_t cache_object = VM_OBJECT_NULL;
+	uint32_t *cache_ring = NULL;
+	uint32_t cache_ring_size = 0;
+	thread_call_t cache_trim_call = NULL;
 	vm_map_t map = NULL, cur_map = NULL;
 	boolean_t	is_map_locked = FALSE;
 
@@ -1609,6 +1628,18 @@ vm_shared_region_slide_init(
 		return kr;
 	}
 
+	/* see vm_shared_region_slid_cache_insert() */
+	cache_ring_size = vm_slid_page_cache_max;
+	if (page_aligned(start) && size != 0 && cache_ring_size != 0) {
+		cache_ring = (uint32_t *) kalloc(cache_ring_size * sizeof (cache_ring[0]));
+		cache_trim_call = thread_call_allocate(
+			(thread_call_func_t) vm_shared_region_slid_cache_trim,
+			(thread_call_param_t) si);
+		if (cache_ring != NULL && cache_trim_call != NULL) {
+			cache_object = vm_object_allocate((vm_object_size_t) vm_object_round_page(size));
+		}
+	}
+
 	if (sr_file_control != MEMORY_OBJECT_CONTROL_NULL) {
 
 		object = memory_object_control_to_vm_object(sr_file_control);
@@ -1670,6 +1701,18 @@ vm_shared_region_slide_init(
 		si->start = offset;
 		si->end = si->start + size;	
 		si->slide = slide;
+		if (cache_object != VM_OBJECT_NULL) {
+			si->slide_cache_object = cache_object;
+			si->slide_cache_ring = cache_ring;
+			si->slide_cache_ring_size = cache_ring_size;
+			si->slide_cache_ring_first = 0;
+			si->slide_cache_ring_count = 0;
+			si->slide_cache_count = 0;
+			si->slide_cache_trim_call = cache_trim_call;
+			cache_object = VM_OBJECT_NULL;
+			cache_ring = NULL;
+			cache_trim_call = NULL;
+		}
 
 		/*
 		 * If we want to have this region get deallocated/freed
@@ -1697,6 +1740,15 @@ vm_shared_region_slide_init(
 	if (kr != KERN_SUCCESS) {
 		kmem_free(kernel_map, slide_info_entry, slide_info_size);
 	}
+	if (cache_object != VM_OBJECT_NULL) {
+		vm_object_deallocate(cache_object);
+	}
+	if (cache_ring != NULL) {
+		kfree(cache_ring, cache_ring_size * sizeof (cache_ring[0]));
+	}
+	if (cache_trim_call != NULL) {
+		thread_call_free(cache_trim_call);
+	}
 	return kr;
 }
 
@@ -1803,6 +1855,7 @@ fail:
 		
 		vm_object_deallocate(si->slide_object);
 	        si->slide_object	= NULL;
+		vm_shared_region_slid_cache_destroy(si);
 		si->start = 0;
 		si->end = 0;	
 		si->slide = 0;
@@ -1818,7 +1871,7 @@ vm_shared_region_slide_page_v1(vm_shared_region_slide_info_t si, vm_offset_t vad
 	uint16_t *toc = NULL;
 	slide_info_entry_toc_t bitmap = NULL;
 	uint32_t i=0, j=0;
-	uint8_t b = 0;
+	uint64_t b = 0;
 	uint32_t slide = si->slide;
 	int is_64 = task_has_64BitAddr(current_task());
 
@@ -1836,29 +1889,34 @@ vm_shared_region_slide_page_v1(vm_shared_region_slide_info_t si, vm_offset_t vad
 		} else {
 			bitmap = &slide_info_entries[entryIndex];
 
-			for(i=0; i < NUM_SLIDING_BITMAPS_PER_PAGE; ++i) {
-				b = bitmap->entry[i];
-				if (b!=0) {
-					for (j=0; j <8; ++j) {
-						if (b & (1 <<j)){
-							uint32_t *ptr_to_slide;
-							uint32_t old_value;
-
-							ptr_to_slide = (uint32_t*)((uintptr_t)(vaddr)+(sizeof(uint32_t)*(i*8 +j)));
-							old_value = *ptr_to_slide;
-							*ptr_to_slide += slide;
-							if (is_64 && *ptr_to_slide < old_value) {
-								/*
-								 * We just slid the low 32 bits of a 64-bit pointer
-								 * and it looks like there should have been a carry-over
-								 * to the upper 32 bits.
-								 * The sliding failed...
-								 */
-								printf("vm_shared_region_slide() carry over: i=%d j=%d b=0x%x slide=0x%x old=0x%x new=0x%x\n",
-								       i, j, b, slide, old_value, *ptr_to_slide);
-								return KERN_FAILURE;
-							}
-						}
+			/*
+			 * Bit n of the (little-endian) bitmap covers the
+			 * n'th 32-bit word of the page.  Most words don't
+			 * need sliding, so go 64 bits at a time and only
+			 * visit the bits that are set.
+			 */
+			for(i=0; i < NUM_SLIDING_BITMAPS_PER_PAGE / sizeof(uint64_t); ++i) {
+				memcpy(&b, &bitmap->entry[i * sizeof(uint64_t)], sizeof(b));
+				while (b != 0) {
+					uint32_t *ptr_to_slide;
+					uint32_t old_value;
+
+					j = (uint32_t)__builtin_ctzll(b);
+					b &= b - 1;
+
+					ptr_to_slide = (uint32_t*)((uintptr_t)(vaddr)+(sizeof(uint32_t)*(i*64 +j)));
+					old_value = *ptr_to_slide;
+					*ptr_to_slide += slide;
+					if (is_64 && *ptr_to_slide < old_value) {
+						/*
+						 * We just slid the low 32 bits of a 64-bit pointer
+						 * and it looks like there should have been a carry-over
+						 * to the upper 32 bits.
+						 * The sliding failed...
+						 */
+						printf("vm_shared_region_slide() carry over: word=%d slide=0x%x old=0x%x new=0x%x\n",
+						       i*64 + j, slide, old_value, *ptr_to_slide);
+						return KERN_FAILURE;
 					}
 				}
 			}
@@ -2060,6 +2118,327 @@ vm_shared_region_slide_page(vm_shared_region_slide_info_t si, vm_offset_t vaddr,
 	}
 }
 
+/*
+ * Slid page cache.
+ *
+ * Slid pages live in the shared cache file's VM object and are shared by
+ * every task using the shared region, but they are clean as far as the
+ * file is concerned: once evicted, the next fault reads the page back
+ * from the file and slides it again.  Under memory pressure, launches
+ * keep paying for that.  Instead, vm_pageout_scan() hands evicted slid
+ * pages to vm_shared_region_slid_cache_insert(), which moves them to
+ * an internal object at the same offset from the start of the slid
+ * range, where they get compressed like anonymous memory.  vm_fault_page()
+ * asks vm_shared_region_slid_cache_lookup() before going to the pager,
+ * and gets back a page that is already slid.  The cache object belongs
+ * to the slide info, so it is specific to the shared region and its
+ * slide, and outlives the tasks that faulted the pages in.
+ *
+ * Each cache holds at most vm_slid_page_cache_max pages (taken when the
+ * slide info is set up).  Inserts append the page's index to a ring;
+ * once the ring is full, vm_shared_region_slid_cache_trim() runs from a
+ * thread call and evicts from the old end of the ring, so a cache that
+ * filled up with pages nobody faults back in keeps turning over instead
+ * of refusing new pages forever.  A page taken back by a fault leaves a
+ * stale index in the ring, which costs nothing when it ages out; if the
+ * same offset was evicted again since, it goes at the older index's turn.
+ *
+ * Only pages that passed code signing validation and were never mapped
+ * writable are cached, and they come back marked validated: the
+ * compressor doesn't keep the page's cs bits, and a slid page can't be
+ * checked against the file's signatures again.
+ *
+ * Lock ordering is the slid object, then its cache object.  The ring and
+ * the cache's count are protected by the cache object's lock.
+ */
+int		vm_slid_page_cache_enabled = 1;
+unsigned int	vm_slid_page_cache_max = 8192;	/* pages per cache, resident or compressed */
+unsigned int	vm_slid_page_cache_count = 0;	/* pages in all caches */
+unsigned int	vm_slid_page_cache_inserts = 0;
+unsigned int	vm_slid_page_cache_hits = 0;
+unsigned int	vm_slid_page_cache_decompressions = 0;	/* hits that came from the compressor */
+unsigned int	vm_slid_page_cache_evictions = 0;
+
+/* trimming a full cache stops just under 7/8 of the ring */
+#define VM_SLID_PAGE_CACHE_TRIM_TARGET(si)	\
+	((si)->slide_cache_ring_size - (si)->slide_cache_ring_size / 8 - 1)
+
+/*
+ * Thread call: evict the oldest pages of a full cache.
+ */
+static void
+vm_shared_region_slid_cache_trim(
+	thread_call_param_t	param0,
+	__unused thread_call_param_t param1)
+{
+	vm_shared_region_slide_info_t	si;
+	vm_object_t			cache;
+	vm_object_offset_t		cache_offset;
+	vm_page_t			m;
+	uint32_t			index, scan;
+
+	si = (vm_shared_region_slide_info_t) param0;
+	cache = si->slide_cache_object;
+
+	vm_object_lock(cache);
+
+	/* each entry is looked at once at most: busy pages go to the back */
+	for (scan = si->slide_cache_ring_count;
+	     scan > 0 && si->slide_cache_ring_count > VM_SLID_PAGE_CACHE_TRIM_TARGET(si);
+	     scan--) {
+		index = si->slide_cache_ring[si->slide_cache_ring_first];
+		si->slide_cache_ring_first = (si->slide_cache_ring_first + 1) % si->slide_cache_ring_size;
+		si->slide_cache_ring_count--;
+		cache_offset = ptoa_64(index);
+
+		m = vm_page_lookup(cache, cache_offset);
+		if (m != VM_PAGE_NULL) {
+			if (m->busy || m->cleaning || m->laundry ||
+			    VM_PAGE_WIRED(m) ||
+			    m->vm_page_q_state == VM_PAGE_ON_PAGEOUT_Q) {
+				/* on its way to the compressor: look again later */
+				si->slide_cache_ring[(si->slide_cache_ring_first +
+						      si->slide_cache_ring_count) %
+						     si->slide_cache_ring_size] = index;
+				si->slide_cache_ring_count++;
+				continue;
+			}
+			VM_PAGE_FREE(m);
+		} else if (VM_COMPRESSOR_PAGER_STATE_GET(cache, cache_offset) ==
+			   VM_EXTERNAL_STATE_EXISTS) {
+			VM_COMPRESSOR_PAGER_STATE_CLR(cache, cache_offset);
+		} else {
+			/* already taken back by a fault */
+			continue;
+		}
+		assert(si->slide_cache_count > 0);
+		si->slide_cache_count--;
+		OSAddAtomic(-1, &vm_slid_page_cache_count);
+		OSAddAtomic(1, &vm_slid_page_cache_evictions);
+	}
+
+	vm_object_unlock(cache);
+}
+
+/*
+ * Release the cache of a slide info that is being torn down, and take
+ * its pages out of the global count.
+ */
+static void
+vm_shared_region_slid_cache_destroy(
+	vm_shared_region_slide_info_t	si)
+{
+	if (si->slide_cache_object == VM_OBJECT_NULL)
+		return;
+
+	thread_call_cancel_wait(si->slide_cache_trim_call);
+	thread_call_free(si->slide_cache_trim_call);
+	si->slide_cache_trim_call = NULL;
+
+	OSAddAtomic(-(SInt32) si->slide_cache_count, &vm_slid_page_cache_count);
+	si->slide_cache_count = 0;
+
+	vm_object_deallocate(si->slide_cache_object);
+	si->slide_cache_object = VM_OBJECT_NULL;
+
+	kfree(si->slide_cache_ring, si->slide_cache_ring_size * sizeof (si->slide_cache_ring[0]));
+	si->slide_cache_ring = NULL;
+	si->slide_cache_ring_size = 0;
+	si->slide_cache_ring_first = 0;
+	si->slide_cache_ring_count = 0;
+}
+
+/*
+ * Called from vm_pageout_scan() with the page queues and the page's
+ * object locked, for a clean slid page that has been taken off the
+ * paging queues and disconnected.  Returns TRUE if the page now belongs
+ * to the cache, in which case the caller must not free it.
+ */
+boolean_t
+vm_shared_region_slid_cache_insert(
+	vm_page_t	m)
+{
+	vm_shared_region_slide_info_t	si;
+	vm_object_t			object, cache;
+	vm_object_offset_t		cache_offset;
+
+	object = VM_PAGE_OBJECT(m);
+
+	LCK_MTX_ASSERT(&vm_page_queue_lock, LCK_MTX_ASSERT_OWNED);
+	vm_object_lock_assert_exclusive(object);
+
+	if (!vm_slid_page_cache_enabled ||
+	    !m->slid ||
+	    !object->object_slid ||
+	    (si = object->vo_slide_info) == NULL ||
+	    (cache = si->slide_cache_object) == VM_OBJECT_NULL)
+		return FALSE;
+
+	/*
+	 * the page comes back from the cache already validated (see
+	 * vm_shared_region_slid_cache_lookup), and a slid page can't be
+	 * validated again, so only take pages whose validation holds
+	 */
+	if (!m->cs_validated || m->cs_tainted || m->wpmapped)
+		return FALSE;
+
+	assert(m->vm_page_q_state == VM_PAGE_NOT_ON_Q);
+	assert(!m->busy && !m->cleaning && !m->laundry);
+	assert(m->offset >= si->start && m->offset < si->end);
+	cache_offset = m->offset - si->start;
+
+	/* the page queues lock is held: can't wait for the cache object */
+	if (!vm_object_lock_try(cache))
+		return FALSE;
+
+	if (si->slide_cache_ring_count >= si->slide_cache_ring_size) {
+		/* full: the trim thread call is on its way */
+		vm_object_unlock(cache);
+		return FALSE;
+	}
+	if (!cache->alive || cache->terminating ||
+	    vm_page_lookup(cache, cache_offset) != VM_PAGE_NULL ||
+	    VM_COMPRESSOR_PAGER_STATE_GET(cache, cache_offset) == VM_EXTERNAL_STATE_EXISTS) {
+		vm_object_unlock(cache);
+		return FALSE;
+	}
+
+	vm_page_remove(m, TRUE);
+	vm_page_insert_internal(m, cache, cache_offset, VM_KERN_MEMORY_NONE,
+				TRUE, TRUE, FALSE, FALSE, NULL);
+
+	/* an internal page: dirty, so that it gets compressed, not dropped */
+	m->slid = FALSE;
+	SET_PAGE_DIRTY(m, FALSE);
+	vm_page_deactivate_internal(m, FALSE);
+
+	si->slide_cache_ring[(si->slide_cache_ring_first + si->slide_cache_ring_count) %
+			     si->slide_cache_ring_size] = (uint32_t) atop_64(cache_offset);
+	si->slide_cache_ring_count++;
+	if (si->slide_cache_ring_count == si->slide_cache_ring_size)
+		thread_call_enter(si->slide_cache_trim_call);
+
+	si->slide_cache_count++;
+	OSAddAtomic(1, &vm_slid_page_cache_count);
+	OSAddAtomic(1, &vm_slid_page_cache_inserts);
+	vm_object_unlock(cache);
+
+	return TRUE;
+}
+
+/*
+ * Called from vm_fault_page() with "object" locked for a non-resident
+ * page of a slid object.  If the slid contents for "offset" are in the
+ * cache, they are put back in "object" at "offset" and TRUE is returned;
+ * the caller must look the page up again, since "object" may have been
+ * unlocked in the meantime.
+ */
+boolean_t
+vm_shared_region_slid_cache_lookup(
+	vm_object_t		object,
+	vm_object_offset_t	offset)
+{
+	vm_shared_region_slide_info_t	si;
+	vm_object_t			cache;
+	vm_object_offset_t		cache_offset;
+	vm_page_t			m;
+	int				my_fault_type;
+	int				compressed_count_delta;
+	kern_return_t			kr;
+
+	vm_object_lock_assert_exclusive(object);
+
+	if (!object->object_slid ||
+	    (si = object->vo_slide_info) == NULL ||
+	    (cache = si->slide_cache_object) == VM_OBJECT_NULL ||
+	    offset < si->start || offset >= si->end)
+		return FALSE;
+	cache_offset = offset - si->start;
+
+	vm_object_lock(cache);
+
+	m = vm_page_lookup(cache, cache_offset);
+	if (m != VM_PAGE_NULL) {
+		if (m->busy || m->cleaning || m->laundry || m->absent ||
+		    m->error || VM_PAGE_WIRED(m) ||
+		    m->vm_page_q_state == VM_PAGE_ON_PAGEOUT_Q) {
+			/* on its way to the compressor: read it from the file */
+			vm_object_unlock(cache);
+			return FALSE;
+		}
+		vm_page_lockspin_queues();
+		vm_page_queues_remove(m, FALSE);
+		vm_page_unlock_queues();
+
+		vm_page_rename(m, object, offset, FALSE);
+	} else {
+		if (VM_COMPRESSOR_PAGER_STATE_GET(cache, cache_offset) !=
+		    VM_EXTERNAL_STATE_EXISTS) {
+			vm_object_unlock(cache);
+			return FALSE;
+		}
+		m = vm_page_grab();
+		if (m == VM_PAGE_NULL) {
+			vm_object_unlock(cache);
+			return FALSE;
+		}
+		/* busy: keeps other faults on this offset waiting for us */
+		vm_page_insert(m, object, offset);
+
+		vm_object_paging_begin(cache);
+		vm_object_unlock(cache);
+		vm_object_unlock(object);
+
+		kr = vm_compressor_pager_get(cache->pager,
+					     cache_offset + cache->paging_offset,
+					     VM_PAGE_GET_PHYS_PAGE(m),
+					     &my_fault_type,
+					     0,
+					     &compressed_count_delta);
+
+		vm_object_lock(object);
+		vm_object_lock(cache);
+		vm_compressor_pager_count(cache->pager,
+					  compressed_count_delta,
+					  FALSE, /* shared_lock */
+					  cache);
+		vm_object_paging_end(cache);
+
+		if (kr != KERN_SUCCESS) {
+			vm_object_unlock(cache);
+			VM_PAGE_FREE(m);
+			return FALSE;
+		}
+		OSAddAtomic(1, &vm_slid_page_cache_decompressions);
+	}
+
+	/*
+	 * same state vm_page_slide() leaves a page in, plus the validation
+	 * it had when it was cached: a page that came through the compressor
+	 * lost it, and vm_page_validate_cs() can't redo it on slid contents
+	 */
+	m->dirty = FALSE;
+	pmap_clear_refmod(VM_PAGE_GET_PHYS_PAGE(m), VM_MEM_MODIFIED | VM_MEM_REFERENCED);
+	m->slid = TRUE;
+	m->cs_validated = TRUE;
+	m->cs_tainted = FALSE;
+
+	vm_page_lockspin_queues();
+	vm_page_activate(m);
+	vm_page_unlock_queues();
+
+	if (m->busy)
+		PAGE_WAKEUP_DONE(m);
+
+	assert(si->slide_cache_count > 0);
+	si->slide_cache_count--;
+	OSAddAtomic(-1, &vm_slid_page_cache_count);
+	OSAddAtomic(1, &vm_slid_page_cache_hits);
+	vm_object_unlock(cache);
+
+	return TRUE;
+}
+
 /******************************************************************************/
 /* Comm page support                                                          */
 /******************************************************************************/
@@ -151,6 +151,13 @@ struct vm_shared_region_slide_info {
 	vm_object_t		slide_object;
 	mach_vm_size_t		slide_info_size;
 	vm_shared_region_slide_info_entry_t	slide_info_entry;
+	vm_object_t		slide_cache_object;	/* evicted slid pages, by offset from "start" */
+	uint32_t		*slide_cache_ring;	/* cache page indices, oldest first */
+	uint32_t		slide_cache_ring_size;
+	uint32_t		slide_cache_ring_first;
+	uint32_t		slide_cache_ring_count;
+	uint32_t		slide_cache_count;	/* pages in the cache, resident or compressed */
+	thread_call_t		slide_cache_trim_call;
 };
 
 /* address space shared region descriptor */
@@ -178,6 +185,9 @@ extern kern_return_t vm_shared_region_slide_page(vm_shared_region_slide_info_t s
 	vm_offset_t	vaddr, 
 	uint32_t pageIndex);
 extern vm_shared_region_slide_info_t vm_shared_region_get_slide_info(vm_shared_region_t sr);
+extern boolean_t vm_shared_region_slid_cache_insert(vm_page_t m);
+extern boolean_t vm_shared_region_slid_cache_lookup(vm_object_t object,
+	vm_object_offset_t offset);
 #else  /* !MACH_KERNEL_PRIVATE */
 
 struct vm_shared_region;
@@ -49,6 +49,17 @@ def WaitqTableElemValid(e):
 def WaitqTableElemRefcnt(e):
     return (e.wqte.lt_bits & 0x1fffffff)
 
+def LinkTableUsedElems(table):
+    """ Sum the per-shard used element counts of a link table
+    """
+    if not hasattr(table, 'free'):
+        return int(table.used_elem)
+    used = 0
+    nshards = sizeof(table.free) / sizeof(table.free[0])
+    for i in range(nshards):
+        used += int(table.free[i].nused)
+    return used
+
 def WaitqTableIdxFromId(id):
     if hasattr(kern.globals, 'g_lt_idx_max'):
         idx = id & unsigned(kern.globals.g_lt_idx_max)
@@ -577,8 +588,8 @@ def ShowAllSetidLinks(cmd_args=None, cmd_options={}):
     nused = nwqs + nlink + nrsvd
     nfound = nused + nfree + ninv
     print "\n\nFound {:d} objects: {:d} WQS, {:d} LINK, {:d} RSVD, {:d} FREE".format(nfound, nwqs, nlink, nrsvd, nfree)
-    if (opt_type_filt == "" and opt_valid_only == 0) and (nused != table.used_elem):
-        print"\tWARNING: inconsistent state! Table reports {:d}/{:d} used elem, found {:d}/{:d}".format(table.used_elem, nelem, nused, nfound)
+    if (opt_type_filt == "" and opt_valid_only == 0) and (nused != LinkTableUsedElems(table)):
+        print"\tWARNING: inconsistent state! Table reports {:d}/{:d} used elem, found {:d}/{:d}".format(LinkTableUsedElems(table), nelem, nused, nfound)
     if len(bt_summary) > 0:
         print "Link allocation BT (frame={:d})".format(opt_bt_idx)
     for k,v in bt_summary.iteritems():
@@ -702,8 +713,8 @@ def ShowAllPreposts(cmd_args=None, cmd_options={}):
     nused = nwq + npost + nrsvd
     nfound = nused + nfree + ninv
     print "\nFound {:d} objects: {:d} WQ, {:d} POST, {:d} RSVD, {:d} FREE".format(nfound, nwq, npost, nrsvd, nfree)
-    if (opt_type_filt == "" and opt_valid_only == 0) and (nused != table.used_elem):
-        print"\tWARNING: inconsistent state! Table reports {:d}/{:d} used elem, found {:d}/{:d}".format(table.used_elem, nelem, nused, nfound)
+    if (opt_type_filt == "" and opt_valid_only == 0) and (nused != LinkTableUsedElems(table)):
+        print"\tWARNING: inconsistent state! Table reports {:d}/{:d} used elem, found {:d}/{:d}".format(LinkTableUsedElems(table), nelem, nused, nfound)
     if len(bt_summary) > 0:
         print "Link allocation BT (frame={:d})".format(opt_bt_idx)
     for k,v in bt_summary.iteritems():
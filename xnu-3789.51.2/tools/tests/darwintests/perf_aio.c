@@ -0,0 +1,167 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <aio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/event.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.kern.perf.aio"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Batches of 4K reads at random offsets of a cached file, issued with
+ * aio_read() or lio_listio() and reaped with aio_suspend() or EVFILT_AIO.
+ * The file is in the buffer cache, so this measures the AIO engine itself:
+ * queueing, worker wakeups and completion delivery.
+ */
+
+#define FILE_SIZE	(16 * 1024 * 1024)
+#define IO_SIZE		4096
+#define MAX_DEPTH	AIO_LISTIO_MAX
+
+static const int depths[] = { 1, 2, 4, 8, MAX_DEPTH };
+
+static char tmpfile[PATH_MAX];
+static int fd;
+static char bufs[MAX_DEPTH][IO_SIZE];
+static struct aiocb cbs[MAX_DEPTH];
+
+static void
+prepare_batch(int depth)
+{
+	int i;
+
+	for (i = 0; i < depth; i++) {
+		memset(&cbs[i], 0, sizeof(cbs[i]));
+		cbs[i].aio_fildes = fd;
+		cbs[i].aio_buf = bufs[i];
+		cbs[i].aio_nbytes = IO_SIZE;
+		cbs[i].aio_offset = (off_t)(arc4random_uniform(FILE_SIZE / IO_SIZE)) * IO_SIZE;
+		cbs[i].aio_lio_opcode = LIO_READ;
+	}
+}
+
+static void
+reap_batch(int depth)
+{
+	int i;
+
+	for (i = 0; i < depth; i++) {
+		T_QUIET; T_ASSERT_EQ(aio_return(&cbs[i]), (ssize_t)IO_SIZE, "aio_return");
+		T_QUIET; T_ASSERT_TRUE(perf_file_check(bufs[i], cbs[i].aio_offset, IO_SIZE),
+		    "aio read data");
+	}
+}
+
+static void
+suspend_batch(int depth)
+{
+	const struct aiocb *list[MAX_DEPTH];
+	int i;
+
+	for (i = 0; i < depth; i++) {
+		list[i] = &cbs[i];
+		while (aio_error(&cbs[i]) == EINPROGRESS) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(aio_suspend(&list[i], 1, NULL), "aio_suspend");
+		}
+	}
+}
+
+static void
+kevent_batch(int kq, int depth)
+{
+	struct kevent kev;
+	int done = 0;
+
+	while (done < depth) {
+		T_QUIET; T_ASSERT_EQ(kevent(kq, NULL, 0, &kev, 1, NULL), 1, "kevent");
+		done += (int)kev.data;
+	}
+	T_QUIET; T_ASSERT_EQ(done, depth, "EVFILT_AIO completions");
+}
+
+T_DECL(aio_read_depth, "aio_read() and aio_suspend() throughput against queue depth")
+{
+	unsigned int d;
+	int i;
+
+	fd = perf_file_create("perf_aio", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		int depth = depths[d];
+
+		dt_stat_time_t s = dt_stat_time_create("aio_read depth=%d", depth);
+		while (!dt_stat_stable(s)) {
+			prepare_batch(depth);
+			T_STAT_MEASURE(s) {
+				for (i = 0; i < depth; i++) {
+					T_QUIET; T_ASSERT_POSIX_SUCCESS(aio_read(&cbs[i]), "aio_read");
+				}
+				suspend_batch(depth);
+			}
+			reap_batch(depth);
+		}
+		dt_stat_finalize(s);
+	}
+
+	perf_file_remove(fd, tmpfile);
+}
+
+T_DECL(lio_listio_kevent_depth, "lio_listio() and EVFILT_AIO throughput against queue depth")
+{
+	struct aiocb *list[MAX_DEPTH];
+	struct kevent kev;
+	uint64_t steals, batches;
+	size_t len = sizeof(steals);
+	unsigned int d;
+	int kq, i;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	EV_SET(&kev, 0, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) != 0) {
+		T_SKIP("EVFILT_AIO not supported");
+	}
+
+	fd = perf_file_create("perf_aio", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		int depth = depths[d];
+
+		for (i = 0; i < depth; i++)
+			list[i] = &cbs[i];
+
+		dt_stat_time_t s = dt_stat_time_create("lio_listio+kevent depth=%d", depth);
+		while (!dt_stat_stable(s)) {
+			prepare_batch(depth);
+			T_STAT_MEASURE(s) {
+				T_QUIET; T_ASSERT_POSIX_SUCCESS(lio_listio(LIO_NOWAIT, list, depth, NULL),
+				    "lio_listio");
+				kevent_batch(kq, depth);
+			}
+			reap_batch(depth);
+		}
+		dt_stat_finalize(s);
+	}
+
+	perf_file_remove(fd, tmpfile);
+	close(kq);
+
+	if (sysctlbyname("kern.aio_steals", &steals, &len, NULL, 0) == 0 &&
+	    sysctlbyname("kern.aio_lio_batches", &batches, &len, NULL, 0) == 0) {
+		T_LOG("aio steals %llu lio batches %llu", steals, batches);
+	}
+}
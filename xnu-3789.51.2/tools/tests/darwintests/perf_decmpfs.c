@@ -0,0 +1,194 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vfs.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Cold "launch" of a large transparently compressed file: drop its pages,
+ * then fault all of it in through a mapping the way dyld touches a large
+ * binary, or read() it end to end.  Large pageins and reads are split
+ * across the decmpfs worker pool unless vfs.decmpfs.parallel_min is 0.
+ */
+
+#define FILE_SIZE	(64 * 1024 * 1024)
+
+extern char **environ;
+
+static char srcfile[PATH_MAX];
+static char cmpfile[PATH_MAX];
+
+static void
+setup_file(void)
+{
+	int fd;
+	pid_t pid;
+	int status;
+	struct stat st;
+	char *args[] = { "/usr/bin/ditto", "--hfsCompression", srcfile, cmpfile, NULL };
+
+	/* offsets compress, but not so well that the decompressor has nothing to do */
+	fd = perf_file_create("perf_decmpfs_src", FILE_SIZE, srcfile, sizeof(srcfile));
+
+	snprintf(cmpfile, sizeof(cmpfile), "%s.cmp", srcfile);
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn(&pid, args[0], NULL, NULL, args, environ), "posix_spawn ditto");
+	T_QUIET; T_ASSERT_EQ(waitpid(pid, &status, 0), pid, "waitpid");
+	perf_file_remove(fd, srcfile);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    stat(cmpfile, &st) != 0 || (st.st_flags & UF_COMPRESSED) == 0) {
+		unlink(cmpfile);
+		T_SKIP("could not create a compressed file in /private/tmp");
+	}
+}
+
+static void
+evict(int fd)
+{
+	void *addr;
+
+	addr = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	T_QUIET; T_ASSERT_NE(addr, MAP_FAILED, "mmap");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(msync(addr, FILE_SIZE, MS_INVALIDATE), "msync");
+	munmap(addr, FILE_SIZE);
+}
+
+static void
+fault_in(int fd)
+{
+	volatile char *addr;
+	char sum = 0;
+	size_t off;
+
+	addr = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+	for (off = 0; off < FILE_SIZE; off += (size_t)getpagesize()) {
+		sum += addr[off];
+	}
+	munmap((void *)addr, FILE_SIZE);
+	(void)sum;
+}
+
+static void
+read_in(int fd)
+{
+	static char buf[1024 * 1024];
+	off_t off;
+
+	for (off = 0; off < FILE_SIZE; off += (off_t)sizeof(buf)) {
+		T_QUIET; T_ASSERT_EQ(pread(fd, buf, sizeof(buf), off), (ssize_t)sizeof(buf), "pread");
+	}
+}
+
+/*
+ * A cold fault in and a cold read both have to decompress the source data.
+ */
+static void
+check_file(int fd)
+{
+	static char buf[1024 * 1024];
+	char *addr;
+	off_t off;
+
+	evict(fd);
+	addr = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+	T_QUIET; T_ASSERT_TRUE(perf_file_check(addr, 0, FILE_SIZE), "faulted in data");
+	munmap(addr, FILE_SIZE);
+
+	evict(fd);
+	for (off = 0; off < FILE_SIZE; off += (off_t)sizeof(buf)) {
+		T_QUIET; T_ASSERT_EQ(pread(fd, buf, sizeof(buf), off), (ssize_t)sizeof(buf), "pread");
+		T_QUIET; T_ASSERT_TRUE(perf_file_check(buf, off, sizeof(buf)), "read data");
+	}
+}
+
+static void
+run_launch_test(const char *label)
+{
+	int fd;
+
+	fd = open(cmpfile, O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open");
+
+	dt_stat_time_t s = dt_stat_time_create("%s cold fault in", label);
+	while (!dt_stat_stable(s)) {
+		evict(fd);
+		T_STAT_MEASURE(s) {
+			fault_in(fd);
+		}
+	}
+	dt_stat_finalize(s);
+
+	s = dt_stat_time_create("%s cold read", label);
+	while (!dt_stat_stable(s)) {
+		evict(fd);
+		T_STAT_MEASURE(s) {
+			read_in(fd);
+		}
+	}
+	dt_stat_finalize(s);
+
+	check_file(fd);
+	close(fd);
+}
+
+static int
+set_parallel_min(int min)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vfs.decmpfs.parallel_min", &old, &len, &min, sizeof(min)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(decmpfs_cold_launch, "cold fault in and read of a large compressed file",
+    T_META_ASROOT(true))
+{
+	uint64_t fetches, pieces, fetches_before = 0;
+	size_t len = sizeof(fetches);
+	int old;
+
+	setup_file();
+
+	if ((old = set_parallel_min(0)) < 0) {
+		T_LOG("vfs.decmpfs not available, measuring default decompression only");
+		run_launch_test("default");
+	} else {
+		run_launch_test("inline");
+
+		set_parallel_min(old);
+		sysctlbyname("vfs.decmpfs.parallel_fetches", &fetches_before, &len, NULL, 0);
+		run_launch_test("parallel");
+
+		if (sysctlbyname("vfs.decmpfs.parallel_fetches", &fetches, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vfs.decmpfs.parallel_pieces", &pieces, &len, NULL, 0) == 0) {
+			T_LOG("decmpfs parallel fetches %llu pieces %llu", fetches, pieces);
+			if (old > 0) {
+				T_EXPECT_GT(fetches, fetches_before, "large fetches used the worker pool");
+			}
+		}
+	}
+
+	unlink(cmpfile);
+}
@@ -0,0 +1,157 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Touch every page of a mapped file whose pages are all resident, the way
+ * a warm launch walks a large binary: in order, or in random order within
+ * 256KB chunks.  With fault-around each fault also maps the resident
+ * neighbours, so most touches don't fault at all; vm.fault_around_self
+ * set to 0 gives the one-page-per-fault baseline.
+ */
+
+#define FILE_SIZE	(64 * 1024 * 1024)
+#define CHUNK_SIZE	(256 * 1024)
+
+static char tmpfile[PATH_MAX];
+static int file_fd;
+
+static long
+touch_file(int random_order)
+{
+	static size_t order[CHUNK_SIZE / 4096];
+	volatile char *addr;
+	struct rusage before, after;
+	size_t pgsz = (size_t)getpagesize();
+	size_t npages = CHUNK_SIZE / pgsz;
+	size_t off, i, j, t;
+	char sum = 0;
+
+	for (i = 0; i < npages; i++) {
+		order[i] = i;
+	}
+	addr = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, file_fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+
+	getrusage(RUSAGE_SELF, &before);
+	for (off = 0; off < FILE_SIZE; off += CHUNK_SIZE) {
+		if (random_order) {
+			for (i = npages - 1; i > 0; i--) {
+				j = arc4random_uniform((uint32_t)(i + 1));
+				t = order[i];
+				order[i] = order[j];
+				order[j] = t;
+			}
+		}
+		for (i = 0; i < npages; i++) {
+			sum += addr[off + order[i] * pgsz];
+		}
+	}
+	getrusage(RUSAGE_SELF, &after);
+
+	munmap((void *)addr, FILE_SIZE);
+	(void)sum;
+
+	return after.ru_minflt - before.ru_minflt;
+}
+
+/*
+ * Every page mapped by a fault, and every neighbour mapped with it, has to
+ * show the file data at its own offset.
+ */
+static void
+check_mapping(void)
+{
+	char *addr;
+
+	addr = mmap(NULL, FILE_SIZE, PROT_READ, MAP_SHARED, file_fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+	T_QUIET; T_ASSERT_TRUE(perf_file_check(addr, 0, FILE_SIZE), "mapped file data");
+	munmap(addr, FILE_SIZE);
+}
+
+static void
+run_touch_test(const char *label)
+{
+	static const char *patterns[] = { "sequential", "launch" };
+	long faults;
+	int p;
+
+	/* make sure everything is resident before measuring */
+	touch_file(0);
+
+	for (p = 0; p < 2; p++) {
+		dt_stat_time_t s = dt_stat_time_create("%s %s touch", label, patterns[p]);
+		faults = 0;
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				faults = touch_file(p);
+			}
+		}
+		dt_stat_finalize(s);
+
+		T_LOG("%s %s touch: %ld minor faults for %d pages", label, patterns[p],
+		    faults, FILE_SIZE / getpagesize());
+	}
+
+	check_mapping();
+}
+
+static int
+set_fault_around(int pages)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.fault_around_self", &old, &len, &pages, sizeof(pages)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(fault_around, "warm fault in of a large mapped file")
+{
+	unsigned int faults, mapped, mapped_before = 0;
+	size_t len = sizeof(faults);
+	int old;
+
+	file_fd = perf_file_create("perf_fault_around", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	if ((old = set_fault_around(0)) < 0) {
+		T_LOG("vm.fault_around_self not available, measuring default faults only");
+		run_touch_test("default");
+	} else {
+		run_touch_test("single page");
+
+		set_fault_around(old);
+		sysctlbyname("vm.fault_around_mapped", &mapped_before, &len, NULL, 0);
+		run_touch_test("fault-around");
+
+		if (sysctlbyname("vm.fault_around_faults", &faults, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.fault_around_mapped", &mapped, &len, NULL, 0) == 0) {
+			T_LOG("fault-around faults %u pages mapped %u", faults, mapped);
+			if (old > 0) {
+				T_EXPECT_GT(mapped, mapped_before, "faults mapped resident neighbours");
+			}
+		}
+	}
+
+	perf_file_remove(file_fd, tmpfile);
+}
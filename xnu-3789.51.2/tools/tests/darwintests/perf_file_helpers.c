@@ -0,0 +1,71 @@
+#include "perf_file_helpers.h"
+
+#include <darwintest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PERF_FILE_CHUNK	(1024 * 1024)
+
+int
+perf_file_create(const char *name, size_t size, char *path, size_t pathlen)
+{
+	static uint64_t chunk[PERF_FILE_CHUNK / sizeof(uint64_t)];
+	size_t off, len;
+	int fd;
+
+	snprintf(path, pathlen, "/private/tmp/%s.XXXXXX", name);
+	fd = mkstemp(path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "mkstemp");
+
+	for (off = 0; off < size; off += len) {
+		len = size - off < sizeof(chunk) ? size - off : sizeof(chunk);
+		perf_file_fill(chunk, (off_t)off, len);
+		T_QUIET; T_ASSERT_EQ(write(fd, chunk, len), (ssize_t)len, "write");
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fsync(fd), "fsync");
+
+	return fd;
+}
+
+void
+perf_file_fill(void *buf, off_t off, size_t len)
+{
+	char *bytes = buf;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(word)) {
+		word = (uint64_t)off + i;
+		memcpy(bytes + i, &word, sizeof(word));
+	}
+}
+
+bool
+perf_file_check(const void *buf, off_t off, size_t len)
+{
+	const char *bytes = buf;
+	uint64_t word;
+	size_t i;
+
+	/* buf may be a mapping or a socket buffer of any alignment */
+	for (i = 0; i < len; i += sizeof(word)) {
+		memcpy(&word, bytes + i, sizeof(word));
+		if (word != (uint64_t)off + i) {
+			T_LOG("word at offset %llu holds %llu", (uint64_t)off + i, word);
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+perf_file_remove(int fd, const char *path)
+{
+	if (fd >= 0) {
+		close(fd);
+	}
+	unlink(path);
+}
@@ -0,0 +1,18 @@
+#ifndef PERF_FILE_HELPERS_H
+#define PERF_FILE_HELPERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Every 8-byte word of a file made by perf_file_create() holds its own
+ * offset, so a buffer read back from anywhere in the file can be checked
+ * with perf_file_check().  Offsets and lengths must be multiples of 8.
+ */
+int perf_file_create(const char *name, size_t size, char *path, size_t pathlen);
+void perf_file_fill(void *buf, off_t off, size_t len);
+bool perf_file_check(const void *buf, off_t off, size_t len);
+void perf_file_remove(int fd, const char *path);
+
+#endif /* !defined(PERF_FILE_HELPERS_H) */
@@ -0,0 +1,232 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/fsevents.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vfs.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Build-tree style file churn: create, rewrite, chmod and delete files in
+ * a small directory while a /dev/fsevents watcher drains events.  Repeated
+ * events for a path that the watcher hasn't read yet are coalesced unless
+ * vfs.fsevents.coalesce_window_ms is 0.
+ */
+
+#define NFILES		256
+#define NOPS		20000
+#define READ_SIZE	(64 * 1024)
+
+static char tmpdir[PATH_MAX];
+
+struct watch_stats {
+	int		fd;
+	volatile int	done;
+	uint64_t	events;
+	uint64_t	dropped;
+	uint64_t	reads;
+};
+
+static int
+watch_open(void)
+{
+	int8_t events[FSE_MAX_EVENTS];
+	fsevent_clone_args args;
+	int devfd, fd = -1;
+
+	devfd = open("/dev/fsevents", O_RDONLY);
+	if (devfd < 0) {
+		return -1;
+	}
+
+	memset(events, FSE_REPORT, sizeof(events));
+	memset(&args, 0, sizeof(args));
+	args.event_list = events;
+	args.num_events = FSE_MAX_EVENTS;
+	args.event_queue_depth = 4096;
+	args.fd = &fd;
+	if (ioctl(devfd, FSEVENTS_CLONE, &args) != 0) {
+		fd = -1;
+	}
+	close(devfd);
+
+	return fd;
+}
+
+/*
+ * Count the events in a buffer returned by read().
+ */
+static void
+count_events(struct watch_stats *ws, const char *buf, ssize_t len)
+{
+	ssize_t off = 0;
+	int32_t type;
+	uint16_t argtype, arglen;
+
+	while (off + (ssize_t)(2 * sizeof(int32_t)) <= len) {
+		memcpy(&type, buf + off, sizeof(type));
+		off += 2 * sizeof(int32_t);	/* type and pid */
+		if (type == FSE_EVENTS_DROPPED) {
+			ws->dropped++;
+		} else {
+			ws->events++;
+		}
+		while (off + (ssize_t)sizeof(argtype) <= len) {
+			memcpy(&argtype, buf + off, sizeof(argtype));
+			off += sizeof(argtype);
+			if (argtype == FSE_ARG_DONE) {
+				break;
+			}
+			memcpy(&arglen, buf + off, sizeof(arglen));
+			off += sizeof(arglen) + arglen;
+		}
+	}
+}
+
+static void *
+watcher(void *arg)
+{
+	struct watch_stats *ws = arg;
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(READ_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+
+	for (;;) {
+		struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+		fd_set rfds;
+
+		FD_ZERO(&rfds);
+		FD_SET(ws->fd, &rfds);
+		if (select(ws->fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
+			if (ws->done) {
+				break;
+			}
+			continue;
+		}
+		n = read(ws->fd, buf, READ_SIZE);
+		if (n <= 0) {
+			break;
+		}
+		ws->reads++;
+		count_events(ws, buf, n);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void
+churn(void)
+{
+	static char data[4096];
+	char path[PATH_MAX];
+	int i, fd;
+
+	for (i = 0; i < NOPS; i++) {
+		snprintf(path, sizeof(path), "%s/f%d.o", tmpdir, i % NFILES);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open");
+		T_QUIET; T_ASSERT_EQ(write(fd, data, sizeof(data)), (ssize_t)sizeof(data), "write");
+		close(fd);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(chmod(path, (i & 1) ? 0644 : 0755), "chmod");
+		if ((i % 7) == 0) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink");
+		}
+	}
+}
+
+static void
+run_churn_test(const char *label)
+{
+	struct watch_stats ws;
+	pthread_t thread;
+
+	memset(&ws, 0, sizeof(ws));
+	ws.fd = watch_open();
+	if (ws.fd < 0) {
+		T_SKIP("could not clone /dev/fsevents");
+	}
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, watcher, &ws), "pthread_create");
+
+	dt_stat_time_t s = dt_stat_time_create("%s file churn ops=%d", label, NOPS);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			churn();
+		}
+	}
+	dt_stat_finalize(s);
+
+	ws.done = 1;
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+	close(ws.fd);
+
+	T_LOG("%s: %llu events in %llu reads (%.1f per read), %llu dropped notices", label,
+	    ws.events, ws.reads, ws.reads ? (double)ws.events / ws.reads : 0.0, ws.dropped);
+}
+
+static int
+set_coalesce_window(int ms)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vfs.fsevents.coalesce_window_ms", &old, &len, &ms, sizeof(ms)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(fsevents_churn, "file churn with a /dev/fsevents watcher draining events",
+    T_META_ASROOT(true))
+{
+	uint64_t coalesced, dropped, delivered, batches;
+	size_t len = sizeof(coalesced);
+	int old;
+
+	strlcpy(tmpdir, "/private/tmp/perf_fsevents.XXXXXX", sizeof(tmpdir));
+	T_QUIET; T_ASSERT_NOTNULL(mkdtemp(tmpdir), "mkdtemp");
+
+	if ((old = set_coalesce_window(0)) < 0) {
+		T_LOG("vfs.fsevents not available, measuring default delivery only");
+		run_churn_test("default");
+	} else {
+		run_churn_test("uncoalesced");
+
+		set_coalesce_window(old);
+		run_churn_test("coalesced");
+
+		if (sysctlbyname("vfs.fsevents.coalesced", &coalesced, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vfs.fsevents.dropped", &dropped, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vfs.fsevents.delivered", &delivered, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vfs.fsevents.batches", &batches, &len, NULL, 0) == 0) {
+			T_LOG("fsevents coalesced %llu dropped %llu delivered %llu batches %llu",
+			    coalesced, dropped, delivered, batches);
+		}
+	}
+
+	for (int i = 0; i < NFILES; i++) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/f%d.o", tmpdir, i);
+		unlink(path);
+	}
+	rmdir(tmpdir);
+}
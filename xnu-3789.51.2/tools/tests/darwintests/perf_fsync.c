@@ -0,0 +1,132 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vfs.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Dirty a number of 4K pages at random offsets of a large file, then time
+ * the fsync() that writes them back.  Small counts stay in the write
+ * behind clusters; larger ones spill into the sparse dirty map.
+ */
+
+#define FILE_SIZE	(256 * 1024 * 1024)
+#define PAGE_BYTES	4096
+
+static const int dirty_counts[] = { 16, 256, 4096, 16384 };
+
+static char tmpfile[PATH_MAX];
+static int fd;
+
+static void
+dirty_pages(int count)
+{
+	static char page[PAGE_BYTES];
+	int i;
+
+	/* rewrite what is already there, so the file can be checked at the end */
+	for (i = 0; i < count; i++) {
+		off_t off = (off_t)(arc4random_uniform(FILE_SIZE / PAGE_BYTES)) * PAGE_BYTES;
+
+		perf_file_fill(page, off, sizeof(page));
+		T_QUIET; T_ASSERT_EQ(pwrite(fd, page, sizeof(page), off), (ssize_t)sizeof(page), "pwrite");
+	}
+}
+
+static void
+run_fsync_test(const char *label)
+{
+	unsigned int d;
+
+	for (d = 0; d < sizeof(dirty_counts) / sizeof(dirty_counts[0]); d++) {
+		dt_stat_time_t s = dt_stat_time_create("%s fsync dirty=%d", label, dirty_counts[d]);
+
+		while (!dt_stat_stable(s)) {
+			dirty_pages(dirty_counts[d]);
+			T_STAT_MEASURE(s) {
+				T_QUIET; T_ASSERT_POSIX_SUCCESS(fsync(fd), "fsync");
+			}
+		}
+		dt_stat_finalize(s);
+	}
+}
+
+/*
+ * Read the file back without the buffer cache, so what is checked is what
+ * write back put on disk.
+ */
+static void
+check_file(void)
+{
+	static char chunk[1024 * 1024];
+	off_t off;
+	int rfd;
+
+	rfd = open(tmpfile, O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rfd, "open");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fcntl(rfd, F_NOCACHE, 1), "F_NOCACHE");
+	for (off = 0; off < FILE_SIZE; off += (off_t)sizeof(chunk)) {
+		T_QUIET; T_ASSERT_EQ(pread(rfd, chunk, sizeof(chunk), off), (ssize_t)sizeof(chunk), "pread");
+		T_QUIET; T_ASSERT_TRUE(perf_file_check(chunk, off, sizeof(chunk)), "file data");
+	}
+	close(rfd);
+}
+
+static int
+set_push_depth(int depth)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("kern.writeback.depth", &old, &len, &depth, sizeof(depth)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(random_write_fsync, "fsync() latency after scattered random writes",
+    T_META_ASROOT(true))
+{
+	uint64_t batches_before = 0, batches, extents, coalesced;
+	size_t len = sizeof(batches);
+	int old;
+
+	fd = perf_file_create("perf_fsync", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	if ((old = set_push_depth(0)) < 0) {
+		T_LOG("kern.writeback not available, measuring default write back only");
+		run_fsync_test("default");
+	} else {
+		run_fsync_test("unbatched");
+
+		set_push_depth(old);
+		sysctlbyname("kern.writeback.batches", &batches_before, &len, NULL, 0);
+		run_fsync_test("batched");
+
+		if (sysctlbyname("kern.writeback.batches", &batches, &len, NULL, 0) == 0 &&
+		    sysctlbyname("kern.writeback.extents", &extents, &len, NULL, 0) == 0 &&
+		    sysctlbyname("kern.writeback.coalesced", &coalesced, &len, NULL, 0) == 0) {
+			T_LOG("write back batches %llu extents %llu coalesced %llu",
+			    batches, extents, coalesced);
+			if (old > 0) {
+				T_EXPECT_GT(batches, batches_before, "fsync pushed batched write back");
+			}
+		}
+	}
+
+	check_file();
+	perf_file_remove(fd, tmpfile);
+}
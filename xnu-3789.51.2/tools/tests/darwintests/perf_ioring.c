@@ -0,0 +1,309 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/event.h>
+#include <sys/ioring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.kern.perf.ioring"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Batches of 4K reads and writes at random offsets of a cached file,
+ * issued one pread()/pwrite() at a time or queued on an I/O ring and
+ * submitted with a single ioring_enter().  The file is in the buffer
+ * cache, so this measures system call and completion overhead.
+ */
+
+#define FILE_SIZE	(16 * 1024 * 1024)
+#define IO_SIZE		4096
+#define RING_ENTRIES	64
+#define OPS_PER_RUN	(64 * 1024)
+
+static const uint32_t depths[] = { 1, 4, 16, RING_ENTRIES };
+
+static char tmpfile[PATH_MAX];
+static int fd;
+static char bufs[RING_ENTRIES][IO_SIZE];
+static off_t offs[RING_ENTRIES];
+
+static int ring_fd;
+static struct ioring_ring_hdr *sq;
+static struct ioring_ring_hdr *cq;
+static struct ioring_sqe *sqes;
+static struct ioring_cqe *cqes;
+
+static void
+setup_ring(void)
+{
+#ifdef SYS_ioring_setup
+	struct ioring_params params;
+
+	sq = mmap(NULL, IORING_SQ_RING_SIZE(RING_ENTRIES), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)sq, MAP_FAILED, "mmap sq");
+	cq = mmap(NULL, IORING_CQ_RING_SIZE(RING_ENTRIES), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)cq, MAP_FAILED, "mmap cq");
+	sqes = (struct ioring_sqe *)(sq + 1);
+	cqes = (struct ioring_cqe *)(cq + 1);
+
+	memset(&params, 0, sizeof(params));
+	params.sq_entries = RING_ENTRIES;
+	params.cq_entries = RING_ENTRIES;
+	params.sq_ring = (uint64_t)(uintptr_t)sq;
+	params.cq_ring = (uint64_t)(uintptr_t)cq;
+	ring_fd = syscall(SYS_ioring_setup, &params);
+	if (ring_fd < 0 && errno == ENOSYS) {
+		T_SKIP("ioring_setup not supported");
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ring_fd, "ioring_setup");
+#else
+	T_SKIP("ioring_setup not available in this SDK");
+#endif
+}
+
+static void
+cleanup_ring(void)
+{
+	close(ring_fd);
+	munmap(sq, IORING_SQ_RING_SIZE(RING_ENTRIES));
+	munmap(cq, IORING_CQ_RING_SIZE(RING_ENTRIES));
+}
+
+static int
+ring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+#ifdef SYS_ioring_enter
+	return syscall(SYS_ioring_enter, ring_fd, to_submit, min_complete, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static off_t
+random_offset(void)
+{
+	return (off_t)(arc4random_uniform(FILE_SIZE / IO_SIZE)) * IO_SIZE;
+}
+
+static void
+classic_batch(uint8_t opcode, uint32_t depth)
+{
+	uint32_t i;
+
+	for (i = 0; i < depth; i++) {
+		offs[i] = random_offset();
+		if (opcode == IORING_OP_READ) {
+			T_QUIET; T_ASSERT_EQ(pread(fd, bufs[i], IO_SIZE, offs[i]),
+			    (ssize_t)IO_SIZE, "pread");
+		} else {
+			perf_file_fill(bufs[i], offs[i], IO_SIZE);
+			T_QUIET; T_ASSERT_EQ(pwrite(fd, bufs[i], IO_SIZE, offs[i]),
+			    (ssize_t)IO_SIZE, "pwrite");
+		}
+	}
+}
+
+static void
+queue_batch(uint8_t opcode, uint32_t depth)
+{
+	uint32_t tail = sq->tail, i;
+
+	for (i = 0; i < depth; i++, tail++) {
+		struct ioring_sqe *sqe = &sqes[tail & (RING_ENTRIES - 1)];
+
+		offs[i] = random_offset();
+		if (opcode == IORING_OP_WRITE)
+			perf_file_fill(bufs[i], offs[i], IO_SIZE);
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->off = offs[i];
+		sqe->addr = (uint64_t)(uintptr_t)bufs[i];
+		sqe->len = IO_SIZE;
+		sqe->user_data = i;
+	}
+	__atomic_store_n(&sq->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void
+reap_batch(uint32_t depth)
+{
+	uint32_t head = cq->head, tail, i;
+
+	tail = __atomic_load_n(&cq->tail, __ATOMIC_ACQUIRE);
+	T_QUIET; T_ASSERT_GE(tail - head, depth, "completions available");
+	for (i = 0; i < depth; i++, head++) {
+		T_QUIET; T_ASSERT_EQ(cqes[head & (RING_ENTRIES - 1)].res, (int64_t)IO_SIZE, "cqe res");
+	}
+	__atomic_store_n(&cq->head, head, __ATOMIC_RELEASE);
+}
+
+static void
+ring_batch(uint8_t opcode, uint32_t depth)
+{
+	queue_batch(opcode, depth);
+	T_QUIET; T_ASSERT_EQ(ring_enter(depth, depth, IORING_ENTER_GETEVENTS), (int)depth,
+	    "ioring_enter");
+	reap_batch(depth);
+}
+
+static void
+ring_kevent_batch(int kq, uint8_t opcode, uint32_t depth)
+{
+	struct kevent kev;
+	uint32_t done = 0;
+
+	queue_batch(opcode, depth);
+	T_QUIET; T_ASSERT_EQ(ring_enter(depth, 0, 0), (int)depth, "ioring_enter");
+	while (done < depth) {
+		T_QUIET; T_ASSERT_EQ(kevent(kq, NULL, 0, &kev, 1, NULL), 1, "kevent");
+		done += (uint32_t)kev.data;
+	}
+	reap_batch(depth);
+}
+
+/*
+ * The buffers of the last read batch hold what the file has at their offsets.
+ */
+static void
+check_reads(uint32_t depth)
+{
+	uint32_t i;
+
+	for (i = 0; i < depth; i++) {
+		T_QUIET; T_ASSERT_TRUE(perf_file_check(bufs[i], offs[i], IO_SIZE), "read data");
+	}
+}
+
+/*
+ * Writes only ever store what was already there, so any write that landed
+ * at the wrong offset shows up here.
+ */
+static void
+check_file(void)
+{
+	static char chunk[1024 * 1024];
+	off_t off;
+
+	for (off = 0; off < FILE_SIZE; off += (off_t)sizeof(chunk)) {
+		T_QUIET; T_ASSERT_EQ(pread(fd, chunk, sizeof(chunk), off), (ssize_t)sizeof(chunk), "pread");
+		T_QUIET; T_ASSERT_TRUE(perf_file_check(chunk, off, sizeof(chunk)), "file data");
+	}
+}
+
+static double
+ops_per_sec(uint64_t start, uint64_t end, uint64_t ops)
+{
+	mach_timebase_info_data_t tb;
+
+	mach_timebase_info(&tb);
+	return (double)ops * 1e9 / ((double)(end - start) * tb.numer / tb.denom);
+}
+
+static void
+run_depths(const char *label, uint8_t opcode, int kq)
+{
+	unsigned int d;
+
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		uint32_t depth = depths[d];
+		uint64_t start, end, ops;
+
+		dt_stat_time_t s = dt_stat_time_create("%s %s batch depth=%u", label,
+		    opcode == IORING_OP_READ ? "read" : "write", depth);
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				if (kq >= 0)
+					ring_kevent_batch(kq, opcode, depth);
+				else if (ring_fd >= 0)
+					ring_batch(opcode, depth);
+				else
+					classic_batch(opcode, depth);
+			}
+			if (opcode == IORING_OP_READ)
+				check_reads(depth);
+		}
+		dt_stat_finalize(s);
+
+		start = mach_absolute_time();
+		for (ops = 0; ops < OPS_PER_RUN; ops += depth) {
+			if (kq >= 0)
+				ring_kevent_batch(kq, opcode, depth);
+			else if (ring_fd >= 0)
+				ring_batch(opcode, depth);
+			else
+				classic_batch(opcode, depth);
+		}
+		end = mach_absolute_time();
+		T_LOG("%s %s depth=%u: %.0f ops/sec", label,
+		    opcode == IORING_OP_READ ? "read" : "write", depth,
+		    ops_per_sec(start, end, ops));
+	}
+}
+
+T_DECL(ioring_vs_classic, "pread()/pwrite() against I/O ring batches")
+{
+	uint64_t sqes_before = 0, sqes_done, batches;
+	size_t len = sizeof(sqes_done);
+
+	fd = perf_file_create("perf_ioring", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	ring_fd = -1;
+	run_depths("classic", IORING_OP_READ, -1);
+	run_depths("classic", IORING_OP_WRITE, -1);
+
+	setup_ring();
+	sysctlbyname("kern.ioring_sqes", &sqes_before, &len, NULL, 0);
+	run_depths("ioring", IORING_OP_READ, -1);
+	run_depths("ioring", IORING_OP_WRITE, -1);
+	cleanup_ring();
+	check_file();
+
+	perf_file_remove(fd, tmpfile);
+
+	if (sysctlbyname("kern.ioring_sqes", &sqes_done, &len, NULL, 0) == 0 &&
+	    sysctlbyname("kern.ioring_batches", &batches, &len, NULL, 0) == 0) {
+		T_LOG("ioring sqes %llu batches %llu", sqes_done, batches);
+		T_EXPECT_GT(sqes_done, sqes_before, "ring workers ran the submissions");
+	}
+}
+
+T_DECL(ioring_kevent, "I/O ring batches reaped through EVFILT_READ")
+{
+	struct kevent kev;
+	int kq;
+
+	setup_ring();
+	fd = perf_file_create("perf_ioring", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	EV_SET(&kev, ring_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kevent(kq, &kev, 1, NULL, 0, NULL), "kevent add");
+
+	run_depths("ioring+kevent", IORING_OP_READ, kq);
+
+	close(kq);
+	cleanup_ring();
+	perf_file_remove(fd, tmpfile);
+}
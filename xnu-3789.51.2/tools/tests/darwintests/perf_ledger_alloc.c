@@ -0,0 +1,110 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.kern.perf.ledger"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Faulting in and freeing anonymous memory credits and debits the task's
+ * memory ledgers (internal, page_table, phys_footprint, ...) on every page.
+ * With many threads of one task doing it at once, every update lands on the
+ * same task ledger entries.
+ */
+
+#define ALLOC_PAGES	16
+
+static atomic_bool done;
+
+static void
+alloc_touch_free(void)
+{
+	size_t size = ALLOC_PAGES * (size_t)getpagesize();
+	volatile char *p;
+	size_t off;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)p, MAP_FAILED, "mmap");
+	for (off = 0; off < size; off += (size_t)getpagesize())
+		p[off] = 1;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(munmap((void *)p, size), "munmap");
+}
+
+static void *
+alloc_thread(void *arg)
+{
+	(void)arg;
+	while (!atomic_load_explicit(&done, memory_order_relaxed))
+		alloc_touch_free();
+	return NULL;
+}
+
+static void
+run_alloc_test(int nthreads, const char *label)
+{
+	pthread_t threads[64];
+	int i;
+
+	atomic_store(&done, false);
+	for (i = 0; i < nthreads - 1; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    alloc_thread, NULL), "pthread_create");
+	}
+
+	dt_stat_time_t s = dt_stat_time_create("%s alloc+touch+free pages=%d threads=%d",
+	    label, ALLOC_PAGES, nthreads);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			alloc_touch_free();
+		}
+	}
+	dt_stat_finalize(s);
+
+	atomic_store(&done, true);
+	for (i = 0; i < nthreads - 1; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void
+run_alloc_tests(const char *label)
+{
+	int ncpu, nthreads;
+	size_t len = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0), "hw.ncpu");
+	if (ncpu > 64)
+		ncpu = 64;
+
+	for (nthreads = 1; nthreads <= ncpu; nthreads *= 2)
+		run_alloc_test(nthreads, label);
+}
+
+T_DECL(ledger_alloc_threads, "anonymous memory churn from many threads of one task")
+{
+	run_alloc_tests("batched");
+}
+
+T_DECL(ledger_alloc_threads_direct, "anonymous memory churn with ledger batching disabled",
+    T_META_ASROOT(true))
+{
+	int enable, off = 0;
+	size_t len = sizeof(enable);
+
+	if (sysctlbyname("kern.ledger_defer", &enable, &len, &off, sizeof(off)) != 0) {
+		T_SKIP("kern.ledger_defer not available");
+	}
+
+	run_alloc_tests("direct");
+
+	sysctlbyname("kern.ledger_defer", NULL, NULL, &enable, sizeof(enable));
+}
@@ -0,0 +1,142 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <mach/mach.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+#define OOL_MAX_DESCRIPTORS	64
+
+typedef struct {
+	mach_msg_header_t		header;
+	mach_msg_body_t			body;
+	mach_msg_ool_descriptor_t	ool[OOL_MAX_DESCRIPTORS];
+} ool_send_msg_t;
+
+typedef struct {
+	mach_msg_header_t		header;
+	mach_msg_body_t			body;
+	mach_msg_ool_descriptor_t	ool[OOL_MAX_DESCRIPTORS];
+	mach_msg_trailer_t		trailer;
+} ool_rcv_msg_t;
+
+static void
+ool_send_receive(mach_port_t port, char *buf, size_t size, int count,
+    mach_msg_copy_options_t copy_option)
+{
+	ool_send_msg_t smsg;
+	ool_rcv_msg_t rmsg;
+	kern_return_t kr;
+	int i;
+
+	memset(&smsg, 0, sizeof(smsg));
+	smsg.header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MAKE_SEND, 0) |
+	    MACH_MSGH_BITS_COMPLEX;
+	smsg.header.msgh_size = (mach_msg_size_t)(sizeof(mach_msg_header_t) +
+	    sizeof(mach_msg_body_t) +
+	    (size_t)count * sizeof(mach_msg_ool_descriptor_t));
+	smsg.header.msgh_remote_port = port;
+	smsg.body.msgh_descriptor_count = (mach_msg_size_t)count;
+	for (i = 0; i < count; i++) {
+		smsg.ool[i].address = buf + (size_t)i * size;
+		smsg.ool[i].size = (mach_msg_size_t)size;
+		smsg.ool[i].deallocate = FALSE;
+		smsg.ool[i].copy = copy_option;
+		smsg.ool[i].type = MACH_MSG_OOL_DESCRIPTOR;
+	}
+
+	kr = mach_msg(&smsg.header, MACH_SEND_MSG, smsg.header.msgh_size, 0,
+	    MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_msg send");
+
+	kr = mach_msg(&rmsg.header, MACH_RCV_MSG, 0, sizeof(rmsg), port,
+	    MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_msg receive");
+
+	for (i = 0; i < count; i++) {
+		T_QUIET; T_ASSERT_EQ(rmsg.ool[i].size, (mach_msg_size_t)size,
+		    "received OOL size");
+		kr = vm_deallocate(mach_task_self(),
+		    (vm_address_t)rmsg.ool[i].address, rmsg.ool[i].size);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "vm_deallocate");
+	}
+}
+
+static void
+run_ool_test(mach_msg_copy_options_t copy_option, const char *label)
+{
+	static const size_t sizes[] = { 64, 1024, 4096, 8192, 16384, 65536, 1 << 20 };
+	static const int counts[] = { 1, 4, 16, 64 };
+	mach_port_t port;
+	kern_return_t kr;
+	unsigned int si, ci;
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+
+	for (si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+		for (ci = 0; ci < sizeof(counts) / sizeof(counts[0]); ci++) {
+			size_t size = sizes[si];
+			int count = counts[ci];
+			char *buf;
+
+			if (size * (size_t)count > (64 << 20))
+				continue;
+
+			buf = malloc(size * (size_t)count);
+			T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+			memset(buf, 'a', size * (size_t)count);
+
+			dt_stat_time_t s = dt_stat_time_create("%s size=%zu count=%d",
+			    label, size, count);
+			while (!dt_stat_stable(s)) {
+				T_STAT_MEASURE(s) {
+					ool_send_receive(port, buf, size, count, copy_option);
+				}
+			}
+			dt_stat_finalize(s);
+			free(buf);
+		}
+	}
+
+	mach_port_destroy(mach_task_self(), port);
+}
+
+T_DECL(mach_msg_ool_virtual, "OOL descriptor send/receive latency, virtual copy")
+{
+	run_ool_test(MACH_MSG_VIRTUAL_COPY, "virtual");
+}
+
+T_DECL(mach_msg_ool_physical, "OOL descriptor send/receive latency, physical copy")
+{
+	run_ool_test(MACH_MSG_PHYSICAL_COPY, "physical");
+}
+
+T_DECL(mach_msg_ool_fixed_threshold, "OOL latency with the adaptive copy threshold disabled",
+    T_META_ASROOT(true))
+{
+	int adaptive, off = 0;
+	uint64_t threshold;
+	size_t len = sizeof(adaptive);
+
+	if (sysctlbyname("kern.ipc_ool_adaptive", &adaptive, &len, &off, sizeof(off)) != 0) {
+		T_SKIP("kern.ipc_ool_adaptive not available");
+	}
+	len = sizeof(threshold);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.ipc_ool_copy_threshold",
+	    &threshold, &len, NULL, 0), "kern.ipc_ool_copy_threshold");
+	T_LOG("copy threshold %llu bytes", threshold);
+
+	run_ool_test(MACH_MSG_VIRTUAL_COPY, "virtual-fixed");
+
+	sysctlbyname("kern.ipc_ool_adaptive", NULL, NULL, &adaptive, sizeof(adaptive));
+}
@@ -0,0 +1,197 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Reclaim rate when the page cache is full of mapped file pages: one
+ * thread per cpu zero fills anonymous memory while a large file stays
+ * mapped, so every page they get has to be stolen from the file first.
+ * vm_pageout_scan hands those pages to vm.pageout_reclaim_threads reclaim
+ * threads; the test steps that from 0 (the scan does it all itself) up
+ * to the number of reclaim threads the kernel started.
+ */
+
+#define FILE_FRACTION	2	/* file: 1/2 of memory */
+#define ANON_FRACTION	2	/* zero filled per pass: 1/2 of memory */
+
+static char tmpfile[PATH_MAX];
+static int file_fd;
+static size_t file_size;
+static size_t anon_size;
+static int nthreads;
+static pthread_barrier_t start_barrier;
+
+static void
+setup_file(void)
+{
+	uint64_t memsize;
+	size_t len = sizeof(memsize);
+	size_t mask = (size_t)getpagesize() - 1;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.memsize", &memsize, &len, NULL, 0), "hw.memsize");
+	len = sizeof(nthreads);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &nthreads, &len, NULL, 0), "hw.ncpu");
+
+	file_size = (size_t)(memsize / FILE_FRACTION) & ~mask;
+	anon_size = (size_t)(memsize / ANON_FRACTION / (uint64_t)nthreads) & ~mask;
+
+	file_fd = perf_file_create("perf_pageout_reclaim", file_size, tmpfile, sizeof(tmpfile));
+}
+
+static void
+fill_page_cache(volatile char *addr)
+{
+	size_t off;
+	char sum = 0;
+
+	for (off = 0; off < file_size; off += (size_t)getpagesize()) {
+		sum += addr[off];
+	}
+	(void)sum;
+}
+
+static void *
+zfod_thread(void *arg)
+{
+	size_t pgsz = (size_t)getpagesize();
+	volatile char *addr;
+	size_t off;
+
+	(void)arg;
+	pthread_barrier_wait(&start_barrier);
+
+	addr = mmap(NULL, anon_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+	for (off = 0; off < anon_size; off += pgsz) {
+		addr[off] = 1;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(munmap((void *)addr, anon_size), "munmap");
+	return NULL;
+}
+
+static double
+run_pass(volatile char *file_addr)
+{
+	pthread_t threads[nthreads];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	int i;
+
+	fill_page_cache(file_addr);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1),
+	    "pthread_barrier_init");
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, zfod_thread, NULL),
+		    "pthread_create");
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+	pthread_barrier_destroy(&start_barrier);
+
+	mach_timebase_info(&tb);
+	return (double)nthreads * anon_size / (1024 * 1024) * 1e9 /
+	    ((double)(end - start) * tb.numer / tb.denom);
+}
+
+static void
+run_reclaim_test(const char *label, int reclaim_threads)
+{
+	volatile char *file_addr;
+	double mb_per_sec = 0;
+
+	file_addr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, file_fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)file_addr, MAP_FAILED, "mmap");
+
+	dt_stat_time_t s = dt_stat_time_create("%s reclaim threads=%d", label, reclaim_threads);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			mb_per_sec = run_pass(file_addr);
+		}
+	}
+	dt_stat_finalize(s);
+
+	T_LOG("%s reclaim threads=%d: %.0f MB/sec zero filled", label, reclaim_threads, mb_per_sec);
+
+	/* file pages stolen by the reclaim threads read back intact */
+	T_QUIET; T_ASSERT_TRUE(perf_file_check((const void *)file_addr, 0, file_size), "file data");
+
+	munmap((void *)file_addr, file_size);
+}
+
+static int
+set_reclaim_threads(int count)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.pageout_reclaim_threads", &old, &len, &count, sizeof(count)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(pageout_reclaim, "reclaim rate across pageout reclaim thread counts",
+    T_META_ASROOT(true))
+{
+	unsigned int handoffs, freed, backed_up, freed_before = 0;
+	size_t len = sizeof(handoffs);
+	int old, max, count;
+
+	setup_file();
+
+	if ((old = set_reclaim_threads(0)) < 0) {
+		T_LOG("vm.pageout_reclaim_threads not available, measuring default reclaim only");
+		run_reclaim_test("default", 0);
+	} else {
+		len = sizeof(max);
+		if (sysctlbyname("vm.pageout_reclaim_thread_count", &max, &len, NULL, 0) != 0)
+			max = old;
+
+		/* 0, 1, 2, 4 ... reclaim threads, finishing with all of them */
+		len = sizeof(freed_before);
+		sysctlbyname("vm.pageout_reclaim_freed", &freed_before, &len, NULL, 0);
+
+		for (count = 0; ; count = (count * 2 < max) ? (count ? count * 2 : 1) : max) {
+			set_reclaim_threads(count);
+			run_reclaim_test(count ? "parallel" : "scan only", count);
+			if (count >= max)
+				break;
+		}
+		set_reclaim_threads(old);
+
+		len = sizeof(handoffs);
+		if (sysctlbyname("vm.pageout_reclaim_handoffs", &handoffs, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.pageout_reclaim_freed", &freed, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.pageout_reclaim_backed_up", &backed_up, &len, NULL, 0) == 0) {
+			T_LOG("reclaim handoffs %u freed %u backed up %u", handoffs, freed, backed_up);
+			if (max > 0) {
+				T_EXPECT_GT(freed, freed_before, "reclaim threads freed pages");
+			}
+		}
+	}
+
+	perf_file_remove(file_fd, tmpfile);
+}
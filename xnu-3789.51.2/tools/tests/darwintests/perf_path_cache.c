@@ -0,0 +1,350 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vfs.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * stat() of a file deep in a directory tree, the way build systems and
+ * language runtimes resolve the same long paths over and over.  Every
+ * component is resolved from the name cache.  /tmp is a symlink, so the
+ * tree lives under /private/tmp to keep the walk to a single pass.
+ */
+
+#define MAX_DEPTH	12
+
+static char tmpdir[PATH_MAX];
+static char leaf[PATH_MAX];
+
+static void
+make_tree(int depth)
+{
+	char path[PATH_MAX];
+	int i, fd;
+
+	strlcpy(tmpdir, "/private/tmp/perf_path_cache.XXXXXX", sizeof(tmpdir));
+	T_QUIET; T_ASSERT_NOTNULL(mkdtemp(tmpdir), "mkdtemp");
+
+	strlcpy(path, tmpdir, sizeof(path));
+	for (i = 0; i < depth; i++) {
+		strlcat(path, "/node_modules", sizeof(path));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(path, 0755), "mkdir");
+	}
+	snprintf(leaf, sizeof(leaf), "%s/index.js", path);
+	fd = open(leaf, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open");
+	close(fd);
+}
+
+static void
+remove_tree(int depth)
+{
+	char path[PATH_MAX];
+	int i, j;
+
+	unlink(leaf);
+	for (i = depth; i > 0; i--) {
+		strlcpy(path, tmpdir, sizeof(path));
+		for (j = 0; j < i; j++)
+			strlcat(path, "/node_modules", sizeof(path));
+		rmdir(path);
+	}
+	rmdir(tmpdir);
+}
+
+static void
+run_stat_test(const char *label)
+{
+	static const int depths[] = { 1, 4, 8, MAX_DEPTH };
+	unsigned int d;
+
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		struct stat sb;
+
+		make_tree(depths[d]);
+
+		dt_stat_time_t s = dt_stat_time_create("%s stat depth=%d", label, depths[d]);
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				T_QUIET; T_ASSERT_POSIX_SUCCESS(stat(leaf, &sb), "stat");
+			}
+		}
+		dt_stat_finalize(s);
+
+		remove_tree(depths[d]);
+	}
+}
+
+static int
+set_path_cache(int enable)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vfs.pathcache.enable", &old, &len, &enable, sizeof(enable)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(path_cache_stat, "stat() of deep paths with and without the whole path cache",
+    T_META_ASROOT(true))
+{
+	int old, hitrate;
+	size_t len = sizeof(hitrate);
+
+	if ((old = set_path_cache(0)) < 0) {
+		T_SKIP("vfs.pathcache not available");
+	}
+	run_stat_test("walk");
+
+	set_path_cache(1);
+	run_stat_test("pathcache");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vfs.pathcache.hitrate",
+	    &hitrate, &len, NULL, 0), "vfs.pathcache.hitrate");
+	T_LOG("path cache hit rate %d%%", hitrate);
+
+	set_path_cache(old);
+}
+
+/*
+ * Behavior: a cached path must never outlive what a real walk would
+ * find or allow.  These run the lookups as "nobody", since root passes
+ * every search permission check and wouldn't notice a stale grant.
+ */
+
+#define REPEAT_LOOKUPS	8	/* enough to enter the path and hit it */
+
+static uid_t test_uid;
+static gid_t test_gid;
+
+static int
+enable_for_behavior(void)
+{
+	struct passwd *pw;
+	int old;
+
+	if ((old = set_path_cache(1)) < 0) {
+		T_SKIP("vfs.pathcache not available");
+	}
+	pw = getpwnam("nobody");
+	T_QUIET; T_ASSERT_NOTNULL(pw, "getpwnam(nobody)");
+	test_uid = pw->pw_uid;
+	test_gid = pw->pw_gid;
+	return old;
+}
+
+static void
+become_user(void)
+{
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setegid(test_gid), "setegid");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(seteuid(test_uid), "seteuid");
+}
+
+static void
+become_root(void)
+{
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(seteuid(0), "seteuid(0)");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setegid(0), "setegid(0)");
+}
+
+/* a directory under "base" that the test user owns */
+static void
+make_user_dir(const char *base, char *dir, size_t len)
+{
+	snprintf(dir, len, "%s/perf_path_cache.XXXXXX", base);
+	T_QUIET; T_ASSERT_NOTNULL(mkdtemp(dir), "mkdtemp");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(chown(dir, test_uid, test_gid), "chown");
+}
+
+static void
+make_file(const char *path, size_t size)
+{
+	char buf[64] = { 0 };
+	int fd;
+
+	fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+	T_QUIET; T_ASSERT_EQ(write(fd, buf, size), (ssize_t)size, "write");
+	close(fd);
+}
+
+static void
+stat_repeatedly(const char *path, struct stat *sb)
+{
+	int i;
+
+	for (i = 0; i < REPEAT_LOOKUPS; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(stat(path, sb), "stat %s", path);
+	}
+}
+
+static void
+expect_stat_error(const char *path, int expected, const char *why)
+{
+	struct stat sb;
+	int i;
+
+	/* more than once: the first miss could re-enter a stale path */
+	for (i = 0; i < REPEAT_LOOKUPS; i++) {
+		if (stat(path, &sb) == 0 || errno != expected) {
+			T_FAIL("%s: stat %s attempt %d: errno %d, expected %d",
+			    why, path, i, errno, expected);
+			return;
+		}
+	}
+	T_PASS("%s", why);
+}
+
+/* search permission taken away after the path was cached */
+static void
+run_chmod_test(const char *base)
+{
+	char dir[PATH_MAX], mid[PATH_MAX], file[PATH_MAX];
+	struct stat sb;
+
+	make_user_dir(base, dir, sizeof(dir));
+	become_user();
+
+	snprintf(mid, sizeof(mid), "%s/a", dir);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(mid, 0755), "mkdir");
+	snprintf(file, sizeof(file), "%s/a/b", dir);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(file, 0755), "mkdir");
+	strlcat(file, "/file", sizeof(file));
+	make_file(file, 0);
+
+	stat_repeatedly(file, &sb);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(chmod(mid, 0644), "chmod a-x");
+	expect_stat_error(file, EACCES, "search permission removed after caching is enforced");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(chmod(mid, 0755), "chmod a+x");
+	T_EXPECT_POSIX_SUCCESS(stat(file, &sb), "search permission restored");
+
+	unlink(file);
+	*strrchr(file, '/') = '\0';
+	rmdir(file);
+	rmdir(mid);
+	become_root();
+	rmdir(dir);
+}
+
+T_DECL(path_cache_chmod, "path cache honors search permission removed by chmod",
+    T_META_ASROOT(true))
+{
+	int old = enable_for_behavior();
+
+	run_chmod_test("/private/tmp");
+	set_path_cache(old);
+}
+
+/*
+ * Same, on a filesystem whose rights cache has a TTL or whose
+ * authorization is opaque (NFS, SMB).  Such walks are never entered in
+ * the path cache, so access has to follow the server's answer.  Point
+ * PATH_CACHE_TTL_DIR at a writable directory on such a mount.
+ */
+T_DECL(path_cache_chmod_ttl, "path cache honors chmod on a TTL rights cache mount",
+    T_META_ASROOT(true))
+{
+	const char *base = getenv("PATH_CACHE_TTL_DIR");
+	int old;
+
+	if (base == NULL) {
+		T_SKIP("set PATH_CACHE_TTL_DIR to a directory on a TTL'd (network) mount");
+	}
+	old = enable_for_behavior();
+	run_chmod_test(base);
+	set_path_cache(old);
+}
+
+T_DECL(path_cache_rename, "cached paths are invalidated by rename",
+    T_META_ASROOT(true))
+{
+	char dir[PATH_MAX], a[PATH_MAX], a2[PATH_MAX], file[PATH_MAX], file2[PATH_MAX];
+	struct stat sb, sb2;
+	int old = enable_for_behavior();
+
+	make_user_dir("/private/tmp", dir, sizeof(dir));
+	become_user();
+
+	snprintf(a, sizeof(a), "%s/a", dir);
+	snprintf(a2, sizeof(a2), "%s/a2", dir);
+	snprintf(file, sizeof(file), "%s/a/file", dir);
+	snprintf(file2, sizeof(file2), "%s/a/file2", dir);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(a, 0755), "mkdir");
+	make_file(file, 1);
+
+	/* rename of the file itself */
+	stat_repeatedly(file, &sb);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rename(file, file2), "rename file");
+	expect_stat_error(file, ENOENT, "renamed file is gone from its old path");
+	T_EXPECT_POSIX_SUCCESS(stat(file2, &sb2), "renamed file found at its new path");
+	T_EXPECT_EQ(sb2.st_ino, sb.st_ino, "same file");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rename(file2, file), "rename file back");
+
+	/* rename of a directory above it, then a new directory in its place */
+	stat_repeatedly(file, &sb);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rename(a, a2), "rename dir");
+	expect_stat_error(file, ENOENT, "path through a renamed directory is gone");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(a, 0755), "mkdir");
+	make_file(file, 2);
+	T_EXPECT_POSIX_SUCCESS(stat(file, &sb2), "stat of the replacement");
+	T_EXPECT_EQ(sb2.st_size, (off_t)2, "path resolves to the replacement, not the renamed file");
+
+	unlink(file);
+	rmdir(a);
+	snprintf(file, sizeof(file), "%s/a2/file", dir);
+	unlink(file);
+	rmdir(a2);
+	become_root();
+	rmdir(dir);
+	set_path_cache(old);
+}
+
+T_DECL(path_cache_unlink, "cached paths are invalidated by unlink",
+    T_META_ASROOT(true))
+{
+	char dir[PATH_MAX], a[PATH_MAX], file[PATH_MAX];
+	struct stat sb;
+	int old = enable_for_behavior();
+
+	make_user_dir("/private/tmp", dir, sizeof(dir));
+	become_user();
+
+	snprintf(a, sizeof(a), "%s/a", dir);
+	snprintf(file, sizeof(file), "%s/a/file", dir);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(a, 0755), "mkdir");
+	make_file(file, 1);
+
+	stat_repeatedly(file, &sb);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(file), "unlink");
+	expect_stat_error(file, ENOENT, "unlinked file is gone");
+
+	make_file(file, 2);
+	T_EXPECT_POSIX_SUCCESS(stat(file, &sb), "stat of the recreated file");
+	T_EXPECT_EQ(sb.st_size, (off_t)2, "path resolves to the recreated file");
+
+	unlink(file);
+	rmdir(a);
+	become_root();
+	rmdir(dir);
+	set_path_cache(old);
+}
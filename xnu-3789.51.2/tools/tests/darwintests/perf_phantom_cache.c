@@ -0,0 +1,164 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Repeated passes over a file that doesn't quite fit in the memory left
+ * over by a large anonymous working set, so the file cache keeps evicting
+ * pages that the next pass reads back in.  The refault distances of those
+ * pages let the pageout daemon grow the inactive queue, which keeps more
+ * of the file resident; vm.phantom_cache_adapt_inactive set to 0 keeps
+ * the fixed inactive target.
+ */
+
+#define HOG_FRACTION	4	/* anonymous memory: 3/4 of memory */
+#define FILE_FRACTION	8	/* file: 1/8 of memory */
+
+static char tmpfile[PATH_MAX];
+static int file_fd;
+static size_t file_size;
+static volatile char *hog;
+static size_t hog_size;
+
+static void
+setup(void)
+{
+	uint64_t memsize;
+	size_t len = sizeof(memsize);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.memsize", &memsize, &len, NULL, 0), "hw.memsize");
+	file_size = (size_t)(memsize / FILE_FRACTION) & ~((size_t)getpagesize() - 1);
+	hog_size = (size_t)(memsize / HOG_FRACTION * (HOG_FRACTION - 1));
+
+	file_fd = perf_file_create("perf_phantom_cache", file_size, tmpfile, sizeof(tmpfile));
+
+	hog = mmap(NULL, hog_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)hog, MAP_FAILED, "mmap");
+}
+
+static void
+file_pass(void)
+{
+	size_t pgsz = (size_t)getpagesize();
+	volatile char *addr;
+	size_t off;
+	char sum = 0;
+
+	addr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, file_fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+	for (off = 0; off < file_size; off += pgsz) {
+		sum += addr[off];
+	}
+	munmap((void *)addr, file_size);
+
+	/* keep the anonymous working set active too */
+	for (off = 0; off < hog_size; off += pgsz) {
+		hog[off] = sum;
+	}
+}
+
+/*
+ * Pages that were evicted and read back in have to hold the file data.
+ */
+static void
+check_file(void)
+{
+	char *addr;
+
+	addr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, file_fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+	T_QUIET; T_ASSERT_TRUE(perf_file_check(addr, 0, file_size), "file data");
+	munmap(addr, file_size);
+}
+
+static uint64_t
+refaults(void)
+{
+	uint64_t histogram[8], total = 0;
+	size_t len = sizeof(histogram);
+	int i;
+
+	if (sysctlbyname("vm.phantom_cache_refault_histogram", histogram, &len, NULL, 0) != 0)
+		return 0;
+	for (i = 0; i < 8; i++) {
+		total += histogram[i];
+	}
+	return total;
+}
+
+static void
+run_pass_test(const char *label)
+{
+	dt_stat_time_t s = dt_stat_time_create("%s file pass", label);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			file_pass();
+		}
+	}
+	dt_stat_finalize(s);
+}
+
+static int
+set_adapt(int enable)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.phantom_cache_adapt_inactive", &old, &len, &enable, sizeof(enable)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(phantom_cache_refault, "repeated passes over a file under memory pressure",
+    T_META_ASROOT(true))
+{
+	uint64_t histogram[8];
+	size_t len = sizeof(histogram);
+	uint64_t refaults_before;
+	int boost, old, i;
+
+	setup();
+	refaults_before = refaults();
+
+	if ((old = set_adapt(0)) < 0) {
+		T_LOG("vm.phantom_cache_adapt_inactive not available, measuring default target only");
+		run_pass_test("default");
+	} else {
+		run_pass_test("fixed inactive target");
+
+		set_adapt(old);
+		run_pass_test("adaptive inactive target");
+
+		if (sysctlbyname("vm.phantom_cache_refault_histogram", histogram, &len, NULL, 0) == 0) {
+			for (i = 0; i < 8; i++) {
+				T_LOG("refault distance bucket %d: %llu", i, histogram[i]);
+			}
+		}
+		T_EXPECT_GT(refaults(), refaults_before, "file refaults were recorded");
+		len = sizeof(boost);
+		if (sysctlbyname("vm.phantom_cache_inactive_boost", &boost, &len, NULL, 0) == 0) {
+			T_LOG("inactive target boost %d%%", boost);
+		}
+	}
+
+	check_file();
+	munmap((void *)hog, hog_size);
+	perf_file_remove(file_fd, tmpfile);
+}
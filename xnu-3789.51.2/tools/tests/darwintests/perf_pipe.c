@@ -0,0 +1,144 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc.perf.pipe"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Push data through a pipe to a reader thread with writes of increasing
+ * size.  Writes of kern.ipc.pipe_direct_min bytes or more that don't fit
+ * in the free buffer space, or that find the reader waiting, are handed to
+ * the reader directly instead of being copied through the pipe buffer.
+ */
+
+#define TRANSFER_SIZE	(16 * 1024 * 1024)
+#define READ_SIZE	(1024 * 1024)
+
+static const size_t write_sizes[] = {
+	4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+};
+
+static char *wbuf;
+
+static void *
+reader(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char *rbuf;
+	ssize_t n;
+
+	rbuf = malloc(READ_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(rbuf, "malloc");
+	while ((n = read(fd, rbuf, READ_SIZE)) > 0)
+		;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+	free(rbuf);
+	return NULL;
+}
+
+static void
+transfer(int fd, size_t wsize)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < TRANSFER_SIZE; done += (size_t)n) {
+		n = write(fd, wbuf, wsize);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "write");
+	}
+}
+
+static double
+mb_per_sec(uint64_t start, uint64_t end, uint64_t bytes)
+{
+	mach_timebase_info_data_t tb;
+
+	mach_timebase_info(&tb);
+	return (double)bytes * 1e9 / ((double)(end - start) * tb.numer / tb.denom) / (1024 * 1024);
+}
+
+static void
+run_write_sizes(const char *label)
+{
+	unsigned int w;
+
+	for (w = 0; w < sizeof(write_sizes) / sizeof(write_sizes[0]); w++) {
+		size_t wsize = write_sizes[w];
+		uint64_t start, end, bytes = 0;
+		pthread_t thread;
+		int fds[2];
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, reader,
+		    (void *)(intptr_t)fds[0]), "pthread_create");
+
+		dt_stat_time_t s = dt_stat_time_create("%s pipe transfer write=%zu", label, wsize);
+		start = mach_absolute_time();
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				transfer(fds[1], wsize);
+			}
+			bytes += TRANSFER_SIZE;
+		}
+		end = mach_absolute_time();
+		dt_stat_finalize(s);
+
+		close(fds[1]);
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+		close(fds[0]);
+
+		T_LOG("%s write=%zu: %.0f MB/sec", label, wsize, mb_per_sec(start, end, bytes));
+	}
+}
+
+static int
+set_direct_min(int min)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("kern.ipc.pipe_direct_min", &old, &len, &min, sizeof(min)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(pipe_bandwidth, "pipe bandwidth against write size, buffered and direct",
+    T_META_ASROOT(true))
+{
+	uint64_t writes, bytes;
+	size_t len = sizeof(writes);
+	int old;
+
+	wbuf = malloc(write_sizes[sizeof(write_sizes) / sizeof(write_sizes[0]) - 1]);
+	T_QUIET; T_ASSERT_NOTNULL(wbuf, "malloc");
+	memset(wbuf, 'a', write_sizes[sizeof(write_sizes) / sizeof(write_sizes[0]) - 1]);
+
+	if ((old = set_direct_min(0)) < 0) {
+		T_LOG("kern.ipc.pipe_direct_min not available, measuring default pipes only");
+		run_write_sizes("default");
+	} else {
+		run_write_sizes("buffered");
+
+		set_direct_min(old);
+		run_write_sizes("direct");
+
+		if (sysctlbyname("kern.ipc.pipe_direct_writes", &writes, &len, NULL, 0) == 0 &&
+		    sysctlbyname("kern.ipc.pipe_direct_bytes", &bytes, &len, NULL, 0) == 0) {
+			T_LOG("pipe direct writes %llu bytes %llu", writes, bytes);
+		}
+	}
+
+	free(wbuf);
+}
@@ -0,0 +1,149 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/vm_purgable.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Purgeable cache churn as the number of threads grows, the way image and
+ * layer caches use purgeable memory: each thread creates small purgeable
+ * objects, marks them volatile (alternating FIFO and LIFO) while they sit
+ * in its cache, takes some of them back as non-volatile and destroys the
+ * rest.  Creating objects only takes the non-volatile queue lock;
+ * volatile transitions also take the volatile queue lock and add or
+ * remove a token.
+ */
+
+#define OBJECT_SIZE	(64 * 1024)
+#define CACHE_SLOTS	64
+#define ITERATIONS	4096
+
+static pthread_barrier_t start_barrier;
+
+static void
+set_state(vm_address_t addr, int state)
+{
+	kern_return_t kr;
+
+	kr = vm_purgable_control(mach_task_self(), addr, VM_PURGABLE_SET_STATE, &state);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "vm_purgable_control");
+}
+
+static void *
+churn_thread(void *arg)
+{
+	vm_address_t cache[CACHE_SLOTS] = { 0 };
+	vm_address_t addr;
+	kern_return_t kr;
+	int i, slot;
+
+	(void)arg;
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		slot = i % CACHE_SLOTS;
+		addr = cache[slot];
+
+		if (addr != 0 && (i & 3) == 0) {
+			/* cache hit: take the object back */
+			set_state(addr, VM_PURGABLE_NONVOLATILE);
+		} else {
+			if (addr != 0) {
+				kr = vm_deallocate(mach_task_self(), addr, OBJECT_SIZE);
+				T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "vm_deallocate");
+			}
+			addr = 0;
+			kr = vm_allocate(mach_task_self(), &addr, OBJECT_SIZE,
+			    VM_FLAGS_ANYWHERE | VM_FLAGS_PURGABLE);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "vm_allocate");
+			cache[slot] = addr;
+		}
+		*(volatile char *)addr = 1;
+
+		set_state(addr, VM_PURGABLE_VOLATILE |
+		    ((i & 1) ? VM_PURGABLE_BEHAVIOR_LIFO : VM_PURGABLE_BEHAVIOR_FIFO));
+	}
+
+	for (slot = 0; slot < CACHE_SLOTS; slot++) {
+		if (cache[slot] != 0) {
+			vm_deallocate(mach_task_self(), cache[slot], OBJECT_SIZE);
+		}
+	}
+	return NULL;
+}
+
+static double
+run_threads(int nthreads)
+{
+	pthread_t threads[nthreads];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	int i;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1),
+	    "pthread_barrier_init");
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, churn_thread, NULL),
+		    "pthread_create");
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+	pthread_barrier_destroy(&start_barrier);
+
+	mach_timebase_info(&tb);
+	return (double)nthreads * ITERATIONS * 1e9 /
+	    ((double)(end - start) * tb.numer / tb.denom);
+}
+
+T_DECL(purgeable_churn, "purgeable object churn across thread counts")
+{
+	unsigned int migrations, steps;
+	size_t len;
+	int ncpu, nthreads;
+
+	len = sizeof(ncpu);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0), "hw.ncpu");
+
+	/* 1, 2, 4 ... threads, finishing with one per cpu */
+	for (nthreads = 1; ; nthreads = (nthreads * 2 < ncpu) ? nthreads * 2 : ncpu) {
+		double ops_per_sec = 0;
+
+		dt_stat_time_t s = dt_stat_time_create("purgeable churn threads=%d", nthreads);
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				ops_per_sec = run_threads(nthreads);
+			}
+		}
+		dt_stat_finalize(s);
+
+		T_LOG("purgeable churn threads=%d: %.0f objects/sec", nthreads, ops_per_sec);
+		if (nthreads >= ncpu)
+			break;
+	}
+
+	len = sizeof(migrations);
+	if (sysctlbyname("vm.purgeable_token_migrations", &migrations, &len, NULL, 0) == 0 &&
+	    sysctlbyname("vm.purgeable_token_migration_steps", &steps, &len, NULL, 0) == 0) {
+		T_LOG("purgeable token migrations %u steps %u", migrations, steps);
+	} else {
+		T_LOG("vm.purgeable_token_migrations not available");
+	}
+}
@@ -0,0 +1,135 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.kern.perf.waitq"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Each select() call links the waitq of every fd it polls into the calling
+ * thread's waitq set, then unlinks them all on the way out. With many fds and
+ * many concurrent selectors, that is a steady stream of waitq link table
+ * allocations and frees from every CPU.
+ */
+
+#define MAX_PIPES	(FD_SETSIZE / 2 - 16)
+
+static int pipes[MAX_PIPES][2];
+static int npipes;
+static int maxfd;
+static atomic_bool done;
+
+static void
+setup_pipes(int n)
+{
+	struct rlimit rl;
+	int i;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getrlimit(RLIMIT_NOFILE, &rl), "getrlimit");
+	if (rl.rlim_cur < (rlim_t)(2 * n + 32)) {
+		rl.rlim_cur = (rlim_t)(2 * n + 32);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_NOFILE, &rl), "setrlimit");
+	}
+
+	for (i = 0; i < n; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(pipes[i]), "pipe");
+		if (pipes[i][0] > maxfd)
+			maxfd = pipes[i][0];
+	}
+	npipes = n;
+}
+
+static void
+teardown_pipes(void)
+{
+	int i;
+
+	for (i = 0; i < npipes; i++) {
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	npipes = 0;
+	maxfd = 0;
+}
+
+static void
+select_all(void)
+{
+	struct timeval tv = { 0, 0 };
+	fd_set rfds;
+	int i;
+
+	FD_ZERO(&rfds);
+	for (i = 0; i < npipes; i++)
+		FD_SET(pipes[i][0], &rfds);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(select(maxfd + 1, &rfds, NULL, NULL, &tv), "select");
+}
+
+static void *
+selector_thread(void *arg)
+{
+	(void)arg;
+	while (!atomic_load_explicit(&done, memory_order_relaxed))
+		select_all();
+	return NULL;
+}
+
+static void
+run_select_test(int nfds, int nthreads)
+{
+	pthread_t threads[64];
+	int i;
+
+	setup_pipes(nfds);
+	atomic_store(&done, false);
+
+	for (i = 0; i < nthreads - 1; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    selector_thread, NULL), "pthread_create");
+	}
+
+	dt_stat_time_t s = dt_stat_time_create("select fds=%d threads=%d",
+	    nfds, nthreads);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			select_all();
+		}
+	}
+	dt_stat_finalize(s);
+
+	atomic_store(&done, true);
+	for (i = 0; i < nthreads - 1; i++)
+		pthread_join(threads[i], NULL);
+
+	teardown_pipes();
+}
+
+T_DECL(select_many_fds, "select() latency over many fds with concurrent selectors")
+{
+	static const int fds[] = { 16, 128, MAX_PIPES };
+	int ncpu;
+	size_t len = sizeof(ncpu);
+	unsigned int f;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0), "hw.ncpu");
+	if (ncpu > 64)
+		ncpu = 64;
+
+	for (f = 0; f < sizeof(fds) / sizeof(fds[0]); f++) {
+		int nthreads;
+
+		for (nthreads = 1; nthreads <= ncpu; nthreads *= 2)
+			run_select_test(fds[f], nthreads);
+	}
+}
@@ -0,0 +1,237 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <mach/shared_region.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Launch latency while another thread keeps the system short of memory,
+ * so the shared cache pages a launch touches keep getting evicted.  Slid
+ * pages that get evicted are kept compressed, with their slide applied,
+ * unless vm.slid_page_cache is 0, in which case every refault reads the
+ * page from the shared cache file and slides it again.
+ */
+
+#define HOG_FRACTION	2	/* keep 1/2 of memory busy */
+#define REFAULT_ROUNDS	8
+#define REFAULT_HOG_SECS	5
+
+extern char **environ;
+
+static volatile int hog_done;
+static size_t hog_size;
+
+static void *
+hog_thread(void *arg)
+{
+	size_t pgsz = (size_t)getpagesize();
+	volatile char *hog;
+	size_t off;
+
+	(void)arg;
+	hog = mmap(NULL, hog_size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)hog, MAP_FAILED, "mmap");
+
+	while (!hog_done) {
+		for (off = 0; off < hog_size && !hog_done; off += pgsz) {
+			hog[off] = (char)arc4random();
+		}
+	}
+	munmap((void *)hog, hog_size);
+	return NULL;
+}
+
+static void
+run_launch_test(const char *label)
+{
+	char *args[] = { "/bin/ls", "-l", "/usr/lib", NULL };
+	posix_spawn_file_actions_t actions;
+	pthread_t thread;
+	pid_t pid;
+	int status = 0, err = 0;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_init(&actions), "file actions");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+	    "/dev/null", O_WRONLY, 0), "addopen");
+
+	hog_done = 0;
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, hog_thread, NULL), "pthread_create");
+
+	dt_stat_time_t s = dt_stat_time_create("%s launch under pressure", label);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			err = posix_spawn(&pid, args[0], &actions, NULL, args, environ);
+			if (err == 0) {
+				waitpid(pid, &status, 0);
+			}
+		}
+		if (err) {
+			T_FAIL("posix_spawn returned %d", err);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			T_FAIL("launched process failed to run");
+		}
+	}
+	dt_stat_finalize(s);
+
+	hog_done = 1;
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+	posix_spawn_file_actions_destroy(&actions);
+}
+
+static int
+set_slid_cache(int enable)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.slid_page_cache", &old, &len, &enable, sizeof(enable)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(slid_page_cache, "launch latency under memory pressure",
+    T_META_ASROOT(true))
+{
+	unsigned int inserts, hits, count, evictions;
+	uint64_t memsize;
+	size_t len = sizeof(memsize);
+	int old;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.memsize", &memsize, &len, NULL, 0), "hw.memsize");
+	hog_size = (size_t)(memsize / HOG_FRACTION);
+
+	if ((old = set_slid_cache(0)) < 0) {
+		T_LOG("vm.slid_page_cache not available, measuring default launch only");
+		run_launch_test("default");
+	} else {
+		run_launch_test("reslide");
+
+		set_slid_cache(old);
+		run_launch_test("slid page cache");
+
+		len = sizeof(inserts);
+		if (sysctlbyname("vm.slid_page_cache_inserts", &inserts, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.slid_page_cache_hits", &hits, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.slid_page_cache_count", &count, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.slid_page_cache_evictions", &evictions, &len, NULL, 0) == 0) {
+			T_LOG("slid page cache inserts %u hits %u cached %u evictions %u",
+			    inserts, hits, count, evictions);
+		}
+	}
+}
+
+static unsigned int
+slid_cache_stat(const char *name)
+{
+	unsigned int value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len, NULL, 0), "%s", name);
+	return value;
+}
+
+/*
+ * Read every page of our writable shared cache mappings, which is where
+ * the slid pages are.  Returns the number of pages touched.
+ */
+static size_t
+touch_shared_cache_data(void)
+{
+	mach_vm_address_t addr = SHARED_REGION_BASE;
+	mach_vm_size_t size;
+	vm_region_basic_info_data_64_t info;
+	mach_msg_type_number_t count;
+	mach_port_t object_name;
+	size_t pgsz = (size_t)getpagesize();
+	size_t touched = 0;
+	volatile char sink;
+	kern_return_t kr;
+	mach_vm_size_t off;
+
+	while (addr < SHARED_REGION_BASE + SHARED_REGION_SIZE) {
+		count = VM_REGION_BASIC_INFO_COUNT_64;
+		kr = mach_vm_region(mach_task_self(), &addr, &size, VM_REGION_BASIC_INFO_64,
+		    (vm_region_info_t)&info, &count, &object_name);
+		if (kr != KERN_SUCCESS || addr >= SHARED_REGION_BASE + SHARED_REGION_SIZE)
+			break;
+		if ((info.protection & (VM_PROT_READ | VM_PROT_WRITE)) == (VM_PROT_READ | VM_PROT_WRITE)) {
+			for (off = 0; off < size; off += pgsz) {
+				sink = *(volatile char *)(uintptr_t)(addr + off);
+				touched++;
+			}
+		}
+		addr += size;
+	}
+	(void)sink;
+	return touched;
+}
+
+/*
+ * Push cached slid pages all the way into the compressor, then fault
+ * them back, both here and in freshly launched processes.  A page that
+ * comes back from the compressor has to be usable in a code signed
+ * mapping like any other slid page.
+ */
+T_DECL(slid_page_cache_refault, "slid pages come back from the compressor",
+    T_META_ASROOT(true))
+{
+	unsigned int decompressions, hits, round;
+	uint64_t memsize;
+	size_t len = sizeof(memsize);
+	pthread_t thread;
+	size_t touched;
+	int old;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.memsize", &memsize, &len, NULL, 0), "hw.memsize");
+	hog_size = (size_t)(memsize / 4 * 3);
+
+	if ((old = set_slid_cache(1)) < 0) {
+		T_SKIP("vm.slid_page_cache not available");
+	}
+	decompressions = slid_cache_stat("vm.slid_page_cache_decompressions");
+	hits = slid_cache_stat("vm.slid_page_cache_hits");
+
+	touched = touch_shared_cache_data();
+	T_QUIET; T_ASSERT_GT(touched, (size_t)0, "found writable shared cache mappings");
+
+	for (round = 0; round < REFAULT_ROUNDS; round++) {
+		hog_done = 0;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, hog_thread, NULL), "pthread_create");
+		sleep(REFAULT_HOG_SECS);
+		hog_done = 1;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+
+		touch_shared_cache_data();
+		if (slid_cache_stat("vm.slid_page_cache_decompressions") > decompressions)
+			break;
+	}
+	T_LOG("%zu shared cache data pages, %u rounds of pressure", touched, round + 1);
+
+	/* the launches fault the same pages in through exec'd mappings */
+	run_launch_test("after refault");
+
+	T_EXPECT_GT(slid_cache_stat("vm.slid_page_cache_hits"), hits,
+	    "slid pages were faulted back from the cache");
+	T_EXPECT_GT(slid_cache_stat("vm.slid_page_cache_decompressions"), decompressions,
+	    "slid pages were faulted back from the compressor");
+
+	set_slid_cache(old);
+}
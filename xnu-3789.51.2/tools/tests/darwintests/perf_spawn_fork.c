@@ -6,6 +6,9 @@
 #include <spawn.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
 
 T_GLOBAL_META(
 	T_META_NAMESPACE("xnu.perf.fork"),
@@ -73,3 +76,109 @@ T_DECL(fork, "fork latency") {
 		dt_stat_finalize(s);
 	}
 }
+
+/*
+ * fork of a process with a large, fragmented address space: many small
+ * anonymous regions, all resident and writable, that can't be coalesced
+ * into one map entry because their protections alternate.  Each of them
+ * has to be write-protected in the parent for copy-on-write.  This
+ * measures the batched fork TLB flush (fork still duplicates every map
+ * entry up front); with vm.fork_batched_tlb_flush set to 0 every region
+ * costs its own TLB shootdown.
+ */
+
+#define FRAG_REGIONS	8192
+#define FRAG_REGION_SIZE	(64 * 1024)
+
+static char *frag_regions[FRAG_REGIONS];
+
+static void
+fragment_address_space(void)
+{
+	size_t pgsz = (size_t)getpagesize();
+	size_t off;
+	int i;
+
+	for (i = 0; i < FRAG_REGIONS; i++) {
+		frag_regions[i] = mmap(NULL, FRAG_REGION_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		T_QUIET; T_ASSERT_NE((void *)frag_regions[i], MAP_FAILED, "mmap");
+		for (off = 0; off < FRAG_REGION_SIZE; off += pgsz) {
+			frag_regions[i][off] = 1;
+		}
+		if (i & 1) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(mprotect(frag_regions[i], FRAG_REGION_SIZE,
+			    PROT_READ | PROT_WRITE | PROT_EXEC), "mprotect");
+		}
+	}
+}
+
+static void
+dirty_address_space(void)
+{
+	int i;
+
+	/* the parent writes again after each fork, as a server would */
+	for (i = 0; i < FRAG_REGIONS; i++) {
+		frag_regions[i][0]++;
+	}
+}
+
+static void
+run_batched_tlb_flush_test(const char *label)
+{
+	pid_t pid;
+	int status;
+
+	dt_stat_time_t s = dt_stat_time_create("%s fork regions=%d", label, FRAG_REGIONS);
+	while (!dt_stat_stable(s)) {
+		dirty_address_space();
+		T_STAT_MEASURE(s) {
+			pid = fork();
+			if (pid == 0)
+				exit(0);
+			else if (pid == -1)
+				T_FAIL("fork returned -1");
+		}
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			T_FAIL("forked process failed to exit properly");
+		}
+	}
+	dt_stat_finalize(s);
+}
+
+static int
+set_batched_tlb_flush(int enable)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.fork_batched_tlb_flush", &old, &len, &enable, sizeof(enable)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(fork_batched_tlb_flush, "batched fork TLB flush: fork latency with a large, fragmented address space",
+    T_META_ASROOT(true))
+{
+	unsigned int batched;
+	size_t len = sizeof(batched);
+	int old;
+
+	fragment_address_space();
+
+	if ((old = set_batched_tlb_flush(0)) < 0) {
+		T_LOG("vm.fork_batched_tlb_flush not available, measuring default fork only");
+		run_batched_tlb_flush_test("default");
+	} else {
+		run_batched_tlb_flush_test("per-entry flush");
+
+		set_batched_tlb_flush(old);
+		run_batched_tlb_flush_test("batched flush");
+
+		if (sysctlbyname("vm.fork_batched_tlb_flush_entries", &batched, &len, NULL, 0) == 0) {
+			T_LOG("batched fork TLB flush entries %u", batched);
+		}
+	}
+}
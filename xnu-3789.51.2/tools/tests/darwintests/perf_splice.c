@@ -0,0 +1,329 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/sysctl.h>
+
+#include "perf_file_helpers.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc.perf.splice"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Throughput of moving data over loopback TCP from a cached file and
+ * between two connections, the way a proxy does, with read()/write()
+ * through a user buffer, sendfile() and splice().
+ */
+
+#define FILE_SIZE	(64 * 1024 * 1024)
+#define PROXY_SIZE	(64 * 1024 * 1024)
+#define BUF_SIZE	(64 * 1024)
+
+static char tmpfile[PATH_MAX];
+static int file_fd;
+static char buf[BUF_SIZE];
+
+/*
+ * A connected pair of loopback TCP sockets.
+ */
+static void
+tcp_pair(int fds[2])
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(lfd, "socket");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_len = sizeof(sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)), "bind");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(lfd, 1), "listen");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(lfd, (struct sockaddr *)&sin, &len), "getsockname");
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[0], "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)), "connect");
+	fds[1] = accept(lfd, NULL, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[1], "accept");
+	close(lfd);
+}
+
+static void *
+drain(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	static char rbuf[BUF_SIZE];
+	ssize_t n;
+
+	while ((n = read(fd, rbuf, sizeof(rbuf))) > 0)
+		;
+	return NULL;
+}
+
+static void *
+feed(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	static char wbuf[BUF_SIZE];
+	size_t done;
+	ssize_t n;
+
+	memset(wbuf, 'b', sizeof(wbuf));
+	for (done = 0; done < PROXY_SIZE; done += (size_t)n) {
+		n = write(fd, wbuf, sizeof(wbuf));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "write");
+	}
+	shutdown(fd, SHUT_WR);
+	return NULL;
+}
+
+static ssize_t
+do_splice(int fd_in, off_t *off_in, int fd_out, size_t len)
+{
+#ifdef SYS_splice
+	return syscall(SYS_splice, fd_in, off_in, fd_out, NULL, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int
+splice_supported(void)
+{
+	int fds[2];
+	ssize_t n;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair");
+	n = do_splice(fds[0], NULL, fds[1], 0);
+	close(fds[0]);
+	close(fds[1]);
+	return !(n < 0 && errno == ENOSYS);
+}
+
+static double
+mb_per_sec(uint64_t start, uint64_t end, uint64_t bytes)
+{
+	mach_timebase_info_data_t tb;
+
+	mach_timebase_info(&tb);
+	return (double)bytes * 1e9 / ((double)(end - start) * tb.numer / tb.denom) / (1024 * 1024);
+}
+
+enum method { READ_WRITE, SENDFILE, SPLICE };
+static const char *method_names[] = { "read/write", "sendfile", "splice" };
+
+static void
+file_to_socket(int sfd, enum method method)
+{
+	off_t off = 0, len;
+	ssize_t n;
+
+	while (off < FILE_SIZE) {
+		switch (method) {
+		case READ_WRITE:
+			n = pread(file_fd, buf, sizeof(buf), off);
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "pread");
+			T_QUIET; T_ASSERT_EQ(write(sfd, buf, (size_t)n), n, "write");
+			off += n;
+			break;
+		case SENDFILE:
+			len = FILE_SIZE - off;
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(sendfile(file_fd, sfd, off, &len, NULL, 0),
+			    "sendfile");
+			off += len;
+			break;
+		case SPLICE:
+			n = do_splice(file_fd, &off, sfd, (size_t)(FILE_SIZE - off));
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "splice");
+			break;
+		}
+	}
+}
+
+static void *
+drain_check(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	static char rbuf[BUF_SIZE];
+	off_t off = 0;
+	ssize_t n;
+
+	while ((n = read(fd, rbuf, sizeof(rbuf))) > 0) {
+		/* reads may split a word, keep them aligned to the pattern */
+		while (n % 8 != 0) {
+			ssize_t r = read(fd, rbuf + n, (size_t)(8 - n % 8));
+
+			T_QUIET; T_ASSERT_GT(r, (ssize_t)0, "read");
+			n += r;
+		}
+		T_QUIET; T_ASSERT_TRUE(perf_file_check(rbuf, off, (size_t)n), "socket data");
+		off += n;
+	}
+	T_QUIET; T_ASSERT_EQ(off, (off_t)FILE_SIZE, "bytes received");
+	return NULL;
+}
+
+/*
+ * One transfer of the whole file with the receiver checking every byte.
+ */
+static void
+check_file_to_socket(enum method method)
+{
+	pthread_t thread;
+	int fds[2];
+
+	tcp_pair(fds);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, drain_check,
+	    (void *)(intptr_t)fds[1]), "pthread_create");
+	file_to_socket(fds[0], method);
+	close(fds[0]);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+	close(fds[1]);
+}
+
+T_DECL(file_to_socket, "file to loopback TCP socket throughput")
+{
+	enum method method;
+	int fds[2];
+
+	file_fd = perf_file_create("perf_splice", FILE_SIZE, tmpfile, sizeof(tmpfile));
+
+	for (method = READ_WRITE; method <= SPLICE; method++) {
+		uint64_t start, end, bytes = 0;
+		pthread_t thread;
+
+		if (method == SPLICE && !splice_supported()) {
+			T_LOG("splice not supported");
+			break;
+		}
+		check_file_to_socket(method);
+
+		tcp_pair(fds);
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, drain,
+		    (void *)(intptr_t)fds[1]), "pthread_create");
+
+		dt_stat_time_t s = dt_stat_time_create("%s file to socket", method_names[method]);
+		start = mach_absolute_time();
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				file_to_socket(fds[0], method);
+			}
+			bytes += FILE_SIZE;
+		}
+		end = mach_absolute_time();
+		dt_stat_finalize(s);
+
+		close(fds[0]);
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+		close(fds[1]);
+
+		T_LOG("%s file to socket: %.0f MB/sec", method_names[method],
+		    mb_per_sec(start, end, bytes));
+	}
+
+	perf_file_remove(file_fd, tmpfile);
+}
+
+/*
+ * Relay everything from in to out until in reaches end of file.
+ */
+static uint64_t
+proxy(int in, int out, enum method method)
+{
+	uint64_t bytes = 0;
+	ssize_t n, w;
+
+	for (;;) {
+		if (method == SPLICE) {
+			n = do_splice(in, NULL, out, BUF_SIZE);
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "splice");
+		} else {
+			n = read(in, buf, sizeof(buf));
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+			for (w = 0; w < n; ) {
+				ssize_t r = write(out, buf + w, (size_t)(n - w));
+
+				T_QUIET; T_ASSERT_POSIX_SUCCESS(r, "write");
+				w += r;
+			}
+		}
+		if (n == 0)
+			break;
+		bytes += (uint64_t)n;
+	}
+	return bytes;
+}
+
+T_DECL(socket_proxy, "socket to socket relay throughput over loopback TCP")
+{
+	static const enum method methods[] = { READ_WRITE, SPLICE };
+	uint64_t spliced, loaned;
+	size_t len = sizeof(spliced);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		enum method method = methods[i];
+		int client[2], server[2];
+		pthread_t feeder, drainer;
+		uint64_t start, end, bytes, relayed = 0;
+
+		if (method == SPLICE && !splice_supported()) {
+			T_LOG("splice not supported");
+			break;
+		}
+
+		dt_stat_time_t s = dt_stat_time_create("%s socket proxy", method_names[method]);
+		start = mach_absolute_time();
+		bytes = 0;
+		while (!dt_stat_stable(s)) {
+			tcp_pair(client);
+			tcp_pair(server);
+			T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&feeder, NULL, feed,
+			    (void *)(intptr_t)client[0]), "pthread_create");
+			T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&drainer, NULL, drain,
+			    (void *)(intptr_t)server[1]), "pthread_create");
+
+			T_STAT_MEASURE(s) {
+				relayed = proxy(client[1], server[0], method);
+			}
+			T_QUIET; T_ASSERT_EQ(relayed, (uint64_t)PROXY_SIZE, "bytes relayed");
+			bytes += relayed;
+			shutdown(server[0], SHUT_WR);
+
+			T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(feeder, NULL), "pthread_join");
+			T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(drainer, NULL), "pthread_join");
+			close(client[0]);
+			close(client[1]);
+			close(server[0]);
+			close(server[1]);
+		}
+		end = mach_absolute_time();
+		dt_stat_finalize(s);
+
+		T_LOG("%s socket proxy: %.0f MB/sec", method_names[method],
+		    mb_per_sec(start, end, bytes));
+	}
+
+	if (sysctlbyname("kern.splice_bytes", &spliced, &len, NULL, 0) == 0 &&
+	    sysctlbyname("kern.splice_loaned_pages", &loaned, &len, NULL, 0) == 0) {
+		T_LOG("splice bytes %llu loaned pages %llu", spliced, loaned);
+	}
+}
@@ -0,0 +1,161 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Random 8-byte reads across a large anonymous heap that was filled in
+ * sequentially, the way a hash table or a GC heap gets walked.  Once each
+ * 2MB block is resident it gets promoted to a superpage, so most reads
+ * hit in the TLB.  Promotion is off by default; the test turns
+ * vm.superpage_promote on for the second walk and restores it after.
+ */
+
+#define REGION_SIZE	(512 * 1024 * 1024)
+#define READS		(8 * 1024 * 1024)
+
+static volatile char *region;
+
+static void
+fill_region(void)
+{
+	region = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)region, MAP_FAILED, "mmap");
+	memset((void *)region, 1, REGION_SIZE);
+
+	/* promotion happens in the background */
+	sleep(1);
+}
+
+static uint64_t
+random_reads(void)
+{
+	uint64_t x = 88172645463325252ULL;
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < READS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		sum += *(volatile uint64_t *)(region + (x % (REGION_SIZE / 8)) * 8);
+	}
+	return sum;
+}
+
+static void
+run_walk_test(const char *label)
+{
+	uint64_t sum = 0;
+
+	fill_region();
+
+	dt_stat_time_t s = dt_stat_time_create("%s random reads", label);
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			sum += random_reads();
+		}
+	}
+	dt_stat_finalize(s);
+
+	munmap((void *)region, REGION_SIZE);
+	(void)sum;
+}
+
+static int
+set_promote(int enable)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.superpage_promote", &old, &len, &enable, sizeof(enable)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(superpage_promote, "random reads across a large anonymous heap",
+    T_META_ASROOT(true))
+{
+	unsigned int promotions, demotions, failures;
+	size_t len = sizeof(promotions);
+	int old;
+
+	if ((old = set_promote(0)) < 0) {
+		T_LOG("vm.superpage_promote not available, measuring default mappings only");
+		run_walk_test("default");
+	} else {
+		run_walk_test("base pages");
+
+		set_promote(1);
+		run_walk_test("superpages");
+		set_promote(old);
+
+		if (sysctlbyname("vm.superpage_promotions", &promotions, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.superpage_demotions", &demotions, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.superpage_promote_failures", &failures, &len, NULL, 0) == 0) {
+			T_LOG("superpage promotions %u demotions %u failures %u",
+			    promotions, demotions, failures);
+		}
+	}
+}
+
+static uint64_t
+phys_footprint(void)
+{
+	task_vm_info_data_t info;
+	mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+	kern_return_t kr;
+
+	kr = task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "task_info(TASK_VM_INFO)");
+	return info.phys_footprint;
+}
+
+/*
+ * The pmap accounts a 2MB translation as the 512 base pages it covers.
+ * That also applies to explicit VM_FLAGS_SUPERPAGE_SIZE_2MB allocations,
+ * which used to be charged a single page: check that the footprint goes
+ * up by the whole superpage and comes back down when it's freed.
+ */
+T_DECL(superpage_footprint, "2MB superpage allocations are charged 2MB")
+{
+#if defined(__x86_64__)
+	const uint64_t sp_size = 2 * 1024 * 1024;
+	mach_vm_address_t addr = 0;
+	uint64_t before, mapped, after;
+	kern_return_t kr;
+
+	before = phys_footprint();
+	kr = mach_vm_allocate(mach_task_self(), &addr, sp_size,
+	    VM_FLAGS_ANYWHERE | VM_FLAGS_SUPERPAGE_SIZE_2MB);
+	if (kr != KERN_SUCCESS) {
+		T_SKIP("no 2MB superpage available (%d)", kr);
+	}
+	*(volatile char *)addr = 1;
+	mapped = phys_footprint();
+
+	kr = mach_vm_deallocate(mach_task_self(), addr, sp_size);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_vm_deallocate");
+	after = phys_footprint();
+
+	T_LOG("footprint before %llu mapped %llu after %llu", before, mapped, after);
+	T_EXPECT_GE(mapped, before + sp_size, "superpage charged to the footprint in full");
+	T_EXPECT_LE(after, mapped - sp_size, "superpage credited back in full when freed");
+#else
+	T_SKIP("2MB superpages are x86_64 only");
+#endif
+}
@@ -0,0 +1,111 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.kern.perf.timer"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/* Must match TIMER_CALL_LATENCY_BINS in osfmk/kern/timer_call.h */
+#define LATENCY_BINS	16
+
+/*
+ * kern.timer.insert_test (DEVELOPMENT and DEBUG kernels only) arms a
+ * population of up to 64K kernel timers and then cancels and re-arms one
+ * per operation, so one write measures that many timer queue removals and
+ * insertions.
+ */
+static void
+run_insert_test(uint64_t operations)
+{
+	dt_stat_time_t s = dt_stat_time_create("arm+cancel ops=%llu", operations);
+
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.insert_test",
+			    NULL, NULL, &operations, sizeof(operations)), "kern.timer.insert_test");
+		}
+	}
+	dt_stat_finalize(s);
+}
+
+T_DECL(timer_arm_cancel, "arm and cancel up to a million kernel timers",
+    T_META_ASROOT(true))
+{
+	static const uint64_t ops[] = { 1024, 16 * 1024, 1000000 };
+	uint64_t hits, misses;
+	size_t len = sizeof(hits);
+	unsigned int i;
+
+	if (sysctlbyname("kern.timer.insert_test", NULL, NULL, NULL, 0) != 0 &&
+	    errno == ENOENT) {
+		T_SKIP("kern.timer.insert_test requires a DEVELOPMENT kernel");
+	}
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		run_insert_test(ops[i]);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.insert_hint_hits",
+	    &hits, &len, NULL, 0), "kern.timer.insert_hint_hits");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.insert_hint_misses",
+	    &misses, &len, NULL, 0), "kern.timer.insert_hint_misses");
+	T_LOG("insert hint hits %llu misses %llu", hits, misses);
+}
+
+static atomic_bool done;
+
+static void *
+sleeper_thread(void *arg)
+{
+	useconds_t interval = (useconds_t)(uintptr_t)arg;
+
+	while (!atomic_load_explicit(&done, memory_order_relaxed))
+		usleep(interval);
+	return NULL;
+}
+
+T_DECL(timer_latency_histogram, "timer callout latency with many concurrent sleepers")
+{
+	uint64_t before[LATENCY_BINS], after[LATENCY_BINS];
+	pthread_t threads[64];
+	size_t len = sizeof(before);
+	int i;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.latency_histogram",
+	    before, &len, NULL, 0), "kern.timer.latency_histogram");
+
+	atomic_store(&done, false);
+	for (i = 0; i < 64; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    sleeper_thread, (void *)(uintptr_t)(100U + 50U * (unsigned int)i)), "pthread_create");
+	}
+
+	dt_stat_time_t s = dt_stat_time_create("usleep(1000) with 64 sleepers");
+	while (!dt_stat_stable(s)) {
+		T_STAT_MEASURE(s) {
+			usleep(1000);
+		}
+	}
+	dt_stat_finalize(s);
+
+	atomic_store(&done, true);
+	for (i = 0; i < 64; i++)
+		pthread_join(threads[i], NULL);
+
+	len = sizeof(after);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.timer.latency_histogram",
+	    after, &len, NULL, 0), "kern.timer.latency_histogram");
+	for (i = 0; i < LATENCY_BINS; i++) {
+		T_LOG("latency < %6llu us: %llu", 1ULL << i,
+		    after[i] - before[i]);
+	}
+}
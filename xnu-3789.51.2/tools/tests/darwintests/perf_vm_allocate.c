@@ -0,0 +1,144 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/mach_vm.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Allocator-style churn from several threads at once: each thread
+ * allocates a region, touches it and deallocates it again, so the
+ * threads work on disjoint parts of the address space.  Tearing down
+ * the translations for a deallocated range happens with the map
+ * unlocked unless vm.remove_reserve is 0, in which case every
+ * deallocation holds the map lock for its TLB shootdown.
+ */
+
+#define REGION_SIZE	(256 * 1024)
+#define ITERATIONS	512
+
+static pthread_barrier_t start_barrier;
+
+static void *
+churn_thread(void *arg)
+{
+	size_t pgsz = (size_t)getpagesize();
+	mach_vm_address_t addr;
+	kern_return_t kr;
+	size_t off;
+	int i;
+
+	(void)arg;
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		addr = 0;
+		kr = mach_vm_allocate(mach_task_self(), &addr, REGION_SIZE, VM_FLAGS_ANYWHERE);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_vm_allocate");
+		for (off = 0; off < REGION_SIZE; off += pgsz) {
+			((volatile char *)addr)[off] = 1;
+		}
+		kr = mach_vm_deallocate(mach_task_self(), addr, REGION_SIZE);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_vm_deallocate");
+	}
+	return NULL;
+}
+
+static double
+run_threads(int nthreads)
+{
+	pthread_t threads[nthreads];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	int i;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1),
+	    "pthread_barrier_init");
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, churn_thread, NULL),
+		    "pthread_create");
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+	pthread_barrier_destroy(&start_barrier);
+
+	mach_timebase_info(&tb);
+	return (double)nthreads * ITERATIONS * 1e9 /
+	    ((double)(end - start) * tb.numer / tb.denom);
+}
+
+static void
+run_scaling_test(const char *label)
+{
+	int ncpu, nthreads;
+	size_t len = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0), "hw.ncpu");
+
+	/* 1, 2, 4 ... threads, finishing with one per cpu */
+	for (nthreads = 1; ; nthreads = (nthreads * 2 < ncpu) ? nthreads * 2 : ncpu) {
+		double ops_per_sec = 0;
+
+		dt_stat_time_t s = dt_stat_time_create("%s allocate/deallocate threads=%d", label, nthreads);
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				ops_per_sec = run_threads(nthreads);
+			}
+		}
+		dt_stat_finalize(s);
+
+		T_LOG("%s allocate/deallocate threads=%d: %.0f cycles/sec", label, nthreads, ops_per_sec);
+		if (nthreads >= ncpu)
+			break;
+	}
+}
+
+static int
+set_remove_reserve(int enable)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.remove_reserve", &old, &len, &enable, sizeof(enable)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(vm_allocate_scaling, "parallel allocate/deallocate of disjoint regions",
+    T_META_ASROOT(true))
+{
+	unsigned int reserved;
+	size_t len = sizeof(reserved);
+	int old;
+
+	if ((old = set_remove_reserve(0)) < 0) {
+		T_LOG("vm.remove_reserve not available, measuring default deallocation only");
+		run_scaling_test("default");
+	} else {
+		run_scaling_test("locked teardown");
+
+		set_remove_reserve(old);
+		run_scaling_test("reserved range");
+
+		if (sysctlbyname("vm.remove_reserved", &reserved, &len, NULL, 0) == 0) {
+			T_LOG("ranges removed outside the map lock %u", reserved);
+		}
+	}
+}
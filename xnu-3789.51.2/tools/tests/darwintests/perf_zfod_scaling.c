@@ -0,0 +1,141 @@
+#ifdef T_NAMESPACE
+#undef T_NAMESPACE
+#endif
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm.perf"),
+	T_META_CHECK_LEAKS(false)
+);
+
+/*
+ * Zero-fill fault throughput as the number of faulting threads grows.
+ * Each thread repeatedly maps anonymous memory, touches every page and
+ * unmaps it again, so every page goes through vm_page_grab() and back
+ * through vm_page_release().  With vm.free_magazine_release_limit set
+ * to 0 every release takes the global free queue lock.
+ */
+
+#define REGION_SIZE	(16 * 1024 * 1024)
+#define ITERATIONS	8
+
+static pthread_barrier_t start_barrier;
+
+static void *
+zfod_thread(void *arg)
+{
+	size_t pgsz = (size_t)getpagesize();
+	size_t off;
+	int i;
+
+	(void)arg;
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		volatile char *addr;
+
+		addr = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		T_QUIET; T_ASSERT_NE((void *)addr, MAP_FAILED, "mmap");
+		for (off = 0; off < REGION_SIZE; off += pgsz) {
+			addr[off] = 1;
+		}
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(munmap((void *)addr, REGION_SIZE), "munmap");
+	}
+	return NULL;
+}
+
+static double
+run_threads(int nthreads)
+{
+	pthread_t threads[nthreads];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	int i;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1),
+	    "pthread_barrier_init");
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL, zfod_thread, NULL),
+		    "pthread_create");
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+	pthread_barrier_destroy(&start_barrier);
+
+	mach_timebase_info(&tb);
+	return (double)nthreads * ITERATIONS * (REGION_SIZE / getpagesize()) * 1e9 /
+	    ((double)(end - start) * tb.numer / tb.denom);
+}
+
+static void
+run_scaling_test(const char *label)
+{
+	int ncpu, nthreads;
+	size_t len = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0), "hw.ncpu");
+
+	/* 1, 2, 4 ... threads, finishing with one per cpu */
+	for (nthreads = 1; ; nthreads = (nthreads * 2 < ncpu) ? nthreads * 2 : ncpu) {
+		double pages_per_sec = 0;
+
+		dt_stat_time_t s = dt_stat_time_create("%s zero fill threads=%d", label, nthreads);
+		while (!dt_stat_stable(s)) {
+			T_STAT_MEASURE(s) {
+				pages_per_sec = run_threads(nthreads);
+			}
+		}
+		dt_stat_finalize(s);
+
+		T_LOG("%s zero fill threads=%d: %.0f pages/sec", label, nthreads, pages_per_sec);
+		if (nthreads >= ncpu)
+			break;
+	}
+}
+
+static int
+set_release_limit(int limit)
+{
+	int old;
+	size_t len = sizeof(old);
+
+	if (sysctlbyname("vm.free_magazine_release_limit", &old, &len, &limit, sizeof(limit)) != 0)
+		return -1;
+	return old;
+}
+
+T_DECL(zfod_scaling, "zero fill fault throughput across thread counts",
+    T_META_ASROOT(true))
+{
+	unsigned int drains, drained;
+	size_t len = sizeof(drains);
+	int old;
+
+	if ((old = set_release_limit(0)) < 0) {
+		T_LOG("vm.free_magazine_release_limit not available, measuring default release only");
+		run_scaling_test("default");
+	} else {
+		run_scaling_test("global release");
+
+		set_release_limit(old);
+		run_scaling_test("per-cpu release");
+
+		if (sysctlbyname("vm.free_magazine_drains", &drains, &len, NULL, 0) == 0 &&
+		    sysctlbyname("vm.free_magazine_drained", &drained, &len, NULL, 0) == 0) {
+			T_LOG("free magazine drains %u pages drained %u", drains, drained);
+		}
+	}
+}
@@ -0,0 +1,109 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * All threads read one shared file, each from its own region, so the
+ * kernel sees several independent streams on a single vnode.  Even
+ * threads read their region sequentially; odd threads read STRIDE_READ
+ * bytes out of every STRIDE_STEP.  The file is written with F_NOCACHE
+ * so the reads are served by read-ahead rather than the buffer cache.
+ */
+
+#define READ_SIZE   (64 * 1024)
+#define STRIDE_READ (16 * 1024)
+#define STRIDE_STEP (64 * 1024)
+
+char tempdir[MAXPATHLEN];
+char filepath[MAXPATHLEN];
+long long filesize;
+
+DECL_SETUP {
+    static char writebuf[1024 * 1024];
+    char* retval;
+    long long left;
+    size_t writelen;
+    int fd;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    filesize = MIN(length, MAXFILESIZE);
+    filesize -= filesize % ((long long)num_threads * STRIDE_STEP);
+    VERIFY(filesize > 0, "length too small");
+
+    snprintf(filepath, sizeof(filepath), "%s/file_read_streams", tempdir);
+    fd = open(filepath, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    VERIFY(fd >= 0, "open failed");
+    VERIFY(fcntl(fd, F_NOCACHE, 1) == 0, "F_NOCACHE failed");
+
+    memset(writebuf, 'a', sizeof(writebuf));
+
+    for(left = filesize; left > 0; left -= writelen) {
+        writelen = sizeof(writebuf) < left ? sizeof(writebuf) : left;
+        VERIFY(write(fd, writebuf, writelen) == writelen, "write failed");
+    }
+
+    close(fd);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    char* readbuf;
+    long long region = filesize / num_threads;
+    long long start = region * thread_id;
+    long long offset = 0;
+    long long left = length / num_threads;
+    size_t readlen;
+    size_t step;
+    int fd;
+
+    if(thread_id & 1) {
+        readlen = STRIDE_READ;
+        step = STRIDE_STEP;
+    } else {
+        readlen = READ_SIZE;
+        step = READ_SIZE;
+    }
+
+    readbuf = malloc(readlen);
+    VERIFY(readbuf, "malloc failed");
+
+    fd = open(filepath, O_RDONLY);
+    VERIFY(fd >= 0, "open failed");
+
+    while(left > 0) {
+        if(offset + readlen > region)
+            offset = 0;
+        VERIFY(pread(fd, readbuf, readlen, start + offset) == readlen, "pread failed");
+        offset += step;
+        left -= readlen;
+    }
+
+    close(fd);
+    free(readbuf);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    int retval;
+
+    retval = unlink(filepath);
+    VERIFY(retval == 0, "unlink failed");
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
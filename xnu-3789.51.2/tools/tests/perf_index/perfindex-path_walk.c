@@ -0,0 +1,82 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PATH_WALK_DEPTH 8
+
+char tempdir[MAXPATHLEN];
+char filepath[MAXPATHLEN];
+
+static void path_walk_dir(char* buf, size_t len, int depth) {
+    int i;
+
+    strlcpy(buf, tempdir, len);
+    for(i=0; i<depth; i++)
+        strlcat(buf, "/path_walk_dir", len);
+}
+
+DECL_SETUP {
+    char dirpath[MAXPATHLEN];
+    char* retval;
+    int i;
+    int fd;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    for(i=1; i<=PATH_WALK_DEPTH; i++) {
+        path_walk_dir(dirpath, sizeof(dirpath), i);
+        VERIFY(mkdir(dirpath, 0755) == 0, "mkdir failed");
+    }
+
+    snprintf(filepath, sizeof(filepath), "%s/path_walk_file", dirpath);
+    fd = open(filepath, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    VERIFY(fd >= 0, "open failed");
+    close(fd);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    struct stat sb;
+    long long i;
+    long long count = length/num_threads;
+
+    if(thread_id < length%num_threads)
+        count++;
+
+    for(i=0; i<count; i++) {
+        VERIFY(stat(filepath, &sb) == 0, "stat failed");
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    char dirpath[MAXPATHLEN];
+    int retval;
+    int i;
+
+    retval = unlink(filepath);
+    VERIFY(retval == 0, "unlink failed");
+
+    for(i=PATH_WALK_DEPTH; i>=1; i--) {
+        path_walk_dir(dirpath, sizeof(dirpath), i);
+        retval = rmdir(dirpath);
+        VERIFY(retval == 0, "rmdir failed");
+    }
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
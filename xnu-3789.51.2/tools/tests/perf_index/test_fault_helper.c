@@ -69,17 +69,17 @@ int test_fault_helper(int thread_id, int num_threads, long long length, testtype
             break;
 
         if(testtype == TESTFAULT) {
-            retval = mprotect(memblock+region_start, region_len, PROT_READ) == 0;
+            retval = mprotect(memblock+region_start, region_len, PROT_READ);
             VERIFY(retval == 0, "mprotect failed");
-            retval = mprotect(memblock+region_start, region_len, PROT_READ | PROT_WRITE) == 0;
+            retval = mprotect(memblock+region_start, region_len, PROT_READ | PROT_WRITE);
             VERIFY(retval == 0, "mprotect failed");
         }
 
         else if(testtype == TESTZFOD) {
-            retval = munmap(memblock+region_start, region_len) == 0;
+            retval = munmap(memblock+region_start, region_len);
             VERIFY(retval == 0, "munmap failed");
             ptr = mmap(memblock+region_start, region_len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1, 0);
-            VERIFY(ptr != 0, "mmap failed");
+            VERIFY(ptr != MAP_FAILED, "mmap failed");
         }
     }
     return PERFINDEX_SUCCESS;